@@ -59,6 +59,8 @@ const char * FileSystem::type_to_string(fsType type)
             return "FS_SDFAT";
         case FSTYPE_TNFS:
             return "FS_TNFS";
+        case FSTYPE_HTTP:
+            return "FS_HTTP";
         default:
             return "UNKNOWN FS TYPE";
     }
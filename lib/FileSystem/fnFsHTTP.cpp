@@ -0,0 +1,523 @@
+#include <expat.h>
+#include <algorithm>
+#include <string.h>
+
+#include "esp_heap_caps.h"
+
+#include "../../include/debug.h"
+#include "../http/fnHttpClient.h"
+#include "../config/fnConfig.h"
+#include "../utils/utils.h"
+#include "EdUrlParser.h"
+
+#include "fnFsHTTP.h"
+
+#define HTTP_RANGE_NO_BLOCK 0xFFFFFFFF
+
+#define HTTP_PROPFIND_BODY "<?xml version=\"1.0\"?>\r\n<D:propfind xmlns:D=\"DAV:\">\r\n<D:prop>\r\n<D:resourcetype />\r\n<D:getcontentlength />\r\n</D:prop>\r\n</D:propfind>\r\n"
+
+/* State behind each FILE we hand out. Either blocks are fetched as they're needed
+   or, if the server doesn't do ranges, the whole file is in _whole.
+*/
+class httpRangeFile
+{
+private:
+    fnHttpClient _client;
+    uint32_t _size = 0;
+    uint32_t _pos = 0;
+
+    uint8_t *_whole = nullptr;
+
+    uint8_t *_blocks = nullptr;
+    uint32_t _block_num[HTTP_RANGE_CACHE_BLOCKS];
+    uint32_t _block_used[HTTP_RANGE_CACHE_BLOCKS];
+    uint32_t _use_counter = 0;
+
+    int _request_block(uint32_t block, int slot);
+    bool _download_whole(int length);
+    uint8_t *_get_block(uint32_t block);
+
+public:
+    ~httpRangeFile();
+
+    bool open(const std::string &url);
+
+    ssize_t read(char *buf, size_t size);
+    int seek(off_t *offset, int whence);
+};
+
+httpRangeFile::~httpRangeFile()
+{
+    _client.close();
+    if (_whole != nullptr)
+        free(_whole);
+    if (_blocks != nullptr)
+        free(_blocks);
+}
+
+/* Asks for one block, reading it into the given cache slot.
+   Returns the HTTP status, or -1 if the request or read failed.
+   A 200 means the server ignored the Range and is sending the whole file, which is left unread.
+*/
+int httpRangeFile::_request_block(uint32_t block, int slot)
+{
+    char range[32];
+    uint32_t start = block * HTTP_RANGE_BLOCK_SIZE;
+    snprintf(range, sizeof(range), "bytes=%u-%u", start, start + HTTP_RANGE_BLOCK_SIZE - 1);
+    _client.set_header("Range", range);
+
+    const char *headers[] = {"Content-Range"};
+    _client.collect_headers(headers, 1);
+
+    int status = _client.GET();
+    if (status != 206)
+        return status;
+
+    // The first response tells us how big the file is: "bytes 0-4095/92176"
+    if (_size == 0)
+    {
+        std::string cr = _client.get_header("Content-Range");
+        size_t slash = cr.find('/');
+        if (slash == std::string::npos || cr[slash + 1] == '*')
+        {
+            Debug_printf("httpRangeFile unusable Content-Range \"%s\"\n", cr.c_str());
+            return -1;
+        }
+        _size = strtoul(cr.c_str() + slash + 1, nullptr, 10);
+    }
+
+    uint32_t want = _size - start < HTTP_RANGE_BLOCK_SIZE ? _size - start : HTTP_RANGE_BLOCK_SIZE;
+    uint8_t *dest = _blocks + slot * HTTP_RANGE_BLOCK_SIZE;
+    if (_client.read(dest, want) != want)
+    {
+        Debug_printf("httpRangeFile short read of block %u\n", block);
+        _block_num[slot] = HTTP_RANGE_NO_BLOCK;
+        return -1;
+    }
+
+    _block_num[slot] = block;
+    _block_used[slot] = ++_use_counter;
+    return status;
+}
+
+/* Reads the rest of a full response into PSRAM. Images bigger than the RAM disk limit
+   would take too long to download and crowd out everything else, so we give up on those.
+*/
+bool httpRangeFile::_download_whole(int length)
+{
+    uint32_t limit = (uint32_t)Config.get_general_ramdisk_limit() * 1024;
+    if (length <= 0 || length > limit)
+    {
+        Debug_printf("httpRangeFile no ranges and %d bytes won't fit in RAM\n", length);
+        return false;
+    }
+
+    _whole = (uint8_t *)heap_caps_malloc(length, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (_whole == nullptr)
+        return false;
+
+    if (_client.read(_whole, length) != length)
+    {
+        Debug_println("httpRangeFile download failed");
+        return false;
+    }
+
+    _size = length;
+    _client.close();
+    Debug_printf("httpRangeFile downloaded whole file (%u bytes)\n", _size);
+    return true;
+}
+
+bool httpRangeFile::open(const std::string &url)
+{
+    if (_client.begin(url) == false)
+        return false;
+
+    _blocks = (uint8_t *)heap_caps_malloc(HTTP_RANGE_CACHE_BLOCKS * HTTP_RANGE_BLOCK_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (_blocks == nullptr)
+        return false;
+    for (int i = 0; i < HTTP_RANGE_CACHE_BLOCKS; i++)
+        _block_num[i] = HTTP_RANGE_NO_BLOCK;
+
+    // The first block is almost always wanted, and the response tells us whether ranges work
+    int status = _request_block(0, 0);
+    if (status == 206)
+        return true;
+
+    if (status == 200)
+    {
+        free(_blocks);
+        _blocks = nullptr;
+        return _download_whole(_client.available());
+    }
+
+    Debug_printf("httpRangeFile open failed with status %d\n", status);
+    return false;
+}
+
+// Returns the cached copy of a block, fetching it into the least recently used slot if we need to
+uint8_t *httpRangeFile::_get_block(uint32_t block)
+{
+    int slot = 0;
+    for (int i = 0; i < HTTP_RANGE_CACHE_BLOCKS; i++)
+    {
+        if (_block_num[i] == block)
+        {
+            _block_used[i] = ++_use_counter;
+            return _blocks + i * HTTP_RANGE_BLOCK_SIZE;
+        }
+        if (_block_num[i] == HTTP_RANGE_NO_BLOCK)
+            _block_used[i] = 0;
+        if (_block_used[i] < _block_used[slot])
+            slot = i;
+    }
+
+    if (_request_block(block, slot) != 206)
+        return nullptr;
+
+    return _blocks + slot * HTTP_RANGE_BLOCK_SIZE;
+}
+
+ssize_t httpRangeFile::read(char *buf, size_t size)
+{
+    if (_pos >= _size)
+        return 0;
+    if (size > _size - _pos)
+        size = _size - _pos;
+
+    if (_whole != nullptr)
+    {
+        memcpy(buf, _whole + _pos, size);
+        _pos += size;
+        return size;
+    }
+
+    size_t done = 0;
+    while (done < size)
+    {
+        uint8_t *b = _get_block(_pos / HTTP_RANGE_BLOCK_SIZE);
+        if (b == nullptr)
+            return done > 0 ? done : -1;
+
+        uint32_t offset = _pos % HTTP_RANGE_BLOCK_SIZE;
+        uint32_t l = HTTP_RANGE_BLOCK_SIZE - offset;
+        if (l > size - done)
+            l = size - done;
+
+        memcpy(buf + done, b + offset, l);
+        done += l;
+        _pos += l;
+    }
+    return done;
+}
+
+int httpRangeFile::seek(off_t *offset, int whence)
+{
+    off_t newpos;
+    switch (whence)
+    {
+    case SEEK_SET:
+        newpos = *offset;
+        break;
+    case SEEK_CUR:
+        newpos = _pos + *offset;
+        break;
+    case SEEK_END:
+        newpos = _size + *offset;
+        break;
+    default:
+        return -1;
+    }
+    if (newpos < 0)
+        return -1;
+
+    _pos = newpos;
+    *offset = newpos;
+    return 0;
+}
+
+static ssize_t _httpfile_read(void *cookie, char *buf, size_t size)
+{
+    return ((httpRangeFile *)cookie)->read(buf, size);
+}
+
+static int _httpfile_seek(void *cookie, off_t *offset, int whence)
+{
+    return ((httpRangeFile *)cookie)->seek(offset, whence);
+}
+
+static int _httpfile_close(void *cookie)
+{
+    delete (httpRangeFile *)cookie;
+    return 0;
+}
+
+// Percent-encodes everything in a path except unreserved characters and '/'
+static std::string _http_encode_path(const char *path)
+{
+    std::string result;
+    char hex[4];
+    for (const char *p = path; *p != '\0'; p++)
+    {
+        if (isalnum((unsigned char)*p) || strchr("/-_.~", *p) != nullptr)
+            result += *p;
+        else
+        {
+            snprintf(hex, sizeof(hex), "%%%02X", (unsigned char)*p);
+            result += hex;
+        }
+    }
+    return result;
+}
+
+std::string FileSystemHTTP::_make_url(const char *path)
+{
+    if (path == nullptr || path[0] == '\0')
+        return _baseurl + "/";
+    if (path[0] != '/')
+        return _baseurl + "/" + _http_encode_path(path);
+    return _baseurl + _http_encode_path(path);
+}
+
+bool FileSystemHTTP::start(const char *url)
+{
+    if (_started || url == nullptr)
+        return false;
+
+    if (strncasecmp(url, "http://", 7) != 0 && strncasecmp(url, "https://", 8) != 0)
+        return false;
+
+    _baseurl = url;
+    while (_baseurl.length() > 0 && _baseurl.back() == '/')
+        _baseurl.pop_back();
+
+    // Make sure there's someone there before saying we're up
+    fnHttpClient client;
+    if (client.begin(_baseurl + "/") == false)
+        return false;
+    int status = client.HEAD();
+    client.close();
+    if (status < 0)
+    {
+        Debug_printf("HTTP host \"%s\" not responding\n", url);
+        return false;
+    }
+
+    Debug_printf("HTTP host \"%s\" started\n", url);
+    _started = true;
+    return true;
+}
+
+FILE *FileSystemHTTP::file_open(const char *path, const char *mode)
+{
+    if (!_started || path == nullptr || strcmp(mode, "r") != 0)
+        return nullptr;
+
+    httpRangeFile *hf = new httpRangeFile;
+    if (hf->open(_make_url(path)) == false)
+    {
+        delete hf;
+        return nullptr;
+    }
+
+    cookie_io_functions_t funcs;
+    funcs.read = _httpfile_read;
+    funcs.write = nullptr;
+    funcs.seek = _httpfile_seek;
+    funcs.close = _httpfile_close;
+
+    FILE *f = fopencookie(hf, "r", funcs);
+    if (f == nullptr)
+        delete hf;
+    return f;
+}
+
+bool FileSystemHTTP::exists(const char *path)
+{
+    if (!_started)
+        return false;
+
+    fnHttpClient client;
+    if (client.begin(_make_url(path)) == false)
+        return false;
+    int status = client.HEAD();
+    client.close();
+    return status == 200;
+}
+
+/* Collects the entries in a PROPFIND response. Names are matched with the namespace
+   URI in front ("DAV: href") since servers differ in the prefixes they use.
+*/
+class httpDirHandler
+{
+public:
+    std::vector<fsdir_entry> entries;
+    fsdir_entry current;
+    std::string text;
+    bool inResponse = false;
+
+    void Start(const XML_Char *el, const XML_Char **attr)
+    {
+        if (strcmp(el, "DAV: response") == 0)
+        {
+            inResponse = true;
+            memset(&current, 0, sizeof(current));
+        }
+        else if (inResponse && strcmp(el, "DAV: collection") == 0)
+            current.isDir = true;
+        text.clear();
+    }
+
+    void End(const XML_Char *el)
+    {
+        if (inResponse == false)
+            return;
+
+        if (strcmp(el, "DAV: href") == 0)
+        {
+            // Just the last part of the path, which may have a trailing '/'
+            std::string href = EdUrlParser::urlDecode(text);
+            while (href.length() > 1 && href.back() == '/')
+                href.pop_back();
+            strlcpy(current.filename, href.substr(href.find_last_of('/') + 1).c_str(), sizeof(current.filename));
+        }
+        else if (strcmp(el, "DAV: getcontentlength") == 0)
+            current.size = strtoul(text.c_str(), nullptr, 10);
+        else if (strcmp(el, "DAV: response") == 0)
+        {
+            inResponse = false;
+            entries.push_back(current);
+        }
+    }
+
+    void Char(const XML_Char *s, int len)
+    {
+        text.append(s, len);
+    }
+};
+
+static void _httpdir_start(void *data, const XML_Char *el, const XML_Char **attr)
+{
+    ((httpDirHandler *)data)->Start(el, attr);
+}
+
+static void _httpdir_end(void *data, const XML_Char *el)
+{
+    ((httpDirHandler *)data)->End(el);
+}
+
+static void _httpdir_char(void *data, const XML_Char *s, int len)
+{
+    ((httpDirHandler *)data)->Char(s, len);
+}
+
+static bool _httpdir_sort(const fsdir_entry &left, const fsdir_entry &right)
+{
+    if (left.isDir != right.isDir)
+        return left.isDir;
+    return strcasecmp(left.filename, right.filename) < 0;
+}
+
+bool FileSystemHTTP::dir_open(const char *path, const char *pattern, uint16_t diropts)
+{
+    dir_close();
+
+    if (!_started)
+        return false;
+
+    std::string url = _make_url(path);
+    if (url.back() != '/')
+        url += "/";
+
+    fnHttpClient client;
+    if (client.begin(url) == false)
+        return false;
+
+    int status = client.PROPFIND(fnHttpClient::webdav_depth::DEPTH_1, HTTP_PROPFIND_BODY);
+    if (status != 207)
+    {
+        Debug_printf("HTTP PROPFIND \"%s\" failed with status %d\n", url.c_str(), status);
+        client.close();
+        return false;
+    }
+
+    httpDirHandler handler;
+    XML_Parser parser = XML_ParserCreateNS(NULL, ' ');
+    XML_SetUserData(parser, &handler);
+    XML_SetElementHandler(parser, _httpdir_start, _httpdir_end);
+    XML_SetCharacterDataHandler(parser, _httpdir_char);
+
+    char buf[512];
+    int len;
+    bool ok = true;
+    while ((len = client.read((uint8_t *)buf, sizeof(buf))) > 0)
+    {
+        if (XML_Parse(parser, buf, len, false) == XML_STATUS_ERROR)
+        {
+            Debug_printf("HTTP PROPFIND XML error: %s\n", XML_ErrorString(XML_GetErrorCode(parser)));
+            ok = false;
+            break;
+        }
+        if (len < sizeof(buf))
+            break;
+    }
+    if (ok)
+        XML_Parse(parser, buf, 0, true);
+    XML_ParserFree(parser);
+    client.close();
+
+    if (ok == false)
+        return false;
+
+    bool have_pattern = pattern != nullptr && pattern[0] != '\0';
+
+    // The first entry is the directory itself
+    for (int i = 1; i < handler.entries.size(); i++)
+    {
+        fsdir_entry &e = handler.entries[i];
+        if (e.filename[0] == '\0' || e.filename[0] == '.')
+            continue;
+        if (e.isDir == false && have_pattern && util_wildcard_match(e.filename, pattern) == false)
+            continue;
+        _dir_entries.push_back(e);
+    }
+
+    // There are no modified times to sort by, so everything's sorted by name
+    std::sort(_dir_entries.begin(), _dir_entries.end(), _httpdir_sort);
+    if (diropts & DIR_OPTION_DESCENDING)
+    {
+        auto firstfile = std::find_if(_dir_entries.begin(), _dir_entries.end(), [](const fsdir_entry &e) { return e.isDir == false; });
+        std::reverse(_dir_entries.begin(), firstfile);
+        std::reverse(firstfile, _dir_entries.end());
+    }
+
+    return true;
+}
+
+fsdir_entry *FileSystemHTTP::dir_read()
+{
+    if (_dir_entry_current < _dir_entries.size())
+        return &_dir_entries[_dir_entry_current++];
+    return nullptr;
+}
+
+void FileSystemHTTP::dir_close()
+{
+    _dir_entries.clear();
+    _dir_entry_current = 0;
+}
+
+uint16_t FileSystemHTTP::dir_tell()
+{
+    if (_dir_entries.empty())
+        return FNFS_INVALID_DIRPOS;
+    return _dir_entry_current;
+}
+
+bool FileSystemHTTP::dir_seek(uint16_t pos)
+{
+    if (pos >= _dir_entries.size())
+        return false;
+    _dir_entry_current = pos;
+    return true;
+}
@@ -0,0 +1,57 @@
+#ifndef _FN_FSHTTP_
+#define _FN_FSHTTP_
+
+#include <string>
+#include <vector>
+
+#include "fnFS.h"
+
+/* Read-only access to files on an HTTP or WebDAV server
+
+ Files are opened as a FILE whose reads turn into Range GET requests for
+ aligned blocks, with the most recently used blocks kept in PSRAM, so
+ mounting a disk image only fetches the sectors that get read. Servers that
+ ignore Range get the whole file downloaded into PSRAM on open instead.
+ Directories are listed with a WebDAV PROPFIND.
+*/
+
+// Bytes per Range request - 32 single density or 16 double density sectors
+#define HTTP_RANGE_BLOCK_SIZE 4096
+// Blocks kept per open file
+#define HTTP_RANGE_CACHE_BLOCKS 16
+
+class FileSystemHTTP : public FileSystem
+{
+private:
+    // Scheme, host and any path that prefixes every path we're given, without a trailing '/'
+    std::string _baseurl;
+
+    std::vector<fsdir_entry> _dir_entries;
+    uint16_t _dir_entry_current = 0;
+
+    std::string _make_url(const char *path);
+
+public:
+    // url is "http://" or "https://" followed by a host and optional base path
+    bool start(const char *url);
+
+    fsType type() override { return FSTYPE_HTTP; };
+    const char * typestring() override { return type_to_string(FSTYPE_HTTP); };
+
+    // Only reading is supported
+    FILE * file_open(const char* path, const char* mode = FILE_READ) override;
+
+    bool exists(const char* path) override;
+
+    bool remove(const char* path) override { return false; };
+
+    bool rename(const char* pathFrom, const char* pathTo) override { return false; };
+
+    bool dir_open(const char * path, const char *pattern, uint16_t diropts) override;
+    fsdir_entry *dir_read() override;
+    void dir_close() override;
+    uint16_t dir_tell() override;
+    bool dir_seek(uint16_t) override;
+};
+
+#endif // _FN_FSHTTP_
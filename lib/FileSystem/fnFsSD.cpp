@@ -137,7 +137,8 @@ bool FileSystemSDFAT::dir_open(const char * path, const char * pattern, uint16_t
         // Ignore some special files we create on SD
         if(strcmp(finfo.fname, "paper") == 0 
         || strcmp(finfo.fname, "fnconfig.ini") == 0
-        || strcmp(finfo.fname, "rs232dump") == 0)
+        || strcmp(finfo.fname, "rs232dump") == 0
+        || strncmp(finfo.fname, "printjob", 8) == 0)
             continue;
 
         // Determine which list to put this in
@@ -250,6 +251,18 @@ bool FileSystemSDFAT::exists(const char* path)
     return (result == FR_OK);
 }
 
+/* Returns the modified time of the given directory, or 0 if it can't be determined
+   (the root directory has no timestamp in FAT)
+*/
+time_t FileSystemSDFAT::dir_mtime(const char *path)
+{
+    FILINFO finfo;
+    if (f_stat(path, &finfo) != FR_OK || !(finfo.fattrib & AM_DIR))
+        return 0;
+
+    return _fssd_fatdatetime_to_epoch(finfo.ftime, finfo.fdate);
+}
+
 bool FileSystemSDFAT::remove(const char* path)
 {
     FRESULT result = f_unlink(path);
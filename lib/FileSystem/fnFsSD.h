@@ -30,6 +30,7 @@ public:
     bool dir_seek(uint16_t) override;
 
     bool create_path(const char *fullpath);
+    time_t dir_mtime(const char *path);
     
     uint64_t card_size();
     uint64_t total_bytes();
@@ -28,9 +28,27 @@ bool FileSystemTNFS::start(const char *host, uint16_t port, const char * mountpa
     
     strlcpy(_mountinfo.hostname, host, sizeof(_mountinfo.hostname));
 
+    // With mirrors, tnfs_mount() picks the server to use
+    _mountinfo.server_count = 0;
+    if (_mirrors.empty() == false)
+    {
+        _mountinfo.add_server(host);
+        size_t start = 0;
+        while (start < _mirrors.length())
+        {
+            size_t end = _mirrors.find(',', start);
+            if (end == std::string::npos)
+                end = _mirrors.length();
+            std::string mirror = _mirrors.substr(start, end - start);
+            if (mirror.empty() == false && _mountinfo.add_server(mirror.c_str()) == false)
+                Debug_printf("Too many TNFS mirrors - ignoring \"%s\"\n", mirror.c_str());
+            start = end + 1;
+        }
+    }
+
     // Try to resolve the hostname and store that so we don't have to keep looking it up
     _mountinfo.host_ip = get_ip4_addr_by_name(host);
-    if(_mountinfo.host_ip == IPADDR_NONE)
+    if(_mountinfo.host_ip == IPADDR_NONE && _mountinfo.server_count < 2)
     {
         Debug_printf("Failed to resolve hostname \"%s\"\n", host);
         return false;
@@ -89,6 +107,18 @@ bool FileSystemTNFS::exists(const char* path)
     return result == TNFS_RESULT_SUCCESS;
 }
 
+bool FileSystemTNFS::file_stat(const char *path, uint32_t *filesize, time_t *mtime)
+{
+    tnfsStat tstat;
+
+    if (TNFS_RESULT_SUCCESS != tnfs_stat(&_mountinfo, &tstat, path) || tstat.isDir)
+        return false;
+
+    *filesize = tstat.filesize;
+    *mtime = tstat.m_time;
+    return true;
+}
+
 bool FileSystemTNFS::remove(const char* path)
 {
     if(path == nullptr)
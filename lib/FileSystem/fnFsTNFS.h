@@ -1,6 +1,8 @@
 #ifndef _FN_FSTNFS_
 #define _FN_FSTNFS_
 
+#include <string>
+
 #include "fnFS.h"
 #include "../TNFSlib/tnfslib.h"
 
@@ -11,11 +13,19 @@ private:
     tnfsMountInfo _mountinfo;
     unsigned long _last_dns_refresh;
     char _current_dirpath[TNFS_MAX_FILELEN];
+    // Comma-separated list of other servers with the same files
+    std::string _mirrors;
 
 public:
     FileSystemTNFS();
     ~FileSystemTNFS();
 
+    // Comma-separated hostnames of servers with the same files as the one given to start()
+    void set_mirrors(const char *mirrors) { _mirrors = mirrors == nullptr ? "" : mirrors; };
+
+    // One of the TNFS_TRANSPORT_* values. Takes effect on the next start()
+    void set_transport(uint8_t transport) { _mountinfo.transport_mode = transport; };
+
     bool start(const char *host, uint16_t port=TNFS_DEFAULT_PORT, const char * mountpath=nullptr, const char * userid=nullptr, const char * password=nullptr);
 
     fsType type() override { return FSTYPE_TNFS; };
@@ -24,6 +34,8 @@ public:
     FILE * file_open(const char* path, const char* mode = FILE_READ) override;
 
     bool exists(const char* path) override;
+    // Size and last modified time of a file. Returns false if it can't be found
+    bool file_stat(const char *path, uint32_t *filesize, time_t *mtime);
 
     bool remove(const char* path) override;
 
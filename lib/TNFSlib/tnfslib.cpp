@@ -3,10 +3,21 @@
 
 #include "tnfslib.h"
 #include "../tcpip/fnUDP.h"
+#include "../tcpip/fnTcpClient.h"
 #include "../utils/utils.h"
 #include "../hardware/fnSystem.h"
+#include "../tcpip/fnDNS.h"
 
 bool _tnfs_transaction(tnfsMountInfo *m_info, tnfsPacket &pkt, uint16_t datalen);
+bool _tnfs_server_transaction(tnfsMountInfo *m_info, tnfsPacket &pkt, uint16_t datalen);
+int _tnfs_mount_server(tnfsMountInfo *m_info);
+int _tnfs_mount_fastest(tnfsMountInfo *m_info);
+bool _tnfs_use_server(tnfsMountInfo *m_info, int index);
+bool _tnfs_failover(tnfsMountInfo *m_info);
+bool _tnfs_tcp_transaction(tnfsMountInfo *m_info, tnfsPacket &pkt, uint16_t datalen);
+bool _tnfs_tcp_connect(tnfsMountInfo *m_info);
+bool _tnfs_tcp_reply_complete(uint8_t command, const tnfsPacket &pkt, int received);
+bool _tnfs_tcp_strings_complete(const uint8_t *data, int len, int count);
 
 int _tnfs_adjust_with_full_path(tnfsMountInfo *m_info, char *buffer, const char *source, int bufflen);
 
@@ -37,6 +48,35 @@ int tnfs_mount(tnfsMountInfo *m_info)
     if (m_info->session != TNFS_INVALID_SESSION)
         tnfs_umount(m_info);
     m_info->session = TNFS_INVALID_SESSION; // In case tnfs_umount fails - throw out the current session ID
+    m_info->empty_statcache();
+
+    if (m_info->server_count > 1)
+        return _tnfs_mount_fastest(m_info);
+
+    return _tnfs_mount_server(m_info);
+}
+
+/*
+ Mounts whichever server hostname and host_ip currently point to
+*/
+int _tnfs_mount_server(tnfsMountInfo *m_info)
+{
+    /* Settle on a transport before we send anything. This is done for every server we mount,
+       since mirrors don't all have to offer TCP, and a server may stop offering it
+    */
+    m_info->transport = TNFS_TRANSPORT_UDP;
+    if (m_info->transport_mode != TNFS_TRANSPORT_UDP)
+    {
+        bool connected = _tnfs_tcp_connect(m_info);
+        if (m_info->transport_mode == TNFS_TRANSPORT_AUTO)
+            Debug_printf("TNFS using %s\n", connected ? "TCP" : "UDP");
+        else if (connected == false)
+            return -1;
+        if (connected)
+            m_info->transport = TNFS_TRANSPORT_TCP;
+    }
+    else
+        m_info->tcp.stop();
 
     tnfsPacket packet;
     packet.command = TNFS_CMD_MOUNT;
@@ -98,15 +138,185 @@ int tnfs_umount(tnfsMountInfo *m_info)
     tnfsPacket packet;
     packet.command = TNFS_CMD_UNMOUNT;
 
+    int result = -1;
     if (_tnfs_transaction(m_info, packet, 0))
     {
         if (packet.payload[0] == TNFS_RESULT_SUCCESS)
         {
             m_info->session = TNFS_INVALID_SESSION;
         }
-        return packet.payload[0];
+        result = packet.payload[0];
     }
-    return -1;
+
+    if (m_info->transport == TNFS_TRANSPORT_TCP)
+        m_info->tcp.stop();
+
+    return result;
+}
+
+/*
+ Points hostname and host_ip at one of our servers
+*/
+bool _tnfs_use_server(tnfsMountInfo *m_info, int index)
+{
+    m_info->current_server = index;
+    strlcpy(m_info->hostname, m_info->servers[index].hostname, sizeof(m_info->hostname));
+    m_info->host_ip = get_ip4_addr_by_name(m_info->hostname);
+    return m_info->host_ip != IPADDR_NONE;
+}
+
+/*
+ Mounts each server once to see how quickly it answers, then mounts the fastest.
+ If none of them answer the first time, the first server gets the usual retries.
+*/
+int _tnfs_mount_fastest(tnfsMountInfo *m_info)
+{
+    uint8_t max_retries = m_info->max_retries;
+    // Anything that needs retries won't be the fastest anyway
+    m_info->max_retries = 1;
+
+    int best = -1;
+    for (int i = 0; i < m_info->server_count; i++)
+    {
+        tnfsServerInfo &server = m_info->servers[i];
+        if (_tnfs_use_server(m_info, i) == false)
+        {
+            server.failures++;
+            continue;
+        }
+
+        uint32_t ms_start = fnSystem.millis();
+        if (_tnfs_mount_server(m_info) != TNFS_RESULT_SUCCESS)
+        {
+            server.failures++;
+            m_info->session = TNFS_INVALID_SESSION;
+            continue;
+        }
+        // Never zero, which means we don't know
+        server.rtt_ms = (fnSystem.millis() - ms_start) | 1;
+        Debug_printf("TNFS server \"%s\" mounted in %ums\n", server.hostname, server.rtt_ms);
+
+        tnfs_umount(m_info);
+
+        if (best < 0 || server.rtt_ms < m_info->servers[best].rtt_ms)
+            best = i;
+    }
+
+    m_info->max_retries = max_retries;
+
+    if (best < 0)
+    {
+        Debug_println("No TNFS server answered quickly - trying the first one again");
+        best = 0;
+    }
+
+    if (_tnfs_use_server(m_info, best) == false)
+        return -1;
+
+    return _tnfs_mount_server(m_info);
+}
+
+/*
+ Called when the current server stops answering. Mounts the next fastest server that
+ answers and re-opens our files there at the same positions. Files open for writing
+ aren't moved, since writes to a mirror wouldn't end up on the original host.
+ The open directory (if any) is lost.
+ Returns true if another server has taken over.
+*/
+bool _tnfs_failover(tnfsMountInfo *m_info)
+{
+    if (m_info->server_count < 2 || m_info->failing_over)
+        return false;
+
+    m_info->failing_over = true;
+
+    int failed = m_info->current_server;
+    m_info->servers[failed].failures++;
+    Debug_printf("TNFS server \"%s\" stopped answering - failing over\n", m_info->servers[failed].hostname);
+
+    bool tried[TNFS_MAX_SERVERS] = { false };
+    tried[failed] = true;
+
+    int next = -1;
+    for (int attempt = 1; attempt < m_info->server_count && next < 0; attempt++)
+    {
+        // Fastest untried server, with those we haven't timed going last
+        int pick = -1;
+        for (int i = 0; i < m_info->server_count; i++)
+        {
+            if (tried[i])
+                continue;
+            if (pick < 0 || (m_info->servers[i].rtt_ms != 0 &&
+                             (m_info->servers[pick].rtt_ms == 0 || m_info->servers[i].rtt_ms < m_info->servers[pick].rtt_ms)))
+                pick = i;
+        }
+        tried[pick] = true;
+
+        // The old session died with the old server, so don't try to log off
+        m_info->session = TNFS_INVALID_SESSION;
+        if (_tnfs_use_server(m_info, pick) && _tnfs_mount_server(m_info) == TNFS_RESULT_SUCCESS)
+            next = pick;
+        else
+            m_info->servers[pick].failures++;
+    }
+
+    if (next < 0)
+    {
+        Debug_println("TNFS failover found no server that answers");
+        m_info->failing_over = false;
+        return false;
+    }
+
+    m_info->servers[next].failovers++;
+    Debug_printf("TNFS failed over to \"%s\"\n", m_info->servers[next].hostname);
+
+    m_info->empty_statcache();
+    m_info->empty_dircache();
+    m_info->dir_handle = TNFS_INVALID_HANDLE;
+
+    for (int i = 0; i < TNFS_MAX_FILE_HANDLES; i++)
+    {
+        tnfsFileHandleInfo *pFileInf = m_info->get_filehandleinfo_at(i);
+        if (pFileInf == nullptr)
+            continue;
+
+        // Anything sent with this will get a bad handle error from the new server
+        pFileInf->server_handle = TNFS_INVALID_HANDLE;
+
+        if (pFileInf->open_mode & TNFS_OPENMODE_WRITE)
+            continue;
+
+        tnfsPacket packet;
+        packet.command = TNFS_CMD_OPEN;
+        packet.payload[0] = TNFS_LOBYTE_FROM_UINT16(pFileInf->open_mode);
+        packet.payload[1] = TNFS_HIBYTE_FROM_UINT16(pFileInf->open_mode);
+        packet.payload[2] = 0;
+        packet.payload[3] = 0;
+        // The filename we kept is already a full path
+        int len = strlcpy((char *)packet.payload + 4, pFileInf->filename, sizeof(packet.payload) - 4);
+
+        if (_tnfs_server_transaction(m_info, packet, len + 5) && packet.payload[0] == TNFS_RESULT_SUCCESS)
+        {
+            pFileInf->server_handle = packet.payload[1];
+            /* Put the server's position back where we think it is. This can happen partway through
+               filling our cache, so only the server's handle is moved - tnfs_lseek() would reset
+               cached_pos and the cache itself
+            */
+            packet.command = TNFS_CMD_LSEEK;
+            packet.payload[0] = pFileInf->server_handle;
+            packet.payload[1] = SEEK_SET;
+            TNFS_UINT32_TO_LOHI_BYTEPTR(pFileInf->file_position, packet.payload + 2);
+            if (_tnfs_server_transaction(m_info, packet, 6) && packet.payload[0] == TNFS_RESULT_SUCCESS)
+            {
+                Debug_printf("TNFS re-opened \"%s\" at %u\n", pFileInf->filename, pFileInf->file_position);
+                continue;
+            }
+        }
+        Debug_printf("TNFS failed to re-open \"%s\"\n", pFileInf->filename);
+    }
+
+    m_info->failing_over = false;
+    return true;
 }
 
 /* Open a file
@@ -174,7 +384,9 @@ int tnfs_open(tnfsMountInfo *m_info, const char *filepath, uint16_t open_mode, u
         if (packet.payload[0] == TNFS_RESULT_SUCCESS)
         {
             // Since everything went okay, save our file info
-            pFileInf->handle_id = packet.payload[1];
+            pFileInf->server_handle = packet.payload[1];
+            pFileInf->handle_id = m_info->unused_handle_id(pFileInf->server_handle, pFileInf);
+            pFileInf->open_mode = open_mode;
             pFileInf->file_position = pFileInf->cached_pos = 0;
 
             *file_handle = pFileInf->handle_id;
@@ -189,6 +401,10 @@ int tnfs_open(tnfsMountInfo *m_info, const char *filepath, uint16_t open_mode, u
                     pFileInf->file_size = 0;
             }
             Debug_printf("File opened, handle ID: %hhd, size: %u, pos: %u\n", *file_handle, pFileInf->file_size, pFileInf->file_position);
+
+            // The file may have been created or truncated
+            if (open_mode & TNFS_OPENMODE_WRITE)
+                m_info->empty_statcache();
         }
         result = packet.payload[0];
     }
@@ -216,7 +432,7 @@ int tnfs_close(tnfsMountInfo *m_info, int16_t file_handle)
 
     tnfsPacket packet;
     packet.command = TNFS_CMD_CLOSE;
-    packet.payload[0] = file_handle;
+    packet.payload[0] = pFileInf->server_handle;
 
     if (_tnfs_transaction(m_info, packet, 1))
     {
@@ -342,7 +558,7 @@ int _tnfs_fill_cache(tnfsMountInfo *m_info, tnfsFileHandleInfo *pFHI)
     {
         tnfsPacket packet;
         packet.command = TNFS_CMD_READ;
-        packet.payload[0] = pFHI->handle_id;
+        packet.payload[0] = pFHI->server_handle;
 
         // How many bytes to read in this call
         uint16_t bytes_to_read = bytes_remaining_to_load > TNFS_MAX_READWRITE_PAYLOAD ? TNFS_MAX_READWRITE_PAYLOAD : bytes_remaining_to_load;
@@ -482,12 +698,15 @@ int tnfs_write(tnfsMountInfo *m_info, int16_t file_handle, uint8_t *buffer, uint
 
     tnfsPacket packet;
     packet.command = TNFS_CMD_WRITE;
-    packet.payload[0] = file_handle;
+    packet.payload[0] = pFileInf->server_handle;
     packet.payload[1] = TNFS_LOBYTE_FROM_UINT16(bufflen);
     packet.payload[2] = TNFS_HIBYTE_FROM_UINT16(bufflen);
 
     memcpy(packet.payload + 3, buffer, bufflen);
 
+    // The file's size and modified time are about to change
+    m_info->empty_statcache();
+
     if (_tnfs_transaction(m_info, packet, bufflen + 3))
     {
         if (packet.payload[0] == TNFS_RESULT_SUCCESS)
@@ -570,7 +789,7 @@ int tnfs_lseek(tnfsMountInfo *m_info, int16_t file_handle, int32_t position, uin
     // Go ahead and execute a new TNFS SEEK request
     tnfsPacket packet;
     packet.command = TNFS_CMD_LSEEK;
-    packet.payload[0] = file_handle;
+    packet.payload[0] = pFileInf->server_handle;
     packet.payload[1] = type;
     TNFS_UINT32_TO_LOHI_BYTEPTR(position, packet.payload + 2);
 
@@ -659,6 +878,7 @@ int tnfs_opendirx(tnfsMountInfo *m_info, const char *directory, uint8_t sortopts
         {
             m_info->dir_handle = packet.payload[1];
             m_info->dir_entries = TNFS_UINT16_FROM_LOHI_BYTEPTR(packet.payload + 2);
+            m_info->dir_statkey = tnfsMountInfo::statcache_key((char *)(packet.payload + pathoffset));
             Debug_printf("Directory opened, handle ID: %hhd, entries: %u\n", m_info->dir_handle, m_info->dir_entries);
         }
         return packet.payload[0];
@@ -769,6 +989,10 @@ int tnfs_readdirx(tnfsMountInfo *m_info, tnfsStat *filestat, char *dir_entry, in
                     int name_len = strlcpy(pEntry->entryname, 
                         (char *)packet.payload + current_offset + OFFSET_READDIRX_PATH, sizeof(pEntry->entryname));
 
+                    // Saves a STAT if this file gets looked at next, which it usually does
+                    m_info->store_statcache(tnfsMountInfo::statcache_key(m_info->dir_statkey, pEntry->entryname),
+                        pEntry->flags & TNFS_READDIRX_DIR, pEntry->filesize, pEntry->m_time, pEntry->c_time);
+
                     /*
                      Adjust our offset to point to the next entry within the packet
                      flags (1) + size (4) + mtime (4) + ctime (4) + null (1) = 14
@@ -890,6 +1114,8 @@ int tnfs_mkdir(tnfsMountInfo *m_info, const char *directory)
     tnfsPacket packet;
     packet.command = TNFS_CMD_MKDIR;
 
+    m_info->empty_statcache();
+
     int len = _tnfs_adjust_with_full_path(m_info, (char *)packet.payload, directory, sizeof(packet.payload));
 
     Debug_printf("TNFS make directory: \"%s\"\n", (char *)packet.payload);
@@ -913,6 +1139,8 @@ int tnfs_rmdir(tnfsMountInfo *m_info, const char *directory)
     tnfsPacket packet;
     packet.command = TNFS_CMD_RMDIR;
 
+    m_info->empty_statcache();
+
     int len = _tnfs_adjust_with_full_path(m_info, (char *)packet.payload, directory, sizeof(packet.payload));
 
     Debug_printf("TNFS remove directory: \"%s\"\n", (char *)packet.payload);
@@ -940,6 +1168,18 @@ int tnfs_stat(tnfsMountInfo *m_info, tnfsStat *filestat, const char *filepath)
 
     // Debug_printf("TNFS stat: \"%s\"\n", (char *)packet.payload);
 
+    uint32_t statkey = tnfsMountInfo::statcache_key((char *)packet.payload);
+    tnfsStatCacheEntry *pCached = m_info->find_statcache(statkey);
+    if (pCached != nullptr)
+    {
+        filestat->isDir = pCached->isDir;
+        filestat->filesize = pCached->filesize;
+        filestat->a_time = 0;
+        filestat->m_time = pCached->m_time;
+        filestat->c_time = pCached->c_time;
+        return TNFS_RESULT_SUCCESS;
+    }
+
 #define OFFSET_STAT_FILEMODE 1
 #define OFFSET_STAT_UID 3
 #define OFFSET_STAT_GID 5
@@ -966,6 +1206,8 @@ int tnfs_stat(tnfsMountInfo *m_info, tnfsStat *filestat, const char *filepath)
             filestat->m_time = TNFS_UINT32_FROM_LOHI_BYTEPTR(packet.payload + OFFSET_STAT_MTIME);
             filestat->c_time = TNFS_UINT32_FROM_LOHI_BYTEPTR(packet.payload + OFFSET_STAT_CTIME);
 
+            m_info->store_statcache(statkey, filestat->isDir, filestat->filesize, filestat->m_time, filestat->c_time);
+
             /*
             Debug_printf("\ttnfs_stat: mode: %ho, uid: %hu, gid: %hu, dir: %d, size: %u, atime: 0x%04x, mtime: 0x%04x, ctime: 0x%04x\n", 
                 filemode, uid, gid,
@@ -990,6 +1232,8 @@ int tnfs_unlink(tnfsMountInfo *m_info, const char *filepath)
     tnfsPacket packet;
     packet.command = TNFS_CMD_UNLINK;
 
+    m_info->empty_statcache();
+
     int len = _tnfs_adjust_with_full_path(m_info, (char *)packet.payload, filepath, sizeof(packet.payload));
 
     Debug_printf("TNFS unlink file: \"%s\"\n", (char *)packet.payload);
@@ -1014,6 +1258,8 @@ int tnfs_rename(tnfsMountInfo *m_info, const char *old_filepath, const char *new
     tnfsPacket packet;
     packet.command = TNFS_CMD_RENAME;
 
+    m_info->empty_statcache();
+
     int l1 = _tnfs_adjust_with_full_path(m_info, (char *)packet.payload, old_filepath, sizeof(packet.payload)) + 1;
     int l2 = _tnfs_adjust_with_full_path(m_info, (char *)packet.payload + l1, new_filepath, sizeof(packet.payload) - l1) + 1;
 
@@ -1039,6 +1285,8 @@ int tnfs_chmod(tnfsMountInfo *m_info, const char *filepath, uint16_t mode)
     tnfsPacket packet;
     packet.command = TNFS_CMD_CHMOD;
 
+    m_info->empty_statcache();
+
     packet.payload[0] = TNFS_LOBYTE_FROM_UINT16(mode);
     packet.payload[1] = TNFS_HIBYTE_FROM_UINT16(mode);
 
@@ -1184,6 +1432,55 @@ const char *tnfs_getcwd(tnfsMountInfo *m_info)
  */
 bool _tnfs_transaction(tnfsMountInfo *m_info, tnfsPacket &pkt, uint16_t payload_size)
 {
+    // Mounting has its own way of picking a server
+    if (m_info->server_count < 2 || m_info->failing_over || pkt.command == TNFS_CMD_MOUNT || pkt.command == TNFS_CMD_UNMOUNT)
+        return _tnfs_server_transaction(m_info, pkt, payload_size);
+
+    // Keep the request, as the packet gets overwritten by whatever comes back
+    uint8_t command = pkt.command;
+    uint8_t request[TNFS_PAYLOAD_SIZE];
+    memcpy(request, pkt.payload, payload_size);
+
+    if (_tnfs_server_transaction(m_info, pkt, payload_size))
+        return true;
+
+    // Remember which file this was for, as its handle changes when it's re-opened
+    tnfsFileHandleInfo *pFileInf = nullptr;
+    bool file_command = command == TNFS_CMD_READ || command == TNFS_CMD_WRITE ||
+                        command == TNFS_CMD_LSEEK || command == TNFS_CMD_CLOSE;
+    if (file_command)
+    {
+        for (int i = 0; i < TNFS_MAX_FILE_HANDLES && pFileInf == nullptr; i++)
+        {
+            tnfsFileHandleInfo *p = m_info->get_filehandleinfo_at(i);
+            if (p != nullptr && p->server_handle == request[0])
+                pFileInf = p;
+        }
+    }
+
+    if (_tnfs_failover(m_info) == false)
+        return false;
+
+    pkt.command = command;
+    memcpy(pkt.payload, request, payload_size);
+    if (file_command)
+    {
+        if (pFileInf == nullptr)
+            return false;
+        pkt.payload[0] = pFileInf->server_handle;
+    }
+
+    return _tnfs_server_transaction(m_info, pkt, payload_size);
+}
+
+/*
+  Sends the packet to the current server
+*/
+bool _tnfs_server_transaction(tnfsMountInfo *m_info, tnfsPacket &pkt, uint16_t payload_size)
+{
+    if (m_info->transport == TNFS_TRANSPORT_TCP)
+        return _tnfs_tcp_transaction(m_info, pkt, payload_size);
+
     fnUDP udp;
 
     // Set our session ID
@@ -1273,6 +1570,212 @@ bool _tnfs_transaction(tnfsMountInfo *m_info, tnfsPacket &pkt, uint16_t payload_
     return false;
 }
 
+bool _tnfs_tcp_connect(tnfsMountInfo *m_info)
+{
+    m_info->tcp.stop();
+
+    int connected;
+    if (m_info->host_ip != IPADDR_NONE)
+        connected = m_info->tcp.connect(m_info->host_ip, m_info->port, TNFS_TCP_CONNECT_TIMEOUT);
+    else
+        connected = m_info->tcp.connect(m_info->hostname, m_info->port, TNFS_TCP_CONNECT_TIMEOUT);
+
+    if (connected == 0)
+    {
+        Debug_printf("TNFS TCP connection to %s:%hu failed\n", m_info->hostname, m_info->port);
+        return false;
+    }
+
+    m_info->tcp.setNoDelay(true);
+    return true;
+}
+
+/*
+  TCP version of _tnfs_transaction
+  The packet format is the same as for UDP, without any extra framing. Responses are small
+  enough to arrive together, except a READ which says how much data follows, so we wait for
+  that much. TCP takes care of lost packets, so a timeout means the connection is in trouble:
+  we drop it (along with any late response that would otherwise be mistaken for the next
+  one) and reconnect before trying again.
+ */
+bool _tnfs_tcp_transaction(tnfsMountInfo *m_info, tnfsPacket &pkt, uint16_t payload_size)
+{
+    // Set our session ID
+    pkt.session_idl = TNFS_LOBYTE_FROM_UINT16(m_info->session);
+    pkt.session_idh = TNFS_HIBYTE_FROM_UINT16(m_info->session);
+
+    uint8_t command = pkt.command;
+
+    int retry = 0;
+    while (retry < m_info->max_retries)
+    {
+        pkt.sequence_num = m_info->current_sequence_num++;
+        uint8_t current_sequence_num = pkt.sequence_num;
+
+#ifdef DEBUG
+        _tnfs_debug_packet(pkt, payload_size);
+#endif
+
+        bool sent = m_info->tcp.connected() || _tnfs_tcp_connect(m_info);
+
+        // Throw out anything left from an earlier reply so it isn't taken as the start of this one
+        if (sent)
+        {
+            uint8_t stale[32];
+            int avail;
+            while ((avail = m_info->tcp.available()) > 0)
+                if (m_info->tcp.read(stale, avail > sizeof(stale) ? sizeof(stale) : avail) <= 0)
+                    break;
+        }
+
+        if (sent)
+            sent = m_info->tcp.write(pkt.rawData, payload_size + TNFS_HEADER_SIZE) == payload_size + TNFS_HEADER_SIZE;
+
+        if (!sent)
+        {
+            Debug_println("Failed to send packet over TCP - retrying");
+        }
+        else
+        {
+            int ms_start = fnSystem.millis();
+            int received = 0;
+            do
+            {
+                int avail = m_info->tcp.available();
+                if (avail > 0)
+                {
+                    if (avail > (int)sizeof(pkt.rawData) - received)
+                        avail = sizeof(pkt.rawData) - received;
+                    int l = m_info->tcp.read(pkt.rawData + received, avail);
+                    if (l > 0)
+                        received += l;
+
+                    if (_tnfs_tcp_reply_complete(command, pkt, received) || received == sizeof(pkt.rawData))
+                    {
+#ifdef DEBUG
+                        _tnfs_debug_packet(pkt, received, true);
+#endif
+                        if (pkt.sequence_num != current_sequence_num)
+                        {
+                            Debug_println("TNFS TCP OUT OF ORDER SEQUENCE! RETRYING");
+                            break;
+                        }
+                        if (pkt.payload[0] != TNFS_RESULT_TRY_AGAIN)
+                            return true;
+
+                        uint16_t backoffms = TNFS_UINT16_FROM_LOHI_BYTEPTR(pkt.payload + 1);
+                        Debug_printf("Server asked us to TRY AGAIN after %ums\n", backoffms);
+                        if (backoffms > TNFS_MAX_BACKOFF_DELAY)
+                            backoffms = TNFS_MAX_BACKOFF_DELAY;
+                        vTaskDelay(backoffms / portTICK_PERIOD_MS);
+                        break;
+                    }
+                }
+                else if (m_info->tcp.connected() == false)
+                {
+                    Debug_println("TNFS TCP connection closed by server");
+                    break;
+                }
+                fnSystem.yield();
+
+            } while ((fnSystem.millis() - ms_start) < m_info->timeout_ms);
+
+            Debug_printf("No complete TCP response after %d milliseconds. Reconnecting\n", (int)(fnSystem.millis() - ms_start));
+            m_info->tcp.stop();
+        }
+
+        vTaskDelay(m_info->min_retry_ms / portTICK_PERIOD_MS);
+        retry++;
+    }
+
+    Debug_println("Retry attempts failed");
+
+    return false;
+}
+
+/* Messages over TCP aren't delimited, so whether we have all of a reply is worked out
+   from what each command sends back. Failures are just the result code, except for
+   TRY_AGAIN which is followed by the delay
+*/
+bool _tnfs_tcp_reply_complete(uint8_t command, const tnfsPacket &pkt, int received)
+{
+    if (received < TNFS_HEADER_SIZE + 1)
+        return false;
+
+    // Payload bytes received, starting with the result code
+    int len = received - TNFS_HEADER_SIZE;
+    const uint8_t *p = pkt.payload;
+
+    if (p[0] == TNFS_RESULT_TRY_AGAIN)
+        return len >= 3;
+    if (p[0] != TNFS_RESULT_SUCCESS)
+        return true;
+
+    switch (command)
+    {
+    case TNFS_CMD_OPEN:
+    case TNFS_CMD_OPENDIR:
+        // Handle
+        return len >= 2;
+    case TNFS_CMD_WRITE:
+        // Bytes written
+        return len >= 3;
+    case TNFS_CMD_OPENDIRX:
+        // Handle and entry count
+        return len >= 4;
+    case TNFS_CMD_MOUNT:
+        // Version and retry delay
+    case TNFS_CMD_LSEEK:
+    case TNFS_CMD_TELLDIR:
+    case TNFS_CMD_SIZE:
+    case TNFS_CMD_FREE:
+        // 32-bit value
+        return len >= 5;
+    case TNFS_CMD_READ:
+        // Byte count and that many bytes
+        return len >= 3 && len >= 3 + TNFS_UINT16_FROM_LOHI_BYTEPTR(p + 1);
+    case TNFS_CMD_READDIR:
+        // Entry name
+        return _tnfs_tcp_strings_complete(p + 1, len - 1, 1);
+    case TNFS_CMD_STAT:
+        // Mode, uid, gid, size and times, then user and group names
+        return len >= 23 && _tnfs_tcp_strings_complete(p + 23, len - 23, 2);
+    case TNFS_CMD_READDIRX:
+    {
+        // Count, status and position, then each entry's flags, size, times and name
+        if (len < 5)
+            return false;
+        int offset = 5;
+        for (int i = 0; i < p[1]; i++)
+        {
+            if (len < offset + 14)
+                return false;
+            const uint8_t *end = (const uint8_t *)memchr(p + offset + 13, '\0', len - offset - 13);
+            if (end == nullptr)
+                return false;
+            offset = end - p + 1;
+        }
+        return true;
+    }
+    default:
+        return true;
+    }
+}
+
+// True if count null-terminated strings are all within the len bytes starting at data
+bool _tnfs_tcp_strings_complete(const uint8_t *data, int len, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        const uint8_t *end = (const uint8_t *)memchr(data, '\0', len);
+        if (end == nullptr)
+            return false;
+        len -= end - data + 1;
+        data = end + 1;
+    }
+    return true;
+}
+
 // Copies to buffer while ensuring that we start with a '/'
 // Returns length of new full path or -1 on failure
 int _tnfs_adjust_with_full_path(tnfsMountInfo *m_info, char *buffer, const char *source, int bufflen)
@@ -1,7 +1,20 @@
 #include <cstring>
 
+#include "../hardware/fnSystem.h"
+
 #include "tnfslibMountInfo.h"
 
+// 32-bit FNV-1a
+static uint32_t _statcache_hash(uint32_t hash, const char *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= (uint8_t)data[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
 tnfsMountInfo::tnfsMountInfo(const char *host_name, uint16_t host_port)
 {
     strlcpy(hostname, host_name, sizeof(hostname));
@@ -82,6 +95,70 @@ int tnfsMountInfo::tell_dircache_entry()
     return _dir_cache[_dir_cache_current]->dirpos;
 }
 
+/*
+ Hashes a full path from _tnfs_adjust_with_full_path, ignoring any trailing slash
+ so "/dir/" and "/dir" are the same thing
+*/
+uint32_t tnfsMountInfo::statcache_key(const char *fullpath)
+{
+    size_t len = strlen(fullpath);
+    while (len > 1 && fullpath[len - 1] == '/')
+        len--;
+    return _statcache_hash(2166136261, fullpath, len);
+}
+
+// Same as statcache_key() on the directory's path + "/" + name
+uint32_t tnfsMountInfo::statcache_key(uint32_t dirkey, const char *name)
+{
+    // Root's key already covers its slash
+    if (dirkey != statcache_key("/"))
+        dirkey = _statcache_hash(dirkey, "/", 1);
+    return _statcache_hash(dirkey, name, strlen(name));
+}
+
+tnfsStatCacheEntry * tnfsMountInfo::find_statcache(uint32_t key)
+{
+    uint32_t now = fnSystem.millis();
+    for (int i = 0; i < TNFS_MAX_STATCACHE_ENTRIES; i++)
+    {
+        tnfsStatCacheEntry *e = &_stat_cache[i];
+        if (e->expires_ms != 0 && e->key == key)
+        {
+            if ((int32_t)(e->expires_ms - now) > 0)
+                return e;
+            e->expires_ms = 0;
+        }
+    }
+    return nullptr;
+}
+
+/*
+ Replaces any existing entry with the same key, otherwise overwrites the oldest entry
+*/
+void tnfsMountInfo::store_statcache(uint32_t key, bool isDir, uint32_t filesize, uint32_t m_time, uint32_t c_time)
+{
+    tnfsStatCacheEntry *e = find_statcache(key);
+    if (e == nullptr)
+    {
+        e = &_stat_cache[_stat_cache_next];
+        _stat_cache_next = (_stat_cache_next + 1) % TNFS_MAX_STATCACHE_ENTRIES;
+    }
+
+    e->key = key;
+    // Zero marks an unused entry
+    e->expires_ms = (fnSystem.millis() + TNFS_STATCACHE_TTL) | 1;
+    e->isDir = isDir;
+    e->filesize = filesize;
+    e->m_time = m_time;
+    e->c_time = c_time;
+}
+
+void tnfsMountInfo::empty_statcache()
+{
+    for (int i = 0; i < TNFS_MAX_STATCACHE_ENTRIES; i++)
+        _stat_cache[i].expires_ms = 0;
+}
+
 /*
  Returns a pointer to the tnfsFileHandleInfo with a matching file handle,
  or null if no match exists in the table.
@@ -100,6 +177,32 @@ tnfsFileHandleInfo *tnfsMountInfo::get_filehandleinfo(uint8_t filehandle)
     return nullptr;
 }
 
+uint8_t tnfsMountInfo::unused_handle_id(uint8_t server_handle, const tnfsFileHandleInfo *pIgnore)
+{
+    uint8_t id = server_handle;
+    for (int tries = 0; tries < 256; tries++, id++)
+    {
+        bool used = false;
+        for (int i = 0; i < TNFS_MAX_FILE_HANDLES; i++)
+            if (_file_handles[i] != nullptr && _file_handles[i] != pIgnore && _file_handles[i]->handle_id == id)
+                used = true;
+        if (used == false)
+            break;
+    }
+    return id;
+}
+
+bool tnfsMountInfo::add_server(const char *host_name)
+{
+    if (server_count >= TNFS_MAX_SERVERS)
+        return false;
+
+    servers[server_count] = tnfsServerInfo();
+    strlcpy(servers[server_count].hostname, host_name, sizeof(servers[server_count].hostname));
+    server_count++;
+    return true;
+}
+
 /*
  Returns a pointer to a new tnfsFileHandleInfo pointer or null if table is full
 */
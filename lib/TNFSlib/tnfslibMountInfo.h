@@ -4,6 +4,8 @@
 #include <cstdint>
 #include <lwip/netdb.h>
 
+#include "../tcpip/fnTcpClient.h"
+
 
 #define TNFS_DEFAULT_PORT 16384
 #define TNFS_RETRIES 5 // Number of times to retry if we fail to send/receive a packet
@@ -19,11 +21,23 @@
 #define TNFS_INVALID_SESSION 0 // We're assuming a '0' is never a valid session ID
 
 #define TNFS_MAX_DIRCACHE_ENTRIES 32 // Max number of directory cache entries we'll store
+#define TNFS_MAX_STATCACHE_ENTRIES 64 // Max number of STAT results we'll remember
+#define TNFS_STATCACHE_TTL 10000 // Milliseconds we trust a STAT result for
+
+// How packets get to the server. All servers speak UDP; TCP is optional
+#define TNFS_TRANSPORT_UDP 0
+#define TNFS_TRANSPORT_TCP 1
+#define TNFS_TRANSPORT_AUTO 2 // Use TCP if the server accepts a connection, otherwise UDP
+#define TNFS_TCP_CONNECT_TIMEOUT 750 // Milliseconds (select() wants this under a second)
+
+#define TNFS_MAX_SERVERS 4 // A host and up to three mirrors serving the same files
 
 // Some things we need to keep track of for every file we open
 struct tnfsFileHandleInfo
 {
-    uint8_t handle_id = 0;
+    uint8_t handle_id = 0; // What our caller knows the file as
+    uint8_t server_handle = 0; // What the server knows it as (changes if we fail over to a mirror)
+    uint16_t open_mode = 0;
 
     uint32_t file_position = 0; // Current actual file position
     uint32_t file_size = 0;
@@ -48,6 +62,29 @@ struct tnfsDirCacheEntry
     char entryname[TNFS_MAX_FILELEN];
 };
 
+// How each of the servers we can mount has been doing
+struct tnfsServerInfo
+{
+    char hostname[64];
+    uint32_t rtt_ms = 0; // Time taken to mount when we last tried it. Zero if unknown
+    uint32_t failures = 0; // Times it didn't answer a mount or stopped answering mid-session
+    uint32_t failovers = 0; // Times we switched to it because another one stopped answering
+};
+
+/*
+ A STAT result (or directory entry from TNFS_READDIRX) we can answer TNFS_STAT with.
+ Paths are identified by a hash of the full path to keep entries small
+*/
+struct tnfsStatCacheEntry
+{
+    uint32_t key;
+    uint32_t expires_ms;
+    bool isDir;
+    uint32_t filesize;
+    uint32_t m_time;
+    uint32_t c_time;
+};
+
 // Everything we need to know about and keep track of for the server we're talking to
 class tnfsMountInfo
 {
@@ -57,6 +94,8 @@ private:
     uint16_t _dir_cache_current = 0;
     uint16_t _dir_cache_count = 0;
     bool _dir_cache_eof = false;
+    tnfsStatCacheEntry _stat_cache[TNFS_MAX_STATCACHE_ENTRIES] = {};
+    int _stat_cache_next = 0;
 
 public:
     ~tnfsMountInfo();
@@ -67,6 +106,9 @@ public:
 
     tnfsFileHandleInfo * new_filehandleinfo();
     tnfsFileHandleInfo * get_filehandleinfo(uint8_t filehandle);
+    tnfsFileHandleInfo * get_filehandleinfo_at(int index) { return _file_handles[index]; };
+    // Returns server_handle if no other open file uses it as its handle_id, otherwise an ID nobody's using
+    uint8_t unused_handle_id(uint8_t server_handle, const tnfsFileHandleInfo *pIgnore);
     void delete_filehandleinfo(uint8_t filehandle);
     void delete_filehandleinfo(tnfsFileHandleInfo * pFilehandle);
 
@@ -79,6 +121,18 @@ public:
     void set_dircache_eof() { _dir_cache_eof = true; };
     bool get_dircache_eof() { return _dir_cache_eof; };
 
+    static uint32_t statcache_key(const char *fullpath);
+    // Key for an entry in the directory whose key is given
+    static uint32_t statcache_key(uint32_t dirkey, const char *name);
+    // Returns null if we don't have an unexpired entry
+    tnfsStatCacheEntry * find_statcache(uint32_t key);
+    void store_statcache(uint32_t key, bool isDir, uint32_t filesize, uint32_t m_time, uint32_t c_time);
+    // Called whenever we change anything on the server
+    void empty_statcache();
+
+    // Adds a server to try when mounting. Returns false if there's no more room
+    bool add_server(const char *host_name);
+
     // These char[] sizes are abitrary...
     char hostname[64] = { '\0' };
     in_addr_t host_ip = IPADDR_NONE;
@@ -93,9 +147,20 @@ public:
     uint8_t max_retries = TNFS_RETRIES;
     int timeout_ms = TNFS_TIMEOUT;
     uint8_t current_sequence_num = 0; // Updated with each transaction to the server
+    uint8_t transport_mode = TNFS_TRANSPORT_UDP; // Set before TNFS_MOUNT; AUTO is resolved again for each server mounted
+    uint8_t transport = TNFS_TRANSPORT_UDP; // UDP or TCP, whichever the current server was mounted with
+    fnTcpClient tcp; // Connection to the server when transport is TNFS_TRANSPORT_TCP
 
     int16_t dir_handle = TNFS_INVALID_HANDLE; // Stored from server's response to TNFS_OPENDIR
     uint16_t dir_entries = 0; // Stored from server's response to TNFS_OPENDIRX
+    uint32_t dir_statkey = 0; // statcache_key() of the directory opened by TNFS_OPENDIRX
+
+    // If more than one server is given, tnfs_mount() uses the fastest and fails over to the others.
+    // hostname and host_ip are those of servers[current_server]
+    tnfsServerInfo servers[TNFS_MAX_SERVERS];
+    uint8_t server_count = 0;
+    uint8_t current_server = 0;
+    bool failing_over = false;
 };
 
 #endif // _TNFSLIB_MOUNTINFO_H
@@ -66,6 +66,60 @@ void fnConfig::store_general_config_enabled(bool config_enabled)
     _dirty = true;
 }
 
+void fnConfig::store_general_ramdisk_limit(int ramdisk_limit)
+{
+    if (_general.ramdisk_limit == ramdisk_limit)
+        return;
+
+    _general.ramdisk_limit = ramdisk_limit;
+    _dirty = true;
+}
+
+void fnConfig::store_general_imagecache_size(int imagecache_size)
+{
+    if (_general.imagecache_size == imagecache_size)
+        return;
+
+    _general.imagecache_size = imagecache_size;
+    _dirty = true;
+}
+
+void fnConfig::store_general_httpcache_size(int httpcache_size)
+{
+    if (_general.httpcache_size == httpcache_size)
+        return;
+
+    _general.httpcache_size = httpcache_size;
+    _dirty = true;
+}
+
+void fnConfig::store_general_tnfs_transport(int tnfs_transport)
+{
+    if (_general.tnfs_transport == tnfs_transport)
+        return;
+
+    _general.tnfs_transport = tnfs_transport;
+    _dirty = true;
+}
+
+void fnConfig::store_general_printer_job_idle(int printer_job_idle)
+{
+    if (_general.printer_job_idle == printer_job_idle)
+        return;
+
+    _general.printer_job_idle = printer_job_idle;
+    _dirty = true;
+}
+
+void fnConfig::store_general_hsio_calibrated(bool hsio_calibrated)
+{
+    if (_general.hsio_calibrated == hsio_calibrated)
+        return;
+
+    _general.hsio_calibrated = hsio_calibrated;
+    _dirty = true;
+}
+
 void fnConfig::store_general_hsioindex(int hsio_index)
 {
     if (_general.hsio_index == hsio_index)
@@ -136,10 +190,32 @@ void fnConfig::store_host(uint8_t num, const char *hostname, host_type_t type)
             return;
         _dirty = true;
         _host_slots[num].type = type;
+        // Mirrors belong to the host they were set for
+        if (_host_slots[num].name.compare(hostname) != 0)
+            _host_slots[num].mirrors.clear();
         _host_slots[num].name = hostname;
     }
 }
 
+std::string fnConfig::get_host_mirrors(uint8_t num)
+{
+    if (num < MAX_HOST_SLOTS)
+        return _host_slots[num].mirrors;
+    else
+        return "";
+}
+
+void fnConfig::store_host_mirrors(uint8_t num, const char *mirrors)
+{
+    if (num < MAX_HOST_SLOTS)
+    {
+        if (_host_slots[num].mirrors.compare(mirrors) == 0)
+            return;
+        _dirty = true;
+        _host_slots[num].mirrors = mirrors;
+    }
+}
+
 void fnConfig::clear_host(uint8_t num)
 {
     if (num < MAX_HOST_SLOTS)
@@ -149,6 +225,7 @@ void fnConfig::clear_host(uint8_t num)
         _dirty = true;
         _host_slots[num].type = HOSTTYPE_INVALID;
         _host_slots[num].name.clear();
+        _host_slots[num].mirrors.clear();
     }
 }
 
@@ -220,6 +297,38 @@ void fnConfig::store_mount(uint8_t num, int hostslot, const char *path, mount_mo
     }
 }
 
+bool fnConfig::get_mount_overlay(uint8_t num)
+{
+    if (num < MAX_MOUNT_SLOTS)
+        return _mount_slots[num].overlay;
+    return false;
+}
+
+void fnConfig::store_mount_overlay(uint8_t num, bool enabled)
+{
+    if (num < MAX_MOUNT_SLOTS && _mount_slots[num].overlay != enabled)
+    {
+        _dirty = true;
+        _mount_slots[num].overlay = enabled;
+    }
+}
+
+bool fnConfig::get_mount_ramdisk(uint8_t num)
+{
+    if (num < MAX_MOUNT_SLOTS)
+        return _mount_slots[num].ramdisk;
+    return false;
+}
+
+void fnConfig::store_mount_ramdisk(uint8_t num, bool enabled)
+{
+    if (num < MAX_MOUNT_SLOTS && _mount_slots[num].ramdisk != enabled)
+    {
+        _dirty = true;
+        _mount_slots[num].ramdisk = enabled;
+    }
+}
+
 void fnConfig::clear_mount(uint8_t num, mount_type_t mounttype)
 {
     // Handle disk slots
@@ -443,8 +552,19 @@ void fnConfig::save()
     ss << "[General]" LINETERM;
     ss << "devicename=" << _general.devicename << LINETERM;
     ss << "hsioindex=" << _general.hsio_index << LINETERM;
+    ss << "hsiocalibrated=" << _general.hsio_calibrated << LINETERM;
     ss << "rotationsounds=" << _general.rotation_sounds << LINETERM;
     ss << "configenabled=" << _general.config_enabled << LINETERM;
+    ss << "ramdisklimit=" << _general.ramdisk_limit << LINETERM;
+    ss << "imagecachesize=" << _general.imagecache_size << LINETERM;
+    ss << "httpcachesize=" << _general.httpcache_size << LINETERM;
+    if (_general.tnfs_transport == TNFS_TRANSPORT_TCP)
+        ss << "tnfstransport=tcp" LINETERM;
+    else if (_general.tnfs_transport == TNFS_TRANSPORT_AUTO)
+        ss << "tnfstransport=auto" LINETERM;
+    else
+        ss << "tnfstransport=udp" LINETERM;
+    ss << "printerjobidle=" << _general.printer_job_idle << LINETERM;
     if (_general.timezone.empty() == false)
         ss << "timezone=" << _general.timezone << LINETERM;
 
@@ -469,18 +589,28 @@ void fnConfig::save()
             ss << LINETERM << "[Host" << (i + 1) << "]" LINETERM;
             ss << "type=" << _host_type_names[_host_slots[i].type] << LINETERM;
             ss << "name=" << _host_slots[i].name << LINETERM;
+            if (_host_slots[i].mirrors.empty() == false)
+                ss << "mirrors=" << _host_slots[i].mirrors << LINETERM;
         }
     }
 
     // MOUNTS
     for (i = 0; i < MAX_MOUNT_SLOTS; i++)
     {
-        if (_mount_slots[i].host_slot >= 0)
+        // The overlay and RAM settings belong to the slot, so keep the section even if nothing's mounted
+        if (_mount_slots[i].host_slot >= 0 || _mount_slots[i].overlay || _mount_slots[i].ramdisk)
         {
             ss << LINETERM << "[Mount" << (i + 1) << "]" LINETERM;
-            ss << "hostslot=" << (_mount_slots[i].host_slot + 1) << LINETERM; // Write host slot as 1-based
-            ss << "path=" << _mount_slots[i].path << LINETERM;
-            ss << "mode=" << _mount_mode_names[_mount_slots[i].mode] << LINETERM;
+            if (_mount_slots[i].host_slot >= 0)
+            {
+                ss << "hostslot=" << (_mount_slots[i].host_slot + 1) << LINETERM; // Write host slot as 1-based
+                ss << "path=" << _mount_slots[i].path << LINETERM;
+                ss << "mode=" << _mount_mode_names[_mount_slots[i].mode] << LINETERM;
+            }
+            if (_mount_slots[i].overlay)
+                ss << "overlay=1" << LINETERM;
+            if (_mount_slots[i].ramdisk)
+                ss << "ramdisk=1" << LINETERM;
         }
     }
 
@@ -705,6 +835,10 @@ void fnConfig::_read_section_general(std::stringstream &ss)
                 if (index >= 0 && index < 10)
                     _general.hsio_index = index;
             }
+            else if (strcasecmp(name.c_str(), "hsiocalibrated") == 0)
+            {
+                _general.hsio_calibrated = util_string_value_is_true(value);
+            }
             else if (strcasecmp(name.c_str(), "timezone") == 0)
             {
                 _general.timezone = value;
@@ -717,6 +851,39 @@ void fnConfig::_read_section_general(std::stringstream &ss)
             {
                 _general.config_enabled = util_string_value_is_true(value);
             }
+            else if (strcasecmp(name.c_str(), "ramdisklimit") == 0)
+            {
+                int limit = atoi(value.c_str());
+                if (limit >= 0)
+                    _general.ramdisk_limit = limit;
+            }
+            else if (strcasecmp(name.c_str(), "imagecachesize") == 0)
+            {
+                int size = atoi(value.c_str());
+                if (size >= 0)
+                    _general.imagecache_size = size;
+            }
+            else if (strcasecmp(name.c_str(), "httpcachesize") == 0)
+            {
+                int size = atoi(value.c_str());
+                if (size >= 0)
+                    _general.httpcache_size = size;
+            }
+            else if (strcasecmp(name.c_str(), "tnfstransport") == 0)
+            {
+                if (strcasecmp(value.c_str(), "tcp") == 0)
+                    _general.tnfs_transport = TNFS_TRANSPORT_TCP;
+                else if (strcasecmp(value.c_str(), "auto") == 0)
+                    _general.tnfs_transport = TNFS_TRANSPORT_AUTO;
+                else
+                    _general.tnfs_transport = TNFS_TRANSPORT_UDP;
+            }
+            else if (strcasecmp(name.c_str(), "printerjobidle") == 0)
+            {
+                int secs = atoi(value.c_str());
+                if (secs >= 0)
+                    _general.printer_job_idle = secs;
+            }
         }
     }
 }
@@ -770,6 +937,7 @@ void fnConfig::_read_section_host(std::stringstream &ss, int index)
     // Throw out any existing data for this index
     _host_slots[index].type = HOSTTYPE_INVALID;
     _host_slots[index].name.clear();
+    _host_slots[index].mirrors.clear();
 
     std::string line;
     // Read lines until one starts with '[' which indicates a new section
@@ -787,6 +955,10 @@ void fnConfig::_read_section_host(std::stringstream &ss, int index)
             {
                 _host_slots[index].type = host_type_from_string(value.c_str());
             }
+            else if (strcasecmp(name.c_str(), "mirrors") == 0)
+            {
+                _host_slots[index].mirrors = value;
+            }
         }
     }
 }
@@ -797,6 +969,8 @@ void fnConfig::_read_section_mount(std::stringstream &ss, int index)
     _mount_slots[index].host_slot = HOST_SLOT_INVALID;
     _mount_slots[index].mode = MOUNTMODE_INVALID;
     _mount_slots[index].path.clear();
+    _mount_slots[index].overlay = false;
+    _mount_slots[index].ramdisk = false;
 
     std::string line;
     // Read lines until one starts with '[' which indicates a new section
@@ -824,6 +998,14 @@ void fnConfig::_read_section_mount(std::stringstream &ss, int index)
                 _mount_slots[index].path = value;
                 //Debug_printf("config mount %d path=\"%s\"\n", index, value.c_str());
             }
+            else if (strcasecmp(name.c_str(), "overlay") == 0)
+            {
+                _mount_slots[index].overlay = util_string_value_is_true(value);
+            }
+            else if (strcasecmp(name.c_str(), "ramdisk") == 0)
+            {
+                _mount_slots[index].ramdisk = util_string_value_is_true(value);
+            }
         }
     }
 }
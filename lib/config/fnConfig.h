@@ -4,6 +4,7 @@
 #include <string>
 
 #include "../sio/printer.h"
+#include "../TNFSlib/tnfslibMountInfo.h"
 
 #define MAX_HOST_SLOTS 8
 #define MAX_MOUNT_SLOTS 8
@@ -17,6 +18,15 @@
 
 #define HSIO_INVALID_INDEX -1
 
+// 2MB leaves plenty of PSRAM for everything else while covering any floppy image
+#define RAMDISK_DEFAULT_LIMIT_KB 2048
+
+// Room on the SD card for copies of images mounted from TNFS hosts
+#define IMAGECACHE_DEFAULT_SIZE_MB 64
+
+// Room on the SD card for HTTP responses fetched by the N: device. Off unless asked for
+#define HTTPCACHE_DEFAULT_SIZE_MB 0
+
 class fnConfig
 {
 public:
@@ -49,15 +59,33 @@ public:
     // GENERAL
     std::string get_general_devicename() { return _general.devicename; };
     int get_general_hsioindex() { return _general.hsio_index; };
+    // Whether hsio_index was picked by SIO.startHighSpeedCalibration() rather than set by hand
+    bool get_general_hsio_calibrated() { return _general.hsio_calibrated; };
     std::string get_general_timezone() { return _general.timezone; };
     bool get_general_rotation_sounds() { return _general.rotation_sounds; };
     std::string get_network_midimaze_host() { return _network.midimaze_host; };
     bool get_general_config_enabled() { return _general.config_enabled; };
+    // Largest image (in KB) that will be loaded into RAM when mounted
+    int get_general_ramdisk_limit() { return _general.ramdisk_limit; };
+    // Space (in MB) on the SD card for cached copies of remote images. Zero disables the cache
+    int get_general_imagecache_size() { return _general.imagecache_size; };
+    // Space (in MB) on the SD card for cached HTTP responses. Zero disables the cache
+    int get_general_httpcache_size() { return _general.httpcache_size; };
+    // TNFS_TRANSPORT_UDP, TNFS_TRANSPORT_TCP or TNFS_TRANSPORT_AUTO for TNFS host mounts
+    int get_general_tnfs_transport() { return _general.tnfs_transport; };
+    // Seconds without printing before output becomes a finished print job. Zero waits for an explicit finish
+    int get_general_printer_job_idle() { return _general.printer_job_idle; };
     void store_general_devicename(const char *devicename);
     void store_general_hsioindex(int hsio_index);
+    void store_general_hsio_calibrated(bool hsio_calibrated);
     void store_general_timezone(const char *timezone);
     void store_general_rotation_sounds(bool rotation_sounds);
     void store_general_config_enabled(bool config_enabled);
+    void store_general_ramdisk_limit(int ramdisk_limit);
+    void store_general_imagecache_size(int imagecache_size);
+    void store_general_httpcache_size(int httpcache_size);
+    void store_general_tnfs_transport(int tnfs_transport);
+    void store_general_printer_job_idle(int printer_job_idle);
     void store_midimaze_host(const char host_ip[64]);
 
     const char * get_network_sntpserver() { return _network.sntpserver; };
@@ -73,8 +101,11 @@ public:
     // HOSTS
     std::string get_host_name(uint8_t num);
     host_type_t get_host_type(uint8_t num);
+    // Comma-separated TNFS servers with the same files as the host
+    std::string get_host_mirrors(uint8_t num);
     void store_host(uint8_t num, const char *hostname, host_type_t type);
     void clear_host(uint8_t num);
+    void store_host_mirrors(uint8_t num, const char *mirrors);
 
     // PHONEBOOK SLOTS
     std::string get_pb_host_name(const char *pbnum);
@@ -90,6 +121,12 @@ public:
     int get_mount_host_slot(uint8_t num, mount_type_t mounttype = mount_type_t::MOUNTTYPE_DISK);
     void store_mount(uint8_t num, int hostslot, const char *path, mount_mode_t mode, mount_type_t mounttype = mount_type_t::MOUNTTYPE_DISK);
     void clear_mount(uint8_t num, mount_type_t mounttype = mount_type_t::MOUNTTYPE_DISK);
+    // Whether writes to images mounted read-only in this slot go to an overlay on SD
+    bool get_mount_overlay(uint8_t num);
+    void store_mount_overlay(uint8_t num, bool enabled);
+    // Whether images mounted in this slot are loaded into RAM
+    bool get_mount_ramdisk(uint8_t num);
+    void store_mount_ramdisk(uint8_t num, bool enabled);
 
     // PRINTERS
     sioPrinter::printer_type get_printer_type(uint8_t num);
@@ -158,6 +195,7 @@ private:
     {
         host_type_t type = HOSTTYPE_INVALID;
         std::string name;
+        std::string mirrors;
     };
 
     struct mount_info
@@ -165,6 +203,8 @@ private:
         int host_slot = HOST_SLOT_INVALID;
         mount_mode_t mode = MOUNTMODE_INVALID;
         std::string path;
+        bool overlay = false;
+        bool ramdisk = false;
     };
 
     struct printer_info
@@ -203,9 +243,15 @@ private:
     {
         std::string devicename = "fujinet";
         int hsio_index = HSIO_INVALID_INDEX;
+        bool hsio_calibrated = false;
         std::string timezone;
         bool rotation_sounds = true;
         bool config_enabled = true;
+        int ramdisk_limit = RAMDISK_DEFAULT_LIMIT_KB;
+        int imagecache_size = IMAGECACHE_DEFAULT_SIZE_MB;
+        int httpcache_size = HTTPCACHE_DEFAULT_SIZE_MB;
+        int tnfs_transport = TNFS_TRANSPORT_UDP;
+        int printer_job_idle = PRINTER_JOB_IDLE_DEFAULT_SECS;
     };
 
     struct modem_info
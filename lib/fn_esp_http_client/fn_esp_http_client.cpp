@@ -886,7 +886,9 @@ esp_err_t esp_http_client_perform(esp_http_client_handle_t client)
 {
     esp_err_t err;
     do {
-        if (client->process_again) {
+        /* A request on a kept-alive connection skips esp_http_client_connect(), which is where
+           the response state is normally reset */
+        if (client->process_again || client->state == HTTP_STATE_CONNECTED) {
             esp_http_client_prepare(client);
         }
         switch (client->state) {
@@ -1275,6 +1277,32 @@ esp_http_client_transport_t esp_http_client_get_transport_type(esp_http_client_h
     }
 }
 
+esp_err_t esp_http_client_set_user_data(esp_http_client_handle_t client, void *user_data)
+{
+    if (client == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    client->user_data = user_data;
+    return ESP_OK;
+}
+
+bool esp_http_client_is_connected(esp_http_client_handle_t client)
+{
+    return client != NULL && client->state == HTTP_STATE_CONNECTED;
+}
+
+esp_err_t esp_http_client_get_origin(esp_http_client_handle_t client, char *origin, int len)
+{
+    if (client == NULL || origin == NULL || client->connection_info.scheme == NULL || client->connection_info.host == NULL) {
+        return ESP_FAIL;
+    }
+    int n = snprintf(origin, len, "%s://%s:%d", client->connection_info.scheme, client->connection_info.host, client->connection_info.port);
+    if (n < 0 || n >= len) {
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
 void esp_http_client_add_auth(esp_http_client_handle_t client)
 {
     if (client == NULL) {
@@ -457,6 +457,43 @@ esp_err_t esp_http_client_cleanup(esp_http_client_handle_t client);
  */
 esp_http_client_transport_t esp_http_client_get_transport_type(esp_http_client_handle_t client);
 
+/**
+ * @brief      Set the user_data passed to the event handler, so a handle can be handed to a new owner
+ *
+ * @param[in]  client     The esp_http_client handle
+ * @param[in]  user_data  The new user_data
+ *
+ * @return
+ *     - ESP_OK
+ *     - ESP_ERR_INVALID_ARG
+ */
+esp_err_t esp_http_client_set_user_data(esp_http_client_handle_t client, void *user_data);
+
+/**
+ * @brief      Check whether the handle holds a kept-alive connection with no request in progress,
+ *             so the next request will be sent on it without connecting again
+ *
+ * @param[in]  client  The esp_http_client handle
+ *
+ * @return
+ *     - true if the connection is open and idle
+ *     - false otherwise
+ */
+bool esp_http_client_is_connected(esp_http_client_handle_t client);
+
+/**
+ * @brief      Get the scheme, host and port the handle connects to, as "scheme://host:port"
+ *
+ * @param[in]  client  The esp_http_client handle
+ * @param[out] origin  Buffer to store the result in
+ * @param[in]  len     Size of the buffer
+ *
+ * @return
+ *     - ESP_OK
+ *     - ESP_FAIL if the handle has no URL or the buffer is too small
+ */
+esp_err_t esp_http_client_get_origin(esp_http_client_handle_t client, char *origin, int len);
+
 /**
  * @brief      Set redirection URL.
  *             When received the 30x code from the server, the client stores the redirect URL provided by the server.
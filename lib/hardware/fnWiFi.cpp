@@ -16,6 +16,7 @@
 #include "../config/fnConfig.h"
 
 #include "httpService.h"
+#include "fnDNS.h"
 #include "led.h"
 
 // Global object to manage WiFi
@@ -438,6 +439,8 @@ void WiFiManager::_wifi_event_handler(void *arg, esp_event_base_t event_base,
             fnLedManager.set(eLed::LED_WIFI, true);
             fnSystem.Net.start_sntp_client();
             fnHTTPD.start();
+            // We may be on a different network with different answers
+            dns_cache_clear();
             break;
         case IP_EVENT_STA_LOST_IP:
             Debug_println("IP_EVENT_STA_LOST_IP");
@@ -0,0 +1,360 @@
+#include <string.h>
+#include <time.h>
+
+#include "../../include/debug.h"
+#include "fnFsSD.h"
+#include "fnConfig.h"
+#include "../utils/utils.h"
+
+#include "fnHttpCache.h"
+
+#define HTTPCACHE_MAGIC "FNHTC02"
+// Before this (2020-01-01) the clock hasn't been set, so nothing is fresh
+#define HTTPCACHE_MIN_VALID_TIME 1577836800
+
+fnHttpResponseCache fnHttpCache;
+
+// 32-bit FNV-1a
+uint32_t fnHttpResponseCache::_hash_url(const char *url)
+{
+    uint32_t hash = 2166136261;
+    for (const char *p = url; *p != '\0'; p++)
+    {
+        hash ^= (uint8_t)*p;
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+/* When a response stops being fresh, going by its Cache-Control max-age.
+   Returns zero if it has to be revalidated every time.
+*/
+uint32_t fnHttpResponseCache::_expires(const char *cache_control)
+{
+    if (cache_control == nullptr)
+        return 0;
+
+    time_t now = time(nullptr);
+    if (now < HTTPCACHE_MIN_VALID_TIME)
+        return 0;
+
+    if (strcasestr(cache_control, "no-cache") != nullptr)
+        return 0;
+
+    const char *p = strcasestr(cache_control, "max-age=");
+    if (p == nullptr)
+        return 0;
+
+    long age = atol(p + 8);
+    if (age <= 0)
+        return 0;
+
+    return now + age;
+}
+
+std::string fnHttpResponseCache::_entry_path(uint32_t url)
+{
+    char filename[32];
+    snprintf(filename, sizeof(filename), HTTPCACHE_DIRECTORY "/%08x.bdy", url);
+    return std::string(filename);
+}
+
+uint32_t fnHttpResponseCache::budget()
+{
+    if (fnSDFAT.running() == false)
+        return 0;
+
+    return util_megabytes_to_bytes(Config.get_general_httpcache_size());
+}
+
+uint32_t fnHttpResponseCache::used()
+{
+    uint32_t total = 0;
+    for (auto &e : _entries)
+        total += e.size;
+    return total;
+}
+
+int fnHttpResponseCache::_find(uint32_t url)
+{
+    for (int i = 0; i < _entries.size(); i++)
+        if (_entries[i].url == url)
+            return i;
+    return -1;
+}
+
+/* Reads the list of cached responses from the SD card the first time we need it
+*/
+bool fnHttpResponseCache::_load_index()
+{
+    if (_loaded)
+        return true;
+
+    if (fnSDFAT.running() == false)
+        return false;
+
+    _loaded = true;
+    _entries.clear();
+
+    FILE *f = fnSDFAT.file_open(HTTPCACHE_INDEX_FILE, "r");
+    if (f == nullptr)
+        return true;
+
+    char magic[sizeof(HTTPCACHE_MAGIC)];
+    if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) || memcmp(magic, HTTPCACHE_MAGIC, sizeof(magic)) != 0)
+    {
+        Debug_println("fnHttpCache index not recognized - starting empty");
+        fclose(f);
+        return true;
+    }
+
+    httpcache_entry e;
+    while (fread(&e, 1, sizeof(e), f) == sizeof(e))
+    {
+        _entries.push_back(e);
+        if (e.last_used > _use_counter)
+            _use_counter = e.last_used;
+    }
+    fclose(f);
+
+    Debug_printf("fnHttpCache loaded %u entries using %u bytes\n", _entries.size(), used());
+    return true;
+}
+
+void fnHttpResponseCache::_save_index()
+{
+    fnSDFAT.create_path(HTTPCACHE_DIRECTORY);
+
+    FILE *f = fnSDFAT.file_open(HTTPCACHE_INDEX_FILE, "w");
+    if (f == nullptr)
+    {
+        Debug_println("fnHttpCache failed to write index");
+        return;
+    }
+
+    fwrite(HTTPCACHE_MAGIC, 1, sizeof(HTTPCACHE_MAGIC), f);
+    for (auto &e : _entries)
+        fwrite(&e, 1, sizeof(e), f);
+    fclose(f);
+}
+
+// Deletes an entry and its file. The caller saves the index
+void fnHttpResponseCache::_remove(int index)
+{
+    fnSDFAT.remove(_entry_path(_entries[index].url).c_str());
+    _entries.erase(_entries.begin() + index);
+}
+
+/* Throws out the least recently used responses until size more bytes fit in our budget.
+   Returns false if they can't.
+*/
+bool fnHttpResponseCache::_make_room(uint32_t size)
+{
+    uint32_t limit = budget();
+    if (size > limit)
+        return false;
+
+    bool removed = false;
+    while (_entries.size() > 0 && used() > limit - size)
+    {
+        int oldest = 0;
+        for (int i = 1; i < _entries.size(); i++)
+            if (_entries[i].last_used < _entries[oldest].last_used)
+                oldest = i;
+
+        Debug_printf("fnHttpCache evicting %08x\n", _entries[oldest].url);
+        _remove(oldest);
+        removed = true;
+    }
+
+    if (removed)
+        _save_index();
+
+    return true;
+}
+
+// Each validator is stored as a length byte followed by the string
+static bool _httpcache_read_string(FILE *f, std::string &s)
+{
+    int len = fgetc(f);
+    if (len == EOF)
+        return false;
+
+    char buf[256];
+    if (fread(buf, 1, len, f) != len)
+        return false;
+    s.assign(buf, len);
+    return true;
+}
+
+static void _httpcache_write_string(FILE *f, const char *s)
+{
+    size_t len = s == nullptr ? 0 : strlen(s);
+    if (len > 255)
+        len = 0; // Too long to be worth sending back
+    fputc(len, f);
+    fwrite(s, 1, len, f);
+}
+
+// The URL is stored as a 16-bit length followed by the string, since it can be longer than a validator
+static bool _httpcache_read_url(FILE *f, std::string &url)
+{
+    uint8_t len[2];
+    if (fread(len, 1, sizeof(len), f) != sizeof(len))
+        return false;
+
+    url.resize(len[0] | (len[1] << 8));
+    return url.size() == 0 || fread(&url[0], 1, url.size(), f) == url.size();
+}
+
+static bool _httpcache_write_url(FILE *f, const char *url)
+{
+    size_t len = strlen(url);
+    if (len > 0xFFFF)
+        return false;
+    fputc(len & 0xFF, f);
+    fputc(len >> 8, f);
+    return fwrite(url, 1, len, f) == len;
+}
+
+FILE *fnHttpResponseCache::open(const char *url, uint32_t &size, bool &fresh, std::string &etag, std::string &last_modified)
+{
+    if (budget() == 0 || _load_index() == false)
+        return nullptr;
+
+    int i = _find(_hash_url(url));
+    if (i < 0)
+    {
+        misses++;
+        return nullptr;
+    }
+
+    FILE *f = fnSDFAT.file_open(_entry_path(_entries[i].url).c_str(), "r");
+    std::string stored_url;
+    if (f == nullptr || _httpcache_read_url(f, stored_url) == false ||
+        _httpcache_read_string(f, etag) == false || _httpcache_read_string(f, last_modified) == false)
+    {
+        Debug_printf("fnHttpCache copy of \"%s\" unreadable\n", url);
+        if (f != nullptr)
+            fclose(f);
+        _remove(i);
+        _save_index();
+        misses++;
+        return nullptr;
+    }
+
+    // Another URL with the same hash. Storing this response will replace it
+    if (stored_url.compare(url) != 0)
+    {
+        Debug_printf("fnHttpCache \"%s\" collides with \"%s\"\n", url, stored_url.c_str());
+        fclose(f);
+        etag.clear();
+        last_modified.clear();
+        misses++;
+        return nullptr;
+    }
+
+    size = _entries[i].size - ftell(f);
+    fresh = _entries[i].expires != 0 && time(nullptr) < _entries[i].expires;
+
+    _entries[i].last_used = ++_use_counter;
+    if (fresh)
+    {
+        hits++;
+        _save_index();
+        Debug_printf("fnHttpCache fresh hit for \"%s\"\n", url);
+    }
+
+    return f;
+}
+
+void fnHttpResponseCache::revalidate(const char *url, const char *cache_control)
+{
+    int i = _find(_hash_url(url));
+    if (i < 0)
+        return;
+
+    revalidated++;
+    _entries[i].expires = _expires(cache_control);
+    _save_index();
+    Debug_printf("fnHttpCache revalidated \"%s\"\n", url);
+}
+
+FILE *fnHttpResponseCache::begin_store(const char *url, int length, const char *etag, const char *last_modified,
+                                       const char *cache_control, std::string &partial)
+{
+    if (length < 0 || budget() == 0 || _load_index() == false)
+        return nullptr;
+
+    if (cache_control != nullptr && strcasestr(cache_control, "no-store") != nullptr)
+        return nullptr;
+
+    // Without a validator or a lifetime there's no way to use our copy
+    bool have_validator = (etag != nullptr && etag[0] != '\0') || (last_modified != nullptr && last_modified[0] != '\0');
+    if (have_validator == false && _expires(cache_control) == 0)
+        return nullptr;
+
+    if (length > budget())
+        return nullptr;
+
+    fnSDFAT.create_path(HTTPCACHE_DIRECTORY);
+
+    char filename[40];
+    snprintf(filename, sizeof(filename), HTTPCACHE_DIRECTORY "/%08x.%u", _hash_url(url), _store_counter++);
+    partial = filename;
+
+    FILE *f = fnSDFAT.file_open(filename, "w");
+    if (f == nullptr)
+    {
+        Debug_println("fnHttpCache failed to create copy");
+        return nullptr;
+    }
+
+    if (_httpcache_write_url(f, url) == false)
+    {
+        fclose(f);
+        fnSDFAT.remove(filename);
+        return nullptr;
+    }
+    _httpcache_write_string(f, etag);
+    _httpcache_write_string(f, last_modified);
+    return f;
+}
+
+void fnHttpResponseCache::end_store(const char *url, FILE *f, const std::string &partial, bool complete, const char *cache_control)
+{
+    httpcache_entry e;
+    e.size = ftell(f) > 0 ? ftell(f) : 0;
+    fclose(f);
+
+    if (complete == false)
+    {
+        fnSDFAT.remove(partial.c_str());
+        return;
+    }
+
+    e.url = _hash_url(url);
+    e.expires = _expires(cache_control);
+
+    // Replace whatever we had before
+    int i = _find(e.url);
+    if (i >= 0)
+        _remove(i);
+
+    // A file left over from an older index would keep the rename from working
+    std::string final = _entry_path(e.url);
+    fnSDFAT.remove(final.c_str());
+    if (_make_room(e.size) == false || fnSDFAT.rename(partial.c_str(), final.c_str()) == false)
+    {
+        fnSDFAT.remove(partial.c_str());
+        if (i >= 0)
+            _save_index();
+        return;
+    }
+
+    e.last_used = ++_use_counter;
+    _entries.push_back(e);
+    _save_index();
+
+    Debug_printf("fnHttpCache stored \"%s\" (%u bytes)\n", url, e.size);
+}
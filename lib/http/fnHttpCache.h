@@ -0,0 +1,83 @@
+/* SD card cache of HTTP GET responses made through the N: device
+
+ Bodies of 200 responses are kept on the SD card along with the response's
+ ETag and Last-Modified. A response that's still fresh according to its
+ Cache-Control max-age is served straight from the SD card. Otherwise the
+ request is made with If-None-Match/If-Modified-Since, and a 304 reply means
+ our copy is served. Responses marked no-store, and those of unknown length,
+ aren't kept.
+
+ Entries are found by a hash of the URL, and the full URL is kept in the file
+ so a different URL with the same hash is treated as a miss. The least
+ recently used ones are removed to stay under the size budget in fnConfig.
+*/
+#ifndef _FN_HTTPCACHE_
+#define _FN_HTTPCACHE_
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#define HTTPCACHE_DIRECTORY "/httpcache"
+#define HTTPCACHE_INDEX_FILE HTTPCACHE_DIRECTORY "/index"
+
+struct httpcache_entry
+{
+    // Hash of the URL
+    uint32_t url;
+    // Size of the file, which holds the URL and validators followed by the body
+    uint32_t size;
+    uint32_t last_used;
+    // Seconds since the epoch after which we have to revalidate. Zero means always revalidate
+    uint32_t expires;
+} __attribute__((packed));
+
+class fnHttpResponseCache
+{
+private:
+    std::vector<httpcache_entry> _entries;
+    bool _loaded = false;
+    uint32_t _use_counter = 0;
+    // Each response being stored gets its own partial file
+    uint32_t _store_counter = 0;
+
+    bool _load_index();
+    void _save_index();
+    std::string _entry_path(uint32_t url);
+    int _find(uint32_t url);
+    void _remove(int index);
+    bool _make_room(uint32_t size);
+
+    static uint32_t _hash_url(const char *url);
+    static uint32_t _expires(const char *cache_control);
+
+public:
+    uint32_t hits = 0;
+    uint32_t revalidated = 0;
+    uint32_t misses = 0;
+
+    // Zero if the cache is disabled or there's no SD card
+    uint32_t budget();
+    uint32_t used();
+    int count() { return _entries.size(); };
+
+    /* Returns our copy of the response body positioned at its start, or nullptr if we don't
+       have one. If we do, size is set to its length, fresh is set if it can be used without
+       asking the server, and etag and last_modified are set to the validators to send if not.
+    */
+    FILE *open(const char *url, uint32_t &size, bool &fresh, std::string &etag, std::string &last_modified);
+    // The server says our copy is still good
+    void revalidate(const char *url, const char *cache_control);
+
+    /* Starts storing a 200 response. Returns the file the body should be written to, or nullptr
+       if the response shouldn't or can't be kept. Finish with end_store()
+    */
+    FILE *begin_store(const char *url, int length, const char *etag, const char *last_modified,
+                      const char *cache_control, std::string &partial);
+    // Keeps the stored response if complete is set, otherwise throws it out. Closes f
+    void end_store(const char *url, FILE *f, const std::string &partial, bool complete, const char *cache_control);
+};
+
+extern fnHttpResponseCache fnHttpCache;
+
+#endif // _FN_HTTPCACHE_
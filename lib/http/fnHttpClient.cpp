@@ -3,6 +3,7 @@
 
 #include <cstdlib>
 #include <string.h>
+#include <algorithm>
 //#include <FreeRTOS.h>
 #include "../../include/debug.h"
 #include "fnSystem.h"
@@ -15,6 +16,18 @@ using namespace fujinet;
 
 const char *webdav_depths[] = {"0", "1", "infinity"};
 
+struct httpclient_idle_connection
+{
+    esp_http_client_handle_t handle = nullptr;
+    char origin[HTTPCLIENT_ORIGIN_MAX];
+    unsigned long since;
+};
+
+static httpclient_idle_connection _idle_connections[HTTPCLIENT_IDLE_CONNECTIONS];
+static portMUX_TYPE _idle_connections_lock = portMUX_INITIALIZER_UNLOCKED;
+
+httpclient_stats fnHttpClient::stats;
+
 fnHttpClient::fnHttpClient()
 {
     _buffer = (char *)malloc(DEFAULT_HTTP_BUF_SIZE);
@@ -23,12 +36,147 @@ fnHttpClient::fnHttpClient()
 // Close connection, destroy any resoruces
 fnHttpClient::~fnHttpClient()
 {
+    _release_handle();
+
+    free(_buffer);
+}
+
+/* Works out the "scheme://host:port" a URL connects to, the same way esp_http_client_get_origin() does.
+   Returns false for URLs whose connection we won't share, such as those carrying credentials
+*/
+bool fnHttpClient::_url_origin(const std::string &url, char *origin, int len)
+{
+    size_t scheme_end = url.find("://");
+    if (scheme_end == std::string::npos)
+        return false;
+
+    std::string scheme = url.substr(0, scheme_end);
+    int port;
+    if (strcasecmp(scheme.c_str(), "http") == 0)
+        port = 80;
+    else if (strcasecmp(scheme.c_str(), "https") == 0)
+        port = 443;
+    else
+        return false;
+
+    size_t host_start = scheme_end + 3;
+    size_t host_end = url.find_first_of("/?#", host_start);
+    std::string host = url.substr(host_start, host_end == std::string::npos ? std::string::npos : host_end - host_start);
+    if (host.empty() || host[0] == '[' || host.find('@') != std::string::npos)
+        return false;
+
+    size_t colon = host.find(':');
+    if (colon != std::string::npos)
+    {
+        port = atoi(host.c_str() + colon + 1);
+        host.erase(colon);
+    }
+
+    int n = snprintf(origin, len, "%s://%s:%d", scheme.c_str(), host.c_str(), port);
+    return n > 0 && n < len;
+}
+
+/* Returns an idle connection to origin if one's being kept, otherwise nullptr.
+   Connections that have been idle too long are closed
+*/
+esp_http_client_handle_t fnHttpClient::_take_idle_connection(const char *origin)
+{
+    esp_http_client_handle_t found = nullptr;
+    esp_http_client_handle_t expired[HTTPCLIENT_IDLE_CONNECTIONS];
+    int expired_count = 0;
+    unsigned long now = fnSystem.millis();
+
+    portENTER_CRITICAL(&_idle_connections_lock);
+    for (int i = 0; i < HTTPCLIENT_IDLE_CONNECTIONS; i++)
+    {
+        httpclient_idle_connection &c = _idle_connections[i];
+        if (c.handle == nullptr)
+            continue;
+
+        if (now - c.since > HTTPCLIENT_IDLE_TIMEOUT_MS)
+            expired[expired_count++] = c.handle;
+        else if (found == nullptr && strcasecmp(c.origin, origin) == 0)
+            found = c.handle;
+        else
+            continue;
+        c.handle = nullptr;
+    }
+    portEXIT_CRITICAL(&_idle_connections_lock);
+
+    // Closing a TLS connection talks to the server, so don't do it while holding the lock
+    for (int i = 0; i < expired_count; i++)
+        esp_http_client_cleanup(expired[i]);
+
+    return found;
+}
+
+// Keeps an idle connection for the next client wanting its origin. Returns false if it can't be kept
+bool fnHttpClient::_keep_idle_connection(esp_http_client_handle_t handle)
+{
+    char origin[HTTPCLIENT_ORIGIN_MAX];
+    if (esp_http_client_get_origin(handle, origin, sizeof(origin)) != ESP_OK)
+        return false;
+
+    unsigned long now = fnSystem.millis();
+
+    portENTER_CRITICAL(&_idle_connections_lock);
+    // Use an empty slot, or else push out the connection that's been idle longest
+    int slot = 0;
+    for (int i = 0; i < HTTPCLIENT_IDLE_CONNECTIONS; i++)
+    {
+        if (_idle_connections[i].handle == nullptr)
+        {
+            slot = i;
+            break;
+        }
+        if (_idle_connections[i].since < _idle_connections[slot].since)
+            slot = i;
+    }
+    esp_http_client_handle_t replaced = _idle_connections[slot].handle;
+    _idle_connections[slot].handle = handle;
+    strcpy(_idle_connections[slot].origin, origin);
+    _idle_connections[slot].since = now;
+    portEXIT_CRITICAL(&_idle_connections_lock);
+
+    if (replaced != nullptr)
+        esp_http_client_cleanup(replaced);
+
+    return true;
+}
+
+// True if our last request completed and the server left the connection open for another
+bool fnHttpClient::_connection_idle()
+{
+    return _handle != nullptr && _perform_error == ESP_OK && esp_http_client_is_connected(_handle);
+}
+
+/* Gives up our handle. If its connection is idle it's kept for reuse by whoever next
+   connects to the same place, otherwise the handle is destroyed
+*/
+void fnHttpClient::_release_handle()
+{
+    if (_handle == nullptr)
+        return;
+
     close();
 
+    if (_shareable && _connection_idle())
+    {
+        // Don't leave our request headers for the next user
+        for (auto &h : _request_headers)
+            esp_http_client_delete_header(_handle, h.c_str());
+        esp_http_client_set_user_data(_handle, nullptr);
+
+        if (_keep_idle_connection(_handle))
+            _handle = nullptr;
+    }
+    _request_headers.clear();
+
     if (_handle != nullptr)
+    {
         esp_http_client_cleanup(_handle);
-
-    free(_buffer);
+        _handle = nullptr;
+    }
 }
 
 // Start an HTTP client session to the given URL
@@ -36,6 +184,9 @@ bool fnHttpClient::begin(std::string url)
 {
     Debug_printf("fnHttpClient::begin \"%s\"\n", url.c_str());
 
+    // Let go of whatever we were connected to before
+    _release_handle();
+
     esp_http_client_config_t cfg;
     memset(&cfg, 0, sizeof(cfg));
     cfg.url = url.c_str();
@@ -48,6 +199,24 @@ bool fnHttpClient::begin(std::string url)
     // Keep track of the auth type set
     _auth_type = cfg.auth_type;
 
+    // Pick up a connection left open by an earlier request if there is one
+    char origin[HTTPCLIENT_ORIGIN_MAX];
+    _shareable = _url_origin(url, origin, sizeof(origin));
+    if (_shareable)
+    {
+        _handle = _take_idle_connection(origin);
+        if (_handle != nullptr)
+        {
+            esp_http_client_set_user_data(_handle, this);
+            if (esp_http_client_set_url(_handle, cfg.url) == ESP_OK)
+            {
+                Debug_printf("fnHttpClient reusing connection to %s\n", origin);
+                return true;
+            }
+            esp_http_client_cleanup(_handle);
+        }
+    }
+
     _handle = esp_http_client_init(&cfg);
     if (_handle == nullptr)
         return false;
@@ -194,7 +363,8 @@ void fnHttpClient::close()
     //Debug_println("::close");
     _delete_subtask_if_running();
 
-    if (_handle != nullptr)
+    // An idle connection is left open so it can be passed on when we let go of the handle
+    if (_handle != nullptr && _connection_idle() == false)
         esp_http_client_close(_handle);
 
     _stored_headers.clear();
@@ -217,6 +387,10 @@ esp_err_t fnHttpClient::_httpevent_handler(esp_http_client_event_t *evt)
     // Our user_data should be a pointer to our fnHttpClient object
     fnHttpClient *client = (fnHttpClient *)evt->user_data;
 
+    // Idle connections waiting to be reused don't belong to anyone
+    if (client == nullptr)
+        return ESP_OK;
+
     switch (evt->event_id)
     {
     case HTTP_EVENT_ERROR: // This event occurs when there are any errors during execution
@@ -224,6 +398,12 @@ esp_err_t fnHttpClient::_httpevent_handler(esp_http_client_event_t *evt)
         break;
     case HTTP_EVENT_ON_CONNECTED: // Once the HTTP has been connected to the server, no data exchange has been performed
         //Debug_printf("HTTP_EVENT_ON_CONNECTED %u\n", uxTaskGetStackHighWaterMark(nullptr));
+        stats.connects++;
+        if (esp_http_client_get_transport_type(client->_handle) == HTTP_TRANSPORT_OVER_SSL)
+        {
+            stats.tls_connects++;
+            stats.tls_connect_ms += fnSystem.millis() - client->_connect_start;
+        }
         break;
     case HTTP_EVENT_HEADER_SENT: // After sending all the headers to the server
         //Debug_printf("HTTP_EVENT_HEADER_SENT %u\n", uxTaskGetStackHighWaterMark(nullptr));
@@ -305,6 +485,8 @@ esp_err_t fnHttpClient::_httpevent_handler(esp_http_client_event_t *evt)
 
     case HTTP_EVENT_DISCONNECTED: // The connection has been disconnected
         //Debug_printf("HTTP_EVENT_DISCONNECTED %p:\"%s\":%u\n", xTaskGetCurrentTaskHandle(), pcTaskGetTaskName(nullptr), uxTaskGetStackHighWaterMark(nullptr));
+        // A redirect to another host connects again
+        client->_connect_start = fnSystem.millis();
         break;
     }
     return ESP_OK;
@@ -322,8 +504,9 @@ void fnHttpClient::_perform_subtask(void *param)
 
     //Debug_printf("esp_http_client_perform start\n");
 
+    parent->_connect_start = fnSystem.millis();
     esp_err_t e = esp_http_client_perform(parent->_handle);
-    __IGNORE_UNUSED_VAR(e);
+    parent->_perform_error = e;
 
     //Debug_printf("esp_http_client_perform returned %d, stack HWM %u\n", e, uxTaskGetStackHighWaterMark(nullptr));
 
@@ -373,7 +556,40 @@ int fnHttpClient::_perform()
 {
     Debug_printf("%08lx _perform\n", fnSystem.millis());
 
+    bool reusing = esp_http_client_is_connected(_handle);
+    if (reusing)
+        stats.reused++;
+
+    if (_start_perform() == false)
+        return -1;
+
+    /*
+     The server may have closed a kept-alive connection while it sat idle, which we only find
+     out when sending the request or waiting for the reply fails. Try once more on a new connection.
+    */
+    if (reusing && _transaction_done &&
+        (_perform_error == ESP_ERR_HTTP_WRITE_DATA || _perform_error == ESP_ERR_HTTP_FETCH_HEADER))
+    {
+        Debug_println("Kept-alive connection was closed - reconnecting");
+        stats.reused_closed++;
+        esp_http_client_close(_handle);
+        if (_start_perform() == false)
+            return -1;
+    }
+
+    bool chunked = esp_http_client_is_chunked_response(_handle);
+    int status = esp_http_client_get_status_code(_handle);
+    int length = esp_http_client_get_content_length(_handle);
+
+    Debug_printf("%08lx _perform status = %d, length = %d, chunked = %d\n", fnSystem.millis(), status, length, chunked ? 1 : 0);
+    return status;
+}
+
+// Starts esp_http_client_perform() in a subtask and waits for the response headers. Returns false on time-out
+bool fnHttpClient::_start_perform()
+{
     _buffer_total_read = 0;
+    _perform_error = ESP_FAIL;
 
     // We want to process the response body (if any)
     _ignore_response_body = false;
@@ -391,17 +607,12 @@ int fnHttpClient::_perform()
     {
         Debug_printf("Timed-out waiting for headers to load\n");
         //_delete_subtask_if_running();
-        return -1;
+        return false;
     }
     //Debug_printf("%08lx _perform notified\n", fnSystem.millis());
     //Debug_printf("Notification of headers loaded\n");
 
-    bool chunked = esp_http_client_is_chunked_response(_handle);
-    int status = esp_http_client_get_status_code(_handle);
-    int length = esp_http_client_get_content_length(_handle);
-
-    Debug_printf("%08lx _perform status = %d, length = %d, chunked = %d\n", fnSystem.millis(), status, length, chunked ? 1 : 0);
-    return status;
+    return true;
 }
 
 /*
@@ -417,6 +628,9 @@ int fnHttpClient::_perform_stream(esp_http_client_method_t method, uint8_t *writ
     if (_handle == nullptr)
         return -1;
 
+    // The connection is left partway through the response, so it can't be reused
+    _perform_error = ESP_FAIL;
+
     /* Headers added by HttpClient
         <METHOD> <URI> HTTP/1.1
         Host: <HOST>
@@ -493,7 +707,7 @@ int fnHttpClient::PUT(const char *put_data, int put_datalen)
     char *value = nullptr;
     esp_http_client_get_header(_handle, "Content-Type", &value);
     if (value == nullptr)
-        esp_http_client_set_header(_handle, "Content-Type", "application/octet-stream");
+        set_header("Content-Type", "application/octet-stream");
     // esp_http_client_set_post_field() sets the content of the body of the transaction
     esp_http_client_set_post_field(_handle, put_data, put_datalen);
 
@@ -512,14 +726,14 @@ int fnHttpClient::PROPFIND(webdav_depth depth, const char *properties_xml)
     // Set method
     esp_http_client_set_method(_handle, esp_http_client_method_t::HTTP_METHOD_PROPFIND);
     // Assume any request body will be XML
-    esp_http_client_set_header(_handle, "Content-Type", "text/xml");
+    set_header("Content-Type", "text/xml");
     // Set depth
     const char *pDepth = webdav_depths[0];
     if (depth == DEPTH_1)
         pDepth = webdav_depths[1];
     else if (depth == DEPTH_INFINITY)
         pDepth = webdav_depths[2];
-    esp_http_client_set_header(_handle, "Depth", pDepth);
+    set_header("Depth", pDepth);
 
     // esp_http_client_set_post_field() sets the content of the body of the transaction
     if (properties_xml != nullptr)
@@ -570,9 +784,9 @@ int fnHttpClient::COPY(const char *destination, bool overwrite, bool move)
     // Set method
     esp_http_client_set_method(_handle, move ? esp_http_client_method_t::HTTP_METHOD_MOVE : esp_http_client_method_t::HTTP_METHOD_COPY);
     // Set detination
-    esp_http_client_set_header(_handle, "Destination", destination);
+    set_header("Destination", destination);
     // Set overwrite
-    esp_http_client_set_header(_handle, "Overwrite", overwrite ? "T" : "F");
+    set_header("Overwrite", overwrite ? "T" : "F");
 
     return _perform();
 }
@@ -644,6 +858,9 @@ bool fnHttpClient::set_url(const char *url)
     if (_handle == nullptr)
         return false;
 
+    char origin[HTTPCLIENT_ORIGIN_MAX];
+    _shareable = _url_origin(url, origin, sizeof(origin));
+
     return ESP_OK == esp_http_client_set_url(_handle, url);
 }
 
@@ -659,6 +876,9 @@ bool fnHttpClient::set_header(const char *header_key, const char *header_value)
         Debug_printf("fnHttpClient::set_header error %d\n", e);
         return false;
     }
+
+    if (std::find(_request_headers.begin(), _request_headers.end(), header_key) == _request_headers.end())
+        _request_headers.push_back(header_key);
     return true;
 }
 
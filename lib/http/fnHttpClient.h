@@ -3,14 +3,42 @@
 
 #include <string>
 #include <map>
+#include <vector>
+#include <strings.h>
 #include "../fn_esp_http_client/fn_esp_http_client.h"
 
 using namespace fujinet;
 
+/* Connections left open by servers that allow keep-alive are kept for a while
+ after their fnHttpClient is done with them, so the next request to the same
+ scheme, host and port skips connecting and, for HTTPS, the TLS handshake.
+*/
+// Idle connections kept across all clients
+#define HTTPCLIENT_IDLE_CONNECTIONS 2
+// How long an idle connection is kept
+#define HTTPCLIENT_IDLE_TIMEOUT_MS 15000
+#define HTTPCLIENT_ORIGIN_MAX 96
+
+struct httpclient_stats
+{
+    uint32_t connects = 0;
+    uint32_t tls_connects = 0;
+    // Total time spent connecting over TLS, including the handshake
+    uint32_t tls_connect_ms = 0;
+    uint32_t reused = 0;
+    // Reused connections the server had closed, which we had to open again
+    uint32_t reused_closed = 0;
+};
+
 class fnHttpClient
 {
 private:
-    typedef std::map<std::string,std::string> header_map_t;
+    // Header names are case-insensitive
+    struct header_less
+    {
+        bool operator()(const std::string &a, const std::string &b) const { return strcasecmp(a.c_str(), b.c_str()) < 0; }
+    };
+    typedef std::map<std::string,std::string,header_less> header_map_t;
     typedef std::pair<std::string,std::string> header_entry_t;
 
     char *_buffer; // Will be allocated to DEFAULT_HTTP_BUF_SIZE
@@ -24,12 +52,19 @@ private:
     bool _ignore_response_body = false;
     bool _transaction_begin;
     bool _transaction_done;
+    esp_err_t _perform_error = ESP_FAIL;
+    // When we started connecting, for timing TLS connections
+    unsigned long _connect_start;
+    // Set if our URL's connection can be passed to other clients
+    bool _shareable = false;
     int _redirect_count;
     int _max_redirects;
     esp_http_client_auth_type_t _auth_type;
 
     uint16_t _port = 80;
     header_map_t _stored_headers;
+    // Request headers we've set, which have to be removed before the connection is used by someone else
+    std::vector<std::string> _request_headers;
 
     esp_http_client_handle_t _handle = nullptr;
 
@@ -38,12 +73,20 @@ private:
 
     void _delete_subtask_if_running();
 
+    static bool _url_origin(const std::string &url, char *origin, int len);
+    static esp_http_client_handle_t _take_idle_connection(const char *origin);
+    static bool _keep_idle_connection(esp_http_client_handle_t handle);
+    bool _connection_idle();
+    void _release_handle();
+
     void _flush_response();
 
+    bool _start_perform();
     int _perform();
     int _perform_stream(esp_http_client_method_t method, uint8_t *write_data, int write_size);
 
 public:
+    static httpclient_stats stats;
 
     fnHttpClient();
     ~fnHttpClient();
@@ -7,6 +7,7 @@
 #include <esp_log.h>
 #include <esp_system.h>
 #include <nvs_flash.h>
+#include "esp_heap_caps.h"
 #include "esp_wps.h"
 
 #include "httpService.h"
@@ -18,6 +19,7 @@
 
 #include "../../lib/modem-sniffer/modem-sniffer.h"
 #include "../../lib/sio/modem.h"
+#include "../../lib/sio/sioTrace.h"
 
 #include "../../include/debug.h"
 
@@ -60,6 +62,7 @@ const char *fnHttpService::find_mimetype_str(const char *extension)
         {"pdf", "application/pdf"},
         {"ico", "image/x-icon"},
         {"txt", "text/plain"},
+        {"json", "application/json"},
         {"bin", "application/octet-stream"},
         {"js", "text/javascript"},
         {"atascii", "application/octet-stream"}};
@@ -268,26 +271,48 @@ esp_err_t fnHttpService::get_handler_print(httpd_req_t *req)
 {
     Debug_println("Print request handler");
 
-    time_t now = fnSystem.millis();
     // Get a pointer to the current (only) printer
     sioPrinter *printer = (sioPrinter *)fnPrinters.get_ptr(0);
 
-    if (now - printer->lastPrintTime() < PRINTER_BUSY_TIME)
+    // "/print?<id>" asks for a specific finished job, otherwise we send the latest output
+    queryparts qp;
+    parse_query(req, &qp);
+    uint32_t jobid = atoi(qp.query.c_str());
+
+    if (jobid == 0)
     {
-        _fnwserr err = fnwserr_post_fail;
-        return_http_error(req, err);
+        time_t now = fnSystem.millis();
+        if (now - printer->lastPrintTime() < PRINTER_BUSY_TIME)
+        {
+            _fnwserr err = fnwserr_post_fail;
+            return_http_error(req, err);
+            return ESP_FAIL;
+        }
+
+        // Close off whatever's been printed so far as a new job
+        printer->finish_job();
+
+        const printer_job *latest = printer->get_job(0);
+        if (latest != nullptr)
+            jobid = latest->id;
+    }
+
+    paper_t ptype;
+    FILE *poutput = printer->open_job(jobid, &ptype);
+    if (poutput == nullptr)
+    {
+        Debug_printf("Print job %u not available\n", jobid);
+        return_http_error(req, fnwserr_fileopen);
         return ESP_FAIL;
     }
-    // Get printer emulator pointer from sioP (which is now extern)
-    printer_emu *currentPrinter = printer->getPrinterPtr();
 
     // Build a print output name
     const char *exts;
 
     bool sendAsAttachment = true;
 
-    // Choose an extension based on current printer papertype
-    switch (currentPrinter->getPaperType())
+    // Choose an extension based on the job's papertype
+    switch (ptype)
     {
     case RAW:
         exts = "bin";
@@ -319,15 +344,14 @@ esp_err_t fnHttpService::get_handler_print(httpd_req_t *req)
         exts = "bin";
     }
 
-    string filename = "printout.";
+    string filename = "printout";
+    filename += std::to_string(jobid);
+    filename += '.';
     filename += exts;
 
     // Set the expected content type based on the filename/extension
     set_file_content_type(req, filename.c_str());
 
-    // Tell printer to finish its output and get a read handle to the file
-    FILE *poutput = currentPrinter->closeOutputAndProvideReadHandle();
-
     char hdrval1[60];
     if (sendAsAttachment)
     {
@@ -344,7 +368,6 @@ esp_err_t fnHttpService::get_handler_print(httpd_req_t *req)
     do
     {
         count = fread((uint8_t *)buf, 1, FNWS_SEND_BUFF_SIZE, poutput);
-        //count = currentPrinter->readFromOutput((uint8_t *)buf, FNWS_SEND_BUFF_SIZE);
         total += count;
 
         // Debug_printf("Read %u bytes from print file\n", count);
@@ -352,14 +375,11 @@ esp_err_t fnHttpService::get_handler_print(httpd_req_t *req)
         httpd_resp_send_chunk(req, buf, count);
     } while (count > 0);
 
-    Debug_printf("Sent %u bytes total from print file\n", total);
+    Debug_printf("Sent %u bytes total from print job %u\n", total, jobid);
 
     free(buf);
     fclose(poutput);
 
-    // Tell the printer it can start writing from the beginning
-    printer->reset_printer(); // destroy,create new printer emulator object of previous type.
-
     Debug_println("Print request completed");
 
     return ESP_OK;
@@ -411,6 +431,58 @@ esp_err_t fnHttpService::get_handler_modem_sniffer(httpd_req_t *req)
     return ESP_OK;
 }
 
+/* Sends the SIO trace as JSON, oldest frame first. Times are fnSystem.micros() values,
+   which wrap every 71 minutes. Frame bytes are hex; responses are the ACK/NAK/COMPLETE/ERROR
+   bytes we sent in order.
+*/
+esp_err_t fnHttpService::get_handler_sio_trace(httpd_req_t *req)
+{
+    Debug_println("SIO trace request handler");
+
+    // Copy the trace so the SIO task isn't held up while we send it
+    sio_trace_entry *entries = (sio_trace_entry *)heap_caps_malloc(SIO_TRACE_ENTRIES * sizeof(sio_trace_entry), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (entries == nullptr)
+    {
+        return_http_error(req, fnwserr_memory);
+        return ESP_FAIL;
+    }
+    int count = fnSioTrace.snapshot(entries, SIO_TRACE_ENTRIES);
+
+    set_file_content_type(req, "siotrace.json");
+    httpd_resp_set_hdr(req, "Content-Disposition", "attachment; filename=\"siotrace.json\"");
+
+    std::stringstream ss;
+    ss << "{\"recorded\":" << fnSioTrace.recorded() << ",\"frames\":[";
+    for (int i = 0; i < count; i++)
+    {
+        const sio_trace_entry &e = entries[i];
+        char frame[11];
+        snprintf(frame, sizeof(frame), "%02x%02x%02x%02x%02x", e.frame[0], e.frame[1], e.frame[2], e.frame[3], e.frame[4]);
+        char responses[SIO_TRACE_MAX_RESPONSES + 1] = { '\0' };
+        memcpy(responses, e.responses, SIO_TRACE_MAX_RESPONSES);
+
+        ss << (i > 0 ? "," : "") << "\n{\"t\":" << e.start_us << ",\"us\":" << e.duration_us
+           << ",\"frame\":\"" << frame << "\",\"ck\":" << ((e.flags & SIO_TRACE_BAD_CHECKSUM) ? "false" : "true")
+           << ",\"resp\":\"" << responses << ((e.flags & SIO_TRACE_RESPONSES_LOST) ? "+" : "")
+           << "\",\"out\":" << e.bytes_to_computer << ",\"in\":" << e.bytes_from_computer << "}";
+
+        // Send a chunk whenever we've built up enough
+        if (ss.tellp() >= FNWS_SEND_BUFF_SIZE)
+        {
+            httpd_resp_send_chunk(req, ss.str().c_str(), ss.str().length());
+            ss.str("");
+        }
+    }
+    ss << "\n]}\n";
+    httpd_resp_send_chunk(req, ss.str().c_str(), ss.str().length());
+    httpd_resp_send_chunk(req, nullptr, 0);
+
+    free(entries);
+
+    Debug_printf("Sent %d SIO trace entries\n", count);
+    return ESP_OK;
+}
+
 esp_err_t fnHttpService::post_handler_config(httpd_req_t *req)
 {
 
@@ -494,6 +566,10 @@ httpd_handle_t fnHttpService::start_server(serverstate &state)
          .method = HTTP_GET,
          .handler = get_handler_modem_sniffer,
          .user_ctx = NULL},
+        {.uri = "/siotrace.json",
+         .method = HTTP_GET,
+         .handler = get_handler_sio_trace,
+         .user_ctx = NULL},
         {.uri = "/favicon.ico",
          .method = HTTP_GET,
          .handler = get_handler_file_in_path,
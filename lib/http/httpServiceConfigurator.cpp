@@ -130,9 +130,15 @@ void fnHttpServiceConfigurator::config_hsio(std::string hsioindex)
     SIO.setHighSpeedIndex(index);
     // Store our change in Config
     Config.store_general_hsioindex(index);
+    Config.store_general_hsio_calibrated(false);
     Config.save();
 }
 
+void fnHttpServiceConfigurator::config_hsio_calibrate()
+{
+    SIO.startHighSpeedCalibration();
+}
+
 void fnHttpServiceConfigurator::config_timezone(std::string timezone)
 {
     Debug_printf("New timezone value: %s\n", timezone.c_str());
@@ -266,6 +272,39 @@ void fnHttpServiceConfigurator::config_printer(std::string printernumber, std::s
     Config.save();
 }
 
+/* Overlay actions take a 1-based drive slot number as their value
+*/
+void fnHttpServiceConfigurator::config_overlay(std::string action, std::string slot)
+{
+    int deviceSlot = atoi(slot.c_str()) - 1;
+    Debug_printf("Overlay action \"%s\" on slot %d\n", action.c_str(), deviceSlot + 1);
+
+    if (deviceSlot < 0 || deviceSlot >= MAX_DISK_DEVICES)
+        return;
+
+    if (action.compare("overlay_on") == 0)
+        theFuji.set_overlay_enabled(deviceSlot, true);
+    else if (action.compare("overlay_off") == 0)
+        theFuji.set_overlay_enabled(deviceSlot, false);
+    else if (action.compare("overlay_discard") == 0)
+        theFuji.discard_overlay(deviceSlot);
+    else if (action.compare("overlay_merge") == 0)
+        theFuji.merge_overlay(deviceSlot);
+}
+
+/* RAM disk actions take a 1-based drive slot number as their value
+*/
+void fnHttpServiceConfigurator::config_ramdisk(std::string action, std::string slot)
+{
+    int deviceSlot = atoi(slot.c_str()) - 1;
+    Debug_printf("RAM disk action \"%s\" on slot %d\n", action.c_str(), deviceSlot + 1);
+
+    if (deviceSlot < 0 || deviceSlot >= MAX_DISK_DEVICES)
+        return;
+
+    theFuji.set_ramdisk_enabled(deviceSlot, action.compare("ramdisk_on") == 0);
+}
+
 int fnHttpServiceConfigurator::process_config_post(const char *postdata, size_t postlen)
 {
 #ifdef DEBUG
@@ -293,6 +332,10 @@ int fnHttpServiceConfigurator::process_config_post(const char *postdata, size_t
         {
             config_hsio(i->second);
         }
+        else if (i->first.compare("hsio_calibrate") == 0)
+        {
+            config_hsio_calibrate();
+        }
         else if (i->first.compare("timezone") == 0)
         {
             config_timezone(i->second);
@@ -321,6 +364,14 @@ int fnHttpServiceConfigurator::process_config_post(const char *postdata, size_t
         {
             config_enable_config(i->second);
         }
+        else if (i->first.compare(0, 8, "overlay_") == 0)
+        {
+            config_overlay(i->first, i->second);
+        }
+        else if (i->first.compare(0, 8, "ramdisk_") == 0)
+        {
+            config_ramdisk(i->first, i->second);
+        }
     }
 
     return 0;
@@ -12,12 +12,15 @@ class fnHttpServiceConfigurator
 {
     static void config_printer(std::string printernumber, std::string printermodel, std::string printerport);
     static void config_hsio(std::string hsio_index);
+    static void config_hsio_calibrate();
     static void config_timezone(std::string timezone);
     static void config_hostname(std::string hostname);
     static void config_midimaze(std::string host_ip);
     static void config_cassette(std::string play_record, std::string resistor);
     static void config_rotation_sounds(std::string rotation_sounds);
     static void config_enable_config(std::string enable_config);
+    static void config_overlay(std::string action, std::string slot);
+    static void config_ramdisk(std::string action, std::string slot);
 
 public:
     static char * url_decode(char * dst, const char * src, size_t dstsize);
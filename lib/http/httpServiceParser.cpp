@@ -10,6 +10,11 @@
 
 #include "fuji.h"
 #include "printerlist.h"
+#include "fujiDirCache.h"
+#include "fujiImageCache.h"
+#include "sioTrace.h"
+#include "fnHttpCache.h"
+#include "fnHttpClient.h"
 
 #include "../hardware/fnSystem.h"
 #include "../hardware/fnWiFi.h"
@@ -87,6 +92,17 @@ const string fnHttpServiceParser::substitute_tag(const string &tag)
         FN_DRIVE6DEVICE,
         FN_DRIVE7DEVICE,
         FN_DRIVE8DEVICE,
+        FN_DIRCACHE_HITS,
+        FN_DIRCACHE_MISSES,
+        FN_DIRCACHE_LISTINGS,
+        FN_PRINTER1_JOBS,
+        FN_DRIVE_OVERLAYS,
+        FN_DRIVE_RAMDISKS,
+        FN_IMAGECACHE_STATS,
+        FN_HTTPCACHE_STATS,
+        FN_HTTP_CONNECTION_STATS,
+        FN_SIO_HSCALIBRATION,
+        FN_SIO_TRACE_COUNT,
         FN_LASTTAG
     };
 
@@ -154,7 +170,18 @@ const string fnHttpServiceParser::substitute_tag(const string &tag)
         "FN_DRIVE5DEVICE",
         "FN_DRIVE6DEVICE",
         "FN_DRIVE7DEVICE",
-        "FN_DRIVE8DEVICE"
+        "FN_DRIVE8DEVICE",
+        "FN_DIRCACHE_HITS",
+        "FN_DIRCACHE_MISSES",
+        "FN_DIRCACHE_LISTINGS",
+        "FN_PRINTER1_JOBS",
+        "FN_DRIVE_OVERLAYS",
+        "FN_DRIVE_RAMDISKS",
+        "FN_IMAGECACHE_STATS",
+        "FN_HTTPCACHE_STATS",
+        "FN_HTTP_CONNECTION_STATS",
+        "FN_SIO_HSCALIBRATION",
+        "FN_SIO_TRACE_COUNT"
     };
 
     stringstream resultstream;
@@ -342,6 +369,97 @@ const string fnHttpServiceParser::substitute_tag(const string &tag)
             resultstream << " (D" << disk_id << ":)";
         }
         break;
+    case FN_DIRCACHE_HITS:
+        resultstream << fnDirCache.hits;
+        break;
+    case FN_DIRCACHE_MISSES:
+        resultstream << fnDirCache.misses;
+        break;
+    case FN_DIRCACHE_LISTINGS:
+        resultstream << fnDirCache.count();
+        break;
+    case FN_PRINTER1_JOBS:
+        /* Links to each finished print job, newest first */
+        if (fnPrinters.get_ptr(0)->job_count() == 0)
+            resultstream << "(None)";
+        for (int i = 0; i < fnPrinters.get_ptr(0)->job_count(); i++)
+        {
+            const printer_job *job = fnPrinters.get_ptr(0)->get_job(i);
+            resultstream << "<a href=\"/print?" << job->id << "\">Job " << job->id << "</a> (" << job->size << " bytes)<br>";
+        }
+        break;
+    case FN_DRIVE_OVERLAYS:
+        /* Overlay state of each drive slot with buttons to change it */
+        for (drive_slot = 0; drive_slot < MAX_DISK_DEVICES; drive_slot++)
+        {
+            resultstream << "<form action=\"/config\" method=\"post\">Slot " << (drive_slot + 1) << ": ";
+            if (Config.get_mount_overlay(drive_slot))
+            {
+                int count = theFuji.overlay_count(drive_slot);
+                if (count >= 0)
+                    resultstream << count << " sectors written ";
+                else
+                    resultstream << "enabled ";
+                resultstream << "<button name=\"overlay_off\" value=\"" << (drive_slot + 1) << "\">Disable</button>";
+                if (count > 0)
+                {
+                    resultstream << "<button name=\"overlay_discard\" value=\"" << (drive_slot + 1) << "\">Discard</button>";
+                    if (theFuji.overlay_mergeable(drive_slot))
+                        resultstream << "<button name=\"overlay_merge\" value=\"" << (drive_slot + 1) << "\">Merge</button>";
+                }
+            }
+            else
+                resultstream << "off <button name=\"overlay_on\" value=\"" << (drive_slot + 1) << "\">Enable</button>";
+            resultstream << "</form>";
+        }
+        break;
+    case FN_DRIVE_RAMDISKS:
+        /* Whether each drive slot loads images into RAM, and whether the current one is */
+        for (drive_slot = 0; drive_slot < MAX_DISK_DEVICES; drive_slot++)
+        {
+            resultstream << "<form action=\"/config\" method=\"post\">Slot " << (drive_slot + 1) << ": ";
+            if (Config.get_mount_ramdisk(drive_slot))
+                resultstream << (theFuji.ramdisk_loaded(drive_slot) ? "loaded " : "enabled ")
+                             << "<button name=\"ramdisk_off\" value=\"" << (drive_slot + 1) << "\">Disable</button>";
+            else
+                resultstream << "off <button name=\"ramdisk_on\" value=\"" << (drive_slot + 1) << "\">Enable</button>";
+            resultstream << "</form>";
+        }
+        resultstream << "Images up to " << Config.get_general_ramdisk_limit() << " KB";
+        break;
+    case FN_SIO_HSCALIBRATION:
+        if (SIO.isHighSpeedCalibrating())
+            resultstream << "Calibrating index " << SIO.getHighSpeedIndex() << ": " << SIO.getHighSpeedCalibrationFrames()
+                         << " good frames, " << SIO.getHighSpeedCalibrationErrors() << " errors";
+        else
+            resultstream << (Config.get_general_hsio_calibrated() ? "Calibrated" : "Not calibrated");
+        break;
+    case FN_SIO_TRACE_COUNT:
+        resultstream << (fnSioTrace.recorded() < SIO_TRACE_ENTRIES ? fnSioTrace.recorded() : SIO_TRACE_ENTRIES);
+        break;
+    case FN_IMAGECACHE_STATS:
+        if (fnImageCache.budget() == 0)
+            resultstream << "Disabled";
+        else
+            resultstream << fnImageCache.count() << " images, " << fnImageCache.used() / (1024 * 1024) << " of "
+                         << Config.get_general_imagecache_size() << " MB, " << fnImageCache.hits << " hits, "
+                         << fnImageCache.misses << " misses";
+        break;
+    case FN_HTTPCACHE_STATS:
+        if (fnHttpCache.budget() == 0)
+            resultstream << "Disabled";
+        else
+            resultstream << fnHttpCache.count() << " responses, " << fnHttpCache.used() / 1024 << " KB of "
+                         << Config.get_general_httpcache_size() << " MB, " << fnHttpCache.hits << " hits, "
+                         << fnHttpCache.revalidated << " revalidated, " << fnHttpCache.misses << " misses";
+        break;
+    case FN_HTTP_CONNECTION_STATS:
+        resultstream << fnHttpClient::stats.connects << " opened (" << fnHttpClient::stats.tls_connects << " TLS";
+        if (fnHttpClient::stats.tls_connects > 0)
+            resultstream << ", " << fnHttpClient::stats.tls_connect_ms / fnHttpClient::stats.tls_connects << " ms each";
+        resultstream << "), " << fnHttpClient::stats.reused << " reused, "
+                     << fnHttpClient::stats.reused_closed << " found closed";
+        break;
     default:
         resultstream << tag;
         break;
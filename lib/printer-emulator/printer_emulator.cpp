@@ -101,6 +101,20 @@ FILE * printer_emu::closeOutputAndProvideReadHandle()
     return _FS->file_open(PRINTER_OUTFILE);
 }
 
+// Closes the output file and renames it, replacing anything already at that path
+bool printer_emu::moveOutput(const char *filename)
+{
+    if (_output_started == false)
+        return false;
+
+    closeOutput();
+
+    if (_FS->exists(filename))
+        _FS->remove(filename);
+
+    return _FS->rename(PRINTER_OUTFILE, filename);
+}
+
 // Closes the output file, giving the printer emulators a chance to provide closing output
 void printer_emu::closeOutput()
 {
@@ -56,6 +56,9 @@ public:
 
     void closeOutput();
     FILE * closeOutputAndProvideReadHandle();
+    // Closes the output file and moves it to the given path so a new output file can be started
+    bool moveOutput(const char *filename);
+    bool hasOutput() { return _output_started; };
 
     bool process(uint8_t linelen, uint8_t aux1, uint8_t aux2);
 
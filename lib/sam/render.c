@@ -47,6 +47,14 @@ unsigned char trans(unsigned char mem39212, unsigned char mem39213);
 // contains the final soundbuffer
 extern int bufferpos;
 extern char *buffer;
+extern void (*outputcallback)(int samples);
+
+// samples before bufferpos/50 are never written again, so they can be played while we keep rendering
+void NotifyOutput()
+{
+    if (outputcallback != NULL)
+        outputcallback(bufferpos / 50);
+}
 
 //timetable for more accurate c64 simulation
 int timetable[5][5] =
@@ -70,6 +78,7 @@ void Output8BitAry(int index, unsigned char ary[5])
         // printf("%d %d\n", bufferpos,k);
         buffer[bufferpos / 50 + k] = ary[k];
     }
+    NotifyOutput();
 }
 void Output8Bit(int index, unsigned char A)
 {
@@ -976,6 +985,7 @@ void Render()
                 // mem[54296] = X;
                 bufferpos += 150;
                 buffer[bufferpos / 50] = (X & 15) * 16;
+                NotifyOutput();
             }
             else
             {
@@ -983,6 +993,7 @@ void Render()
                 X = 6;
                 bufferpos += 150;
                 buffer[bufferpos / 50] = (X & 15) * 16;
+                NotifyOutput();
             }
 
             for (X = wait2; X > 0; X--)
@@ -43,6 +43,8 @@ unsigned char phonemeLengthOutput[60]; //tab47416
 // contains the final soundbuffer
 int bufferpos = 0;
 char *buffer = NULL;
+// called by the renderer as more of the soundbuffer becomes final
+void (*outputcallback)(int samples) = NULL;
 
 void SetInput(char *_input)
 {
@@ -63,6 +65,7 @@ void EnableSingmode() { singmode = 1; }
 char *GetBuffer() { return buffer; }
 int GetBufferLength() { return bufferpos; }
 void FreeBuffer() { free(buffer); }
+void SetOutputCallback(void (*callback)(int samples)) { outputcallback = callback; }
 
 void Init();
 int Parser1();
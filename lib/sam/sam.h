@@ -19,6 +19,8 @@ extern "C"
     char *GetBuffer();
     int GetBufferLength();
     void FreeBuffer();
+    // Callback receives the number of samples at the start of the buffer that won't change any more
+    void SetOutputCallback(void (*callback)(int samples));
     
     //char input[]={"/HAALAOAO MAYN NAAMAEAE IHSTT SAEBAASTTIHAAN \x9b\x9b\0"};
     //unsigned char input[]={"/HAALAOAO \x9b\0"};
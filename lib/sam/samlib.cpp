@@ -2,8 +2,9 @@
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/timers.h>
+#include <freertos/semphr.h>
 #include <driver/gpio.h>
-#include <driver/dac.h>
+#include <driver/i2s.h>
 
 #include "fnSystem.h"
 
@@ -151,36 +152,103 @@ void OutputSound()
 
 #else
 
-void OutputSound()
-{
 #ifdef ESP_PLATFORM
-    int n = GetBufferLength() / 50;
+
+// Samples are streamed to the built-in DAC by I2S DMA, so the pitch doesn't depend on our timing
+#define SAM_SAMPLE_RATE 22050
+#define SAM_I2S_PORT I2S_NUM_0
+#define SAM_DMA_BUF_COUNT 4
+#define SAM_DMA_BUF_LEN 256
+// Samples converted and handed to the DMA buffers at a time
+#define SAM_STREAM_CHUNK 256
+
+int samples_played = 0;
+
+// Sends everything up to the given sample to the DAC. Blocks while the DMA buffers are full
+void StreamSamples(int samples)
+{
+    // The built-in DAC uses the high byte of each 16-bit sample; we send the same value to both channels
+    uint16_t out[SAM_STREAM_CHUNK * 2];
     char *s = GetBuffer();
 
-    //fnSystem.dac_output_enable(SystemManager::dac_channel_t::DAC_CHANNEL_1);
-    //fnSystem.dac_output_voltage(SystemManager::dac_channel_t::DAC_CHANNEL_1, 100);
+    while (samples_played < samples)
+    {
+        int n = samples - samples_played;
+        if (n > SAM_STREAM_CHUNK)
+            n = SAM_STREAM_CHUNK;
 
-    dac_output_enable(DAC_CHANNEL_1);
+        for (int i = 0; i < n; i++)
+            out[i * 2] = out[i * 2 + 1] = ((uint8_t)s[samples_played + i]) << 8;
 
-    for (int i = 0; i < n; i++)
+        size_t written;
+        i2s_write(SAM_I2S_PORT, out, n * 2 * sizeof(uint16_t), &written, portMAX_DELAY);
+        samples_played += n;
+    }
+}
+
+// Called by the renderer as samples become final
+void OutputReady(int samples)
+{
+    if (samples - samples_played >= SAM_STREAM_CHUNK)
+        StreamSamples(samples);
+}
+
+void StartSound()
+{
+    i2s_config_t cfg = {};
+    cfg.mode = (i2s_mode_t)(I2S_MODE_MASTER | I2S_MODE_TX | I2S_MODE_DAC_BUILT_IN);
+    cfg.sample_rate = SAM_SAMPLE_RATE;
+    cfg.bits_per_sample = I2S_BITS_PER_SAMPLE_16BIT;
+    cfg.channel_format = I2S_CHANNEL_FMT_RIGHT_LEFT;
+    cfg.communication_format = I2S_COMM_FORMAT_I2S_MSB;
+    cfg.dma_buf_count = SAM_DMA_BUF_COUNT;
+    cfg.dma_buf_len = SAM_DMA_BUF_LEN;
+
+    i2s_driver_install(SAM_I2S_PORT, &cfg, 0, NULL);
+    // DAC channel 1 (GPIO25) is the right channel
+    i2s_set_dac_mode(I2S_DAC_CHANNEL_RIGHT_EN);
+
+    samples_played = 0;
+    SetOutputCallback(OutputReady);
+}
+
+void StopSound()
+{
+    SetOutputCallback(NULL);
+
+    // Push a full set of DMA buffers of silence through so the last real samples get played
+    uint16_t out[SAM_DMA_BUF_LEN * 2];
+    for (int i = 0; i < SAM_DMA_BUF_LEN * 2; i++)
+        out[i] = 128 << 8;
+    for (int i = 0; i < SAM_DMA_BUF_COUNT; i++)
     {
-        //dacWrite(DAC1, s[i]);
-        // fnSystem.dac_write(PIN_DAC1, s[i]);
-        dac_output_voltage(DAC_CHANNEL_1, s[i]);
-        //delayMicroseconds(40);
-        fnSystem.delay_microseconds(40);
+        size_t written;
+        i2s_write(SAM_I2S_PORT, out, sizeof(out), &written, portMAX_DELAY);
     }
 
-    //fnSystem.dac_output_disable(SystemManager::dac_channel_t::DAC_CHANNEL_1);
-    dac_output_disable(DAC_CHANNEL_1);
+    i2s_set_dac_mode(I2S_DAC_CHANNEL_DISABLE);
+    i2s_driver_uninstall(SAM_I2S_PORT);
 
     FreeBuffer();
+}
+
+#endif // ESP_PLATFORM
+
+void OutputSound()
+{
+#ifdef ESP_PLATFORM
+    // Most of the utterance has already been streamed while it was rendered
+    StreamSamples(GetBufferLength() / 50);
+    StopSound();
 #endif
 }
 
 #endif
 
-int sam(int argc, char **argv)
+// SAM renders into global buffers and owns the I2S port while speaking, so only one task may speak at a time
+static SemaphoreHandle_t _sam_mutex = xSemaphoreCreateMutex();
+
+static int _sam(int argc, char **argv)
 {
     int i;
     int phonetic = 0;
@@ -302,14 +370,32 @@ int sam(int argc, char **argv)
 
     // printf("right before SAMMain");
 
+#ifdef ESP_PLATFORM
+    StartSound();
+#else
+    clock_t render_start = clock();
+#endif
+
     if (!SAMMain())
     {
+#ifdef ESP_PLATFORM
+        StopSound();
+#endif
         PrintUsage();
         return 1;
     }
     // printf("right after SAMMain");
 
 #ifndef ESP_PLATFORM
+    if (debug)
+    {
+        // Render speed benchmark - how much faster than real time we are
+        double render_secs = (double)(clock() - render_start) / CLOCKS_PER_SEC;
+        double audio_secs = (double)(GetBufferLength() / 50) / 22050;
+        printf("rendered %.2fs of audio in %.3fs (%.1fx real time)\n", audio_secs, render_secs,
+               render_secs > 0 ? audio_secs / render_secs : 0);
+    }
+
     if (wavfilename != NULL)
         WriteWav(wavfilename, GetBuffer(), GetBufferLength() / 50);
     else
@@ -318,3 +404,11 @@ int sam(int argc, char **argv)
 
     return 0;
 }
+
+int sam(int argc, char **argv)
+{
+    xSemaphoreTake(_sam_mutex, portMAX_DELAY);
+    int result = _sam(argc, argv);
+    xSemaphoreGive(_sam_mutex);
+    return result;
+}
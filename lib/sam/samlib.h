@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <string.h>
+#include <time.h>
 
 #include "reciter.h"
 #include "sam.h"
@@ -30,6 +31,12 @@ void PrintUsage();
 void MixAudio(void *unused, Uint8 *stream, int len);
 void OutputSound();
 #else
+#ifdef ESP_PLATFORM
+void StreamSamples(int samples);
+void OutputReady(int samples);
+void StartSound();
+void StopSound();
+#endif // ESP_PLATFORM
 void OutputSound();
 #endif
 
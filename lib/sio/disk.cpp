@@ -8,6 +8,7 @@
 #include "disk.h"
 #include "diskTypeAtr.h"
 #include "diskTypeAtx.h"
+#include "diskTypeCompressed.h"
 #include "diskTypeXex.h"
 #include "fuji.h"
 
@@ -44,8 +45,16 @@ void sioDisk::sio_read()
     }
 
     uint16_t readcount;
+    uint16_t sectorNum = UINT16_FROM_HILOBYTES(cmdFrame.aux2, cmdFrame.aux1);
 
-    bool err = _disk->read(UINT16_FROM_HILOBYTES(cmdFrame.aux2, cmdFrame.aux1), &readcount);
+    // Anything written to a read-only image comes from its overlay
+    if (_overlay != nullptr && _overlay->read(sectorNum, _disk->_disk_sectorbuff, _disk->sector_size(sectorNum)))
+    {
+        sio_to_computer(_disk->_disk_sectorbuff, _disk->sector_size(sectorNum), false);
+        return;
+    }
+
+    bool err = _disk->read(sectorNum, &readcount);
 
     // Send result to Atari
     sio_to_computer(_disk->_disk_sectorbuff, readcount, err);
@@ -67,7 +76,16 @@ void sioDisk::sio_write(bool verify)
 
         if (ck == sio_checksum(_disk->_disk_sectorbuff, sectorSize))
         {
-            if (_disk->write(sectorNum, verify) == false)
+            if (_overlay != nullptr)
+            {
+                if (sectorNum != 0 && (_disk->num_sectors() == 0 || sectorNum <= _disk->num_sectors()) &&
+                    _overlay->write(sectorNum, _disk->_disk_sectorbuff, sectorSize))
+                {
+                    sio_complete();
+                    return;
+                }
+            }
+            else if (_disk->write(sectorNum, verify) == false)
             {
                 sio_complete();
                 return;
@@ -197,12 +215,15 @@ disktype_t sioDisk::mount(FILE *f, const char *filename, uint32_t disksize, disk
     //  DiskType::discover_disktype(filename) can detect CAS and WAV files
     Debug_print("disk MOUNT\n");
 
+    xSemaphoreTake(_disk_mutex, portMAX_DELAY);
+
     // Destroy any existing DiskType
     if (_disk != nullptr)
     {
         delete _disk;
         _disk = nullptr;
     }
+    _detach_overlay();
 
     // Determine DiskType based on filename extension
     if (disk_type == DISKTYPE_UNKNOWN && filename != nullptr)
@@ -215,21 +236,36 @@ disktype_t sioDisk::mount(FILE *f, const char *filename, uint32_t disksize, disk
     case DISKTYPE_WAV:
         // open the cassette file
         theFuji.cassette()->mount_cassette_file(f, disksize);
-        return disk_type;
         // TODO left off here for tape cassette
         break;
     case DISKTYPE_XEX:
         _disk = new DiskTypeXEX();
-        return _disk->mount(f, disksize);
+        disk_type = _disk->mount(f, disksize);
+        break;
     case DISKTYPE_ATX:
         _disk = new DiskTypeATX();
-        return _disk->mount(f, disksize);
+        disk_type = _disk->mount(f, disksize);
+        break;
+    case DISKTYPE_DCM:
+    case DISKTYPE_ATR_GZ:
+        _disk = new DiskTypeCompressed(disk_type);
+        disk_type = _disk->mount(f, disksize);
+        break;
     case DISKTYPE_ATR:
     case DISKTYPE_UNKNOWN:
     default:
         _disk = new DiskTypeATR();
-        return _disk->mount(f, disksize);
+        disk_type = _disk->mount(f, disksize);
+        break;
     }
+
+    xSemaphoreGive(_disk_mutex);
+    return disk_type;
+}
+
+sioDisk::sioDisk()
+{
+    _disk_mutex = xSemaphoreCreateMutex();
 }
 
 // Destructor
@@ -237,6 +273,8 @@ sioDisk::~sioDisk()
 {
     if (_disk != nullptr)
         delete _disk;
+    _detach_overlay();
+    vSemaphoreDelete(_disk_mutex);
 }
 
 // Unmount disk file
@@ -244,8 +282,136 @@ void sioDisk::unmount()
 {
     Debug_print("disk UNMOUNT\n");
 
+    xSemaphoreTake(_disk_mutex, portMAX_DELAY);
     if (_disk != nullptr)
         _disk->unmount();
+    _detach_overlay();
+    xSemaphoreGive(_disk_mutex);
+}
+
+bool sioDisk::load_ram(uint32_t disksize, uint32_t max_size, bool read_only)
+{
+    if (_disk == nullptr || (_disk->_disktype != DISKTYPE_ATR && _disk->_disktype != DISKTYPE_XEX))
+        return false;
+
+    return _disk->load_ram(disksize, max_size, read_only);
+}
+
+bool sioDisk::prefetch_ram(uint32_t disksize, uint32_t max_size, bool read_only)
+{
+    if (_disk == nullptr || (_disk->_disktype != DISKTYPE_ATR && _disk->_disktype != DISKTYPE_XEX))
+        return false;
+
+    return _disk->prefetch_ram(disksize, max_size, read_only);
+}
+
+/* Sends writes for the currently mounted image to an overlay on SD instead.
+   Should be called after mount() with the same file handle.
+*/
+bool sioDisk::attach_overlay(const char *hostname, const char *imagepath, FILE *f, uint32_t disksize)
+{
+    xSemaphoreTake(_disk_mutex, portMAX_DELAY);
+    _detach_overlay();
+
+    // Compressed images can't be written to, so an overlay is the only way to keep changes to them
+    if (_disk == nullptr || (_disk->_disktype != DISKTYPE_ATR && _disk->_disktype != DISKTYPE_XEX &&
+                             _disk->_disktype != DISKTYPE_DCM && _disk->_disktype != DISKTYPE_ATR_GZ))
+    {
+        xSemaphoreGive(_disk_mutex);
+        return false;
+    }
+
+    _overlay = new diskOverlay();
+    bool opened = _overlay->open(hostname, imagepath, f, disksize);
+    // Fingerprinting read from the image, so don't trust where the last read left the file
+    _disk->forget_position();
+    if (opened)
+        Debug_printf("disk overlay attached with %d sectors\n", _overlay->count());
+    else
+        _detach_overlay();
+
+    xSemaphoreGive(_disk_mutex);
+    return opened;
+}
+
+// Closes the overlay but leaves its file on SD for next time
+void sioDisk::detach_overlay()
+{
+    xSemaphoreTake(_disk_mutex, portMAX_DELAY);
+    _detach_overlay();
+    xSemaphoreGive(_disk_mutex);
+}
+
+// Caller must hold _disk_mutex
+void sioDisk::_detach_overlay()
+{
+    if (_overlay != nullptr)
+    {
+        delete _overlay;
+        _overlay = nullptr;
+    }
+}
+
+void sioDisk::discard_overlay()
+{
+    xSemaphoreTake(_disk_mutex, portMAX_DELAY);
+    if (_overlay != nullptr)
+        _overlay->discard();
+    xSemaphoreGive(_disk_mutex);
+}
+
+int sioDisk::overlay_count()
+{
+    xSemaphoreTake(_disk_mutex, portMAX_DELAY);
+    int count = _overlay == nullptr ? -1 : _overlay->count();
+    xSemaphoreGive(_disk_mutex);
+    return count;
+}
+
+bool sioDisk::merge_overlay(FILE *f, uint32_t disksize)
+{
+    // Hold off disk commands until the merge is done
+    xSemaphoreTake(_disk_mutex, portMAX_DELAY);
+    bool merged = _merge_overlay(f, disksize);
+    xSemaphoreGive(_disk_mutex);
+    return merged;
+}
+
+// Caller must hold _disk_mutex
+bool sioDisk::_merge_overlay(FILE *f, uint32_t disksize)
+{
+    if (_overlay == nullptr || _disk == nullptr || _disk->_disktype != DISKTYPE_ATR)
+    {
+        fclose(f);
+        return false;
+    }
+
+    // Use a second ATR object on the writable file so sector offsets are worked out the usual way.
+    // It closes the file when it goes out of scope
+    DiskTypeATR atr;
+    if (atr.mount(f, disksize) != DISKTYPE_ATR)
+    {
+        fclose(f);
+        return false;
+    }
+
+    for (int i = 0; i < _overlay->count(); i++)
+    {
+        uint16_t length;
+        uint16_t sectornum = _overlay->get(i, atr._disk_sectorbuff, &length);
+        if (sectornum == 0 || atr.write(sectornum, false))
+        {
+            Debug_printf("disk overlay merge failed at sector %hu\n", sectornum);
+            return false;
+        }
+    }
+
+    Debug_printf("disk overlay merged %d sectors\n", _overlay->count());
+    _overlay->discard();
+    // Our copy in RAM doesn't have the merged sectors, so go back to reading the file
+    _disk->unload_ram();
+
+    return true;
 }
 
 // Create blank disk
@@ -262,6 +428,14 @@ void sioDisk::sio_process(uint32_t commanddata, uint8_t checksum)
     cmdFrame.commanddata = commanddata;
     cmdFrame.checksum = checksum;
 
+    xSemaphoreTake(_disk_mutex, portMAX_DELAY);
+    _process_command();
+    xSemaphoreGive(_disk_mutex);
+}
+
+// Caller must hold _disk_mutex
+void sioDisk::_process_command()
+{
     if (_disk == nullptr || _disk->_disktype == DISKTYPE_UNKNOWN)
         return;
 
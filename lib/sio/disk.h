@@ -1,13 +1,25 @@
 #ifndef DISK_H
 #define DISK_H
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
 #include "sio.h"
 #include "diskType.h"
+#include "diskOverlay.h"
 
 class sioDisk : public sioDevice
 {
 private:
     DiskType *_disk = nullptr;
+    // Sectors written to an image mounted read-only, if enabled
+    diskOverlay *_overlay = nullptr;
+    // Overlays are changed from the web UI while the SIO task may be using the disk
+    SemaphoreHandle_t _disk_mutex = nullptr;
+
+    void _detach_overlay();
+    bool _merge_overlay(FILE *f, uint32_t disksize);
+    void _process_command();
 
     void sio_read();
     void sio_write(bool verify);
@@ -21,12 +33,35 @@ private:
     void dump_percom_block();
 
 public:
+    sioDisk();
+
     disktype_t mount(FILE *f, const char *filename, uint32_t disksize, disktype_t disk_type = DISKTYPE_UNKNOWN);
     void unmount();
     bool write_blank(FILE *f, uint16_t sectorSize, uint16_t numSectors);
 
     disktype_t disktype() { return _disk == nullptr ? DISKTYPE_UNKNOWN : _disk->_disktype; };
 
+    // Serves the mounted image from PSRAM (ATR and XEX only)
+    bool load_ram(uint32_t disksize, uint32_t max_size, bool read_only);
+    bool ram_loaded() { return _disk != nullptr && _disk->ram_loaded(); };
+    // Called while the bus is idle so changes to RAM-loaded images get written back
+    void flush_idle() { if (_disk != nullptr) _disk->flush_ram_if_idle(); };
+    // Starts reading the mounted image into PSRAM bit by bit from prefetch_idle() (ATR and XEX only)
+    bool prefetch_ram(uint32_t disksize, uint32_t max_size, bool read_only);
+    // Returns false if there's no prefetch in progress
+    bool prefetch_idle() { return _disk != nullptr && _disk->prefetch_ram_step(); };
+    // Frees a prefetched (but not fully loaded) copy of the image
+    void cancel_prefetch() { if (_disk != nullptr && _disk->ram_prefetching()) _disk->unload_ram(); };
+
+    // Copy-on-write overlay for read-only images (ATR, XEX and compressed ATR only)
+    bool attach_overlay(const char *hostname, const char *imagepath, FILE *f, uint32_t disksize);
+    void detach_overlay();
+    void discard_overlay();
+    // Writes the overlay's sectors into the given writable copy of the image and discards it
+    bool merge_overlay(FILE *f, uint32_t disksize);
+    // Returns -1 if there's no overlay attached
+    int overlay_count();
+
     ~sioDisk();
 };
 
@@ -0,0 +1,231 @@
+#include <string.h>
+
+#include "../../include/debug.h"
+#include "fnFsSD.h"
+
+#include "diskOverlay.h"
+
+#define OVERLAY_MAGIC "FNOVL01"
+#define OVERLAY_RECORD_SIZE (sizeof(overlay_record_header) + DISK_SECTORBUF_SIZE)
+
+// Number of bytes from the start of the image used to fingerprint it
+#define OVERLAY_FINGERPRINT_BYTES 1024
+
+// 32-bit FNV-1a
+static uint32_t _overlay_hash(uint32_t hash, const uint8_t *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= data[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+/* Identifies the image contents cheaply (we don't want to read an entire image over the network).
+   Uses the image size and its first few sectors, then puts the file position back where it was.
+*/
+uint32_t diskOverlay::fingerprint(FILE *image, uint32_t image_size)
+{
+    uint32_t hash = _overlay_hash(2166136261, (const uint8_t *)&image_size, sizeof(image_size));
+
+    long pos = ftell(image);
+    uint8_t *buf = (uint8_t *)malloc(OVERLAY_FINGERPRINT_BYTES);
+    if (buf != nullptr)
+    {
+        fseek(image, 0, SEEK_SET);
+        size_t count = fread(buf, 1, OVERLAY_FINGERPRINT_BYTES, image);
+        hash = _overlay_hash(hash, buf, count);
+        free(buf);
+    }
+    fseek(image, pos < 0 ? 0 : pos, SEEK_SET);
+
+    return hash;
+}
+
+std::string diskOverlay::make_path(const char *hostname, const char *imagepath, uint32_t fingerprint)
+{
+    uint32_t sourcehash = _overlay_hash(2166136261, (const uint8_t *)hostname, strlen(hostname));
+    sourcehash = _overlay_hash(sourcehash, (const uint8_t *)imagepath, strlen(imagepath));
+
+    char filename[40];
+    snprintf(filename, sizeof(filename), OVERLAY_DIRECTORY "/%08x%08x.ovl", sourcehash, fingerprint);
+    return std::string(filename);
+}
+
+bool diskOverlay::open(const char *hostname, const char *imagepath, FILE *image, uint32_t image_size)
+{
+    close();
+
+    if (fnSDFAT.running() == false)
+    {
+        Debug_println("diskOverlay: no SD card available");
+        return false;
+    }
+
+    memset(&_header, 0, sizeof(_header));
+    memcpy(_header.magic, OVERLAY_MAGIC, sizeof(_header.magic));
+    _header.image_size = image_size;
+    _header.image_fingerprint = fingerprint(image, image_size);
+    _header.record_size = OVERLAY_RECORD_SIZE;
+    snprintf(_header.source, sizeof(_header.source), "%s:%s", hostname, imagepath);
+
+    _path = make_path(hostname, imagepath, _header.image_fingerprint);
+
+    if (fnSDFAT.exists(_path.c_str()))
+        return _load();
+
+    Debug_printf("diskOverlay: no existing overlay \"%s\"\n", _path.c_str());
+    return true;
+}
+
+// Reads an existing delta file and builds our index
+bool diskOverlay::_load()
+{
+    _file = fnSDFAT.file_open(_path.c_str(), "r+");
+    if (_file == nullptr)
+        return false;
+
+    overlay_header hdr;
+    if (fread(&hdr, 1, sizeof(hdr), _file) != sizeof(hdr) || memcmp(hdr.magic, OVERLAY_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.image_fingerprint != _header.image_fingerprint || hdr.record_size != OVERLAY_RECORD_SIZE)
+    {
+        // Start over rather than serve sectors we can't trust
+        Debug_printf("diskOverlay: removing invalid overlay \"%s\"\n", _path.c_str());
+        fclose(_file);
+        _file = nullptr;
+        fnSDFAT.remove(_path.c_str());
+        return true;
+    }
+
+    uint32_t offset = sizeof(hdr);
+    overlay_record_header rec;
+    while (fseek(_file, offset, SEEK_SET) == 0 && fread(&rec, 1, sizeof(rec), _file) == sizeof(rec))
+    {
+        if (rec.length > DISK_SECTORBUF_SIZE)
+            break;
+        _index[rec.sectornum] = offset;
+        offset += OVERLAY_RECORD_SIZE;
+    }
+
+    Debug_printf("diskOverlay: loaded %u sectors from \"%s\"\n", _index.size(), _path.c_str());
+    return true;
+}
+
+bool diskOverlay::_create()
+{
+    fnSDFAT.create_path(OVERLAY_DIRECTORY);
+
+    _file = fnSDFAT.file_open(_path.c_str(), "w+");
+    if (_file == nullptr)
+    {
+        Debug_printf("diskOverlay: failed to create \"%s\"\n", _path.c_str());
+        return false;
+    }
+
+    if (fwrite(&_header, 1, sizeof(_header), _file) != sizeof(_header))
+    {
+        fclose(_file);
+        _file = nullptr;
+        return false;
+    }
+
+    Debug_printf("diskOverlay: created \"%s\"\n", _path.c_str());
+    return true;
+}
+
+void diskOverlay::close()
+{
+    if (_file != nullptr)
+    {
+        fclose(_file);
+        _file = nullptr;
+    }
+    _index.clear();
+}
+
+bool diskOverlay::read(uint16_t sectornum, uint8_t *buf, uint16_t length)
+{
+    auto it = _index.find(sectornum);
+    if (it == _index.end())
+        return false;
+
+    if (length > DISK_SECTORBUF_SIZE)
+        length = DISK_SECTORBUF_SIZE;
+
+    if (fseek(_file, it->second + sizeof(overlay_record_header), SEEK_SET) != 0 ||
+        fread(buf, 1, length, _file) != length)
+    {
+        Debug_printf("diskOverlay: failed reading sector %hu\n", sectornum);
+        return false;
+    }
+
+    return true;
+}
+
+bool diskOverlay::write(uint16_t sectornum, const uint8_t *buf, uint16_t length)
+{
+    if (length > DISK_SECTORBUF_SIZE)
+        return false;
+
+    if (_file == nullptr && _create() == false)
+        return false;
+
+    // Overwrite the existing record for this sector or add a new one at the end
+    uint32_t offset;
+    auto it = _index.find(sectornum);
+    if (it != _index.end())
+        offset = it->second;
+    else
+        offset = sizeof(overlay_header) + _index.size() * OVERLAY_RECORD_SIZE;
+
+    uint8_t record[OVERLAY_RECORD_SIZE] = {0};
+    overlay_record_header *rec = (overlay_record_header *)record;
+    rec->sectornum = sectornum;
+    rec->length = length;
+    memcpy(record + sizeof(overlay_record_header), buf, length);
+
+    if (fseek(_file, offset, SEEK_SET) != 0 || fwrite(record, 1, sizeof(record), _file) != sizeof(record))
+    {
+        Debug_printf("diskOverlay: failed writing sector %hu\n", sectornum);
+        return false;
+    }
+    // We might get reset at any moment
+    fflush(_file);
+    fsync(fileno(_file));
+
+    _index[sectornum] = offset;
+    return true;
+}
+
+uint16_t diskOverlay::get(int index, uint8_t *buf, uint16_t *length)
+{
+    if (index < 0 || index >= (int)_index.size())
+        return 0;
+
+    auto it = _index.begin();
+    std::advance(it, index);
+
+    overlay_record_header rec;
+    if (fseek(_file, it->second, SEEK_SET) != 0 || fread(&rec, 1, sizeof(rec), _file) != sizeof(rec) ||
+        fread(buf, 1, rec.length, _file) != rec.length)
+        return 0;
+
+    *length = rec.length;
+    return rec.sectornum;
+}
+
+void diskOverlay::discard()
+{
+    close();
+    if (_path.length() > 0 && fnSDFAT.exists(_path.c_str()))
+    {
+        Debug_printf("diskOverlay: discarding \"%s\"\n", _path.c_str());
+        fnSDFAT.remove(_path.c_str());
+    }
+}
+
+diskOverlay::~diskOverlay()
+{
+    close();
+}
@@ -0,0 +1,79 @@
+/* Copy-on-write overlay for read-only disk images
+
+ Sectors written to a disk mounted read-only are kept in a delta file on the
+ SD card instead of failing, and reads check the delta file first. The file is
+ named after the host, the image path and a fingerprint of the image contents,
+ so it's found again when the same image is mounted after a reboot and a
+ changed image doesn't pick up stale sectors.
+
+ The delta file is a fixed-size header followed by one fixed-size record per
+ sector that has been written. Only the sector number to record offset index
+ is kept in memory.
+*/
+#ifndef _DISK_OVERLAY_
+#define _DISK_OVERLAY_
+
+#include <stdio.h>
+#include <map>
+#include <string>
+
+#include "diskType.h"
+
+#define OVERLAY_DIRECTORY "/overlays"
+
+struct overlay_header
+{
+    char magic[8];
+    uint32_t image_size;
+    uint32_t image_fingerprint;
+    uint16_t record_size;
+    uint16_t reserved;
+    // Host and path of the image, only so someone looking at the file knows what it belongs to
+    char source[236];
+} __attribute__((packed));
+
+struct overlay_record_header
+{
+    uint16_t sectornum;
+    uint16_t length;
+} __attribute__((packed));
+
+class diskOverlay
+{
+private:
+    FILE *_file = nullptr;
+    std::string _path;
+    overlay_header _header;
+    // Sector number -> file offset of its record
+    std::map<uint16_t, uint32_t> _index;
+
+    bool _load();
+    bool _create();
+
+public:
+    static uint32_t fingerprint(FILE *image, uint32_t image_size);
+    static std::string make_path(const char *hostname, const char *imagepath, uint32_t fingerprint);
+
+    /* Opens the overlay for the given image. The delta file isn't created until the first write
+       Returns false if the SD card isn't available
+    */
+    bool open(const char *hostname, const char *imagepath, FILE *image, uint32_t image_size);
+    void close();
+
+    // Returns true and fills buf if we have this sector
+    bool read(uint16_t sectornum, uint8_t *buf, uint16_t length);
+    // Returns false on error
+    bool write(uint16_t sectornum, const uint8_t *buf, uint16_t length);
+
+    // Copies the sector at the given index (in sector number order) into buf. Returns its sector number or 0
+    uint16_t get(int index, uint8_t *buf, uint16_t *length);
+
+    // Throws out every stored sector and deletes the delta file
+    void discard();
+
+    int count() { return _index.size(); };
+
+    ~diskOverlay();
+};
+
+#endif // _DISK_OVERLAY_
@@ -1,7 +1,11 @@
 #include <string.h>
+#include <unistd.h>
+
+#include "esp_heap_caps.h"
 
 #include "../../include/debug.h"
 #include "../utils/utils.h"
+#include "fnSystem.h"
 
 #include "diskType.h"
 
@@ -127,8 +131,239 @@ void DiskType::dump_percom_block()
 #endif
 }
 
+// PSRAM is much larger than internal memory, so images always go there
+bool DiskType::_ram_alloc(uint32_t size)
+{
+    uint32_t dirtybytes = (size / RAMDISK_BLOCK_SIZE + 8) / 8;
+    uint8_t *ram = (uint8_t *)heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    uint8_t *dirty = (uint8_t *)calloc(1, dirtybytes);
+    if (ram == nullptr || dirty == nullptr)
+    {
+        Debug_printf("load_ram: failed to allocate %u bytes\n", size);
+        free(ram);
+        free(dirty);
+        return false;
+    }
+
+    _disk_ram = ram;
+    _disk_ram_size = size;
+    _disk_ram_dirty = dirty;
+    _disk_ram_dirty_count = 0;
+    _disk_ram_loaded = 0;
+    _disk_ram_partial = false;
+    return true;
+}
+
+bool DiskType::load_ram(uint32_t disksize, uint32_t max_size, bool read_only)
+{
+    unload_ram();
+
+    if (_disk_fileh == nullptr || disksize == 0 || disksize > max_size)
+    {
+        Debug_printf("load_ram: image size %u over limit %u\n", disksize, max_size);
+        return false;
+    }
+
+    if (_ram_alloc(disksize) == false)
+        return false;
+
+    unsigned long ms_start = fnSystem.millis();
+    if (fseek(_disk_fileh, 0, SEEK_SET) != 0 || fread(_disk_ram, 1, disksize, _disk_fileh) != disksize)
+    {
+        Debug_println("load_ram: failed reading image");
+        unload_ram();
+        return false;
+    }
+
+    _disk_ram_loaded = disksize;
+    _disk_ram_readonly = read_only;
+    _disk_last_sector = INVALID_SECTOR_VALUE;
+
+    Debug_printf("load_ram: loaded %u bytes in %lu ms\n", disksize, fnSystem.millis() - ms_start);
+    return true;
+}
+
+bool DiskType::prefetch_ram(uint32_t disksize, uint32_t max_size, bool read_only)
+{
+    // Already loaded or on its way
+    if (_disk_ram != nullptr)
+        return true;
+
+    if (_disk_fileh == nullptr || disksize == 0)
+        return false;
+
+    uint32_t size = disksize;
+    if (disksize > max_size && disksize > RAMDISK_PREFETCH_HEAD_BYTES)
+        size = RAMDISK_PREFETCH_HEAD_BYTES;
+
+    if (_ram_alloc(size) == false)
+        return false;
+
+    _disk_ram_partial = size < disksize;
+    _disk_ram_readonly = read_only;
+
+    Debug_printf("prefetch_ram: prefetching %u of %u bytes\n", size, disksize);
+    return true;
+}
+
+bool DiskType::prefetch_ram_step()
+{
+    if (_disk_ram == nullptr || _disk_ram_loaded >= _disk_ram_size)
+        return false;
+
+    uint32_t length = _disk_ram_size - _disk_ram_loaded;
+    if (length > RAMDISK_PREFETCH_CHUNK)
+        length = RAMDISK_PREFETCH_CHUNK;
+
+    // We're moving the file position out from under read()
+    _disk_last_sector = INVALID_SECTOR_VALUE;
+
+    if (fseek(_disk_fileh, _disk_ram_loaded, SEEK_SET) != 0 ||
+        fread(_disk_ram + _disk_ram_loaded, 1, length, _disk_fileh) != length)
+    {
+        Debug_printf("prefetch_ram: failed reading at %u - giving up\n", _disk_ram_loaded);
+        unload_ram();
+        return false;
+    }
+
+    _disk_ram_loaded += length;
+    if (_disk_ram_loaded == _disk_ram_size)
+        Debug_printf("prefetch_ram: finished %u bytes\n", _disk_ram_size);
+
+    return true;
+}
+
+bool DiskType::_ram_has(uint32_t offset, uint32_t length)
+{
+    // A whole image in RAM serves short reads at its end too
+    if (ram_loaded())
+        return true;
+    return _disk_ram != nullptr && offset <= _disk_ram_loaded && length <= _disk_ram_loaded - offset;
+}
+
+uint32_t DiskType::_ram_read(uint32_t offset, uint8_t *buf, uint32_t length)
+{
+    if (offset >= _disk_ram_size)
+        return 0;
+    if (length > _disk_ram_size - offset)
+        length = _disk_ram_size - offset;
+
+    memcpy(buf, _disk_ram + offset, length);
+    return length;
+}
+
+bool DiskType::_ram_write(uint32_t offset, const uint8_t *buf, uint32_t length)
+{
+    if (_disk_ram_readonly || ram_loaded() == false || offset >= _disk_ram_size || length > _disk_ram_size - offset)
+        return false;
+
+    memcpy(_disk_ram + offset, buf, length);
+
+    for (uint32_t block = offset / RAMDISK_BLOCK_SIZE; block <= (offset + length - 1) / RAMDISK_BLOCK_SIZE; block++)
+    {
+        uint8_t mask = 1 << (block % 8);
+        if ((_disk_ram_dirty[block / 8] & mask) == 0)
+        {
+            _disk_ram_dirty[block / 8] |= mask;
+            _disk_ram_dirty_count++;
+        }
+    }
+    _disk_ram_last_write = fnSystem.millis();
+
+    return true;
+}
+
+/* Writes dirty blocks back to the image file, at most max_blocks of them if not zero.
+   Neighbouring dirty blocks are written together to keep the number of writes down
+*/
+bool DiskType::flush_ram(uint32_t max_blocks)
+{
+    if (_disk_ram == nullptr || _disk_ram_dirty_count == 0)
+        return true;
+
+    uint32_t num_blocks = (_disk_ram_size + RAMDISK_BLOCK_SIZE - 1) / RAMDISK_BLOCK_SIZE;
+    uint32_t flushed = 0;
+    bool err = false;
+
+    uint32_t block = 0;
+    while (block < num_blocks && err == false && (max_blocks == 0 || flushed < max_blocks))
+    {
+        if ((_disk_ram_dirty[block / 8] & (1 << (block % 8))) == 0)
+        {
+            block++;
+            continue;
+        }
+
+        // Collect this block and any dirty ones following it
+        uint32_t first = block;
+        while (block < num_blocks && (_disk_ram_dirty[block / 8] & (1 << (block % 8))) &&
+               (max_blocks == 0 || flushed < max_blocks))
+        {
+            _disk_ram_dirty[block / 8] &= ~(1 << (block % 8));
+            _disk_ram_dirty_count--;
+            flushed++;
+            block++;
+        }
+
+        uint32_t offset = first * RAMDISK_BLOCK_SIZE;
+        uint32_t length = (block - first) * RAMDISK_BLOCK_SIZE;
+        if (length > _disk_ram_size - offset)
+            length = _disk_ram_size - offset;
+
+        if (fseek(_disk_fileh, offset, SEEK_SET) != 0 || fwrite(_disk_ram + offset, 1, length, _disk_fileh) != length)
+        {
+            Debug_printf("flush_ram: failed writing %u bytes at %u\n", length, offset);
+            // Put the blocks back so we try again later
+            for (uint32_t b = first; b < block; b++)
+                _disk_ram_dirty[b / 8] |= 1 << (b % 8);
+            _disk_ram_dirty_count += block - first;
+            err = true;
+        }
+    }
+
+    if (flushed > 0)
+    {
+        fflush(_disk_fileh);
+        fsync(fileno(_disk_fileh));
+        Debug_printf("flush_ram: wrote %u blocks, %u left\n", flushed, _disk_ram_dirty_count);
+    }
+
+    return err == false;
+}
+
+void DiskType::flush_ram_if_idle()
+{
+    if (_disk_ram_dirty_count > 0 && fnSystem.millis() - _disk_ram_last_write >= RAMDISK_FLUSH_IDLE_MS)
+    {
+        // Don't come straight back if the file is failing
+        if (flush_ram(RAMDISK_FLUSH_BLOCKS_PER_PASS) == false)
+            _disk_ram_last_write = fnSystem.millis();
+    }
+}
+
+void DiskType::unload_ram()
+{
+    if (_disk_ram == nullptr)
+        return;
+
+    if (flush_ram() == false)
+        Debug_println("unload_ram: failed writing back RAM image");
+
+    free(_disk_ram);
+    free(_disk_ram_dirty);
+    _disk_ram = nullptr;
+    _disk_ram_dirty = nullptr;
+    _disk_ram_size = 0;
+    _disk_ram_dirty_count = 0;
+    _disk_ram_loaded = 0;
+    _disk_ram_partial = false;
+    _disk_last_sector = INVALID_SECTOR_VALUE;
+}
+
 void DiskType::unmount()
 {
+    unload_ram();
+
     if (_disk_fileh != nullptr)
     {
         fclose(_disk_fileh);
@@ -139,6 +374,9 @@ void DiskType::unmount()
 disktype_t DiskType::discover_disktype(const char *filename)
 {
     int l = strlen(filename);
+    // Compressed ATRs have a double extension
+    if(l > 7 && strcasecmp(filename + l - 7, ".ATR.GZ") == 0)
+        return DISKTYPE_ATR_GZ;
     if(l > 4 && filename[l - 4] == '.')
     {
         // Check the last 3 characters of the string
@@ -157,6 +395,8 @@ disktype_t DiskType::discover_disktype(const char *filename)
             return DISKTYPE_CAS;
         } else if(strcasecmp(ext, "WAV") == 0) {
             return DISKTYPE_WAV;
+        } else if(strcasecmp(ext, "DCM") == 0) {
+            return DISKTYPE_DCM;
         }
     }
     return DISKTYPE_UNKNOWN;
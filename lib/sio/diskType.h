@@ -29,6 +29,17 @@
 #define DISK_DRIVE_STATUS_DOUBLE_SIDED 0x40
 #define DISK_DRIVE_STATUS_ENHANCED_DENSITY 0x80
 
+// Dirty sectors of an image loaded into RAM are tracked in blocks of this many bytes
+#define RAMDISK_BLOCK_SIZE 256
+// Dirty blocks are written back once there have been no writes for this long
+#define RAMDISK_FLUSH_IDLE_MS 2000
+// Most blocks written back in one idle pass so a waiting command isn't held up for long
+#define RAMDISK_FLUSH_BLOCKS_PER_PASS 16
+// Bytes read per idle pass while prefetching an image into RAM - about one TNFS read
+#define RAMDISK_PREFETCH_CHUNK 512
+// Images over the RAM disk limit only have this much of their start prefetched (boot and loader)
+#define RAMDISK_PREFETCH_HEAD_BYTES 65536
+
 enum disktype_t 
 {
     DISKTYPE_UNKNOWN = 0,
@@ -37,6 +48,8 @@ enum disktype_t
     DISKTYPE_XEX,
     DISKTYPE_CAS,
     DISKTYPE_WAV,
+    DISKTYPE_DCM,
+    DISKTYPE_ATR_GZ,
     DISKTYPE_COUNT
 };
 
@@ -50,6 +63,29 @@ protected:
     int32_t _disk_last_sector = INVALID_SECTOR_VALUE;
     uint8_t _disk_controller_status = DISK_CTRL_STATUS_CLEAR;
 
+    // Copy of the entire image in PSRAM if load_ram() succeeded
+    uint8_t *_disk_ram = nullptr;
+    uint32_t _disk_ram_size = 0;
+    // One bit per RAMDISK_BLOCK_SIZE bytes that haven't been written back to the file yet
+    uint8_t *_disk_ram_dirty = nullptr;
+    uint32_t _disk_ram_dirty_count = 0;
+    unsigned long _disk_ram_last_write = 0;
+    // The image file was opened read-only, so writes to the RAM copy are refused too
+    bool _disk_ram_readonly = false;
+    // Bytes of _disk_ram read from the file so far, which is less than _disk_ram_size while prefetching
+    uint32_t _disk_ram_loaded = 0;
+    // _disk_ram only holds the start of the image
+    bool _disk_ram_partial = false;
+
+    bool _ram_alloc(uint32_t size);
+    // True if the given range can be read from RAM
+    bool _ram_has(uint32_t offset, uint32_t length);
+
+    // Returns the number of bytes copied, which is short at the end of the image
+    uint32_t _ram_read(uint32_t offset, uint8_t *buf, uint32_t length);
+    // Returns false if the range is outside the image
+    bool _ram_write(uint32_t offset, const uint8_t *buf, uint32_t length);
+
 public:
     struct
     {
@@ -85,9 +121,37 @@ public:
 
     // Always returns 128 for the first 3 sectors, otherwise _sectorSize
     virtual uint16_t sector_size(uint16_t sectornum);
+
+    // Zero if the disk type doesn't have a fixed number of sectors
+    uint32_t num_sectors() { return _disk_num_sectors; };
+    // Makes the next read seek, for when something else has moved the file position
+    void forget_position() { _disk_last_sector = INVALID_SECTOR_VALUE; };
     
     virtual void status(uint8_t statusbuff[4]) = 0;
 
+    /* Reads the whole image into PSRAM so sectors are served from memory.
+       Must be called right after mount(). Returns false (and leaves the image file-backed)
+       if the image is larger than max_size or there isn't enough memory
+    */
+    bool load_ram(uint32_t disksize, uint32_t max_size, bool read_only);
+    // Writes back anything dirty and goes back to reading from the file
+    void unload_ram();
+    // True only once the whole image is in RAM
+    bool ram_loaded() { return _disk_ram != nullptr && _disk_ram_partial == false && _disk_ram_loaded == _disk_ram_size; };
+    /* Like load_ram(), but the image is read a piece at a time by prefetch_ram_step() so it can be done
+       while the bus is idle. Images larger than max_size only have their first RAMDISK_PREFETCH_HEAD_BYTES read.
+       Sectors already read are served from RAM in the meantime, and a write abandons the prefetch
+    */
+    bool prefetch_ram(uint32_t disksize, uint32_t max_size, bool read_only);
+    // Reads the next piece of an image being prefetched. Returns false if there was nothing to do
+    bool prefetch_ram_step();
+    // RAM holds some or all of the image but can't take writes yet
+    bool ram_prefetching() { return _disk_ram != nullptr && ram_loaded() == false; };
+    // Writes dirty blocks back to the image file, at most max_blocks of them if not zero
+    bool flush_ram(uint32_t max_blocks = 0);
+    // Writes back some dirty blocks if nothing's been written for RAMDISK_FLUSH_IDLE_MS
+    void flush_ram_if_idle();
+
     static disktype_t discover_disktype(const char *filename);
 
     void dump_percom_block();
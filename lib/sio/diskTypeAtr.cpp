@@ -5,12 +5,16 @@
 #include "../utils/utils.h"
 
 #include "fnSystem.h"
+#include "led.h"
 #include "disk.h"
 
 #include "diskTypeAtr.h"
 
 #define ATR_MAGIC_HEADER 0x0296 // Sum of 'NICKATARI'
 
+// Size of the zero-filled blocks written when a new image can't be extended by seeking
+#define ATR_CREATE_BLOCK_SIZE 4096
+
 // Returns byte offset of given sector number (1-based)
 uint32_t DiskTypeATR::_sector_to_offset(uint16_t sectorNum)
 {
@@ -58,17 +62,26 @@ bool DiskTypeATR::read(uint16_t sectornum, uint16_t *readcount)
     memset(_disk_sectorbuff, 0, sizeof(_disk_sectorbuff));
 
     bool err = false;
-    // Perform a seek if we're not reading the sector after the last one we read
-    if (sectornum != _disk_last_sector + 1)
+    bool from_ram = _ram_has(_sector_to_offset(sectornum), sectorSize);
+    if (from_ram)
     {
-        uint32_t offset = _sector_to_offset(sectornum);
-        err = fseek(_disk_fileh, offset, SEEK_SET) != 0;
+        err = _ram_read(_sector_to_offset(sectornum), _disk_sectorbuff, sectorSize) != sectorSize;
     }
+    else
+    {
+        // Perform a seek if we're not reading the sector after the last one we read
+        if (sectornum != _disk_last_sector + 1)
+        {
+            uint32_t offset = _sector_to_offset(sectornum);
+            err = fseek(_disk_fileh, offset, SEEK_SET) != 0;
+        }
 
-    if (err == false)
-        err = fread(_disk_sectorbuff, 1, sectorSize, _disk_fileh) != sectorSize;
+        if (err == false)
+            err = fread(_disk_sectorbuff, 1, sectorSize, _disk_fileh) != sectorSize;
+    }
 
-    if (err == false)
+    // Reading from RAM leaves the file position where it was
+    if (err == false && from_ram == false)
         _disk_last_sector = sectornum;
     else
         _disk_last_sector = INVALID_SECTOR_VALUE;
@@ -95,6 +108,17 @@ bool DiskTypeATR::write(uint16_t sectornum, bool verify)
 
     _disk_last_sector = INVALID_SECTOR_VALUE;
 
+    // Images loaded into RAM are written back later
+    if (ram_loaded())
+        return _ram_write(offset, _disk_sectorbuff, sectorSize) == false;
+
+    // Our partial copy would go stale, and the disk is being written to so it's not worth finishing
+    if (ram_prefetching())
+    {
+        Debug_println("ATR write abandons prefetch");
+        unload_ram();
+    }
+
     // Perform a seek if we're writing to the sector after the last one
     int e;
     if (sectornum != _disk_last_sector + 1)
@@ -276,33 +300,69 @@ bool DiskTypeATR::create(FILE *f, uint16_t sectorSize, uint16_t numSectors)
     Debug_printf("Write header to ATR: sec_size=%d, sectors=%d, paragraphs=%d, bytes=%d\n",
         sectorSize, numSectors, num_paragraphs, total_size);
 
-    uint32_t offset = fwrite(&atrHeader, 1, sizeof(atrHeader), f);
+    // Write the header and first three 128 byte sectors in one go
+    uint8_t start[sizeof(atrHeader) + 384] = {0};
+    memcpy(start, &atrHeader, sizeof(atrHeader));
+
+    if (fwrite(start, 1, sizeof(start), f) != sizeof(start))
+    {
+        Debug_println("Error writing ATR header");
+        return false;
+    }
+
+    uint32_t image_size = sizeof(atrHeader) + total_size;
 
-    // Write first three 128 uint8_t sectors
+    // Extend the file to its full size by writing just the last sector. SD and TNFS
+    // both support seeking past the end of a file, so this is a single seek and write
     uint8_t blank[256] = {0};
+    if (fseek(f, image_size - sectorSize, SEEK_SET) == 0 &&
+        fwrite(blank, 1, sectorSize, f) == sectorSize &&
+        fflush(f) == 0 && ftell(f) == (long)image_size)
+        return true;
 
-    for (int i = 0; i < 3; i++)
+    Debug_println("Sparse extend failed, writing blank sectors instead");
+    return _write_zeros(f, sizeof(start), image_size);
+}
+
+/* Fills the file with zeros from start up to end, using large blocks to keep
+   the number of writes (and TNFS round trips) down
+*/
+bool DiskTypeATR::_write_zeros(FILE *f, uint32_t start, uint32_t end)
+{
+    if (fseek(f, start, SEEK_SET) != 0)
+        return false;
+
+    uint8_t *zeros = (uint8_t *)calloc(1, ATR_CREATE_BLOCK_SIZE);
+    if (zeros == nullptr)
+        return false;
+
+    uint32_t started_ms = fnSystem.millis();
+    uint32_t pos = start;
+    while (pos < end)
     {
-        size_t out = fwrite(blank, 1, 128, f);
-        if (out != 128)
+        uint32_t count = end - pos;
+        if (count > ATR_CREATE_BLOCK_SIZE)
+            count = ATR_CREATE_BLOCK_SIZE;
+
+        if (fwrite(zeros, 1, count, f) != count)
         {
-            Debug_printf("Error writing sector %hhu\n", i);
+            Debug_printf("Error writing blank sectors at offset %u\n", pos);
+            free(zeros);
             return false;
         }
-        offset += 128;
-        numSectors--;
-    }
+        pos += count;
 
-    // Write the rest of the sectors via sparse seek to the last sector
-    offset += (numSectors * sectorSize) - sectorSize;
-    fseek(f, offset, SEEK_SET);
-    size_t out = fwrite(blank, 1, sectorSize, f);
-
-    if (out != sectorSize)
-    {
-        Debug_println("Error writing last sector");
-        return false;
+        // Blink so there's some sign of progress on long creates
+        if ((pos / ATR_CREATE_BLOCK_SIZE) % 16 == 0)
+        {
+            fnLedManager.toggle(eLed::LED_SIO);
+            Debug_printf("Blank sectors written: %u/%u bytes\n", pos, end);
+        }
     }
 
+    free(zeros);
+    fnLedManager.set(eLed::LED_SIO, false);
+    Debug_printf("Wrote %u blank bytes in %ums\n", end - start, fnSystem.millis() - started_ms);
+
     return true;
 }
@@ -6,6 +6,9 @@
 class DiskTypeATR : public DiskType
 {
 private:
+    static bool _write_zeros(FILE *f, uint32_t start, uint32_t end);
+
+protected:
     uint32_t _sector_to_offset(uint16_t sectorNum);
 
 public:
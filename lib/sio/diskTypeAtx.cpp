@@ -11,7 +11,6 @@
 #include "diskTypeAtx.h"
 
 #define ATX_MAGIC_HEADER 0x41543858 // "AT8X"
-#define ATX_DEFAULT_NUMTRACKS 40
 
 /*
   Assuming 288RPM:
@@ -22,17 +21,15 @@
   0.20833... / 26042 = 0.0000079998976013... = 8 microseconds per angular position
 
 */
+#define ANGULAR_POSITION_INVALID 65535
+
 /*
- Frequency with which to update the angular position counter.
- Counter is updated every 
- US_ANGULAR_UNIT_TIME * ANGULAR_POSITION_UPDATE_FREQ microseconds.
- ANGULAR_POSITION_UPDATE_FREQ must be at least '8' (updates every
- 8*8 = 64 microseconds) because the ESP timer fucntion won't allow
- frequencies lower than every 50 microseconds.
- "29" evenly divides 26042
+ Waits shorter than US_SLEEP_MINIMUM are done by spinning. Longer ones sleep on
+ a one-shot timer that fires US_FINAL_SPIN microseconds early, and we spin the
+ rest of the way to make up for task wake-up latency.
 */
-#define ANGULAR_POSITION_UPDATE_FREQ 29
-#define ANGULAR_POSITION_INVALID 65535
+#define US_SLEEP_MINIMUM 500
+#define US_FINAL_SPIN 150
 
 // Most of the following timing constants come from S-Drive Max sources atx.c
 // (converted from milliseconds to microseconds)
@@ -67,6 +64,20 @@ AtxTrack::AtxTrack(){
 
 };
 
+void AtxTrack::clear()
+{
+    if (data != nullptr)
+    {
+        delete[] data;
+        data = nullptr;
+    }
+    sectors.clear();
+    track_number = -1;
+    sector_count = 0;
+    record_bytes_read = 0;
+    offset_to_data_start = 0;
+}
+
 AtxSector::~AtxSector(){
 
 };
@@ -89,102 +100,83 @@ DiskTypeATX::~DiskTypeATX()
     }
 }
 
-// Constructor initializes the AtxTrack vector to assume we have 40 tracks
 DiskTypeATX::DiskTypeATX()
 {
-    _tracks.reserve(ATX_DEFAULT_NUMTRACKS);
-    int i = 0;
-    for (auto it = _tracks.begin(); i < ATX_DEFAULT_NUMTRACKS; i++)
-        _tracks.emplace(it++);
+    memset(_atx_track_offsets, 0, sizeof(_atx_track_offsets));
 
     // Disallow HSIO
     _allow_hsio = false;
 
-    // Create a timer to track our fake disk rotating
+    // Our fake disk starts spinning now
+    _atx_rotation_start = esp_timer_get_time();
+
+    // Create a (one-shot) timer to wake us up while waiting on the disk to rotate
     esp_timer_create_args_t tcfg;
     tcfg.arg = this;
     tcfg.callback = on_timer;
     tcfg.dispatch_method = esp_timer_dispatch_t::ESP_TIMER_TASK;
     tcfg.name = nullptr;
     esp_timer_create(&tcfg, &_atx_timer);
-    ESP_ERROR_CHECK(esp_timer_start_periodic(_atx_timer,
-        US_ANGULAR_UNIT_TIME * ANGULAR_POSITION_UPDATE_FREQ));
 }
 
-/*
-    Some notes on esp_timer_get_time() from:
-    https://github.com/espressif/arduino-esp32/pull/1424
-    * returns monotonic time in microseconds
-    * can be called from tasks and interrupts
-    * does not use any critical sections/mutexes
-    * is thread safe
-    * takes less than 1 microsecond to execute
-*/
+// Wakes up the task waiting in _sleep_until()
 void DiskTypeATX::on_timer(void *info)
 {
     DiskTypeATX *pAtx = (DiskTypeATX *)info;
 
-    portENTER_CRITICAL(&pAtx->__atx_timerMux);
-
-    pAtx->__atx_position_time = esp_timer_get_time();
-    pAtx->__atx_current_angular_pos += ANGULAR_POSITION_UPDATE_FREQ;
-
-    if (pAtx->__atx_current_angular_pos >= ANGULAR_UNIT_TOTAL)
-    {
-        pAtx->__atx_current_angular_pos -= ANGULAR_UNIT_TOTAL;
-        pAtx->_atx_total_rotations++;
-    }
-
-    portEXIT_CRITICAL(&pAtx->__atx_timerMux);
+    if (pAtx->_atx_waiting_task != nullptr)
+        xTaskNotifyGive(pAtx->_atx_waiting_task);
 }
 
+/*
+    The head position is derived directly from esp_timer_get_time(), which
+    returns monotonic time in microseconds, is thread safe and doesn't use any
+    critical sections. Nothing needs to run in the background to keep it updated.
+*/
 uint16_t DiskTypeATX::_get_head_position()
 {
-    uint64_t us_now = esp_timer_get_time();
+    uint64_t us_elapsed = esp_timer_get_time() - _atx_rotation_start;
+    return (us_elapsed / US_ANGULAR_UNIT_TIME) % ANGULAR_UNIT_TOTAL;
+}
 
-    portENTER_CRITICAL(&__atx_timerMux);
-    uint64_t us_then = __atx_position_time;
-    uint16_t pos = __atx_current_angular_pos;
-    portEXIT_CRITICAL(&__atx_timerMux);
+// Returns the number of microseconds until the head reaches the given angular position
+uint32_t DiskTypeATX::_us_until_head_position(uint16_t pos)
+{
+    uint16_t current = _get_head_position();
+    uint32_t units = pos >= current ? pos - current : ANGULAR_UNIT_TOTAL - current + pos;
+    return units * US_ANGULAR_UNIT_TIME;
+}
 
-    /*
-     Adjust the recorded angular position by the number of microseconds passed since
-     it was recorded.
-    */
-    uint64_t us_diff;
+/*
+  Block until esp_timer_get_time() reaches us_target without keeping the CPU busy
+  for the bulk of the wait, so other tasks on this core can run.
+*/
+void DiskTypeATX::_sleep_until(int64_t us_target)
+{
+    int64_t us_remaining = us_target - esp_timer_get_time();
 
-    // Handle the rare case of a timer roll-over
-    if (us_now > us_then)
-    {
-        us_diff = us_now - us_then;
-    }
-    else
+    if (us_remaining > US_SLEEP_MINIMUM && _atx_timer != nullptr)
     {
-        us_diff = UINT64_MAX - us_now + us_then;
-    }
+        _atx_waiting_task = xTaskGetCurrentTaskHandle();
+        // Clear any notification left over from an earlier wait
+        ulTaskNotifyTake(pdTRUE, 0);
 
-    pos += us_diff / US_ANGULAR_UNIT_TIME;
-    if (pos >= ANGULAR_UNIT_TOTAL)
-        pos -= ANGULAR_UNIT_TOTAL;
+        if (esp_timer_start_once(_atx_timer, us_remaining - US_FINAL_SPIN) == ESP_OK)
+        {
+            // Time out a little after the target just in case the timer doesn't fire
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(us_remaining / 1000) + 2);
+            esp_timer_stop(_atx_timer);
+        }
+        _atx_waiting_task = nullptr;
+    }
 
-    return pos;
+    while (esp_timer_get_time() < us_target)
+        NOP();
 }
 
 void DiskTypeATX::_wait_full_rotation()
 {
-    uint32_t pos = _get_head_position();
-
-    // Wait for a roll-over to occur
-    do
-    {
-        NOP();
-    } while (pos <= _get_head_position());
-
-    // Wait for the head to be over the previous position
-    do
-    {
-        NOP();
-    } while (pos > _get_head_position());
+    _sleep_us(ANGULAR_UNIT_TOTAL * US_ANGULAR_UNIT_TIME);
 }
 
 void DiskTypeATX::_wait_head_position(uint16_t pos, uint16_t extra_delay)
@@ -193,32 +185,24 @@ void DiskTypeATX::_wait_head_position(uint16_t pos, uint16_t extra_delay)
     if (pos >= ANGULAR_UNIT_TOTAL)
         pos -= ANGULAR_UNIT_TOTAL;
 
-    uint16_t current = _get_head_position();
-
-    // The head is ahead of the position we want - wait for a roll-over to occur
-    if (pos < current)
-    {
-        //Debug_print("$$$ DEBUG rollover wait\n");
-        do
-        {
-            NOP();
-        } while (pos < (current = _get_head_position()));
-    }
-
-    // The head is behind the position we want - wait for it to reach that position
-    if (pos > current)
-    {
-        do
-        {
-            NOP();
-        } while (pos > _get_head_position());
-    }
+    _sleep_us(_us_until_head_position(pos));
 }
 
 void DiskTypeATX::_process_sector(AtxTrack &track, AtxSector *psector, uint16_t sectorsize)
 {
+    uint16_t extra_delay = ANGULAR_UNIT_TOTAL / _atx_sectors_per_track;
+
+    /*
+     If there's enough time before the sector comes around under the head, use it to
+     load the next track so a sequential read doesn't have to wait on the image file.
+     We leave twice the time the last track load took to be safe.
+    */
+    uint16_t target = (psector->position + extra_delay) % ANGULAR_UNIT_TOTAL;
+    if (track.track_number >= 0 && _us_until_head_position(target) > _atx_track_load_us * 2)
+        _prefetch_track(track.track_number + 1);
+
     // Pause for the read head to be in the position of the sector
-    _wait_head_position(psector->position, ANGULAR_UNIT_TOTAL / _atx_sectors_per_track);
+    _wait_head_position(psector->position, extra_delay);
 
     // Copy data from the sector into the buffer if any is available
     if ((psector->status & ATX_SECTOR_STATUS_MISSING_DATA) == 0)
@@ -291,7 +275,13 @@ bool DiskTypeATX::_copy_track_sector_data(uint8_t tracknum, uint8_t sectornum, u
     // because they check the checksum value, so we won't do it either...
     // memset(_disk_sectorbuff, 0, sectorsize);
 
-    AtxTrack &track = _tracks[tracknum];
+    AtxTrack *ptrack = _get_track(tracknum);
+    if (ptrack == nullptr)
+    {
+        _disk_controller_status = DISK_CTRL_STATUS_SECTOR_MISSING;
+        return true;
+    }
+    AtxTrack &track = *ptrack;
 
     _disk_controller_status = DISK_CTRL_STATUS_CLEAR;
 
@@ -350,7 +340,7 @@ bool DiskTypeATX::_copy_track_sector_data(uint8_t tracknum, uint8_t sectornum, u
     }
 
     // Delay for the CRC calculation
-    fnSystem.delay_microseconds(_atx_drive_model == ATX_DRIVE_MODEL_810 ? US_CRC_CALCULATION_810 : US_CRC_CALCULATION_1050);
+    _sleep_us(_atx_drive_model == ATX_DRIVE_MODEL_810 ? US_CRC_CALCULATION_810 : US_CRC_CALCULATION_1050);
 
     // Return error condition if our controller status isn't clear
     return _disk_controller_status != DISK_CTRL_STATUS_CLEAR;
@@ -359,7 +349,8 @@ bool DiskTypeATX::_copy_track_sector_data(uint8_t tracknum, uint8_t sectornum, u
 // Returns TRUE if an error condition occurred
 bool DiskTypeATX::read(uint16_t sectornum, uint16_t *readcount)
 {
-    Debug_printf("ATX READ (%d) rots=%u\n", sectornum, _atx_total_rotations);
+    Debug_printf("ATX READ (%d) rots=%u\n", sectornum,
+        (uint32_t)((esp_timer_get_time() - _atx_rotation_start) / (ANGULAR_UNIT_TOTAL * US_ANGULAR_UNIT_TIME)));
 
     *readcount = 0;
 
@@ -369,9 +360,9 @@ bool DiskTypeATX::read(uint16_t sectornum, uint16_t *readcount)
     int tracknumber = (sectornum - 1) / _atx_sectors_per_track;
     int tracksector = (sectornum - 1) % _atx_sectors_per_track + 1; // sector numbers are 1-based
 
-    if (tracknumber >= _tracks.size())
+    if (tracknumber >= ATX_DEFAULT_NUMTRACKS)
     {
-        Debug_printf("calculated track number %d > track count %d\n", tracknumber, _tracks.size());
+        Debug_printf("calculated track number %d > track count %d\n", tracknumber, ATX_DEFAULT_NUMTRACKS);
         return true;
     }
     int trackdiff = tracknumber < _atx_last_track ? _atx_last_track - tracknumber : tracknumber - _atx_last_track;
@@ -381,11 +372,11 @@ bool DiskTypeATX::read(uint16_t sectornum, uint16_t *readcount)
     if (trackdiff > 0)
     {
         uint32_t us_delay = _atx_drive_model == ATX_DRIVE_MODEL_810 ? US_TRACK_STEP_810 * trackdiff + US_HEAD_SETTLE_810 : US_TRACK_STEP_1050 * trackdiff + US_HEAD_SETTLE_1050;
-        fnSystem.delay_microseconds(us_delay);
+        _sleep_us(us_delay);
     }
 
     // Add a fake drive CPU request handling delay
-    fnSystem.delay_microseconds(
+    _sleep_us(
         _atx_drive_model == ATX_DRIVE_MODEL_810 ? US_DRIVE_REQUEST_DELAY_810 : US_DRIVE_REQUEST_DELAY_1050);
 
     *readcount = sectorSize;
@@ -648,15 +639,33 @@ int DiskTypeATX::_load_atx_track_chunk(track_header_t &trk_hdr, AtxTrack &track)
     return 0;
 }
 
-bool DiskTypeATX::_load_atx_track_record(uint32_t length)
+/*
+  Decodes the track record for the given track into the AtxTrack object.
+  Tracks the image doesn't have are left with no sectors.
+  Returns FALSE on error
+*/
+bool DiskTypeATX::_load_atx_track_record(uint8_t tracknum, AtxTrack &track)
 {
     #ifdef VERBOSE_ATX
-    Debug_printf("::_load_atx_track_record len %u\n", length);
+    Debug_printf("::_load_atx_track_record #%hu\n", tracknum);
     #endif
 
-    track_header_t trk_hdr;
+    track.clear();
+    track.track_number = tracknum;
+
+    if (_atx_track_offsets[tracknum] == 0)
+        return true;
 
+    // Skip the record header we already looked at while indexing
     int i;
+    if ((i = fseek(_disk_fileh, _atx_track_offsets[tracknum] + sizeof(record_header_t), SEEK_SET)) < 0)
+    {
+        Debug_printf("failed seeking to track record (%d, %d)\n", i, errno);
+        return false;
+    }
+
+    track_header_t trk_hdr;
+
     if ((i = fread(&trk_hdr, 1, sizeof(trk_hdr), _disk_fileh)) != sizeof(trk_hdr))
     {
         Debug_printf("failed reading track header bytes (%d, %d)\n", i, errno);
@@ -669,24 +678,7 @@ bool DiskTypeATX::_load_atx_track_record(uint32_t length)
                  trk_hdr.rate, trk_hdr.flags, trk_hdr.header_size);
     #endif
 
-    // Make sure we don't have a bogus track number
-    if (trk_hdr.track_number >= ATX_DEFAULT_NUMTRACKS)
-    {
-        Debug_print("ERROR: track number > 40 - aborting\n");
-        return false;
-    }
-
-    AtxTrack &track = _tracks[trk_hdr.track_number];
-
-    // Check if we've alrady read this track
-    if (track.track_number != -1)
-    {
-        Debug_print("ERROR: duplicate track number - aborting!\n");
-        return false;
-    }
-
     // Store basic track info
-    track.track_number = trk_hdr.track_number;
     track.rate = trk_hdr.rate;
     track.flags = trk_hdr.flags;
     track.sector_count = trk_hdr.sector_count;
@@ -695,8 +687,6 @@ bool DiskTypeATX::_load_atx_track_record(uint32_t length)
     // So far we've read record_header + track_header bytes into this record
     track.record_bytes_read = sizeof(record_header_t) + sizeof(track_header_t);
 
-    _atx_num_tracks++;
-
     // If needed, skip ahead to the first track chunk given the header size value
     // (The 'header_size' value includes both the current track header and the 'parent' record header)
     uint32_t chunk_start_offset = trk_hdr.header_size - sizeof(trk_hdr) - sizeof(record_header);
@@ -725,75 +715,138 @@ bool DiskTypeATX::_load_atx_track_record(uint32_t length)
 }
 
 /*
-  Each record consists of an 8 byte header followed by the actual data
-  Since there's only one type of record we care about (RECORD), all we need is the length
-  Returns FALSE on error, otherwise TRUE
+  Returns the decoded track, loading it from the image into the least recently
+  used cache slot if it isn't already in memory. Returns nullptr on failure.
 */
-bool DiskTypeATX::_load_atx_record()
+AtxTrack *DiskTypeATX::_get_track(uint8_t tracknum)
 {
+    AtxTrack *slot = &_atx_track_cache[0];
+    for (int i = 0; i < ATX_TRACK_CACHE_SIZE; i++)
+    {
+        AtxTrack *t = &_atx_track_cache[i];
+        if (t->track_number == tracknum)
+        {
+            t->last_used = ++_atx_track_cache_counter;
+            return t;
+        }
+        if (t->last_used < slot->last_used)
+            slot = t;
+    }
+
+    uint64_t us_start = esp_timer_get_time();
+
+    if (false == _load_atx_track_record(tracknum, *slot))
+    {
+        Debug_printf("failed loading ATX track %hu\n", tracknum);
+        slot->clear();
+        slot->last_used = 0;
+        return nullptr;
+    }
+    slot->last_used = ++_atx_track_cache_counter;
+
+    _atx_track_load_us = esp_timer_get_time() - us_start;
+
     #ifdef VERBOSE_ATX
-    Debug_printf("::_load_atx_record #%u\n", ++_atx_num_records);
+    Debug_printf("loaded ATX track %hu in %uus\n", tracknum, _atx_track_load_us);
     #endif
 
-    record_header rec_hdr;
+    return slot;
+}
 
-    int i;
-    if ((i = fread(&rec_hdr, 1, sizeof(rec_hdr), _disk_fileh)) != sizeof(rec_hdr))
+// Makes sure the given track is in the cache without marking it as recently used
+void DiskTypeATX::_prefetch_track(uint8_t tracknum)
+{
+    if (tracknum >= ATX_DEFAULT_NUMTRACKS)
+        return;
+
+    for (int i = 0; i < ATX_TRACK_CACHE_SIZE; i++)
+        if (_atx_track_cache[i].track_number == tracknum)
+            return;
+
+    AtxTrack *t = _get_track(tracknum);
+    // Let anything the drive actually asked for take priority over a prefetched track
+    if (t != nullptr)
+        t->last_used = 1;
+}
+
+/*
+ Scan the records in the ATX image, noting where each track record starts.
+ Track data itself isn't read until it's needed.
+ Returns FALSE on failure
+*/
+bool DiskTypeATX::_index_atx_data(atx_header_t &atx_hdr)
+{
+    Debug_println("DiskTypeATX::_index_atx_data starting scan");
+
+    uint32_t offset = atx_hdr.start;
+
+    while (true)
     {
-        if (errno != EOF)
+        #ifdef VERBOSE_ATX
+        Debug_printf("::_index_atx_data record #%u @ %u\n", ++_atx_num_records, offset);
+        #endif
+
+        int i;
+        if ((i = fseek(_disk_fileh, offset, SEEK_SET)) < 0)
         {
-            Debug_printf("failed reading record header bytes (%d, %d)\n", i, errno);
+            Debug_printf("failed seeking to ATX record (%d, %d)\n", i, errno);
+            return false;
         }
-        else
+
+        record_header_t rec_hdr;
+        if ((i = fread(&rec_hdr, 1, sizeof(rec_hdr), _disk_fileh)) != sizeof(rec_hdr))
         {
             #ifdef VERBOSE_ATX
             Debug_print("reached EOF\n");
             #endif
+            break;
         }
-        return false;
-    }
 
-    if (rec_hdr.type != ATX_RECORDTYPE_TRACK)
-    {
-        Debug_print("record type is not TRACK - skipping\n");
-        // Skip forward to the next record
-        if ((i = fseek(_disk_fileh, rec_hdr.length - sizeof(rec_hdr), SEEK_CUR)) < 0)
+        if (rec_hdr.length < sizeof(rec_hdr))
         {
-            Debug_printf("failed seeking past this record (%d, %d)\n", i, errno);
-            return false;
+            Debug_printf("invalid record length %u - stopping\n", rec_hdr.length);
+            break;
         }
-        return true; // Return TRUE since this isn't an error
-    }
 
-    // Try to read the track into memory
-    return _load_atx_track_record(rec_hdr.length);
-}
+        if (rec_hdr.type == ATX_RECORDTYPE_TRACK)
+        {
+            track_header_t trk_hdr;
+            if ((i = fread(&trk_hdr, 1, sizeof(trk_hdr), _disk_fileh)) != sizeof(trk_hdr))
+            {
+                Debug_printf("failed reading track header bytes (%d, %d)\n", i, errno);
+                return false;
+            }
 
-/*
- Load the data records that make up the ATX image into memory
- Returns FALSE on failure
-*/
-bool DiskTypeATX::_load_atx_data(atx_header_t &atx_hdr)
-{
-    Debug_println("DiskTypeATX::_load_atx_data starting read");
+            // Make sure we don't have a bogus track number
+            if (trk_hdr.track_number >= ATX_DEFAULT_NUMTRACKS)
+            {
+                Debug_print("ERROR: track number > 40 - aborting\n");
+                return false;
+            }
 
-    // Seek to the start of the ATX record data
-    int i;
-    if ((i = fseek(_disk_fileh, atx_hdr.start, SEEK_SET)) < 0)
-    {
-        Debug_printf("failed seeking to start of ATX data (%d, %d)\n", i, errno);
-        return false;
-    }
+            if (_atx_track_offsets[trk_hdr.track_number] != 0)
+            {
+                Debug_print("ERROR: duplicate track number - aborting!\n");
+                return false;
+            }
 
-    while (_load_atx_record())
-        ;
+            _atx_track_offsets[trk_hdr.track_number] = offset;
+            _atx_num_tracks++;
+        }
+        else
+        {
+            Debug_print("record type is not TRACK - skipping\n");
+        }
+
+        offset += rec_hdr.length;
+    }
 
     if (_atx_num_tracks != ATX_DEFAULT_NUMTRACKS)
     {
         Debug_printf("WARNING: Number of tracks read = %hu\n", _atx_num_tracks);
     }
 
-    Debug_print("ATX load completed\n");
+    Debug_print("ATX index completed\n");
 
     return true;
 }
@@ -803,7 +856,8 @@ bool DiskTypeATX::_load_atx_data(atx_header_t &atx_hdr)
  Header layout details from:
  http://a8preservation.com/#/guides/atx
 
- Since timing is important, we will load the entire image into memory.
+ Only an index of track record offsets is built here. Track data is decoded
+ the first time it's accessed and kept in a small cache (see _get_track()).
  */
 disktype_t DiskTypeATX::mount(FILE *f, uint32_t disksize)
 {
@@ -860,14 +914,21 @@ disktype_t DiskTypeATX::mount(FILE *f, uint32_t disksize)
 
     _disk_fileh = f;
 
-    // Load all the actual ATX records into memory (return immediately if we fail)
-    if (_load_atx_data(hdr) == false)
+    uint64_t us_start = esp_timer_get_time();
+
+    // Find where each track lives in the image (return immediately if we fail)
+    if (_index_atx_data(hdr) == false)
     {
         _disk_fileh = nullptr;
-        _tracks.clear();
+        memset(_atx_track_offsets, 0, sizeof(_atx_track_offsets));
         return DISKTYPE_UNKNOWN;
     }
 
+    // Every boot starts on track 0, so go ahead and load it now
+    _get_track(0);
+
+    Debug_printf("ATX mount took %uus\n", (uint32_t)(esp_timer_get_time() - us_start));
+
     return _disktype = DISKTYPE_ATX;
 }
 
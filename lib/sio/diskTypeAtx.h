@@ -3,6 +3,10 @@
 
 #include <vector>
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+
 #include "diskType.h"
 
 /*
@@ -51,6 +55,10 @@
 #define ATX_FORMAT_TIMEOUT_810_1050 0xE0
 #define ATX_FORMAT_TIMEOUT_XF551 0xFE
 
+#define ATX_DEFAULT_NUMTRACKS 40
+// Number of decoded tracks kept in memory per mounted image
+#define ATX_TRACK_CACHE_SIZE 4
+
 struct atx_header
 {
     uint32_t magic;
@@ -152,6 +160,12 @@ public:
     // Actual sectors
     std::vector<AtxSector> sectors;
 
+    // Used to pick the least recently used track when replacing a cached track
+    uint32_t last_used = 0;
+
+    // Throws out all loaded data so the object can be re-used for another track
+    void clear();
+
     ~AtxTrack();
     AtxTrack();
 };
@@ -170,24 +184,31 @@ private:
 
     uint8_t _atx_drive_model = ATX_DRIVE_MODEL_810;
 
-    portMUX_TYPE __atx_timerMux = portMUX_INITIALIZER_UNLOCKED;
-
-    uint64_t __atx_position_time;
-    uint16_t __atx_current_angular_pos = 0;
-    uint32_t _atx_total_rotations = 0;
+    // Time our fake disk started spinning - the head position is derived from this
+    int64_t _atx_rotation_start = 0;
 
+    // One-shot timer used to wake us up when sleeping until a head position
     esp_timer_handle_t _atx_timer = nullptr;
+    TaskHandle_t _atx_waiting_task = nullptr;
+
+    // File offset of each track record in the image (0 if the image has no such track)
+    uint32_t _atx_track_offsets[ATX_DEFAULT_NUMTRACKS];
 
-    std::vector<AtxTrack> _tracks;
+    // Tracks are only decoded when first accessed and kept in a small LRU cache
+    AtxTrack _atx_track_cache[ATX_TRACK_CACHE_SIZE];
+    uint32_t _atx_track_cache_counter = 0;
+    // How long it took to decode the last track we loaded
+    uint32_t _atx_track_load_us = 0;
 
     // ATX header.density
     uint8_t _atx_density = ATX_DENSITY_SINGLE;
     // ATX header.end - normally the size of the entire ATX file
     uint32_t _atx_size = 0;
 
-    bool _load_atx_data(atx_header_t &atx_hdr);
-    bool _load_atx_record();
-    bool _load_atx_track_record(uint32_t length);
+    bool _index_atx_data(atx_header_t &atx_hdr);
+    bool _load_atx_track_record(uint8_t tracknum, AtxTrack &track);
+    AtxTrack *_get_track(uint8_t tracknum);
+    void _prefetch_track(uint8_t tracknum);
     int _load_atx_track_chunk(track_header_t &trk_hdr, AtxTrack &track);
 
     bool _load_atx_chunk_sector_list(chunk_header_t &chunk_hdr, AtxTrack &track);
@@ -200,6 +221,9 @@ private:
     void _process_sector(AtxTrack &track, AtxSector *sectorp, uint16_t sectorsize);
 
     uint16_t _get_head_position();
+    uint32_t _us_until_head_position(uint16_t pos);
+    void _sleep_until(int64_t us_target);
+    void _sleep_us(uint32_t us) { _sleep_until(esp_timer_get_time() + us); };
     void _wait_full_rotation();
     void _wait_head_position(uint16_t pos, uint16_t extra_delay);
 
@@ -0,0 +1,494 @@
+#include <string.h>
+
+#include "esp_heap_caps.h"
+#include "esp32/rom/miniz.h"
+
+#include "../../include/debug.h"
+#include "../utils/utils.h"
+
+#include "fnSystem.h"
+#include "fnConfig.h"
+#include "fnFsSD.h"
+
+#include "diskTypeCompressed.h"
+
+#define GZIP_MAGIC1 0x1F
+#define GZIP_MAGIC2 0x8B
+#define GZIP_METHOD_DEFLATE 0x08
+#define GZIP_FLAG_FHCRC 0x02
+#define GZIP_FLAG_FEXTRA 0x04
+#define GZIP_FLAG_FNAME 0x08
+#define GZIP_FLAG_FCOMMENT 0x10
+// Compressed bytes read at a time when inflating
+#define INFLATE_INPUT_BUFSIZE 4096
+
+#define DCM_ARCHIVE_MULTI 0xFA
+#define DCM_ARCHIVE_SINGLE 0xF9
+#define DCM_PASS_LAST 0x80
+#define DCM_BLOCK_SEQUENTIAL 0x80
+
+#define DCM_BLOCK_CHANGE_BEGIN 0x41
+#define DCM_BLOCK_DOS_SECTOR 0x42
+#define DCM_BLOCK_COMPRESSED 0x43
+#define DCM_BLOCK_CHANGE_END 0x44
+#define DCM_BLOCK_END_PASS 0x45
+#define DCM_BLOCK_SAME_AS_PREVIOUS 0x46
+#define DCM_BLOCK_UNCOMPRESSED 0x47
+
+// Each mounted image gets its own scratch file
+static unsigned int _scratch_counter = 0;
+
+/* Decoded images small enough to fit under the RAM disk limit are kept in PSRAM,
+   and anything else goes to a scratch file on SD
+*/
+FILE *DiskTypeCompressed::_open_store(uint32_t size)
+{
+    if (size <= (uint32_t)Config.get_general_ramdisk_limit() * 1024)
+    {
+        _store_ram = (uint8_t *)heap_caps_calloc(1, size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (_store_ram != nullptr)
+        {
+            FILE *f = fmemopen(_store_ram, size, "r+");
+            if (f != nullptr)
+                return f;
+            free(_store_ram);
+            _store_ram = nullptr;
+        }
+        Debug_printf("compressed disk: no room for %u bytes in RAM\n", size);
+    }
+
+    if (fnSDFAT.running() == false)
+    {
+        Debug_println("compressed disk: no SD card for scratch file");
+        return nullptr;
+    }
+
+    fnSDFAT.create_path(COMPRESSED_SCRATCH_DIRECTORY);
+
+    char path[32];
+    snprintf(path, sizeof(path), COMPRESSED_SCRATCH_DIRECTORY "/image%u.atr", _scratch_counter++);
+    _store_path = path;
+
+    FILE *f = fnSDFAT.file_open(path, "w+");
+    if (f == nullptr)
+    {
+        Debug_printf("compressed disk: failed to create \"%s\"\n", path);
+        _store_path.clear();
+    }
+    return f;
+}
+
+// Throws out the decoded image. The store's FILE must already be closed
+void DiskTypeCompressed::_close_store()
+{
+    if (_store_ram != nullptr)
+    {
+        free(_store_ram);
+        _store_ram = nullptr;
+    }
+
+    if (_store_path.length() > 0)
+    {
+        fnSDFAT.remove(_store_path.c_str());
+        _store_path.clear();
+    }
+}
+
+/* Checks the gzip header and returns the uncompressed size from the trailer,
+   or 0 if this doesn't look like a gzip file
+*/
+uint32_t DiskTypeCompressed::_gzip_size(FILE *f, uint32_t disksize)
+{
+    uint8_t buf[4];
+
+    if (disksize < 18 || fseek(f, 0, SEEK_SET) != 0 || fread(buf, 1, 3, f) != 3 ||
+        buf[0] != GZIP_MAGIC1 || buf[1] != GZIP_MAGIC2 || buf[2] != GZIP_METHOD_DEFLATE)
+    {
+        Debug_println("compressed disk: missing gzip header");
+        return 0;
+    }
+
+    // ISIZE is the last 4 bytes of the file
+    if (fseek(f, disksize - 4, SEEK_SET) != 0 || fread(buf, 1, 4, f) != 4)
+        return 0;
+
+    return buf[0] | (buf[1] << 8) | (buf[2] << 16) | (buf[3] << 24);
+}
+
+bool DiskTypeCompressed::_decode_gzip(FILE *in, uint32_t insize, FILE *out, uint32_t outsize)
+{
+    uint8_t header[10];
+    if (fseek(in, 0, SEEK_SET) != 0 || fread(header, 1, sizeof(header), in) != sizeof(header))
+        return false;
+
+    // Skip the optional header fields to get to the deflate stream
+    uint8_t flags = header[3];
+    if (flags & GZIP_FLAG_FEXTRA)
+    {
+        int lo = fgetc(in);
+        int hi = fgetc(in);
+        if (hi == EOF || fseek(in, UINT16_FROM_HILOBYTES(hi, lo), SEEK_CUR) != 0)
+            return false;
+    }
+    if (flags & GZIP_FLAG_FNAME)
+    {
+        int c;
+        while ((c = fgetc(in)) != 0 && c != EOF)
+            ;
+    }
+    if (flags & GZIP_FLAG_FCOMMENT)
+    {
+        int c;
+        while ((c = fgetc(in)) != 0 && c != EOF)
+            ;
+    }
+    if (flags & GZIP_FLAG_FHCRC)
+        fseek(in, 2, SEEK_CUR);
+
+    long start = ftell(in);
+    if (start < 0 || (uint32_t)start + 8 > insize)
+        return false;
+
+    // The deflate stream is followed by an 8-byte trailer
+    return inflate(in, insize - start - 8, out, outsize);
+}
+
+/* Inflates a raw deflate stream of insize bytes starting at the current position in "in".
+   The decompressor's output buffer doubles as its 32KB history window
+*/
+bool DiskTypeCompressed::inflate(FILE *in, uint32_t insize, FILE *out, uint32_t outsize)
+{
+    tinfl_decompressor *decomp = (tinfl_decompressor *)malloc(sizeof(tinfl_decompressor));
+    uint8_t *inbuf = (uint8_t *)malloc(INFLATE_INPUT_BUFSIZE);
+    uint8_t *dict = (uint8_t *)malloc(TINFL_LZ_DICT_SIZE);
+    if (decomp == nullptr || inbuf == nullptr || dict == nullptr)
+    {
+        Debug_println("compressed disk: failed to allocate inflate buffers");
+        free(decomp);
+        free(inbuf);
+        free(dict);
+        return false;
+    }
+    tinfl_init(decomp);
+
+    const uint8_t *in_next = inbuf;
+    size_t in_avail = 0;
+    bool in_eof = false;
+    size_t dict_ofs = 0;
+    uint32_t total = 0;
+    tinfl_status status;
+
+    for (;;)
+    {
+        if (in_avail == 0 && in_eof == false)
+        {
+            in_avail = fread(inbuf, 1, insize < INFLATE_INPUT_BUFSIZE ? insize : INFLATE_INPUT_BUFSIZE, in);
+            in_next = inbuf;
+            insize -= in_avail;
+            in_eof = insize == 0 || in_avail == 0;
+        }
+
+        size_t in_bytes = in_avail;
+        size_t out_bytes = TINFL_LZ_DICT_SIZE - dict_ofs;
+        status = tinfl_decompress(decomp, in_next, &in_bytes, dict, dict + dict_ofs, &out_bytes,
+                                  in_eof ? 0 : TINFL_FLAG_HAS_MORE_INPUT);
+        in_next += in_bytes;
+        in_avail -= in_bytes;
+
+        if (out_bytes > 0)
+        {
+            if (total + out_bytes > outsize || fwrite(dict + dict_ofs, 1, out_bytes, out) != out_bytes)
+            {
+                status = TINFL_STATUS_FAILED;
+                break;
+            }
+            total += out_bytes;
+            dict_ofs = (dict_ofs + out_bytes) & (TINFL_LZ_DICT_SIZE - 1);
+        }
+
+        if (status <= TINFL_STATUS_DONE)
+            break;
+        // Ran out of file before the end of the stream
+        if (status == TINFL_STATUS_NEEDS_MORE_INPUT && in_eof && in_avail == 0)
+        {
+            status = TINFL_STATUS_FAILED;
+            break;
+        }
+    }
+
+    free(decomp);
+    free(inbuf);
+    free(dict);
+
+    if (status != TINFL_STATUS_DONE || total != outsize)
+    {
+        Debug_printf("compressed disk: inflate failed (%d) after %u of %u bytes\n", status, total, outsize);
+        return false;
+    }
+
+    return true;
+}
+
+/* Works out the disk geometry from the density in the first pass header:
+   00 = 720 single density, 01 = 720 double density, 10 = 1040 enhanced density
+*/
+bool DiskTypeCompressed::_dcm_geometry(FILE *f, uint16_t *sectorsize, uint16_t *numsectors)
+{
+    uint8_t header[2];
+    if (fseek(f, 0, SEEK_SET) != 0 || fread(header, 1, sizeof(header), f) != sizeof(header) ||
+        (header[0] != DCM_ARCHIVE_MULTI && header[0] != DCM_ARCHIVE_SINGLE))
+    {
+        Debug_println("compressed disk: missing DCM header");
+        return false;
+    }
+
+    switch ((header[1] >> 5) & 0x03)
+    {
+    case 0:
+        *sectorsize = DISK_BYTES_PER_SECTOR_SINGLE;
+        *numsectors = 720;
+        return true;
+    case 1:
+        *sectorsize = DISK_BYTES_PER_SECTOR_DOUBLE;
+        *numsectors = 720;
+        return true;
+    case 2:
+        *sectorsize = DISK_BYTES_PER_SECTOR_SINGLE;
+        *numsectors = 1040;
+        return true;
+    default:
+        Debug_printf("compressed disk: unknown DCM density in 0x%02x\n", header[1]);
+        return false;
+    }
+}
+
+/* Decodes one sector block into buf. Most block types only change part of the
+   previous sector, so buf has to hold on to whatever was decoded last
+*/
+bool DiskTypeCompressed::_decode_dcm_block(FILE *in, uint8_t blocktype, uint8_t *buf, uint16_t size)
+{
+    int offset;
+    int end;
+    int c;
+
+    switch (blocktype)
+    {
+    case DCM_BLOCK_CHANGE_BEGIN:
+        // Bytes from offset down to the start of the sector, stored in reverse
+        offset = fgetc(in);
+        if (offset == EOF || offset >= size)
+            return false;
+        for (; offset >= 0; offset--)
+            buf[offset] = fgetc(in);
+        break;
+
+    case DCM_BLOCK_DOS_SECTOR:
+        // A DOS 2 sector that's all one byte except for the link bytes at the end
+        if (fread(buf + 123, 1, 5, in) != 5)
+            return false;
+        memset(buf, buf[123], 123);
+        break;
+
+    case DCM_BLOCK_COMPRESSED:
+        // Alternating runs of literal bytes and a repeated byte, each given by its end offset
+        offset = 0;
+        while (offset < size)
+        {
+            end = fgetc(in);
+            if (end == EOF)
+                return false;
+            if (end == 0 && offset > 0)
+                end = 256;
+            for (; offset < end && offset < size; offset++)
+                buf[offset] = fgetc(in);
+            if (offset >= size)
+                break;
+
+            end = fgetc(in);
+            c = fgetc(in);
+            if (c == EOF)
+                return false;
+            if (end == 0)
+                end = 256;
+            for (; offset < end && offset < size; offset++)
+                buf[offset] = c;
+        }
+        break;
+
+    case DCM_BLOCK_CHANGE_END:
+        // Bytes from offset to the end of the sector
+        offset = fgetc(in);
+        if (offset == EOF || offset >= size)
+            return false;
+        for (; offset < size; offset++)
+            buf[offset] = fgetc(in);
+        break;
+
+    case DCM_BLOCK_SAME_AS_PREVIOUS:
+        break;
+
+    case DCM_BLOCK_UNCOMPRESSED:
+        if (fread(buf, 1, size, in) != size)
+            return false;
+        break;
+
+    default:
+        Debug_printf("compressed disk: unknown DCM block type 0x%02x\n", blocktype);
+        return false;
+    }
+
+    return feof(in) == 0 && ferror(in) == 0;
+}
+
+/* A DCM file is one or more passes, each starting with a header giving the first sector.
+   Each sector block is followed by the number of the next sector unless it's marked sequential
+*/
+bool DiskTypeCompressed::_decode_dcm(FILE *in, FILE *out)
+{
+    uint8_t buf[DISK_SECTORBUF_SIZE] = {0};
+
+    if (fseek(in, 0, SEEK_SET) != 0)
+        return false;
+
+    bool last_pass = false;
+    while (last_pass == false)
+    {
+        uint8_t header[4];
+        if (fread(header, 1, sizeof(header), in) != sizeof(header) ||
+            (header[0] != DCM_ARCHIVE_MULTI && header[0] != DCM_ARCHIVE_SINGLE))
+        {
+            Debug_println("compressed disk: bad DCM pass header");
+            return false;
+        }
+        last_pass = (header[1] & DCM_PASS_LAST) != 0;
+        uint16_t sectornum = UINT16_FROM_HILOBYTES(header[3], header[2]);
+
+        for (;;)
+        {
+            int blocktype = fgetc(in);
+            if (blocktype == EOF)
+                return false;
+            if ((blocktype & ~DCM_BLOCK_SEQUENTIAL) == DCM_BLOCK_END_PASS)
+                break;
+
+            if (sectornum == 0 || sectornum > _disk_num_sectors)
+            {
+                Debug_printf("compressed disk: DCM sector %hu out of range\n", sectornum);
+                return false;
+            }
+
+            uint16_t size = sector_size(sectornum);
+            if (_decode_dcm_block(in, blocktype & ~DCM_BLOCK_SEQUENTIAL, buf, size) == false ||
+                fseek(out, _sector_to_offset(sectornum), SEEK_SET) != 0 || fwrite(buf, 1, size, out) != size)
+            {
+                Debug_printf("compressed disk: failed decoding DCM sector %hu\n", sectornum);
+                return false;
+            }
+
+            if (blocktype & DCM_BLOCK_SEQUENTIAL)
+            {
+                sectornum++;
+            }
+            else
+            {
+                int lo = fgetc(in);
+                int hi = fgetc(in);
+                if (hi == EOF)
+                    return false;
+                sectornum = UINT16_FROM_HILOBYTES(hi, lo);
+            }
+        }
+    }
+
+    return true;
+}
+
+disktype_t DiskTypeCompressed::mount(FILE *f, uint32_t disksize)
+{
+    Debug_print("COMPRESSED MOUNT\n");
+
+    _disktype = DISKTYPE_UNKNOWN;
+
+    uint16_t sectorsize = DISK_BYTES_PER_SECTOR_SINGLE;
+    uint16_t numsectors = 0;
+    uint32_t storesize;
+
+    if (_compressed_type == DISKTYPE_DCM)
+    {
+        if (_dcm_geometry(f, &sectorsize, &numsectors) == false)
+            return _disktype;
+        // ATR header plus the first 3 sectors, which are always 128 bytes
+        storesize = 16 + 3 * DISK_BYTES_PER_SECTOR_SINGLE + (numsectors - 3) * sectorsize;
+    }
+    else
+    {
+        storesize = _gzip_size(f, disksize);
+        if (storesize == 0)
+            return _disktype;
+    }
+
+    FILE *store = _open_store(storesize);
+    if (store == nullptr)
+        return _disktype;
+
+    unsigned long ms_start = fnSystem.millis();
+
+    bool ok;
+    if (_compressed_type == DISKTYPE_DCM)
+    {
+        _disk_sector_size = sectorsize;
+        _disk_num_sectors = numsectors;
+        ok = DiskTypeATR::create(store, sectorsize, numsectors) && _decode_dcm(f, store);
+    }
+    else
+    {
+        ok = _decode_gzip(f, disksize, store, storesize);
+    }
+    fflush(store);
+
+    if (ok == false || DiskTypeATR::mount(store, storesize) != DISKTYPE_ATR)
+    {
+        fclose(store);
+        _disk_fileh = nullptr;
+        _close_store();
+        return _disktype;
+    }
+
+    Debug_printf("decoded %u-byte image to %u bytes in %s in %lu ms\n", disksize, storesize,
+                 _store_ram != nullptr ? "RAM" : "scratch file", fnSystem.millis() - ms_start);
+
+    _compressed_fileh = f;
+    _disktype = _compressed_type;
+    return _disktype;
+}
+
+// We can't put changes back into the compressed image
+bool DiskTypeCompressed::write(uint16_t sectornum, bool verify)
+{
+    Debug_print("COMPRESSED WRITE NOT SUPPORTED\n");
+    return true;
+}
+
+bool DiskTypeCompressed::format(uint16_t *responsesize)
+{
+    Debug_print("COMPRESSED FORMAT NOT SUPPORTED\n");
+    return true;
+}
+
+void DiskTypeCompressed::unmount()
+{
+    // Closes the store
+    DiskType::unmount();
+    _close_store();
+
+    if (_compressed_fileh != nullptr)
+    {
+        fclose(_compressed_fileh);
+        _compressed_fileh = nullptr;
+    }
+}
+
+DiskTypeCompressed::~DiskTypeCompressed()
+{
+    unmount();
+}
@@ -0,0 +1,56 @@
+#ifndef _DISKTYPE_COMPRESSED_
+#define _DISKTYPE_COMPRESSED_
+
+#include <string>
+
+#include "diskTypeAtr.h"
+
+/*
+ DCM (DiskComm) and gzipped ATR images
+
+ Neither format can be read at a random sector without decoding everything
+ before it, so the whole image is decoded once when mounted into a plain ATR
+ "store" and sectors are then read from that as usual. The store is kept in
+ PSRAM if it's under the RAM disk limit, otherwise it's a scratch file on SD.
+
+ Writes aren't supported since we can't recompress the original, but an
+ overlay can be attached to capture them.
+*/
+#define COMPRESSED_SCRATCH_DIRECTORY "/scratch"
+
+class DiskTypeCompressed : public DiskTypeATR
+{
+private:
+    // DISKTYPE_DCM or DISKTYPE_ATR_GZ
+    disktype_t _compressed_type;
+    // The image we were mounted with - _disk_fileh is the decoded store
+    FILE *_compressed_fileh = nullptr;
+
+    uint8_t *_store_ram = nullptr;
+    std::string _store_path;
+
+    FILE *_open_store(uint32_t size);
+    void _close_store();
+
+    static uint32_t _gzip_size(FILE *f, uint32_t disksize);
+    static bool _decode_gzip(FILE *in, uint32_t insize, FILE *out, uint32_t outsize);
+
+    static bool _dcm_geometry(FILE *f, uint16_t *sectorsize, uint16_t *numsectors);
+    static bool _decode_dcm_block(FILE *in, uint8_t blocktype, uint8_t *buf, uint16_t size);
+    bool _decode_dcm(FILE *in, FILE *out);
+
+public:
+    // Inflates a raw deflate stream of insize bytes from the current position of in
+    static bool inflate(FILE *in, uint32_t insize, FILE *out, uint32_t outsize);
+
+    virtual bool write(uint16_t sectornum, bool verify) override;
+    virtual bool format(uint16_t *responsesize) override;
+
+    virtual disktype_t mount(FILE *f, uint32_t disksize) override;
+    virtual void unmount() override;
+
+    DiskTypeCompressed(disktype_t compressed_type) : _compressed_type(compressed_type) {};
+    ~DiskTypeCompressed();
+};
+
+#endif // _DISKTYPE_COMPRESSED_
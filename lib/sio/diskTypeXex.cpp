@@ -1,6 +1,8 @@
 #include <memory.h>
 #include <string.h>
 
+#include "esp_heap_caps.h"
+
 #include "../../include/debug.h"
 #include "../utils/utils.h"
 
@@ -73,6 +75,109 @@ void DiskTypeXEX::_fake_directory_entry()
     _disk_sectorbuff[15] = 0x20;
 }
 
+/* Walks the segment headers so reads can be grouped by segment. Each segment is an optional
+   $FFFF marker, start and end addresses, then the data. We stop at anything that doesn't look
+   right, and the rest of the file is read in plain XEX_READAHEAD_SIZE pieces.
+*/
+void DiskTypeXEX::_map_segments()
+{
+    _xex_segments.clear();
+
+    uint32_t pos = 0;
+    uint8_t header[6];
+    while (pos < _disk_image_size && _xex_segments.size() < XEX_MAX_SEGMENTS)
+    {
+        if (fseek(_disk_fileh, pos, SEEK_SET) != 0)
+            break;
+        size_t count = fread(header, 1, sizeof(header), _disk_fileh);
+
+        int skip = (count >= 2 && header[0] == 0xFF && header[1] == 0xFF) ? 2 : 0;
+        if (count < skip + 4)
+            break;
+
+        uint16_t start = UINT16_FROM_HILOBYTES(header[skip + 1], header[skip]);
+        uint16_t end = UINT16_FROM_HILOBYTES(header[skip + 3], header[skip + 2]);
+        if (end < start)
+            break;
+
+        xex_segment seg;
+        seg.offset = pos;
+        seg.length = skip + 4 + (end - start + 1);
+        seg.start_address = start;
+        _xex_segments.push_back(seg);
+
+        pos += seg.length;
+    }
+
+    fseek(_disk_fileh, 0, SEEK_SET);
+    _disk_last_sector = INVALID_SECTOR_VALUE;
+
+    Debug_printf("mapped %u XEX segments covering %u bytes\n", _xex_segments.size(), pos > _disk_image_size ? _disk_image_size : pos);
+}
+
+/* How much to read from the host to cover length bytes at offset. We read up to XEX_READAHEAD_SIZE
+   bytes but end on a segment boundary if there's one in there, so a segment that fits is never
+   split across two reads and the next read starts where the loader picks up after running any
+   INIT segment.
+*/
+uint32_t DiskTypeXEX::_readahead_span(uint32_t offset, uint32_t length)
+{
+    uint32_t span = XEX_READAHEAD_SIZE;
+
+    // Last segment that ends inside the window
+    uint32_t boundary = 0;
+    for (auto &seg : _xex_segments)
+    {
+        uint32_t seg_end = seg.offset + seg.length;
+        if (seg_end > offset + span)
+            break;
+        boundary = seg_end;
+    }
+
+    if (boundary >= offset + length)
+        span = boundary - offset;
+
+    if (span > _disk_image_size - offset)
+        span = _disk_image_size - offset;
+
+    return span;
+}
+
+int DiskTypeXEX::_read_file(uint32_t offset, uint8_t *buf, uint32_t length)
+{
+    if (offset >= _disk_image_size)
+        return 0;
+    if (length > _disk_image_size - offset)
+        length = _disk_image_size - offset;
+
+    // No buffer, so read what we were asked for
+    if (_xex_readahead == nullptr)
+    {
+        if (fseek(_disk_fileh, offset, SEEK_SET) != 0)
+            return -1;
+        return fread(buf, 1, length, _disk_fileh);
+    }
+
+    if (offset < _xex_readahead_offset || offset + length > _xex_readahead_offset + _xex_readahead_length)
+    {
+        uint32_t span = _readahead_span(offset, length);
+        Debug_printf("XEX read-ahead %u bytes at %u\n", span, offset);
+
+        _xex_readahead_offset = offset;
+        _xex_readahead_length = 0;
+        if (fseek(_disk_fileh, offset, SEEK_SET) != 0)
+            return -1;
+        _xex_readahead_length = fread(_xex_readahead, 1, span, _disk_fileh);
+    }
+
+    uint32_t available = _xex_readahead_offset + _xex_readahead_length - offset;
+    if (length > available)
+        length = available;
+
+    memcpy(buf, _xex_readahead + (offset - _xex_readahead_offset), length);
+    return length;
+}
+
 // Returns TRUE if an error condition occurred
 bool DiskTypeXEX::read(uint16_t sectornum, uint16_t *readcount)
 {
@@ -119,45 +224,41 @@ bool DiskTypeXEX::read(uint16_t sectornum, uint16_t *readcount)
         return false;
     }
 
+    // Nothing lives between the bootloader and the directory
+    if (sectornum < FIRST_XEX_SECTOR)
+    {
+        Debug_printf("no XEX sector %d\n", sectornum);
+        return true;
+    }
+
     int data_bytes = _disk_sector_size - SECTOR_LINK_SIZE;
     // This is the number of bytes into the XEX file we should be reading
-    int xex_offset = data_bytes * (sectornum - FIRST_XEX_SECTOR);
+    uint32_t xex_offset = data_bytes * (sectornum - FIRST_XEX_SECTOR);
 
-    // Perform a seek if we're not reading the sector after the last one we read
-    if (sectornum != _disk_last_sector + 1)
-    {
-        Debug_printf("seeking to offset %d in XEX\n", xex_offset);
-        err = fseek(_disk_fileh, xex_offset, SEEK_SET) != 0;
-    }
+    Debug_printf("requesting %d bytes from XEX\n", data_bytes);
+    int read;
+    if (_ram_has(xex_offset, data_bytes))
+        read = _ram_read(xex_offset, _disk_sectorbuff, data_bytes);
+    else
+        read = _read_file(xex_offset, _disk_sectorbuff, data_bytes);
+    Debug_printf("received %d bytes\n", read);
 
-    if (err == false)
+    // Fill in the sector link data pointing to the next sector
+    if(read >= 0)
     {
-        Debug_printf("requesting %d bytes from XEX\n", data_bytes);
-        int read = fread(_disk_sectorbuff, 1, data_bytes, _disk_fileh);
-        Debug_printf("received %d bytes\n", read);
+        // Provide number of bytes read
+        _disk_sectorbuff[_disk_sector_size - 1] = read;
 
-        // Fill in the sector link data pointing to the next sector
-        if(read >= 0)
+        // Only provide a next sector pointer if we read a full sector of data
+        if(read == data_bytes)
         {
-            // Provide number of bytes read
-            _disk_sectorbuff[_disk_sector_size - 1] = read;
-
-            // Only provide a next sector pointer if we read a full sector of data
-            if(read == data_bytes)
-            {
-                uint16_t next_sector = sectornum + 1;
-                _disk_sectorbuff[_disk_sector_size - 2] = LOBYTE_FROM_UINT16(next_sector);
-                _disk_sectorbuff[_disk_sector_size - 3] = HIBYTE_FROM_UINT16(next_sector);
-            }
+            uint16_t next_sector = sectornum + 1;
+            _disk_sectorbuff[_disk_sector_size - 2] = LOBYTE_FROM_UINT16(next_sector);
+            _disk_sectorbuff[_disk_sector_size - 3] = HIBYTE_FROM_UINT16(next_sector);
         }
-        else
-            err = true;
     }
-
-    if (err == false)
-        _disk_last_sector = sectornum;
     else
-        _disk_last_sector = INVALID_SECTOR_VALUE;
+        err = true;
 
     return err;
 }
@@ -171,6 +272,12 @@ void DiskTypeXEX::unmount()
 {
     if (_xex_bootloader != nullptr)
         free(_xex_bootloader);
+    _xex_bootloader = nullptr;
+
+    free(_xex_readahead);
+    _xex_readahead = nullptr;
+    _xex_readahead_length = 0;
+    _xex_segments.clear();
 
     // Call the parent unmount
     this->DiskType::unmount();
@@ -201,6 +308,11 @@ disktype_t DiskTypeXEX::mount(FILE *f, uint32_t disksize)
     _disk_last_sector = INVALID_SECTOR_VALUE;
     _disktype = DISKTYPE_XEX;
 
+    _map_segments();
+    // Without this we read one sector at a time, which still works
+    _xex_readahead = (uint8_t *)heap_caps_malloc(XEX_READAHEAD_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    _xex_readahead_length = 0;
+
     Debug_printf("mounted XEX with %d-byte bootloader; XEX size=%d\n", _xex_bootloadersize, _disk_image_size);
 
     return _disktype;
@@ -1,15 +1,41 @@
 #ifndef _DISKTYPE_XEX_
 #define _DISKTYPE_XEX_
 
+#include <vector>
+
 #include "diskType.h"
 
+// Most bytes read from the host at once when filling the read-ahead buffer
+#define XEX_READAHEAD_SIZE 8192
+// Files with more segments than this only have the first ones mapped
+#define XEX_MAX_SEGMENTS 512
+
+// A segment's header and data in the XEX file
+struct xex_segment
+{
+    uint32_t offset;
+    uint32_t length;
+    uint16_t start_address;
+};
+
 class DiskTypeXEX : public DiskType
 {
 private:
     uint8_t *_xex_bootloader = nullptr;
     int _xex_bootloadersize = 0;
 
+    // Built once at mount so read-ahead can stop at segment boundaries
+    std::vector<xex_segment> _xex_segments;
+
+    uint8_t *_xex_readahead = nullptr;
+    uint32_t _xex_readahead_offset = 0;
+    uint32_t _xex_readahead_length = 0;
+
     void _fake_directory_entry();
+    void _map_segments();
+    uint32_t _readahead_span(uint32_t offset, uint32_t length);
+    // Returns the number of bytes copied (short at the end of the file) or -1 on error
+    int _read_file(uint32_t offset, uint8_t *buf, uint32_t length);
 
 public:
     virtual bool read(uint16_t sectornum, uint16_t *readcount) override;
@@ -9,6 +9,7 @@
 #include "../utils/utils.h"
 #include "../FileSystem/fnFsSPIF.h"
 #include "../config/fnConfig.h"
+#include "fujiImageCache.h"
 
 #define SIO_FUJICMD_RESET 0xFF
 #define SIO_FUJICMD_GET_SSID 0xFE
@@ -305,9 +306,9 @@ void sioFuji::sio_disk_image_mount()
     Debug_println("Fuji cmd: MOUNT IMAGE");
 
     uint8_t deviceSlot = cmdFrame.aux1;
-    uint8_t options = cmdFrame.aux2; // DISK_ACCESS_MODE
+    uint8_t options = cmdFrame.aux2 & ~DISK_ACCESS_MODE_FETCH; // DISK_ACCESS_MODE
+    bool fetch = (cmdFrame.aux2 & DISK_ACCESS_MODE_FETCH) != 0;
 
-    // TODO: Implement FETCH?
     char flag[3] = {'r', 0, 0};
     if (options == DISK_ACCESS_MODE_WRITE)
         flag[1] = '+';
@@ -326,7 +327,7 @@ void sioFuji::sio_disk_image_mount()
     Debug_printf("Selecting '%s' from host #%u as %s on D%u:\n",
                  disk.filename, disk.host_slot, flag, deviceSlot + 1);
 
-    disk.fileh = host.file_open(disk.filename, disk.filename, sizeof(disk.filename), flag);
+    disk.fileh = host.image_open(disk.filename, disk.filename, sizeof(disk.filename), flag);
 
     if (disk.fileh == nullptr)
     {
@@ -344,9 +345,172 @@ void sioFuji::sio_disk_image_mount()
     // And now mount it
     disk.disk_type = disk.disk_dev.mount(disk.fileh, disk.filename, disk.disk_size);
 
+    // FETCH asks for the whole image to be pulled into RAM, as does the slot's config
+    if (fetch || Config.get_mount_ramdisk(deviceSlot))
+        disk.disk_dev.load_ram(disk.disk_size, Config.get_general_ramdisk_limit() * 1024, options != DISK_ACCESS_MODE_WRITE);
+
+    // Send writes to an overlay on SD if this slot has one enabled and the image is read-only
+    if (options != DISK_ACCESS_MODE_WRITE && Config.get_mount_overlay(deviceSlot))
+        disk.disk_dev.attach_overlay(host.get_hostname(), disk.filename, disk.fileh, disk.disk_size);
+
+    // This may have added to the set of disks image_rotate() cycles through
+    _prefetch_rotation();
+
     sio_complete();
 }
 
+void sioFuji::set_overlay_enabled(uint8_t deviceSlot, bool enabled)
+{
+    if (deviceSlot >= MAX_DISK_DEVICES)
+        return;
+
+    Config.store_mount_overlay(deviceSlot, enabled);
+    Config.save();
+
+    portENTER_CRITICAL(&_overlay_pending_lock);
+    if (enabled)
+        _overlay_attach_pending |= 1 << deviceSlot;
+    else
+        _overlay_attach_pending &= ~(1 << deviceSlot);
+    portEXIT_CRITICAL(&_overlay_pending_lock);
+
+    // Detaching only touches SD, so it can happen right away
+    if (enabled == false)
+        _fnDisks[deviceSlot].disk_dev.detach_overlay();
+}
+
+// Called from the SIO task only
+void sioFuji::_attach_overlay(uint8_t deviceSlot)
+{
+    fujiDisk &disk = _fnDisks[deviceSlot];
+    if (disk.fileh != nullptr && disk.access_mode != DISK_ACCESS_MODE_WRITE && disk.host_slot < MAX_HOSTS)
+        disk.disk_dev.attach_overlay(_fnHosts[disk.host_slot].get_hostname(), disk.filename, disk.fileh, disk.disk_size);
+}
+
+void sioFuji::set_ramdisk_enabled(uint8_t deviceSlot, bool enabled)
+{
+    if (deviceSlot >= MAX_DISK_DEVICES)
+        return;
+
+    Config.store_mount_ramdisk(deviceSlot, enabled);
+    Config.save();
+    // Takes effect the next time an image is mounted in this slot
+}
+
+bool sioFuji::ramdisk_loaded(uint8_t deviceSlot)
+{
+    if (deviceSlot >= MAX_DISK_DEVICES)
+        return false;
+    return _fnDisks[deviceSlot].disk_dev.ram_loaded();
+}
+
+// Only one disk is prefetched at a time, so a single chunk is read per pass
+void sioFuji::prefetch_idle_disks()
+{
+    for (int i = 0; i < MAX_DISK_DEVICES; i++)
+        if (_fnDisks[i].disk_dev.prefetch_idle())
+            return;
+}
+
+// Directory listings are read one batch per pass, like prefetching
+void sioFuji::fill_idle_directories()
+{
+    for (int i = 0; i < MAX_HOSTS; i++)
+        if (_fnHosts[i].dir_fill_idle())
+            return;
+}
+
+// Gives each disk a chance to write back changes to images loaded into RAM
+void sioFuji::flush_idle_disks()
+{
+    for (int i = 0; i < MAX_DISK_DEVICES; i++)
+        _fnDisks[i].disk_dev.flush_idle();
+}
+
+void sioFuji::discard_overlay(uint8_t deviceSlot)
+{
+    if (deviceSlot < MAX_DISK_DEVICES)
+        _fnDisks[deviceSlot].disk_dev.discard_overlay();
+}
+
+void sioFuji::merge_overlay(uint8_t deviceSlot)
+{
+    if (deviceSlot >= MAX_DISK_DEVICES)
+        return;
+
+    portENTER_CRITICAL(&_overlay_pending_lock);
+    _overlay_merge_pending |= 1 << deviceSlot;
+    portEXIT_CRITICAL(&_overlay_pending_lock);
+}
+
+void sioFuji::run_pending_overlays()
+{
+    portENTER_CRITICAL(&_overlay_pending_lock);
+    uint8_t attach = _overlay_attach_pending;
+    uint8_t merge = _overlay_merge_pending;
+    _overlay_attach_pending = 0;
+    _overlay_merge_pending = 0;
+    portEXIT_CRITICAL(&_overlay_pending_lock);
+
+    for (int i = 0; i < MAX_DISK_DEVICES; i++)
+    {
+        if (attach & (1 << i))
+            _attach_overlay(i);
+        if (merge & (1 << i))
+            _merge_overlay(i);
+    }
+}
+
+/* Writes the overlay's sectors back into the original image on its host.
+   Only works for ATR images on hosts that allow writing. Called from the SIO task only
+*/
+bool sioFuji::_merge_overlay(uint8_t deviceSlot)
+{
+    if (deviceSlot >= MAX_DISK_DEVICES)
+        return false;
+
+    fujiDisk &disk = _fnDisks[deviceSlot];
+    if (disk.fileh == nullptr || disk.host_slot >= MAX_HOSTS || disk.disk_dev.overlay_count() <= 0)
+        return false;
+
+    fujiHost &host = _fnHosts[disk.host_slot];
+
+    char fullpath[MAX_FILENAME_LEN];
+    FILE *f = host.file_open(disk.filename, fullpath, sizeof(fullpath), "r+");
+    if (f == nullptr)
+    {
+        Debug_printf("Couldn't open \"%s\" for writing to merge overlay\n", disk.filename);
+        return false;
+    }
+
+    return disk.disk_dev.merge_overlay(f, host.file_size(f));
+}
+
+bool sioFuji::file_mounted(FILE *f)
+{
+    if (f == nullptr)
+        return false;
+
+    for (int i = 0; i < MAX_DISK_DEVICES; i++)
+        if (_fnDisks[i].fileh == f)
+            return true;
+    return false;
+}
+
+bool sioFuji::overlay_mergeable(uint8_t deviceSlot)
+{
+    if (deviceSlot >= MAX_DISK_DEVICES)
+        return false;
+    return _fnDisks[deviceSlot].disk_dev.disktype() == DISKTYPE_ATR;
+}
+
+int sioFuji::overlay_count(uint8_t deviceSlot)
+{
+    if (deviceSlot >= MAX_DISK_DEVICES)
+        return -1;
+    return _fnDisks[deviceSlot].disk_dev.overlay_count();
+}
+
 // Toggle boot config on/off, aux1=0 is disabled, aux1=1 is enabled
 void sioFuji::sio_set_boot_config()
 {
@@ -584,6 +748,9 @@ void sioFuji::sio_disk_image_umount()
             _cassetteDev.sio_disable_cassette();
         }
         _fnDisks[deviceSlot].reset();
+
+        // Copies that were kept because this disk was using them can go now
+        fnImageCache.trim();
     }
     // Handle tape
     // else if (deviceSlot == BASE_TAPE_SLOT)
@@ -616,6 +783,7 @@ void sioFuji::image_rotate()
     if (count > 1)
     {
         count--;
+        _rotation_used = true;
 
         // Save the device ID of the disk in the last slot
         int last_id = _fnDisks[count].disk_dev.id();
@@ -642,6 +810,51 @@ void sioFuji::image_rotate()
                 }
             }
         }
+
+        _prefetch_rotation();
+    }
+}
+
+/* image_rotate() cycles device IDs through the slots up to the first empty one, so the slot
+   after the one that's D1: now is D1: after the next rotation. Multi-disk games ask for that
+   disk next, so we start reading it into RAM in the background to avoid a stall after the swap.
+   Partial prefetches of the other disks are dropped to give back the memory. Nothing is
+   prefetched until the disks have actually been rotated, since several disks mounted in a row
+   are usually just separate drives.
+*/
+void sioFuji::_prefetch_rotation()
+{
+    int count = 0;
+    while (count < MAX_DISK_DEVICES && _fnDisks[count].fileh != nullptr)
+        count++;
+
+    // Fewer than two disks means the rotation set is gone
+    if (count < 2)
+        _rotation_used = false;
+
+    if (count < 2 || _rotation_used == false)
+        return;
+
+    int current = -1;
+    for (int i = 0; i < count; i++)
+        if (_fnDisks[i].disk_dev.id() == SIO_DEVICEID_DISK)
+            current = i;
+
+    if (current < 0)
+        return;
+
+    int next = (current + 1) % count;
+    for (int i = 0; i < count; i++)
+    {
+        fujiDisk &disk = _fnDisks[i];
+        if (i == next)
+        {
+            Debug_printf("Prefetching slot %d for next rotation\n", i + 1);
+            disk.disk_dev.prefetch_ram(disk.disk_size, Config.get_general_ramdisk_limit() * 1024,
+                                       disk.access_mode != DISK_ACCESS_MODE_WRITE);
+        }
+        else if (i != current)
+            disk.disk_dev.cancel_prefetch();
     }
 }
 
@@ -705,7 +918,7 @@ void sioFuji::sio_open_directory()
         sio_error();
 }
 
-void _set_additional_direntry_details(fsdir_entry_t *f, uint8_t *dest, uint8_t maxlen)
+void _set_additional_direntry_details(fsdir_entry_t *f, uint8_t *dest, uint8_t maxlen, uint8_t disktype)
 {
     // File modified date-time
     struct tm *modtime = localtime(&f->modified_time);
@@ -737,7 +950,7 @@ void _set_additional_direntry_details(fsdir_entry_t *f, uint8_t *dest, uint8_t m
         dest[8] |= FF_TRUNC;
 
     // File type
-    dest[9] = DiskType::discover_disktype(f->filename);
+    dest[9] = disktype;
 }
 
 void sioFuji::sio_read_directory_entry()
@@ -755,7 +968,8 @@ void sioFuji::sio_read_directory_entry()
 
     char current_entry[256];
 
-    fsdir_entry_t *f = _fnHosts[_current_open_directory_slot].dir_nextfile();
+    uint8_t disktype;
+    fsdir_entry_t *f = _fnHosts[_current_open_directory_slot].dir_nextfile(&disktype);
 
     if (f == nullptr)
     {
@@ -774,7 +988,7 @@ void sioFuji::sio_read_directory_entry()
         // If 0x80 is set on AUX2, send back additional information
         if (cmdFrame.aux2 & 0x80)
         {
-            _set_additional_direntry_details(f, (uint8_t *)current_entry, maxlen);
+            _set_additional_direntry_details(f, (uint8_t *)current_entry, maxlen, disktype);
             // Adjust remaining size of buffer and file path destination
             bufsize = sizeof(current_entry) - ADDITIONAL_DETAILS_BYTES;
             filenamedest = current_entry + ADDITIONAL_DETAILS_BYTES;
@@ -1130,7 +1344,10 @@ void sioFuji::_populate_slots_from_config()
         if (Config.get_host_type(i) == fnConfig::host_types::HOSTTYPE_INVALID)
             _fnHosts[i].set_hostname("");
         else
+        {
             _fnHosts[i].set_hostname(Config.get_host_name(i).c_str());
+            _fnHosts[i].set_mirrors(Config.get_host_mirrors(i).c_str());
+        }
     }
 
     for (int i = 0; i < MAX_DISK_DEVICES; i++)
@@ -1168,7 +1385,7 @@ void sioFuji::_populate_config_from_slots()
         else
         {
             Config.store_host(i, hname,
-                              htype == HOSTTYPE_TNFS ? fnConfig::host_types::HOSTTYPE_TNFS : fnConfig::host_types::HOSTTYPE_SD);
+                              (htype == HOSTTYPE_TNFS || htype == HOSTTYPE_HTTP) ? fnConfig::host_types::HOSTTYPE_TNFS : fnConfig::host_types::HOSTTYPE_SD);
         }
     }
 
@@ -1204,6 +1421,7 @@ void sioFuji::sio_set_hsio_index()
     if (cmdFrame.aux2 & 1)
     {
         Config.store_general_hsioindex(index);
+        Config.store_general_hsio_calibrated(false);
         Config.save();
     }
 
@@ -58,6 +58,19 @@ private:
 
     void _populate_slots_from_config();
     void _populate_config_from_slots();
+    /* Overlay attaches and merges asked for by the web UI, one bit per drive slot. They read
+       and write the image through its host, so they're left for the SIO task to run
+    */
+    uint8_t _overlay_attach_pending = 0;
+    uint8_t _overlay_merge_pending = 0;
+    portMUX_TYPE _overlay_pending_lock = portMUX_INITIALIZER_UNLOCKED;
+    void _attach_overlay(uint8_t deviceSlot);
+    bool _merge_overlay(uint8_t deviceSlot);
+
+    // Set once image_rotate() has been used, so mounting several disks alone doesn't start prefetches
+    bool _rotation_used = false;
+    // Starts prefetching the disk the next image_rotate() will put in D1:
+    void _prefetch_rotation();
 
     appkey _current_appkey;
 
@@ -114,6 +127,29 @@ public:
     void image_rotate();
     int get_disk_id(int drive_slot);
 
+    // Copy-on-write overlays for images mounted read-only
+    void set_overlay_enabled(uint8_t deviceSlot, bool enabled);
+    void discard_overlay(uint8_t deviceSlot);
+    // Merges happen the next time the SIO bus is idle
+    void merge_overlay(uint8_t deviceSlot);
+    // Runs overlay attaches and merges left for the SIO task
+    void run_pending_overlays();
+    int overlay_count(uint8_t deviceSlot);
+    // Merging only works for ATR images
+    bool overlay_mergeable(uint8_t deviceSlot);
+
+    // True if f is the image file of a mounted disk
+    bool file_mounted(FILE *f);
+
+    // Images loaded into RAM when mounted
+    void set_ramdisk_enabled(uint8_t deviceSlot, bool enabled);
+    bool ramdisk_loaded(uint8_t deviceSlot);
+    void flush_idle_disks();
+    // Reads a little more of the image the next image_rotate() will put in D1:
+    void prefetch_idle_disks();
+    // Reads a little more of any directory listing a host hasn't finished reading
+    void fill_idle_directories();
+
     sioFuji();
 };
 
@@ -0,0 +1,133 @@
+#include <string.h>
+
+#include "../../include/debug.h"
+#include "../hardware/fnSystem.h"
+
+#include "fujiDirCache.h"
+
+// Global directory listing cache shared by all host slots
+fujiDirCache fnDirCache;
+
+void dircache_listing::add(const fsdir_entry_t *f, uint8_t disktype)
+{
+    dircache_entry e;
+    e.name_offset = names.size();
+    e.size = f->size;
+    e.modified_time = f->modified_time;
+    e.isDir = f->isDir;
+    e.disktype = disktype;
+
+    names.insert(names.end(), f->filename, f->filename + strlen(f->filename) + 1);
+    entries.push_back(e);
+}
+
+bool dircache_listing::get(uint16_t position, fsdir_entry_t *dest, uint8_t *disktype)
+{
+    if (position >= entries.size())
+        return false;
+
+    dircache_entry &e = entries[position];
+    strlcpy(dest->filename, &names[e.name_offset], sizeof(dest->filename));
+    dest->size = e.size;
+    dest->modified_time = e.modified_time;
+    dest->isDir = e.isDir;
+
+    if (disktype != nullptr)
+        *disktype = e.disktype;
+
+    return true;
+}
+
+std::string fujiDirCache::make_key(const char *hostname, const char *path, const char *pattern, uint16_t diroptions)
+{
+    std::string key(hostname);
+    key += '\n';
+    key += path;
+    key += '\n';
+    if (pattern != nullptr)
+        key += pattern;
+    key += '\n';
+    key += std::to_string(diroptions);
+    return key;
+}
+
+/* Returns the matching listing if we have one that's still considered good.
+   A dir_mtime of 0 means the caller couldn't determine it, so only the TTL applies.
+*/
+std::shared_ptr<dircache_listing> fujiDirCache::find(const std::string &key, time_t dir_mtime, unsigned long ttl_ms)
+{
+    unsigned long now = fnSystem.millis();
+
+    for (auto it = _listings.begin(); it != _listings.end(); ++it)
+    {
+        if ((*it)->key != key)
+            continue;
+
+        if (now - (*it)->loaded_ms > ttl_ms || (dir_mtime != 0 && (*it)->dir_mtime != dir_mtime))
+        {
+            Debug_println("fujiDirCache::find listing expired");
+            _listings.erase(it);
+            break;
+        }
+
+        hits++;
+        (*it)->last_used = ++_use_counter;
+        return *it;
+    }
+
+    misses++;
+    return nullptr;
+}
+
+void fujiDirCache::store(std::shared_ptr<dircache_listing> listing)
+{
+    // Replace any existing listing with the same key
+    for (auto it = _listings.begin(); it != _listings.end(); ++it)
+    {
+        if ((*it)->key == listing->key)
+        {
+            _listings.erase(it);
+            break;
+        }
+    }
+
+    // Make room by dropping the least recently used listing
+    if (_listings.size() >= DIRCACHE_MAX_LISTINGS)
+    {
+        auto oldest = _listings.begin();
+        for (auto it = _listings.begin(); it != _listings.end(); ++it)
+            if ((*it)->last_used < (*oldest)->last_used)
+                oldest = it;
+        _listings.erase(oldest);
+        evictions++;
+    }
+
+    listing->loaded_ms = fnSystem.millis();
+    listing->last_used = ++_use_counter;
+    // Don't hold on to more memory than the listing actually needs
+    listing->entries.shrink_to_fit();
+    listing->names.shrink_to_fit();
+
+    Debug_printf("fujiDirCache::store %u entries, %u bytes of names\n", listing->entries.size(), listing->names.size());
+
+    _listings.push_back(listing);
+}
+
+void fujiDirCache::invalidate(const char *hostname)
+{
+    std::string prefix(hostname);
+    prefix += '\n';
+
+    for (auto it = _listings.begin(); it != _listings.end();)
+    {
+        if ((*it)->key.compare(0, prefix.length(), prefix) == 0)
+            it = _listings.erase(it);
+        else
+            ++it;
+    }
+}
+
+void fujiDirCache::clear()
+{
+    _listings.clear();
+}
@@ -0,0 +1,91 @@
+/* Directory listing cache
+
+ The CONFIG program re-opens the same directories over and over as the user
+ pages back and forth, and every open has to walk the whole directory again
+ (many round trips on TNFS). fujiHost keeps complete listings here so they can
+ be served from memory across open/close sessions.
+
+ Listings are keyed by host name, full path, filter pattern and sort options.
+ A listing is considered stale once its TTL expires, when the directory's
+ modified time changes (local SD only) or when a file is written through the
+ same host.
+
+ A listing that isn't in the cache yet is read a batch at a time: fujiHost reads
+ enough to answer the first few requests, then keeps reading the rest while the
+ SIO bus is idle. Entries beyond what's been read so far are fetched on demand.
+*/
+#ifndef _FUJI_DIRCACHE_
+#define _FUJI_DIRCACHE_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../FileSystem/fnFS.h"
+
+// Number of directory listings we hold at once (least recently used is dropped first)
+#define DIRCACHE_MAX_LISTINGS 6
+// Directories with more entries than this are read directly from the host every time
+#define DIRCACHE_MAX_ENTRIES 16384
+// Entries read from the host at a time - about one TNFS READDIRX response
+#define DIRCACHE_FILL_BATCH 32
+
+// How long a listing is trusted before going back to the host, in milliseconds
+#define DIRCACHE_TTL_LOCAL_MS 300000
+#define DIRCACHE_TTL_TNFS_MS 30000
+
+struct dircache_entry
+{
+    uint32_t name_offset;
+    uint32_t size;
+    time_t modified_time;
+    bool isDir;
+    uint8_t disktype;
+};
+
+class dircache_listing
+{
+public:
+    std::string key;
+    time_t dir_mtime = 0;
+    unsigned long loaded_ms = 0;
+    unsigned long last_used = 0;
+    // False while fujiHost is still reading entries from the host
+    bool complete = true;
+
+    // Filenames are packed into a single buffer to avoid an allocation per entry
+    std::vector<dircache_entry> entries;
+    std::vector<char> names;
+
+    void add(const fsdir_entry_t *f, uint8_t disktype);
+    // Copies entry at the given position into dest. Returns false if out of range
+    bool get(uint16_t position, fsdir_entry_t *dest, uint8_t *disktype);
+};
+
+class fujiDirCache
+{
+private:
+    std::vector<std::shared_ptr<dircache_listing>> _listings;
+    unsigned long _use_counter = 0;
+
+public:
+    uint32_t hits = 0;
+    uint32_t misses = 0;
+    uint32_t evictions = 0;
+
+    static std::string make_key(const char *hostname, const char *path, const char *pattern, uint16_t diroptions);
+
+    // Returns nullptr if there's no valid listing for this key
+    std::shared_ptr<dircache_listing> find(const std::string &key, time_t dir_mtime, unsigned long ttl_ms);
+    void store(std::shared_ptr<dircache_listing> listing);
+
+    // Throws out every listing for the given host
+    void invalidate(const char *hostname);
+    void clear();
+
+    int count() { return _listings.size(); };
+};
+
+extern fujiDirCache fnDirCache;
+
+#endif // _FUJI_DIRCACHE_
@@ -3,10 +3,14 @@
 #include "../FileSystem/fnFS.h"
 #include "../FileSystem/fnFsSD.h"
 #include "../FileSystem/fnFsTNFS.h"
+#include "../FileSystem/fnFsHTTP.h"
+#include "../config/fnConfig.h"
 
 #include "../utils/utils.h"
 
 #include "fujiHost.h"
+#include "fujiImageCache.h"
+#include "diskType.h"
 
 void fujiHost::unmount()
 {
@@ -17,6 +21,11 @@ void fujiHost::unmount()
 */
 void fujiHost::cleanup()
 {
+    _dircache.reset();
+    _dirfill.reset();
+    _zip.reset();
+    fnImageCache.cancel_fill(this);
+
     if (_fs != nullptr)
         _fs->dir_close();
 
@@ -42,6 +51,7 @@ void fujiHost::set_type(fujiHostType type)
         cleanup();
         break;
     case HOSTTYPE_TNFS:
+    case HOSTTYPE_HTTP:
         cleanup();
         break;
     }
@@ -64,6 +74,8 @@ void fujiHost::set_hostname(const char *hostname)
         Debug_printf("fujiHost::set_hostname replacing hold host \"%s\"\n", _hostname);
         set_type(HOSTTYPE_UNINITIALIZED);
     }
+    if (strncasecmp(_hostname, hostname, sizeof(_hostname)) != 0)
+        _mirrors.clear();
     strlcpy(_hostname, hostname, sizeof(_hostname));
 }
 
@@ -97,11 +109,16 @@ uint16_t fujiHost::dir_tell()
     if (_fs == nullptr)
         return FNFS_INVALID_DIRPOS;
 
+    _dir_fill_until(_dircache_pos);
+    if (_dircache != nullptr)
+        return _dircache->entries.empty() ? FNFS_INVALID_DIRPOS : _dircache_pos;
+
     uint16_t result = FNFS_INVALID_DIRPOS;
     switch (_type)
     {
     case HOSTTYPE_LOCAL:
     case HOSTTYPE_TNFS:
+    case HOSTTYPE_HTTP:
         result = _fs->dir_tell();
         break;
     case HOSTTYPE_UNINITIALIZED:
@@ -116,11 +133,21 @@ bool fujiHost::dir_seek(uint16_t pos)
     if (_fs == nullptr)
         return false;
 
+    _dir_fill_until(pos);
+    if (_dircache != nullptr)
+    {
+        if (pos >= _dircache->entries.size())
+            return false;
+        _dircache_pos = pos;
+        return true;
+    }
+
     bool result = false;
     switch (_type)
     {
     case HOSTTYPE_LOCAL:
     case HOSTTYPE_TNFS:
+    case HOSTTYPE_HTTP:
         result = _fs->dir_seek(pos);
         break;
     case HOSTTYPE_UNINITIALIZED:
@@ -145,12 +172,18 @@ bool fujiHost::dir_open(const char *path, const char *pattern, uint16_t options)
     
     Debug_printf("::dir_open actual path = \"%s\"\n", realpath);
 
+    // Directories inside ZIP archives come from the archive's central directory
+    std::string archivepath, memberdir;
+    if (fujiZip::split_path(realpath, archivepath, memberdir))
+        return _dir_open_zip(realpath, archivepath, memberdir, pattern, options);
+
     int result = false;
     switch (_type)
     {
     case HOSTTYPE_LOCAL:
     case HOSTTYPE_TNFS:
-        result = _fs->dir_open(realpath, pattern, options);
+    case HOSTTYPE_HTTP:
+        result = _dir_open_cached(realpath, pattern, options);
         break;
     case HOSTTYPE_UNINITIALIZED:
         break;
@@ -158,28 +191,309 @@ bool fujiHost::dir_open(const char *path, const char *pattern, uint16_t options)
     return result;
 }
 
-fsdir_entry_t *fujiHost::dir_nextfile()
+fsdir_entry_t *fujiHost::dir_nextfile(uint8_t *disktype)
 {
     Debug_printf("::dir_nextfile {%d:%d}\n", slotid, _type);
 
+    _dir_fill_until(_dircache_pos);
+    if (_dircache != nullptr)
+    {
+        if (false == _dircache->get(_dircache_pos, &_dircache_entry, disktype))
+            return nullptr;
+        _dircache_pos++;
+        return &_dircache_entry;
+    }
+
+    fsdir_entry_t *f = nullptr;
     switch (_type)
     {
     case HOSTTYPE_LOCAL:
     case HOSTTYPE_TNFS:
-        return _fs->dir_read();
+    case HOSTTYPE_HTTP:
+        f = _fs->dir_read();
+        break;
     case HOSTTYPE_UNINITIALIZED:
         break;
     }
 
-    return nullptr;
+    if (f != nullptr && disktype != nullptr)
+        *disktype = DiskType::discover_disktype(f->filename);
+
+    // ZIP archives can be opened like directories
+    if (f != nullptr && fujiZip::is_archive(f->filename))
+        f->isDir = true;
+
+    return f;
 }
 
 void fujiHost::dir_close()
 {
+    // A cached listing has already closed the underlying directory, or
+    // leaves it open for _dirfill to finish reading in the background
+    if (_dircache != nullptr)
+    {
+        _dircache.reset();
+        return;
+    }
+
     if (_type != HOSTTYPE_UNINITIALIZED && _fs != nullptr)
         _fs->dir_close();
 }
 
+/* Serves the directory from fnDirCache if we have a valid listing for it.
+   Otherwise opens the directory, reads the first batch of entries and leaves the
+   rest to be read by dir_fill_idle() or as they're asked for. The finished listing
+   is stored in the cache. Directories too large to cache are read from the
+   filesystem as before.
+*/
+bool fujiHost::_dir_open_cached(const char *realpath, const char *pattern, uint16_t options)
+{
+    _dircache.reset();
+    _dircache_pos = 0;
+
+    std::string key = fujiDirCache::make_key(_hostname, realpath, pattern, options);
+
+    // Pick up where we left off with a listing that's still being read
+    if (_dirfill != nullptr && _dirfill->key == key && _dirfill_stale == false)
+    {
+        Debug_printf("::dir_open using partial listing (%u entries so far)\n", _dirfill->entries.size());
+        _dircache = _dirfill;
+        return true;
+    }
+
+    // We only have the one directory open on the filesystem
+    _dir_fill_abandon();
+
+    // SD directories can be checked cheaply, TNFS relies on the TTL
+    time_t dir_mtime = 0;
+    unsigned long ttl = DIRCACHE_TTL_TNFS_MS;
+    if (_type == HOSTTYPE_LOCAL)
+    {
+        dir_mtime = ((FileSystemSDFAT *)_fs)->dir_mtime(realpath);
+        ttl = DIRCACHE_TTL_LOCAL_MS;
+    }
+
+    _dircache = fnDirCache.find(key, dir_mtime, ttl);
+    if (_dircache != nullptr)
+    {
+        Debug_printf("::dir_open using cached listing (%u entries)\n", _dircache->entries.size());
+        return true;
+    }
+
+    if (false == _fs->dir_open(realpath, pattern, options))
+        return false;
+
+    std::shared_ptr<dircache_listing> listing = std::make_shared<dircache_listing>();
+    listing->key = key;
+    listing->dir_mtime = dir_mtime;
+    listing->complete = false;
+
+    _dirfill = listing;
+    _dirfill_stale = false;
+    _dircache = listing;
+
+    // Enough to get the first screen going
+    _dir_fill(DIRCACHE_FILL_BATCH);
+
+    return true;
+}
+
+/* Reads up to count more entries into _dirfill. Once the directory's been read to the
+   end, it's closed and the listing goes into fnDirCache. Returns false once there's no
+   more filling to do.
+*/
+bool fujiHost::_dir_fill(int count)
+{
+    if (_dirfill == nullptr)
+        return false;
+
+    for (int i = 0; i < count; i++)
+    {
+        fsdir_entry_t *f = _fs->dir_read();
+        if (f == nullptr)
+        {
+            _fs->dir_close();
+            _dirfill->complete = true;
+            if (_dirfill_stale == false)
+                fnDirCache.store(_dirfill);
+            _dirfill.reset();
+            return false;
+        }
+
+        if (_dirfill->entries.size() >= DIRCACHE_MAX_ENTRIES)
+        {
+            Debug_printf("::dir_fill more than %d entries - not caching\n", DIRCACHE_MAX_ENTRIES);
+            // If the directory is open, keep serving it straight from the filesystem
+            if (_dircache == _dirfill)
+            {
+                _dircache.reset();
+                _fs->dir_seek(_dircache_pos);
+            }
+            else
+                _fs->dir_close();
+            _dirfill.reset();
+            return false;
+        }
+
+        // ZIP archives can be opened like directories
+        if (fujiZip::is_archive(f->filename))
+            f->isDir = true;
+        _dirfill->add(f, DiskType::discover_disktype(f->filename));
+    }
+
+    return true;
+}
+
+// Makes sure the open listing has the entry at position, unless the directory ends first
+void fujiHost::_dir_fill_until(uint16_t position)
+{
+    while (_dircache != nullptr && _dircache == _dirfill && position >= _dircache->entries.size())
+        if (_dir_fill(DIRCACHE_FILL_BATCH) == false)
+            break;
+}
+
+// Stops reading a listing, throwing out what we have so far
+void fujiHost::_dir_fill_abandon()
+{
+    if (_dirfill == nullptr)
+        return;
+
+    if (_dircache == _dirfill)
+        _dircache.reset();
+    _dirfill.reset();
+    _fs->dir_close();
+}
+
+bool fujiHost::dir_fill_idle()
+{
+    if (_dirfill == nullptr)
+        return false;
+
+    _dir_fill(DIRCACHE_FILL_BATCH);
+    return true;
+}
+
+// Reads the archive's central directory unless it's the one we already have
+bool fujiHost::_zip_load(const std::string &archivepath)
+{
+    std::string key = std::string(_hostname) + ':' + archivepath;
+    if (_zip != nullptr && _zip->key == key)
+        return true;
+
+    _zip.reset();
+
+    FILE *f = _fs->file_open(archivepath.c_str(), "r");
+    if (f == nullptr)
+        return false;
+
+    std::shared_ptr<fujiZip> zip = std::make_shared<fujiZip>();
+    zip->key = key;
+
+    unsigned long ms_start = fnSystem.millis();
+    bool ok = zip->load(f, _fs->FileSystem::filesize(f));
+    fclose(f);
+
+    if (ok == false)
+        return false;
+
+    Debug_printf("::zip_load read \"%s\" in %lu ms\n", archivepath.c_str(), fnSystem.millis() - ms_start);
+    _zip = zip;
+    return true;
+}
+
+/* Serves a directory inside a ZIP archive the same way as a cached listing,
+   without going back to the host for anything but the archive's central directory
+*/
+bool fujiHost::_dir_open_zip(const char *realpath, const std::string &archivepath, const std::string &memberdir,
+                             const char *pattern, uint16_t options)
+{
+    _dircache.reset();
+    _dircache_pos = 0;
+
+    if (_zip_load(archivepath) == false)
+        return false;
+
+    std::shared_ptr<dircache_listing> listing = std::make_shared<dircache_listing>();
+    listing->key = fujiDirCache::make_key(_hostname, realpath, pattern, options);
+
+    std::string dir = memberdir;
+    if (dir.length() > 0 && dir.back() != '/')
+        dir += '/';
+    _zip->list(dir, pattern, options, *listing);
+
+    _dircache = listing;
+    return true;
+}
+
+/* Extracts the member to a scratch file on SD (if it isn't there already from an earlier
+   mount) and returns that file open for reading. Archives can't be written to
+*/
+FILE *fujiHost::_file_open_zip(const std::string &archivepath, const std::string &membername, const char *mode)
+{
+    if (strpbrk(mode, "wa+") != nullptr)
+    {
+        Debug_println("::file_open can't write to a ZIP archive");
+        return nullptr;
+    }
+
+    if (fnSDFAT.running() == false)
+    {
+        Debug_println("::file_open need an SD card to extract from ZIP archives");
+        return nullptr;
+    }
+
+    if (_zip_load(archivepath) == false)
+        return nullptr;
+
+    const zip_member *m = _zip->find(membername.c_str());
+    if (m == nullptr)
+    {
+        Debug_printf("::file_open no \"%s\" in archive\n", membername.c_str());
+        return nullptr;
+    }
+
+    // Scratch files that aren't in the index may not have been finished
+    std::string scratch = _zip->scratch_path(*m);
+    FILE *f = nullptr;
+    if (fnZipScratch.known(scratch.c_str(), m->size))
+        f = fnSDFAT.file_open(scratch.c_str(), "r");
+    if (f != nullptr && fnSDFAT.FileSystem::filesize(f) == (long)m->size)
+    {
+        fnZipScratch.note_used(scratch.c_str(), m->size, f);
+        return f;
+    }
+    if (f != nullptr)
+        fclose(f);
+
+    FILE *archive = _fs->file_open(archivepath.c_str(), "r");
+    if (archive == nullptr)
+        return nullptr;
+
+    fnSDFAT.create_path(ZIP_SCRATCH_DIRECTORY);
+    fnZipScratch.make_room(m->size);
+    f = fnSDFAT.file_open(scratch.c_str(), "w+");
+
+    unsigned long ms_start = fnSystem.millis();
+    bool ok = f != nullptr && _zip->extract(archive, *m, f);
+    fclose(archive);
+    ok = ok && fflush(f) == 0 && _zip->verify(f, *m);
+
+    if (ok == false)
+    {
+        Debug_printf("::file_open failed extracting \"%s\"\n", membername.c_str());
+        if (f != nullptr)
+            fclose(f);
+        fnSDFAT.remove(scratch.c_str());
+        fnZipScratch.forget(scratch.c_str());
+        return nullptr;
+    }
+
+    fnZipScratch.note_used(scratch.c_str(), m->size, f);
+    Debug_printf("::file_open extracted %u bytes in %lu ms\n", m->size, fnSystem.millis() - ms_start);
+    fseek(f, 0, SEEK_SET);
+    return f;
+}
+
 bool fujiHost::file_exists(const char *path)
 {
     if (_type == HOSTTYPE_UNINITIALIZED || _fs == nullptr)
@@ -192,6 +506,10 @@ bool fujiHost::file_exists(const char *path)
     
     Debug_printf("::file_exists actual path = \"%s\"\n", realpath);
 
+    std::string archivepath, membername;
+    if (fujiZip::split_path(realpath, archivepath, membername))
+        return _zip_load(archivepath) && (membername.empty() || _zip->find(membername.c_str()) != nullptr);
+
     return _fs->exists(realpath);
 }
 
@@ -227,9 +545,66 @@ FILE * fujiHost::file_open(const char *path, char *fullpath, int fullpathlen, co
     }
     Debug_printf("fujiHost #%d opening file path \"%s\"\n", slotid, fullpath);
 
+    std::string archivepath, membername;
+    if (fujiZip::split_path(realpath, archivepath, membername))
+        return _file_open_zip(archivepath, membername, mode);
+
+    // Anything other than a plain read may change a directory we have cached
+    if (strpbrk(mode, "wa+") != nullptr)
+    {
+        fnDirCache.invalidate(_hostname);
+        // A listing that's open can still be read to the end, but shouldn't be kept
+        if (_dirfill != nullptr && _dircache != _dirfill)
+            _dir_fill_abandon();
+        else
+            _dirfill_stale = true;
+    }
+
     return _fs->file_open(fullpath, mode);
 }
 
+/* Opens an image to be mounted. If it's a read-only TNFS image, we use our copy of it on SD if
+   we have an up-to-date one, otherwise a second handle on the image is given to fnImageCache so
+   a copy is made while the bus is idle.
+*/
+FILE * fujiHost::image_open(const char *path, char *fullpath, int fullpathlen, const char *mode)
+{
+    if (_type != HOSTTYPE_TNFS || _fs == nullptr || strcmp(mode, "r") != 0 || fnImageCache.budget() == 0)
+        return file_open(path, fullpath, fullpathlen, mode);
+
+    // ZIP members are already extracted to SD
+    char realpath[MAX_PATHLEN];
+    std::string archivepath, membername;
+    if (false == util_concat_paths(realpath, _prefix, path, sizeof(realpath)) ||
+        fujiZip::split_path(realpath, archivepath, membername))
+        return file_open(path, fullpath, fullpathlen, mode);
+
+    uint32_t size;
+    time_t mtime;
+    if (false == ((FileSystemTNFS *)_fs)->file_stat(realpath, &size, &mtime))
+        return file_open(path, fullpath, fullpathlen, mode);
+
+    FILE *f = fnImageCache.open(_hostname, realpath, size, mtime);
+    if (f != nullptr)
+    {
+        if (fullpath != nullptr && strlcpy(fullpath, realpath, fullpathlen) != strlen(realpath))
+        {
+            fclose(f);
+            return nullptr;
+        }
+        return f;
+    }
+
+    f = file_open(path, fullpath, fullpathlen, mode);
+    if (f != nullptr)
+    {
+        FILE *copysrc = _fs->file_open(realpath, "r");
+        if (copysrc != nullptr)
+            fnImageCache.start_fill(this, copysrc, _hostname, realpath, size, mtime);
+    }
+    return f;
+}
+
 /* Returns pointer to current hostname and, if provided, fills buffer with that string
 */
 const char *fujiHost::get_hostname(char *buffer, size_t buffersize)
@@ -321,6 +696,8 @@ int fujiHost::mount_tnfs()
     else
     {
         Debug_println("Calling TNFS::begin");
+        ((FileSystemTNFS *)_fs)->set_transport(Config.get_general_tnfs_transport());
+        ((FileSystemTNFS *)_fs)->set_mirrors(_mirrors.c_str());
         if (((FileSystemTNFS *)_fs)->start(_hostname))
         {
             return 0;
@@ -330,9 +707,37 @@ int fujiHost::mount_tnfs()
     return -1;
 }
 
+/* Returns:
+    0 on success
+   -1 hostname isn't an HTTP URL
+   -2 on failure
+*/
+int fujiHost::mount_http()
+{
+    if (strncasecmp(_hostname, "http://", 7) != 0 && strncasecmp(_hostname, "https://", 8) != 0)
+        return -1;
+
+    Debug_printf("::mount_http {%d:%d} \"%s\"\n", slotid, _type, _hostname);
+
+    if (_type == HOSTTYPE_HTTP)
+    {
+        if (_fs != nullptr && _fs->running())
+            return 0;
+    }
+    else
+        set_type(HOSTTYPE_HTTP);
+
+    _fs = new FileSystemHTTP;
+    if (((FileSystemHTTP *)_fs)->start(_hostname))
+        return 0;
+
+    return -2;
+}
+
 /* Returns true if successful
 *  We expect a valid devicename, currently:
 *  "SD" = local
+*  "http://..." or "https://..." = HTTP/WebDAV
 *  anything else = TNFS
 */
 bool fujiHost::mount()
@@ -343,6 +748,10 @@ bool fujiHost::mount()
     if (0 == mount_local())
         return true;
 
+    int r = mount_http();
+    if (r != -1)
+        return r == 0;
+
     // Try mounting TNFS last
     return 0 == mount_tnfs();
 }
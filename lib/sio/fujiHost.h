@@ -1,9 +1,12 @@
 #ifndef _FUJI_HOST_
 #define _FUJI_HOST_
 
+#include <memory>
 #include <string>
 
 #include "../FileSystem/fnFS.h"
+#include "fujiDirCache.h"
+#include "fujiZip.h"
 
 #define MAX_HOSTNAME_LEN 32
 #define MAX_HOST_PREFIX_LEN 256
@@ -12,7 +15,8 @@ enum fujiHostType
 {
     HOSTTYPE_UNINITIALIZED = 0,
     HOSTTYPE_LOCAL,
-    HOSTTYPE_TNFS
+    HOSTTYPE_TNFS,
+    HOSTTYPE_HTTP
 };
 
 class fujiHost
@@ -23,12 +27,36 @@ private:
     fujiHostType _type;
     char _hostname[MAX_HOSTNAME_LEN] = { '\0' };
     char _prefix[MAX_HOST_PREFIX_LEN] = { '\0' };
+    // Other TNFS servers with the same files, comma-separated
+    std::string _mirrors;
+
+    // Set when the currently open directory is being served from fnDirCache
+    std::shared_ptr<dircache_listing> _dircache;
+    uint16_t _dircache_pos = 0;
+    fsdir_entry_t _dircache_entry;
+
+    // Listing still being read from the host. The filesystem's directory stays open until it's done
+    std::shared_ptr<dircache_listing> _dirfill;
+    // Set when something was written to the host after the listing was started
+    bool _dirfill_stale = false;
+
+    // Central directory of the last ZIP archive we looked into
+    std::shared_ptr<fujiZip> _zip;
 
     void cleanup();
+    bool _dir_open_cached(const char *realpath, const char *pattern, uint16_t options);
+    bool _dir_fill(int count);
+    void _dir_fill_until(uint16_t position);
+    void _dir_fill_abandon();
+    bool _zip_load(const std::string &archivepath);
+    bool _dir_open_zip(const char *realpath, const std::string &archivepath, const std::string &memberdir,
+                       const char *pattern, uint16_t options);
+    FILE *_file_open_zip(const std::string &archivepath, const std::string &membername, const char *mode);
     void unmount();
 
     int mount_local();
     int mount_tnfs();
+    int mount_http();
 
 public:
     int slotid = -1;
@@ -43,6 +71,9 @@ public:
     const char* get_hostname(char *buffer, size_t buffersize);
     const char* get_hostname();
 
+    // Takes effect the next time the host is mounted
+    void set_mirrors(const char *mirrors) { _mirrors = mirrors; };
+
     bool mount();
 
     // Host prefixes are used for host file operations that take a path (file_exists, file_open, dir_open)
@@ -53,14 +84,19 @@ public:
     // File functions
     bool file_exists(const char *path);
     FILE * file_open(const char *path, char *fullpath, int fullpathlen, const char *mode);
+    // Like file_open, but read-only opens of TNFS images may be served from (and fill) fnImageCache
+    FILE * image_open(const char *path, char *fullpath, int fullpathlen, const char *mode);
     long file_size(FILE *filehandle);
 
     // Directory functions
     bool dir_open(const char *path, const char *pattern, uint16_t options = 0);
     void dir_close();
-    fsdir_entry_t * dir_nextfile();
+    // If disktype is given, it's set to the DiskType::discover_disktype() result for the entry
+    fsdir_entry_t * dir_nextfile(uint8_t *disktype = nullptr);
     uint16_t dir_tell();
     bool dir_seek(uint16_t position);
+    // Reads a few more entries of a directory listing that isn't complete yet. Returns false if there was nothing to do
+    bool dir_fill_idle();
 
 };
 
@@ -0,0 +1,342 @@
+#include <string.h>
+
+#include "../../include/debug.h"
+#include "fnFsSD.h"
+#include "fnConfig.h"
+#include "../utils/utils.h"
+
+#include "fuji.h"
+#include "fujiImageCache.h"
+
+#define IMAGECACHE_MAGIC "FNIMC01"
+
+fujiImageCache fnImageCache;
+
+// 32-bit FNV-1a
+static uint32_t _imagecache_hash(uint32_t hash, const uint8_t *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= data[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+imagecache_entry fujiImageCache::_make_entry(const char *hostname, const char *path, uint32_t size, time_t mtime)
+{
+    imagecache_entry e;
+
+    e.source = _imagecache_hash(2166136261, (const uint8_t *)hostname, strlen(hostname));
+    e.source = _imagecache_hash(e.source, (const uint8_t *)path, strlen(path));
+
+    uint32_t t = mtime;
+    e.version = _imagecache_hash(2166136261, (const uint8_t *)&size, sizeof(size));
+    e.version = _imagecache_hash(e.version, (const uint8_t *)&t, sizeof(t));
+
+    e.size = size;
+    e.last_used = 0;
+    return e;
+}
+
+std::string fujiImageCache::_entry_path(const imagecache_entry &e, bool partial)
+{
+    char filename[40];
+    snprintf(filename, sizeof(filename), IMAGECACHE_DIRECTORY "/%08x%08x.%s", e.source, e.version, partial ? "prt" : "img");
+    return std::string(filename);
+}
+
+uint32_t fujiImageCache::budget()
+{
+    if (fnSDFAT.running() == false)
+        return 0;
+
+    return util_megabytes_to_bytes(Config.get_general_imagecache_size());
+}
+
+uint32_t fujiImageCache::used()
+{
+    uint32_t total = 0;
+    for (auto &e : _entries)
+        total += e.size;
+    return total;
+}
+
+/* Reads the list of cached images from the SD card the first time we need it
+*/
+bool fujiImageCache::_load_index()
+{
+    if (_loaded)
+        return true;
+
+    if (fnSDFAT.running() == false)
+        return false;
+
+    _loaded = true;
+    _entries.clear();
+
+    FILE *f = fnSDFAT.file_open(IMAGECACHE_INDEX_FILE, "r");
+    if (f == nullptr)
+        return true;
+
+    char magic[sizeof(IMAGECACHE_MAGIC)];
+    if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) || memcmp(magic, IMAGECACHE_MAGIC, sizeof(magic)) != 0)
+    {
+        Debug_println("fujiImageCache index not recognized - starting empty");
+        fclose(f);
+        return true;
+    }
+
+    imagecache_entry e;
+    while (fread(&e, 1, sizeof(e), f) == sizeof(e))
+    {
+        _entries.push_back(e);
+        if (e.last_used > _use_counter)
+            _use_counter = e.last_used;
+    }
+    fclose(f);
+
+    Debug_printf("fujiImageCache loaded %u entries using %u bytes\n", _entries.size(), used());
+    return true;
+}
+
+void fujiImageCache::_save_index()
+{
+    fnSDFAT.create_path(IMAGECACHE_DIRECTORY);
+
+    FILE *f = fnSDFAT.file_open(IMAGECACHE_INDEX_FILE, "w");
+    if (f == nullptr)
+    {
+        Debug_println("fujiImageCache failed to write index");
+        return;
+    }
+
+    fwrite(IMAGECACHE_MAGIC, 1, sizeof(IMAGECACHE_MAGIC), f);
+    for (auto &e : _entries)
+        fwrite(&e, 1, sizeof(e), f);
+    fclose(f);
+}
+
+// Deletes an entry and its file. The caller saves the index
+void fujiImageCache::_remove(int index)
+{
+    fnSDFAT.remove(_entry_path(_entries[index]).c_str());
+    _entries.erase(_entries.begin() + index);
+}
+
+/* True if a copy we handed out is still mounted. Handles that are no longer mounted are
+   forgotten along the way
+*/
+bool fujiImageCache::_in_use(const imagecache_entry &e)
+{
+    bool in_use = false;
+    for (auto it = _open_files.begin(); it != _open_files.end();)
+    {
+        if (theFuji.file_mounted(it->f) == false)
+        {
+            it = _open_files.erase(it);
+            continue;
+        }
+        if (it->source == e.source && it->version == e.version)
+            in_use = true;
+        ++it;
+    }
+    return in_use;
+}
+
+/* Throws out the least recently used images that aren't mounted until size more bytes
+   fit in our budget. Returns false if they can't.
+*/
+bool fujiImageCache::_make_room(uint32_t size)
+{
+    uint32_t limit = budget();
+    if (size > limit)
+        return false;
+
+    bool removed = false;
+    while (used() > limit - size)
+    {
+        int oldest = -1;
+        for (int i = 0; i < _entries.size(); i++)
+            if (_in_use(_entries[i]) == false && (oldest < 0 || _entries[i].last_used < _entries[oldest].last_used))
+                oldest = i;
+
+        if (oldest < 0)
+        {
+            Debug_println("fujiImageCache can't make room while copies are mounted");
+            if (removed)
+                _save_index();
+            return false;
+        }
+
+        Debug_printf("fujiImageCache evicting %08x%08x\n", _entries[oldest].source, _entries[oldest].version);
+        _remove(oldest);
+        removed = true;
+    }
+
+    if (removed)
+        _save_index();
+
+    return true;
+}
+
+void fujiImageCache::trim()
+{
+    if (_loaded && budget() > 0)
+        _make_room(0);
+}
+
+FILE *fujiImageCache::open(const char *hostname, const char *path, uint32_t size, time_t mtime)
+{
+    if (budget() == 0 || _load_index() == false)
+        return nullptr;
+
+    imagecache_entry wanted = _make_entry(hostname, path, size, mtime);
+
+    for (int i = 0; i < _entries.size(); i++)
+    {
+        if (_entries[i].source != wanted.source)
+            continue;
+
+        /* The image has changed on the host since we copied it. A copy that's still mounted
+           is left to be removed once it's the oldest
+        */
+        if (_entries[i].version != wanted.version || _entries[i].size != wanted.size)
+        {
+            if (_in_use(_entries[i]))
+                continue;
+            Debug_printf("fujiImageCache \"%s\" changed on host - dropping our copy\n", path);
+            _remove(i--);
+            _save_index();
+            continue;
+        }
+
+        FILE *f = fnSDFAT.file_open(_entry_path(_entries[i]).c_str(), "r");
+        if (f == nullptr)
+        {
+            Debug_printf("fujiImageCache copy of \"%s\" has gone missing\n", path);
+            _remove(i);
+            _save_index();
+            break;
+        }
+
+        _entries[i].last_used = ++_use_counter;
+        _save_index();
+        _open_files.push_back({f, _entries[i].source, _entries[i].version});
+
+        hits++;
+        Debug_printf("fujiImageCache hit for \"%s\"\n", path);
+        return f;
+    }
+
+    misses++;
+    return nullptr;
+}
+
+void fujiImageCache::start_fill(const fujiHost *host, FILE *src, const char *hostname, const char *path, uint32_t size, time_t mtime)
+{
+    imagecache_entry e = _make_entry(hostname, path, size, mtime);
+
+    // Already copying this one
+    if (_fill_src != nullptr && _fill_entry.source == e.source && _fill_entry.version == e.version)
+    {
+        fclose(src);
+        return;
+    }
+
+    // Only one image is copied at a time, and the latest one mounted is the one most likely to be wanted again
+    if (_fill_src != nullptr)
+        _fill_finish(false);
+
+    if (size == 0 || _load_index() == false || _make_room(size) == false)
+    {
+        fclose(src);
+        return;
+    }
+
+    fnSDFAT.create_path(IMAGECACHE_DIRECTORY);
+    _fill_dst = fnSDFAT.file_open(_entry_path(e, true).c_str(), "w");
+    if (_fill_dst == nullptr)
+    {
+        Debug_println("fujiImageCache failed to create copy");
+        fclose(src);
+        return;
+    }
+
+    Debug_printf("fujiImageCache copying \"%s\" (%u bytes)\n", path, size);
+
+    _fill_host = host;
+    _fill_src = src;
+    _fill_entry = e;
+    _fill_pos = 0;
+    fseek(_fill_src, 0, SEEK_SET);
+}
+
+void fujiImageCache::fill_idle()
+{
+    if (_fill_src == nullptr)
+        return;
+
+    uint8_t buf[IMAGECACHE_FILL_CHUNK];
+
+    uint32_t want = _fill_entry.size - _fill_pos;
+    if (want > sizeof(buf))
+        want = sizeof(buf);
+
+    if (fread(buf, 1, want, _fill_src) != want || fwrite(buf, 1, want, _fill_dst) != want)
+    {
+        Debug_printf("fujiImageCache copy failed at offset %u\n", _fill_pos);
+        _fill_finish(false);
+        return;
+    }
+
+    _fill_pos += want;
+    if (_fill_pos >= _fill_entry.size)
+        _fill_finish(true);
+}
+
+void fujiImageCache::_fill_finish(bool success)
+{
+    fclose(_fill_src);
+    fclose(_fill_dst);
+    _fill_src = nullptr;
+    _fill_dst = nullptr;
+    _fill_host = nullptr;
+
+    std::string partial = _entry_path(_fill_entry, true);
+
+    if (success)
+    {
+        std::string final = _entry_path(_fill_entry);
+        fnSDFAT.remove(final.c_str());
+        success = fnSDFAT.rename(partial.c_str(), final.c_str());
+    }
+
+    if (success == false)
+    {
+        fnSDFAT.remove(partial.c_str());
+        return;
+    }
+
+    Debug_printf("fujiImageCache finished copying %08x%08x\n", _fill_entry.source, _fill_entry.version);
+
+    // Other mounts may have used up some of the room since we started
+    if (_make_room(_fill_entry.size) == false)
+    {
+        fnSDFAT.remove(_entry_path(_fill_entry).c_str());
+        return;
+    }
+
+    _fill_entry.last_used = ++_use_counter;
+    _entries.push_back(_fill_entry);
+    _save_index();
+}
+
+void fujiImageCache::cancel_fill(const fujiHost *host)
+{
+    if (_fill_src != nullptr && _fill_host == host)
+    {
+        Debug_println("fujiImageCache host going away - abandoning copy");
+        _fill_finish(false);
+    }
+}
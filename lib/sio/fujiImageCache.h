@@ -0,0 +1,100 @@
+/* SD card cache of disk images mounted from TNFS hosts
+
+ The first time an image is mounted from a TNFS host it's copied to the SD
+ card a little at a time while the SIO bus is idle, using a second handle so
+ the mounted image isn't disturbed. Later mounts of the same image are served
+ from the copy on SD.
+
+ Images are identified by host and path, and a copy is only used if the
+ image's size and modified time on the host still match. A copy of an image
+ that has since changed is thrown out when it's next mounted. The least
+ recently used copies are removed to stay under the size budget in fnConfig.
+ Copies that are mounted are never removed, since FATFS would let us delete a
+ file that's still open and hand its clusters to something else.
+*/
+#ifndef _FUJI_IMAGECACHE_
+#define _FUJI_IMAGECACHE_
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#define IMAGECACHE_DIRECTORY "/imagecache"
+#define IMAGECACHE_INDEX_FILE IMAGECACHE_DIRECTORY "/index"
+
+// Bytes copied per idle pass - about one TNFS read so a command arriving isn't kept waiting long
+#define IMAGECACHE_FILL_CHUNK 512
+
+struct imagecache_entry
+{
+    // Hash of host and path
+    uint32_t source;
+    // Hash of size and modified time on the host
+    uint32_t version;
+    uint32_t size;
+    uint32_t last_used;
+} __attribute__((packed));
+
+// A copy we handed out, which can't be removed while it's mounted
+struct imagecache_open_file
+{
+    FILE *f;
+    uint32_t source;
+    uint32_t version;
+};
+
+class fujiHost;
+
+class fujiImageCache
+{
+private:
+    std::vector<imagecache_entry> _entries;
+    std::vector<imagecache_open_file> _open_files;
+    bool _loaded = false;
+    uint32_t _use_counter = 0;
+
+    // Image currently being copied to SD
+    const fujiHost *_fill_host = nullptr;
+    FILE *_fill_src = nullptr;
+    FILE *_fill_dst = nullptr;
+    imagecache_entry _fill_entry;
+    uint32_t _fill_pos = 0;
+
+    bool _load_index();
+    void _save_index();
+    std::string _entry_path(const imagecache_entry &e, bool partial = false);
+    void _remove(int index);
+    bool _in_use(const imagecache_entry &e);
+    bool _make_room(uint32_t size);
+    void _fill_finish(bool success);
+
+    static imagecache_entry _make_entry(const char *hostname, const char *path, uint32_t size, time_t mtime);
+
+public:
+    uint32_t hits = 0;
+    uint32_t misses = 0;
+
+    // Zero if the cache is disabled or there's no SD card
+    uint32_t budget();
+    uint32_t used();
+    int count() { return _entries.size(); };
+
+    // Removes copies until we're within budget again, such as after a disk using one is unmounted
+    void trim();
+
+    // Returns our copy of the image open for reading, or nullptr if we don't have an up-to-date copy
+    FILE *open(const char *hostname, const char *path, uint32_t size, time_t mtime);
+
+    /* Starts copying an image we don't have. Takes ownership of src, a handle on the
+       image that's separate from the one used for the mount
+    */
+    void start_fill(const fujiHost *host, FILE *src, const char *hostname, const char *path, uint32_t size, time_t mtime);
+    // Copies the next chunk of the image being filled, if any
+    void fill_idle();
+    // Stops copying from the given host (which is going away)
+    void cancel_fill(const fujiHost *host);
+};
+
+extern fujiImageCache fnImageCache;
+
+#endif // _FUJI_IMAGECACHE_
@@ -0,0 +1,633 @@
+#include <ctype.h>
+#include <string.h>
+#include <algorithm>
+#include <set>
+
+#include "../../include/debug.h"
+#include "../utils/utils.h"
+#include "fnFsSD.h"
+
+#include "diskType.h"
+#include "diskTypeCompressed.h"
+
+#include "fuji.h"
+#include "fujiZip.h"
+
+#define ZIP_SIG_LOCAL_HEADER 0x04034b50
+#define ZIP_SIG_CENTRAL_HEADER 0x02014b50
+#define ZIP_SIG_END_OF_CD 0x06054b50
+#define ZIP_SIG_ZIP64_END_OF_CD 0x06064b50
+#define ZIP_SIG_ZIP64_LOCATOR 0x07064b50
+
+#define ZIP_LOCAL_HEADER_SIZE 30
+#define ZIP_CENTRAL_HEADER_SIZE 46
+#define ZIP_END_OF_CD_SIZE 22
+#define ZIP_ZIP64_LOCATOR_SIZE 20
+#define ZIP_ZIP64_END_OF_CD_SIZE 56
+#define ZIP_MAX_COMMENT 65535
+
+#define ZIP_EXTRA_ZIP64 0x0001
+
+#define ZIP_SCRATCH_MAGIC "FNZSC01"
+
+fujiZipScratch fnZipScratch;
+
+static uint16_t _zip_u16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t _zip_u32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t _zip_u64(const uint8_t *p)
+{
+    return _zip_u32(p) | ((uint64_t)_zip_u32(p + 4) << 32);
+}
+
+// MS-DOS date and time as stored in the archive
+static time_t _zip_dostime_to_epoch(uint16_t dostime, uint16_t dosdate)
+{
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_sec = (dostime & 0x1F) * 2;
+    tm.tm_min = (dostime >> 5) & 0x3F;
+    tm.tm_hour = dostime >> 11;
+    tm.tm_mday = dosdate & 0x1F;
+    tm.tm_mon = ((dosdate >> 5) & 0x0F) - 1;
+    tm.tm_year = (dosdate >> 9) + 80;
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+// CRC-32 as used by ZIP, a nibble at a time to keep the table small
+static uint32_t _zip_crc32(uint32_t crc, const uint8_t *data, size_t len)
+{
+    static const uint32_t table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c};
+
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++)
+    {
+        crc = table[(crc ^ data[i]) & 0x0F] ^ (crc >> 4);
+        crc = table[(crc ^ (data[i] >> 4)) & 0x0F] ^ (crc >> 4);
+    }
+    return ~crc;
+}
+
+// 32-bit FNV-1a
+static uint32_t _zip_hash(uint32_t hash, const char *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= (uint8_t)data[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+bool fujiZip::is_archive(const char *filename)
+{
+    int l = strlen(filename);
+    return l > 4 && strcasecmp(filename + l - 4, ".zip") == 0;
+}
+
+bool fujiZip::split_path(const char *path, std::string &archive, std::string &member)
+{
+    for (const char *p = path; (p = strchr(p, '.')) != nullptr; p++)
+    {
+        if (strncasecmp(p, ".zip", 4) != 0 || (p[4] != '/' && p[4] != '\0'))
+            continue;
+
+        archive.assign(path, p + 4 - path);
+        member = p[4] == '/' ? p + 5 : "";
+        return true;
+    }
+    return false;
+}
+
+/* Finds the end of central directory record, which is followed only by the archive comment.
+   Most archives have no comment, so we try the last 22 bytes before searching further back
+*/
+bool fujiZip::_find_central_directory(FILE *f, uint32_t filesize, uint32_t *cd_offset, uint32_t *cd_entries)
+{
+    if (filesize < ZIP_END_OF_CD_SIZE)
+        return false;
+
+    uint32_t searchsize = ZIP_END_OF_CD_SIZE;
+    uint8_t small[ZIP_END_OF_CD_SIZE];
+    uint8_t *buf = small;
+    long eocd = -1;
+
+    if (fseek(f, filesize - searchsize, SEEK_SET) == 0 && fread(buf, 1, searchsize, f) == searchsize &&
+        _zip_u32(buf) == ZIP_SIG_END_OF_CD)
+    {
+        eocd = 0;
+    }
+    else
+    {
+        searchsize = filesize < ZIP_END_OF_CD_SIZE + ZIP_MAX_COMMENT ? filesize : ZIP_END_OF_CD_SIZE + ZIP_MAX_COMMENT;
+        buf = (uint8_t *)malloc(searchsize);
+        if (buf == nullptr)
+            return false;
+        if (fseek(f, filesize - searchsize, SEEK_SET) == 0 && fread(buf, 1, searchsize, f) == searchsize)
+        {
+            for (long i = searchsize - ZIP_END_OF_CD_SIZE; i >= 0; i--)
+                if (_zip_u32(buf + i) == ZIP_SIG_END_OF_CD)
+                {
+                    eocd = i;
+                    break;
+                }
+        }
+    }
+
+    bool found = eocd >= 0;
+    uint32_t eocd_pos = filesize - searchsize + eocd;
+    if (found)
+    {
+        *cd_entries = _zip_u16(buf + eocd + 10);
+        *cd_offset = _zip_u32(buf + eocd + 16);
+    }
+    if (buf != small)
+        free(buf);
+
+    if (found == false)
+    {
+        Debug_println("fujiZip: no end of central directory record");
+        return false;
+    }
+
+    if (*cd_entries != 0xFFFF && *cd_offset != 0xFFFFFFFF)
+        return true;
+
+    // ZIP64 - the real values are in another record pointed to by a locator just before this one
+    uint8_t loc[ZIP_ZIP64_LOCATOR_SIZE];
+    uint8_t rec[ZIP_ZIP64_END_OF_CD_SIZE];
+    if (eocd_pos < ZIP_ZIP64_LOCATOR_SIZE || fseek(f, eocd_pos - ZIP_ZIP64_LOCATOR_SIZE, SEEK_SET) != 0 ||
+        fread(loc, 1, sizeof(loc), f) != sizeof(loc) || _zip_u32(loc) != ZIP_SIG_ZIP64_LOCATOR)
+    {
+        Debug_println("fujiZip: missing ZIP64 locator");
+        return false;
+    }
+
+    uint64_t rec_offset = _zip_u64(loc + 8);
+    if (rec_offset >= filesize || fseek(f, rec_offset, SEEK_SET) != 0 || fread(rec, 1, sizeof(rec), f) != sizeof(rec) ||
+        _zip_u32(rec) != ZIP_SIG_ZIP64_END_OF_CD)
+    {
+        Debug_println("fujiZip: bad ZIP64 end of central directory record");
+        return false;
+    }
+
+    uint64_t entries = _zip_u64(rec + 32);
+    uint64_t offset = _zip_u64(rec + 48);
+    if (entries > ZIP_MAX_MEMBERS || offset >= filesize)
+    {
+        Debug_printf("fujiZip: can't handle ZIP64 archive with %llu members\n", entries);
+        return false;
+    }
+
+    *cd_entries = entries;
+    *cd_offset = offset;
+    return true;
+}
+
+bool fujiZip::_read_central_directory(FILE *f, uint32_t cd_offset, uint32_t cd_entries)
+{
+    if (fseek(f, cd_offset, SEEK_SET) != 0)
+        return false;
+
+    _members.reserve(cd_entries);
+
+    uint8_t hdr[ZIP_CENTRAL_HEADER_SIZE];
+    char name[MAX_PATHLEN];
+    uint8_t extra[64];
+
+    for (uint32_t i = 0; i < cd_entries; i++)
+    {
+        if (fread(hdr, 1, sizeof(hdr), f) != sizeof(hdr) || _zip_u32(hdr) != ZIP_SIG_CENTRAL_HEADER)
+        {
+            Debug_printf("fujiZip: bad central directory entry %u\n", i);
+            return false;
+        }
+
+        uint16_t namelen = _zip_u16(hdr + 28);
+        uint16_t extralen = _zip_u16(hdr + 30);
+        uint16_t commentlen = _zip_u16(hdr + 32);
+
+        // Names too long for us are skipped along with their member
+        bool usable = namelen < sizeof(name);
+        if (usable)
+        {
+            if (fread(name, 1, namelen, f) != namelen)
+                return false;
+            name[namelen] = '\0';
+        }
+        else if (fseek(f, namelen, SEEK_CUR) != 0)
+            return false;
+
+        zip_member m;
+        m.method = _zip_u16(hdr + 10);
+        m.modified_time = _zip_dostime_to_epoch(_zip_u16(hdr + 12), _zip_u16(hdr + 14));
+        m.crc32 = _zip_u32(hdr + 16);
+        uint64_t compressed_size = _zip_u32(hdr + 20);
+        uint64_t size = _zip_u32(hdr + 24);
+        uint64_t local_header_offset = _zip_u32(hdr + 42);
+
+        // Fields that don't fit in 32 bits are in the ZIP64 extra field, in this order
+        uint16_t extraread = extralen < sizeof(extra) ? extralen : sizeof(extra);
+        if (fread(extra, 1, extraread, f) != extraread || fseek(f, extralen - extraread + commentlen, SEEK_CUR) != 0)
+            return false;
+        for (uint16_t pos = 0; pos + 4 <= extraread;)
+        {
+            uint16_t id = _zip_u16(extra + pos);
+            uint16_t len = _zip_u16(extra + pos + 2);
+            pos += 4;
+            if (id == ZIP_EXTRA_ZIP64)
+            {
+                uint16_t p = pos;
+                if (size == 0xFFFFFFFF && p + 8 <= pos + len && p + 8 <= extraread)
+                {
+                    size = _zip_u64(extra + p);
+                    p += 8;
+                }
+                if (compressed_size == 0xFFFFFFFF && p + 8 <= pos + len && p + 8 <= extraread)
+                {
+                    compressed_size = _zip_u64(extra + p);
+                    p += 8;
+                }
+                if (local_header_offset == 0xFFFFFFFF && p + 8 <= pos + len && p + 8 <= extraread)
+                    local_header_offset = _zip_u64(extra + p);
+                break;
+            }
+            pos += len;
+        }
+
+        if (usable == false || size > UINT32_MAX || compressed_size > UINT32_MAX || local_header_offset > INT32_MAX)
+            continue;
+
+        m.size = size;
+        m.compressed_size = compressed_size;
+        m.local_header_offset = local_header_offset;
+        m.name_offset = _names.size();
+        _names.insert(_names.end(), name, name + namelen + 1);
+        _members.push_back(m);
+    }
+
+    return true;
+}
+
+bool fujiZip::load(FILE *f, uint32_t filesize)
+{
+    _members.clear();
+    _names.clear();
+    archive_size = filesize;
+
+    uint32_t cd_offset;
+    uint32_t cd_entries;
+    if (_find_central_directory(f, filesize, &cd_offset, &cd_entries) == false)
+        return false;
+
+    if (cd_entries > ZIP_MAX_MEMBERS)
+    {
+        Debug_printf("fujiZip: too many members (%u)\n", cd_entries);
+        return false;
+    }
+
+    if (_read_central_directory(f, cd_offset, cd_entries) == false)
+    {
+        _members.clear();
+        _names.clear();
+        return false;
+    }
+
+    _members.shrink_to_fit();
+    _names.shrink_to_fit();
+    Debug_printf("fujiZip: %u members, %u bytes of names\n", _members.size(), _names.size());
+    return true;
+}
+
+const zip_member *fujiZip::find(const char *membername)
+{
+    for (auto &m : _members)
+        if (strcmp(name(m), membername) == 0)
+            return &m;
+    return nullptr;
+}
+
+/* Archives only list files (and sometimes directories) by their full path,
+   so subdirectories are worked out from the names of members below dir
+*/
+void fujiZip::list(const std::string &dir, const char *pattern, uint16_t diroptions, dircache_listing &listing)
+{
+    bool have_pattern = pattern != nullptr && pattern[0] != '\0';
+    std::set<std::string> subdirs;
+    std::vector<const zip_member *> files;
+
+    for (auto &m : _members)
+    {
+        const char *n = name(m);
+        if (strncmp(n, dir.c_str(), dir.length()) != 0 || n[dir.length()] == '\0')
+            continue;
+
+        const char *rest = n + dir.length();
+        const char *slash = strchr(rest, '/');
+        if (slash != nullptr)
+        {
+            subdirs.insert(std::string(rest, slash - rest));
+            continue;
+        }
+
+        if (have_pattern && util_wildcard_match(rest, pattern) == false)
+            continue;
+        files.push_back(&m);
+    }
+
+    bool descending = diroptions & DIR_OPTION_DESCENDING;
+    if (diroptions & DIR_OPTION_FILEDATE)
+        std::sort(files.begin(), files.end(), [descending](const zip_member *a, const zip_member *b) {
+            return descending ? a->modified_time > b->modified_time : a->modified_time < b->modified_time;
+        });
+    else
+        std::sort(files.begin(), files.end(), [this, descending](const zip_member *a, const zip_member *b) {
+            int c = strcasecmp(name(*a), name(*b));
+            return descending ? c > 0 : c < 0;
+        });
+
+    // Directories first, like the other file systems
+    fsdir_entry_t entry;
+    entry.isDir = true;
+    entry.size = 0;
+    entry.modified_time = 0;
+    for (auto &d : subdirs)
+    {
+        strlcpy(entry.filename, d.c_str(), sizeof(entry.filename));
+        listing.add(&entry, DISKTYPE_UNKNOWN);
+    }
+
+    entry.isDir = false;
+    for (auto m : files)
+    {
+        strlcpy(entry.filename, name(*m) + dir.length(), sizeof(entry.filename));
+        entry.size = m->size;
+        entry.modified_time = m->modified_time;
+        listing.add(&entry, DiskType::discover_disktype(entry.filename));
+    }
+}
+
+std::string fujiZip::scratch_path(const zip_member &m)
+{
+    uint32_t hash = _zip_hash(2166136261, key.c_str(), key.length());
+    hash = _zip_hash(hash, name(m), strlen(name(m)));
+
+    // Keep the member's extension if it has a short, plain one
+    const char *ext = strrchr(name(m), '.');
+    if (ext != nullptr && (strchr(ext, '/') != nullptr || strlen(ext) > ZIP_SCRATCH_FILENAME_MAX - 17))
+        ext = nullptr;
+    for (const char *p = ext != nullptr ? ext + 1 : nullptr; p != nullptr && *p != '\0'; p++)
+        if (!isalnum((unsigned char)*p))
+        {
+            ext = nullptr;
+            break;
+        }
+
+    char path[sizeof(ZIP_SCRATCH_DIRECTORY) + ZIP_SCRATCH_FILENAME_MAX];
+    snprintf(path, sizeof(path), ZIP_SCRATCH_DIRECTORY "/%08x%08x%s", hash, m.crc32, ext != nullptr ? ext : "");
+    return std::string(path);
+}
+
+/* Reads the list of scratch files from the SD card the first time we need it
+*/
+bool fujiZipScratch::_load_index()
+{
+    if (_loaded)
+        return true;
+
+    if (fnSDFAT.running() == false)
+        return false;
+
+    _loaded = true;
+    _entries.clear();
+
+    FILE *f = fnSDFAT.file_open(ZIP_SCRATCH_INDEX_FILE, "r");
+    if (f == nullptr)
+        return true;
+
+    char magic[sizeof(ZIP_SCRATCH_MAGIC)];
+    if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) || memcmp(magic, ZIP_SCRATCH_MAGIC, sizeof(magic)) != 0)
+    {
+        Debug_println("fujiZipScratch index not recognized - starting empty");
+        fclose(f);
+        return true;
+    }
+
+    zip_scratch_entry e;
+    while (fread(&e, 1, sizeof(e), f) == sizeof(e))
+    {
+        e.filename[sizeof(e.filename) - 1] = '\0';
+        _entries.push_back(e);
+        if (e.last_used > _use_counter)
+            _use_counter = e.last_used;
+    }
+    fclose(f);
+    return true;
+}
+
+void fujiZipScratch::_save_index()
+{
+    fnSDFAT.create_path(ZIP_SCRATCH_DIRECTORY);
+
+    FILE *f = fnSDFAT.file_open(ZIP_SCRATCH_INDEX_FILE, "w");
+    if (f == nullptr)
+    {
+        Debug_println("fujiZipScratch failed to write index");
+        return;
+    }
+
+    fwrite(ZIP_SCRATCH_MAGIC, 1, sizeof(ZIP_SCRATCH_MAGIC), f);
+    for (auto &e : _entries)
+        fwrite(&e, 1, sizeof(e), f);
+    fclose(f);
+}
+
+uint32_t fujiZipScratch::_used()
+{
+    uint32_t total = 0;
+    for (auto &e : _entries)
+        total += e.size;
+    return total;
+}
+
+// Takes a path or a bare filename. Returns the index of its entry, or -1
+int fujiZipScratch::_find(const char *filename)
+{
+    const char *slash = strrchr(filename, '/');
+    if (slash != nullptr)
+        filename = slash + 1;
+
+    for (int i = 0; i < _entries.size(); i++)
+        if (strcmp(_entries[i].filename, filename) == 0)
+            return i;
+    return -1;
+}
+
+/* True if a scratch file we handed out is still mounted. Handles that are no longer
+   mounted are forgotten along the way
+*/
+bool fujiZipScratch::_in_use(const char *filename)
+{
+    bool in_use = false;
+    for (auto it = _open_files.begin(); it != _open_files.end();)
+    {
+        if (theFuji.file_mounted(it->f) == false)
+        {
+            it = _open_files.erase(it);
+            continue;
+        }
+        if (strcmp(it->filename, filename) == 0)
+            in_use = true;
+        ++it;
+    }
+    return in_use;
+}
+
+bool fujiZipScratch::known(const char *path, uint32_t size)
+{
+    if (_load_index() == false)
+        return false;
+
+    int i = _find(path);
+    return i >= 0 && _entries[i].size == size;
+}
+
+/* A member bigger than the whole limit still gets extracted, since there's no other way
+   to mount it, but everything that isn't mounted goes first
+*/
+void fujiZipScratch::make_room(uint32_t size)
+{
+    if (_load_index() == false)
+        return;
+
+    bool removed = false;
+    while (_entries.size() > 0 && (size > ZIP_SCRATCH_MAX_SIZE || _used() > ZIP_SCRATCH_MAX_SIZE - size))
+    {
+        int oldest = -1;
+        for (int i = 0; i < _entries.size(); i++)
+            if (_in_use(_entries[i].filename) == false &&
+                (oldest < 0 || _entries[i].last_used < _entries[oldest].last_used))
+                oldest = i;
+
+        if (oldest < 0)
+            break;
+
+        Debug_printf("fujiZipScratch removing \"%s\"\n", _entries[oldest].filename);
+        std::string path = ZIP_SCRATCH_DIRECTORY "/";
+        path += _entries[oldest].filename;
+        fnSDFAT.remove(path.c_str());
+        _entries.erase(_entries.begin() + oldest);
+        removed = true;
+    }
+
+    if (removed)
+        _save_index();
+}
+
+void fujiZipScratch::note_used(const char *path, uint32_t size, FILE *f)
+{
+    if (_load_index() == false)
+        return;
+
+    const char *slash = strrchr(path, '/');
+    const char *filename = slash != nullptr ? slash + 1 : path;
+
+    int i = _find(filename);
+    if (i < 0)
+    {
+        zip_scratch_entry e;
+        strlcpy(e.filename, filename, sizeof(e.filename));
+        _entries.push_back(e);
+        i = _entries.size() - 1;
+    }
+    _entries[i].size = size;
+    _entries[i].last_used = ++_use_counter;
+    _save_index();
+
+    zip_scratch_open_file o;
+    o.f = f;
+    strlcpy(o.filename, filename, sizeof(o.filename));
+    _open_files.push_back(o);
+}
+
+void fujiZipScratch::forget(const char *path)
+{
+    if (_load_index() == false)
+        return;
+
+    int i = _find(path);
+    if (i < 0)
+        return;
+    _entries.erase(_entries.begin() + i);
+    _save_index();
+}
+
+bool fujiZip::verify(FILE *f, const zip_member &m)
+{
+    if (fseek(f, 0, SEEK_SET) != 0)
+        return false;
+
+    uint8_t buf[512];
+    uint32_t crc = 0;
+    uint32_t remaining = m.size;
+    while (remaining > 0)
+    {
+        size_t count = remaining < sizeof(buf) ? remaining : sizeof(buf);
+        if (fread(buf, 1, count, f) != count)
+            return false;
+        crc = _zip_crc32(crc, buf, count);
+        remaining -= count;
+    }
+
+    if (crc != m.crc32)
+    {
+        Debug_printf("fujiZip: CRC mismatch for \"%s\" (%08x, expected %08x)\n", name(m), crc, m.crc32);
+        return false;
+    }
+    return true;
+}
+
+bool fujiZip::extract(FILE *archive, const zip_member &m, FILE *out)
+{
+    uint8_t hdr[ZIP_LOCAL_HEADER_SIZE];
+    if (fseek(archive, m.local_header_offset, SEEK_SET) != 0 || fread(hdr, 1, sizeof(hdr), archive) != sizeof(hdr) ||
+        _zip_u32(hdr) != ZIP_SIG_LOCAL_HEADER)
+    {
+        Debug_printf("fujiZip: bad local header for \"%s\"\n", name(m));
+        return false;
+    }
+
+    // The local header's name and extra field can differ in length from the central directory's
+    if (fseek(archive, _zip_u16(hdr + 26) + _zip_u16(hdr + 28), SEEK_CUR) != 0)
+        return false;
+
+    if (m.method == ZIP_METHOD_DEFLATED)
+        return DiskTypeCompressed::inflate(archive, m.compressed_size, out, m.size);
+
+    if (m.method != ZIP_METHOD_STORED)
+    {
+        Debug_printf("fujiZip: unsupported compression method %hu\n", m.method);
+        return false;
+    }
+
+    uint8_t buf[512];
+    uint32_t remaining = m.size;
+    while (remaining > 0)
+    {
+        size_t count = remaining < sizeof(buf) ? remaining : sizeof(buf);
+        if (fread(buf, 1, count, archive) != count || fwrite(buf, 1, count, out) != count)
+            return false;
+        remaining -= count;
+    }
+    return true;
+}
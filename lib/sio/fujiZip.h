@@ -0,0 +1,125 @@
+/* Browsing and mounting images inside ZIP archives
+
+ A path like "/games/collection.zip/Disk 1.atr" refers to a member of the
+ archive. The archive's central directory is read once into memory (names
+ packed into one buffer, as with fujiDirCache) and listings of the archive's
+ directories are built from it. A member is extracted to a scratch file on SD
+ the first time it's opened, so after that it can be read at any sector like
+ any other image. Scratch files are named after the archive and member CRC, so
+ mounting the same member again doesn't extract it again, and keep the member's
+ extension so the image type can still be told from the name. A scratch file is
+ only reused if it's in the index, which it's added to once its CRC has checked
+ out. The least recently used scratch files that aren't mounted are removed to
+ keep them under ZIP_SCRATCH_MAX_SIZE.
+
+ Only stored and deflated members are supported. ZIP64 sizes and offsets are
+ understood, but members past 4GB can't be reached.
+*/
+#ifndef _FUJI_ZIP_
+#define _FUJI_ZIP_
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "fujiDirCache.h"
+
+#define ZIP_SCRATCH_DIRECTORY "/scratch"
+#define ZIP_SCRATCH_INDEX_FILE ZIP_SCRATCH_DIRECTORY "/zipindex"
+// Total size of the members we keep extracted
+#define ZIP_SCRATCH_MAX_SIZE (64 * 1024 * 1024)
+// Two 8-digit hashes plus a dot and an extension of up to 8 characters
+#define ZIP_SCRATCH_FILENAME_MAX 26
+// Archives with more members than this are refused rather than eating all our memory
+#define ZIP_MAX_MEMBERS 16384
+
+#define ZIP_METHOD_STORED 0
+#define ZIP_METHOD_DEFLATED 8
+
+struct zip_member
+{
+    uint32_t name_offset;
+    uint32_t compressed_size;
+    uint32_t size;
+    uint32_t local_header_offset;
+    uint32_t crc32;
+    uint16_t method;
+    time_t modified_time;
+};
+
+struct zip_scratch_entry
+{
+    char filename[ZIP_SCRATCH_FILENAME_MAX];
+    uint32_t size;
+    uint32_t last_used;
+} __attribute__((packed));
+
+// A scratch file we handed out, which can't be removed while it's mounted
+struct zip_scratch_open_file
+{
+    FILE *f;
+    char filename[ZIP_SCRATCH_FILENAME_MAX];
+};
+
+// Keeps track of which scratch files were used last so the oldest can be removed
+class fujiZipScratch
+{
+private:
+    std::vector<zip_scratch_entry> _entries;
+    std::vector<zip_scratch_open_file> _open_files;
+    bool _loaded = false;
+    uint32_t _use_counter = 0;
+
+    bool _load_index();
+    void _save_index();
+    uint32_t _used();
+    int _find(const char *filename);
+    bool _in_use(const char *filename);
+
+public:
+    // True if the scratch file at path was fully extracted and checked
+    bool known(const char *path, uint32_t size);
+    // Removes the least recently used files that aren't mounted until size more bytes fit
+    void make_room(uint32_t size);
+    // Records that the scratch file at path was just extracted or opened as f
+    void note_used(const char *path, uint32_t size, FILE *f);
+    // Stops keeping track of the scratch file at path
+    void forget(const char *path);
+};
+
+extern fujiZipScratch fnZipScratch;
+
+class fujiZip
+{
+private:
+    std::vector<zip_member> _members;
+    std::vector<char> _names;
+
+    bool _find_central_directory(FILE *f, uint32_t filesize, uint32_t *cd_offset, uint32_t *cd_entries);
+    bool _read_central_directory(FILE *f, uint32_t cd_offset, uint32_t cd_entries);
+
+public:
+    // Host and full path of the archive
+    std::string key;
+    uint32_t archive_size = 0;
+
+    // Splits a path at the first ".zip/" into the archive and the path inside it. Returns false if there's no archive
+    static bool split_path(const char *path, std::string &archive, std::string &member);
+    static bool is_archive(const char *filename);
+
+    bool load(FILE *f, uint32_t filesize);
+
+    const char *name(const zip_member &m) { return &_names[m.name_offset]; };
+    const zip_member *find(const char *name);
+
+    // Adds the files and directories directly inside dir (which is empty or ends in '/') to the listing
+    void list(const std::string &dir, const char *pattern, uint16_t diroptions, dircache_listing &listing);
+
+    std::string scratch_path(const zip_member &m);
+    // Writes the member's uncompressed contents to out
+    bool extract(FILE *archive, const zip_member &m, FILE *out);
+    // Reads f back from the start and checks it against the member's CRC
+    bool verify(FILE *f, const zip_member &m);
+};
+
+#endif // _FUJI_ZIP_
@@ -9,6 +9,7 @@
 #include "fnWiFi.h"
 #include "fnFsSPIF.h"
 #include "fnSystem.h"
+#include "fnDNS.h"
 #include "../utils/utils.h"
 #include "fnConfig.h"
 
@@ -1086,7 +1087,22 @@ void sioModem::at_handle_dial()
 
         int portInt = std::stoi(port);
 
-        if (tcpClient.connect(host.c_str(), portInt))
+        // Look the host up in the background so a keypress can abort the dial, as on a real modem
+        in_addr_t ip;
+        bool aborted = false;
+        while (get_ip4_addr_by_name_async(host.c_str(), &ip) == false)
+        {
+            if (fnUartSIO.available())
+            {
+                fnUartSIO.read();
+                Debug_println("Dial aborted by keypress");
+                aborted = true;
+                break;
+            }
+            fnSystem.delay(10);
+        }
+
+        if (aborted == false && ip != IPADDR_NONE && tcpClient.connect(ip, portInt))
         {
             tcpClient.setNoDelay(true); // Try to disable naggle
 
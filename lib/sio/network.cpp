@@ -942,7 +942,9 @@ void sioNetwork::sio_special_protocol_00()
 // For commands with Peripheral->Computer payload
 void sioNetwork::sio_special_protocol_40()
 {
-    err = protocol->special(sp_buf, 4, &cmdFrame);
+    // Protocols send back four bytes
+    sp_buf_len = 4;
+    err = protocol->special(sp_buf, sp_buf_len, &cmdFrame);
     sio_to_computer(sp_buf, sp_buf_len, err);
 }
 
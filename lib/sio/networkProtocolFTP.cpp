@@ -5,6 +5,11 @@
 
 #include "networkProtocolFTP.h"
 
+extern "C"
+{
+#include "ftpparse.h"
+}
+
 networkProtocolFTP::networkProtocolFTP()
 {
 }
@@ -13,60 +18,318 @@ networkProtocolFTP::~networkProtocolFTP()
 {
 }
 
-string networkProtocolFTP::ftpResult()
+/* Feeds whatever has arrived on the control connection into the reply we're assembling.
+   Returns the reply code once a complete reply (including all lines of a multi-line
+   reply) is in, 0 if we're still waiting, or -1 if the connection is gone.
+   controlResponse holds the reply text without the code.
+*/
+int networkProtocolFTP::ftpPollReply()
 {
-    char buf[512];
-    long tstart=fnSystem.millis();
-    long tdur=0;
-
-    memset(buf, 0, sizeof(buf));
+    // The last read may have brought in more than one reply
+    int code = ftpParseReply();
+    if (code != 0)
+        return code;
 
-    if (!control.connected())
-        return "";
+    char buf[128];
 
-    while (tdur < 10000)
+    int a;
+    while ((a = control.available()) > 0)
     {
-        if (control.available() > 0)
+        int l = control.read((uint8_t *)buf, a > sizeof(buf) ? sizeof(buf) : a);
+        if (l <= 0)
             break;
 
-        tdur = fnSystem.millis() - tstart;
+        controlLine.append(buf, l);
+        code = ftpParseReply();
+        if (code != 0)
+            return code;
     }
 
-    int l = control.read_until('\n', buf, sizeof(buf));
-    Debug_printf("We got %d bytes back\n", l);
+    if (a <= 0 && !control.connected())
+        return -1;
 
-    if (l < 4)
-        return "";
+    return 0;
+}
 
-    string sbuf = string(buf);
-    controlResponse = sbuf.substr(4);
+/* Takes complete lines off the front of controlLine. Returns the reply code once they
+   finish a reply, leaving anything after it for the next call, otherwise 0
+*/
+int networkProtocolFTP::ftpParseReply()
+{
+    size_t eol;
+    while ((eol = controlLine.find('\n')) != string::npos)
+    {
+        string line = controlLine.substr(0, eol);
+        controlLine.erase(0, eol + 1);
+        if (line.length() > 0 && line[line.length() - 1] == '\r')
+            line.erase(line.length() - 1);
+
+        int code = 0;
+        if (line.length() >= 3 && isdigit(line[0]) && isdigit(line[1]) && isdigit(line[2]))
+            code = atoi(line.substr(0, 3).c_str());
+        string text = line.length() > 4 ? line.substr(4) : "";
+
+        // "123-" starts a multi-line reply, which runs until a line starting "123 "
+        if (controlMultiline == 0)
+        {
+            if (code == 0)
+                continue;
+            controlResponse = text;
+            if (line.length() > 3 && line[3] == '-')
+            {
+                controlMultiline = code;
+                continue;
+            }
+        }
+        else
+        {
+            if (code != controlMultiline || (line.length() > 3 && line[3] != ' '))
+            {
+                controlResponse += "\n" + line;
+                continue;
+            }
+            controlResponse += "\n" + text;
+            controlMultiline = 0;
+        }
 
-    Debug_printf("FTP Result: %s -  %s\n",sbuf.substr(0,3).c_str(),sbuf.c_str());
-    
-    return sbuf.substr(0,3);
+        Debug_printf("FTP Result: %d - %s\n", code, controlResponse.c_str());
+        return code;
+    }
+
+    return 0;
+}
+
+// Waits for the next reply and returns its three-digit code, or an empty string if none came
+string networkProtocolFTP::ftpResult()
+{
+    unsigned long tstart = fnSystem.millis();
+
+    while (fnSystem.millis() - tstart < FTP_TIMEOUT_MS)
+    {
+        int code = ftpPollReply();
+        if (code < 0)
+            return "";
+        if (code > 0)
+            return std::to_string(code);
+
+        // Let other tasks have a turn while we wait
+        fnSystem.delay(1);
+    }
+
+    Debug_println("Timed out waiting for FTP reply");
+    return "";
 }
 
+// Port from an EPSV reply: "Entering Extended Passive Mode (|||port|)"
 unsigned short networkProtocolFTP::parsePort(string response)
 {
-    size_t pos_start = 0;
-    size_t pos_end = 0;
-    unsigned short port;
+    size_t pos = response.find("|||");
+    if (pos == string::npos)
+        return 0;
 
-    pos_start = response.find_first_of("|");
-    pos_start += 2;
+    unsigned short port = atoi(response.c_str() + pos + 3);
+    Debug_printf("Parsed port is: %d\n", port);
+    return port;
+}
+
+/* Port from a PASV reply: "Entering Passive Mode (h1,h2,h3,h4,p1,p2)"
+   The address is ignored - we use the one we connected to, since servers behind NAT
+   often give their private address
+*/
+unsigned short networkProtocolFTP::parsePasv(string response)
+{
+    size_t pos = response.find('(');
+    if (pos == string::npos)
+        pos = response.find_first_of("0123456789");
+    if (pos == string::npos)
+        return 0;
 
-    Debug_printf("pos_start %d\n", pos_start);
+    int h1, h2, h3, h4, p1, p2;
+    if (sscanf(response.c_str() + pos + (response[pos] == '(' ? 1 : 0), "%d,%d,%d,%d,%d,%d", &h1, &h2, &h3, &h4, &p1, &p2) != 6)
+        return 0;
 
-    pos_end = response.find_last_of("|");
-    Debug_printf("pos_end %d\n", pos_end);
-    pos_start++;
-    pos_end--;
-    port = (atoi(response.substr(pos_start, pos_end).c_str()));
-    Debug_printf("port string %s\n", response.substr(pos_start, pos_end).c_str());
+    unsigned short port = (p1 << 8) | p2;
     Debug_printf("Parsed port is: %d\n", port);
     return port;
 }
 
+// Asks for a data port, using PASV if the server doesn't understand EPSV
+bool networkProtocolFTP::ftpPassive()
+{
+    Debug_printf("Attempting to get passive port\n");
+    control.write("EPSV\r\n");
+    if (ftpResult() == "229" && (dataPort = parsePort(controlResponse)) != 0)
+        return true;
+
+    Debug_printf("EPSV failed, trying PASV\n");
+    control.write("PASV\r\n");
+    if (ftpResult() == "227" && (dataPort = parsePasv(controlResponse)) != 0)
+        return true;
+
+    return false;
+}
+
+/* Turns a line of MLSD or LIST output into a directory entry.
+   MLSD lines are "fact=value;fact=value; name". LIST output has no standard
+   format, so it's left to ftpparse.
+*/
+void networkProtocolFTP::ftpAddEntry(string &line, bool mlsd, const string &pattern)
+{
+    string name;
+    long size = 0;
+    bool isDir = false;
+
+    if (mlsd)
+    {
+        size_t sp = line.find(' ');
+        if (sp == string::npos)
+            return;
+        name = line.substr(sp + 1);
+
+        size_t start = 0;
+        while (start < sp)
+        {
+            size_t end = line.find(';', start);
+            if (end == string::npos || end > sp)
+                end = sp;
+            string fact = line.substr(start, end - start);
+            start = end + 1;
+
+            size_t eq = fact.find('=');
+            if (eq == string::npos)
+                continue;
+            string key = fact.substr(0, eq);
+            string value = fact.substr(eq + 1);
+
+            if (strcasecmp(key.c_str(), "type") == 0)
+            {
+                // The directory itself and its parent
+                if (strcasecmp(value.c_str(), "cdir") == 0 || strcasecmp(value.c_str(), "pdir") == 0)
+                    return;
+                isDir = strcasecmp(value.c_str(), "dir") == 0;
+            }
+            else if (strcasecmp(key.c_str(), "size") == 0)
+                size = atol(value.c_str());
+        }
+    }
+    else
+    {
+        struct ftpparse fp;
+        if (ftpparse(&fp, &line[0], line.length()) == 0)
+            return;
+        name.assign(fp.name, fp.namelen);
+        if (fp.sizetype != FTPPARSE_SIZE_UNKNOWN)
+            size = fp.size;
+        isDir = fp.flagtrycwd && !fp.flagtryretr;
+    }
+
+    if (name.empty() || name == "." || name == "..")
+        return;
+
+    if (!pattern.empty() && !util_wildcard_match(name.c_str(), pattern.c_str()))
+        return;
+
+    if (aux2 & 0x80)
+    {
+        // Long entry
+        if (isDir)
+            name += "/";
+        dirBuffer += util_long_entry(name, size) + "\x9b";
+    }
+    else
+    {
+        // Short entry
+        dirBuffer += util_entry(util_crunch(name), size) + "\x9b";
+    }
+}
+
+/* Reads the current directory into dirBuffer, using MLSD if the server has it and LIST otherwise.
+   The listing is parsed line by line as it arrives.
+*/
+bool networkProtocolFTP::ftpListing(string pattern)
+{
+    bool mlsd = true;
+    string code;
+
+    while (true)
+    {
+        if (ftpPassive() == false)
+            return false;
+
+        control.write(mlsd ? "MLSD\r\n" : "LIST\r\n");
+
+        if (!data.connect(hostName.c_str(), dataPort))
+            return false;
+
+        code = ftpResult();
+        if (code == "150" || code == "125")
+            break;
+
+        data.stop();
+        if (mlsd == false)
+            return false;
+
+        Debug_printf("MLSD not available (%s), trying LIST\n", code.c_str());
+        mlsd = false;
+    }
+
+    string line;
+    uint8_t buf[256];
+    unsigned long tstart = fnSystem.millis();
+    transferDone = false;
+
+    while (true)
+    {
+        int a = data.available();
+        if (a > 0)
+        {
+            int l = data.read(buf, a > sizeof(buf) ? sizeof(buf) : a);
+            for (int i = 0; i < l; i++)
+            {
+                if (buf[i] == '\n')
+                {
+                    ftpAddEntry(line, mlsd, pattern);
+                    line.clear();
+                }
+                else if (buf[i] != '\r')
+                    line += (char)buf[i];
+            }
+            tstart = fnSystem.millis();
+            continue;
+        }
+
+        // The data connection was already drained when the server said it was done
+        if (transferDone)
+            break;
+
+        int reply = ftpPollReply();
+        if (reply < 0 || reply >= 400 || fnSystem.millis() - tstart > FTP_TIMEOUT_MS)
+        {
+            Debug_printf("Directory listing failed (%d)\n", reply);
+            data.stop();
+            return false;
+        }
+        // Check once more for data that arrived just ahead of the reply
+        if (reply > 0)
+        {
+            transferDone = true;
+            continue;
+        }
+
+        fnSystem.delay(1);
+    }
+
+    if (!line.empty())
+        ftpAddEntry(line, mlsd, pattern);
+
+    data.stop();
+
+    // Finally drop a FREE SECTORS trailer.
+    dirBuffer += "999+FREE SECTORS\x9b";
+
+    return true;
+}
+
 bool networkProtocolFTP::ftpLogin(EdUrlParser *urlParser)
 {
     string tmpPath;
@@ -80,12 +343,16 @@ bool networkProtocolFTP::ftpLogin(EdUrlParser *urlParser)
 
     Debug_printf("Got user, sending USER.\n");
     control.write("USER anonymous\r\n");
-    if (ftpResult()!="331")
-        return false;
+    string code = ftpResult();
 
-    Debug_printf("User Ok, sending password.\n");
-    control.write("PASS fujinet@fujinet.online\r\n");
-    if (ftpResult()!="230")
+    // Some servers let anonymous users straight in
+    if (code == "331")
+    {
+        Debug_printf("User Ok, sending password.\n");
+        control.write("PASS fujinet@fujinet.online\r\n");
+        code = ftpResult();
+    }
+    if (code != "230")
         return false;
 
     Debug_printf("Logged in.\n");
@@ -139,73 +406,54 @@ bool networkProtocolFTP::open(EdUrlParser *urlParser, cmdFrame_t *cmdFrame, enab
 
     hostName = urlParser->hostName;
     aux1 = cmdFrame->aux1;
+    aux2 = cmdFrame->aux2;
+    transferDone = false;
+    dirBuffer.clear();
+    controlLine.clear();
+    controlMultiline = 0;
 
     if (ftpLogin(urlParser) == false)
         return false;
 
-    Debug_printf("Attempting to get passive port\n");
-    control.write("EPSV\r\n");
-
-    if (ftpResult()!="229")
-        return false;
-
-    dataPort = parsePort(controlResponse);
-    Debug_printf("Received EPSV response. Port %d\n", dataPort);
-
     switch (cmdFrame->aux1)
     {
     case 4:
         Debug_printf("Attempting to open RETR. to %s\n", urlParser->path.c_str());
-
-        control.write("RETR ");
-        control.write(urlParser->path.c_str());
-        control.write("\r\n");
         break;
     case 6:
         tmpPath = urlParser->path.substr(urlParser->path.find_last_of("/") + 1);
-        Debug_printf("Attempting NLST to %s\n", tmpPath.c_str());
-        control.write("NLST");
-        if ((tmpPath != "*.*") && (tmpPath != "*") && (tmpPath != "**.*") && (tmpPath != "**") && (tmpPath != "-"))
-        {
-            control.write(" ");
-            control.write(tmpPath.c_str());
-        }
-        control.write("\r\n");
-        break;
+        if ((tmpPath == "*.*") || (tmpPath == "*") || (tmpPath == "**.*") || (tmpPath == "**") || (tmpPath == "-"))
+            tmpPath.clear();
+        Debug_printf("Attempting directory listing, pattern \"%s\"\n", tmpPath.c_str());
+        return ftpListing(tmpPath);
     case 8:
         Debug_printf("Storing file %s\n", urlParser->path.c_str());
-        control.write("STOR ");
-        control.write(urlParser->path.c_str());
-        control.write("\r\n");
         break;
     default:
         Debug_printf("Unimplemented aux1 = %d\n", cmdFrame->aux1);
         return false;
     }
 
+    if (ftpPassive() == false)
+        return false;
+
+    control.write(cmdFrame->aux1 == 4 ? "RETR " : "STOR ");
+    control.write(urlParser->path.c_str());
+    control.write("\r\n");
+
     if (!data.connect(hostName.c_str(), dataPort))
         return false;
 
     Debug_printf("%s Connected to data port: %d\n", fnSystem.get_uptime_str(), dataPort);
 
-    if (cmdFrame->aux1 != 8) // do not do this for write!
+    // Data flows as it comes - status() reports how much is waiting
+    string code = ftpResult();
+    if (code != "150" && code != "125")
     {
-        // Wait for data to become available before letting the Atari cut loose...
-        int delaymax = 0;
-        while (data.available() == 0)
-        {
-            if (delaymax >= 8000)
-            {
-                Debug_println("Timed out waiting for data on DATA channel");
-                data.stop();
-                return false;
-            }
-
-            Debug_println("Waiting for data on DATA channel");
-            fnSystem.delay(250);
-            delaymax += 250;
-        }
+        data.stop();
+        return false;
     }
+
     return true;
 }
 
@@ -215,6 +463,10 @@ bool networkProtocolFTP::close(enable_interrupt_t enable_interrupt)
     if (data.connected())
         data.stop();
 
+    // Make sure the server has stored everything we sent
+    if (aux1 == 8 && transferDone == false && ftpResult() != "226")
+        Debug_println("Server didn't confirm STOR");
+
     if (control.connected())
     {
         Debug_printf("Connected to data port, closing it.\n");
@@ -227,25 +479,22 @@ bool networkProtocolFTP::close(enable_interrupt_t enable_interrupt)
 
 bool networkProtocolFTP::read(uint8_t *rx_buf, unsigned short len)
 {
+    if (aux1 == 6) // are we reading directory?
+    {
+        // Asking for more than is left is an error, but give them what there is
+        unsigned short l = len > dirBuffer.size() ? dirBuffer.size() : len;
+        memcpy(rx_buf, dirBuffer.data(), l);
+        dirBuffer.erase(0, l);
+        return l != len;
+    }
+
     Debug_print("networkProtocolFTP::read()... ");
     size_t z = data.read(rx_buf, len);
     Debug_printf("%u of %hu bytes\n", z, len);
 
     if (z != len)
         return true;
-    else
-        dataSize -= len;
 
-    if (aux1 == 6)
-    {
-        for (int i = 0; i < len; i++)
-        {
-            if (rx_buf[i] == 0x0D)
-                rx_buf[i] = 0x20;
-            else if (rx_buf[i] == 0x0A)
-                rx_buf[i] = 0x9B;
-        }
-    }
     return false;
 }
 
@@ -263,12 +512,25 @@ bool networkProtocolFTP::write(uint8_t *tx_buf, unsigned short len)
 
 bool networkProtocolFTP::status(uint8_t *status_buf)
 {
+    if (aux1 == 6)
+    {
+        status_buf[0] = dirBuffer.size() & 0xFF;
+        status_buf[1] = dirBuffer.size() >> 8;
+        status_buf[2] = dirBuffer.empty() ? 0 : 1;
+        status_buf[3] = dirBuffer.empty() ? 136 : 1;
+        return false;
+    }
+
     int a = data.available();
-    __IGNORE_UNUSED_VAR(a);
+
+    // Nothing waiting doesn't mean the end - that's when the server says the transfer's done
+    if (a == 0 && transferDone == false && ftpPollReply() != 0)
+        transferDone = true;
+
     status_buf[0] = a & 0xFF;
     status_buf[1] = a >> 8;
     status_buf[2] = 0;
-    status_buf[3] = (a==0 ? 136 : 1);
+    status_buf[3] = (a == 0 && transferDone) ? 136 : 1;
     return false;
 }
 
@@ -307,7 +569,7 @@ bool networkProtocolFTP::mkdir(EdUrlParser *urlParser, cmdFrame_t *cmdFrame)
     control.write(urlParser->path.c_str());
     control.write("\r\n");
 
-    return ftpResult()=="250";
+    return ftpResult()=="257";
 }
 
 bool networkProtocolFTP::rmdir(EdUrlParser *urlParser, cmdFrame_t *cmdFrame)
@@ -360,7 +622,7 @@ bool networkProtocolFTP::rename(EdUrlParser *urlParser, cmdFrame_t *cmdFrame)
     control.write(rnFrom.c_str());
     control.write("\r\n");
 
-    if (ftpResult()=="350")
+    if (ftpResult()!="350")
         return false;
 
     control.write("RNTO ");
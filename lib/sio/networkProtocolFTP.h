@@ -6,6 +6,9 @@
 #include "sio.h"
 #include "EdUrlParser.h"
 
+// How long we wait for the server to say something
+#define FTP_TIMEOUT_MS 10000
+
 class networkProtocolFTP : public networkProtocol
 {
 public:
@@ -31,13 +34,26 @@ private:
     fnTcpClient control;
     fnTcpClient data;
     string controlResponse;
-    long dataSize;
+    // Control connection data not yet parsed, and the multi-line reply code while a reply is coming in
+    string controlLine;
+    int controlMultiline = 0;
     unsigned short dataPort;
     unsigned char aux1;
+    unsigned char aux2;
+    // Directory listing, already formatted for the Atari
+    string dirBuffer;
+    // Set once the server has said the transfer is over
+    bool transferDone = false;
 
     bool ftpLogin(EdUrlParser *urlParser);
+    int ftpPollReply();
+    int ftpParseReply();
     string ftpResult();
+    bool ftpPassive();
+    bool ftpListing(string pattern);
+    void ftpAddEntry(string &line, bool mlsd, const string &pattern);
     unsigned short parsePort(string response);
+    unsigned short parsePasv(string response);
 };
 
 #endif /* NETWORKPROTOCOLFTP */
@@ -1,6 +1,7 @@
 #include <expat.h>
 #include <sstream>
 #include "networkProtocolHTTP.h"
+#include "fnHttpCache.h"
 #include "utils.h"
 #include "../../include/debug.h"
 
@@ -153,6 +154,73 @@ void networkProtocolHTTP::parseDir()
     free(buf);
 }
 
+/* Looks for the response in fnHttpCache. Returns true if our copy is fresh enough to use
+   without asking the server, otherwise sets up the request to revalidate any copy we have.
+*/
+bool networkProtocolHTTP::cacheOpen()
+{
+    string etag, lastModified;
+    bool fresh = false;
+
+    cacheFile = fnHttpCache.open(openedUrl.c_str(), cacheRemaining, fresh, etag, lastModified);
+    if (cacheFile != nullptr && fresh)
+        return true;
+
+    if (cacheFile != nullptr)
+    {
+        if (!etag.empty())
+            client.set_header("If-None-Match", etag.c_str());
+        if (!lastModified.empty())
+            client.set_header("If-Modified-Since", lastModified.c_str());
+    }
+
+    const char *validators[] = {"ETag", "Last-Modified", "Cache-Control"};
+    client.collect_headers(validators, 3);
+    return false;
+}
+
+/* Serves a 304 from our copy, or starts copying a 200 into fnHttpCache.
+   Returns the result code the Atari should see.
+*/
+int networkProtocolHTTP::cacheCheckResponse(int code)
+{
+    cacheControl = client.get_header("Cache-Control");
+
+    if (code == 304 && cacheFile != nullptr)
+    {
+        fnHttpCache.revalidate(openedUrl.c_str(), cacheControl.c_str());
+        return 200;
+    }
+
+    if (cacheFile != nullptr)
+    {
+        fclose(cacheFile);
+        cacheFile = nullptr;
+    }
+
+    if (code == 200)
+        cacheStore = fnHttpCache.begin_store(openedUrl.c_str(), client.available(), client.get_header("ETag").c_str(),
+                                             client.get_header("Last-Modified").c_str(), cacheControl.c_str(), cacheStorePath);
+
+    return code;
+}
+
+// Keeps the copy being made only if the whole body made it
+void networkProtocolHTTP::cacheClose()
+{
+    if (cacheStore != nullptr)
+    {
+        fnHttpCache.end_store(openedUrl.c_str(), cacheStore, cacheStorePath, client.available() == 0, cacheControl.c_str());
+        cacheStore = nullptr;
+    }
+
+    if (cacheFile != nullptr)
+    {
+        fclose(cacheFile);
+        cacheFile = nullptr;
+    }
+}
+
 bool networkProtocolHTTP::startConnection(uint8_t *buf, unsigned short len)
 {
     bool ret = false;
@@ -172,9 +240,23 @@ bool networkProtocolHTTP::startConnection(uint8_t *buf, unsigned short len)
         ret = true;
         break;
     case GET:
-        client.collect_headers((const char **)headerCollection, headerCollectionIndex);
+        // Responses can only be cached if we know the Atari won't want anything but the body
+        if (headerCollectionIndex == 0 && requestHeadersSet == false && fnHttpCache.budget() > 0)
+        {
+            if (cacheOpen())
+            {
+                resultCode = 200;
+                ret = true;
+                break;
+            }
+            resultCode = cacheCheckResponse(client.GET());
+        }
+        else
+        {
+            client.collect_headers((const char **)headerCollection, headerCollectionIndex);
+            resultCode = client.GET();
+        }
 
-        resultCode = client.GET();
         if (resultCode == 404)
         {
             string baseurl = openedUrl.substr(0, openedUrl.find_last_of("/"));
@@ -341,6 +423,8 @@ bool networkProtocolHTTP::close(enable_interrupt_t enable_interrupt)
         free(putBuf);
     }
 
+    cacheClose();
+
     //client.end();
     client.close();
     
@@ -368,10 +452,26 @@ bool networkProtocolHTTP::read(uint8_t *rx_buf, unsigned short len)
             dirString.erase(0, len);
             return false;
         }
-        else
+        else if (cacheFile != nullptr)
         {
-            if (client.read(rx_buf, len) != len)
+            if (fread(rx_buf, 1, len, cacheFile) != len)
                 return true;
+            cacheRemaining = len > cacheRemaining ? 0 : cacheRemaining - len;
+            break;
+        }
+        else
+        {
+            {
+                int l = client.read(rx_buf, len);
+                if (cacheStore != nullptr && l > 0 && fwrite(rx_buf, 1, l, cacheStore) != l)
+                {
+                    // Out of room on SD - carry on without keeping a copy
+                    fnHttpCache.end_store(openedUrl.c_str(), cacheStore, cacheStorePath, false, nullptr);
+                    cacheStore = nullptr;
+                }
+                if (l != len)
+                    return true;
+            }
             break;
         case HEADERS:
             if (headerIndex < numHeaders)
@@ -444,6 +544,7 @@ bool networkProtocolHTTP::write(uint8_t *tx_buf, unsigned short len)
         strcpy(tmpValue, p);
 
         client.set_header(tmpKey, tmpValue);
+        requestHeadersSet = true;
 
 #ifdef DEBUG
         Debug_printf("headerKey: %s\n", tmpKey);
@@ -521,7 +622,7 @@ bool networkProtocolHTTP::status(uint8_t *status_buf)
                     return true;
             }
 
-            a = client.available();
+            a = cacheFile != nullptr ? cacheRemaining : client.available();
             a = a > 0xFFFF ? 0xFFFF : a;
 
             status_buf[0] = a & 0xFF;
@@ -44,6 +44,9 @@ public:
 private:
     virtual bool startConnection(uint8_t *buf, unsigned short len);
     void parseDir();
+    bool cacheOpen();
+    int cacheCheckResponse(int code);
+    void cacheClose();
 
     //HTTPClient client;
     fnHttpClient client;
@@ -88,6 +91,16 @@ private:
     string dirString;
     vector<DAVEntry> dirEntries;
     string postData;
+
+    // Set once the Atari has added request headers, which might change the response
+    bool requestHeadersSet = false;
+    // Our copy of the response body in fnHttpCache, when that's what we're reading
+    FILE *cacheFile = nullptr;
+    uint32_t cacheRemaining = 0;
+    // Where the body from the server is being copied for fnHttpCache
+    FILE *cacheStore = nullptr;
+    string cacheStorePath;
+    string cacheControl;
 };
 
 #endif /* NETWORKPROTOCOLHTTP */
@@ -1,3 +1,5 @@
+#include "esp_heap_caps.h"
+
 #include "networkProtocolUDP.h"
 #include "../../include/debug.h"
 
@@ -6,7 +8,6 @@ networkProtocolUDP::networkProtocolUDP()
 #ifdef DEBUG
     Debug_printf("networkProtocolUDP::ctor\n");
 #endif
-    saved_rx_buffer_len = 0;
     strcpy(dest, "localhost");
 }
 
@@ -15,7 +16,8 @@ networkProtocolUDP::~networkProtocolUDP()
 #ifdef DEBUG
     Debug_printf("networkProtocolUDP::dtor\n");
 #endif
-    saved_rx_buffer_len = 0;
+    if (queue != nullptr)
+        free(queue);
 }
 
 bool networkProtocolUDP::open(EdUrlParser *urlParser, cmdFrame_t *cmdFrame, enable_interrupt_t enable_interrupt)
@@ -32,24 +34,90 @@ bool networkProtocolUDP::open(EdUrlParser *urlParser, cmdFrame_t *cmdFrame, enab
 #endif
     }
 
+    if (queue == nullptr)
+    {
+        queue = (udp_datagram *)heap_caps_malloc(UDP_QUEUE_DEPTH * sizeof(udp_datagram), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (queue == nullptr)
+        {
+            Debug_println("networkProtocolUDP failed to allocate receive queue");
+            return false;
+        }
+    }
+    queue_head = 0;
+    queue_count = 0;
+    dropped = 0;
+
     return udp.begin(atoi(urlParser->port.c_str()));
 }
 
 bool networkProtocolUDP::close(enable_interrupt_t enable_interrupt)
 {
     udp.stop();
+    queue_count = 0;
+    if (dropped > 0)
+        Debug_printf("networkProtocolUDP dropped %u datagrams\n", dropped);
     return true;
 }
 
+/* Moves everything waiting on the socket into the queue, so datagrams that arrive
+   between polls from the Atari are kept separately instead of overwriting each other
+*/
+void networkProtocolUDP::receive_pending()
+{
+    if (queue == nullptr)
+        return;
+
+    int len;
+    while ((len = udp.parsePacket()) > 0)
+    {
+        if (queue_count == UDP_QUEUE_DEPTH)
+        {
+            // The newest data is the most useful to a game, so make room by losing the oldest
+            queue_head = (queue_head + 1) % UDP_QUEUE_DEPTH;
+            queue_count--;
+            dropped++;
+            Debug_printf("networkProtocolUDP queue full - dropped %u so far\n", dropped);
+        }
+
+        udp_datagram *d = &queue[(queue_head + queue_count) % UDP_QUEUE_DEPTH];
+        d->addr = udp.remoteIP();
+        d->port = udp.remotePort();
+        d->len = udp.read(d->data, len > UDP_DATAGRAM_MAX ? UDP_DATAGRAM_MAX : len);
+        d->pos = 0;
+        // Throw out whatever didn't fit
+        udp.flush();
+
+        queue_count++;
+    }
+}
+
 bool networkProtocolUDP::read(uint8_t *rx_buf, unsigned short len)
 {
 #ifdef DEBUG
     Debug_printf("networkProtocolUDP::read %d bytes\n", len);
 #endif
 
-    memcpy(rx_buf, saved_rx_buffer, len);
-    memset(saved_rx_buffer, 0, len);
-    saved_rx_buffer_len = 0;
+    if (queue_count == 0)
+        return true;
+
+    // Reads never run past the end of the datagram at the head of the queue
+    udp_datagram *d = &queue[queue_head];
+    unsigned short l = d->len - d->pos;
+    if (len < l)
+        l = len;
+
+    memcpy(rx_buf, d->data + d->pos, l);
+    d->pos += l;
+
+    // Replies go to whoever sent what we just read
+    strcpy(dest, inet_ntoa(d->addr));
+
+    if (d->pos >= d->len)
+    {
+        queue_head = (queue_head + 1) % UDP_QUEUE_DEPTH;
+        queue_count--;
+    }
+
     return false;
 }
 
@@ -73,30 +141,31 @@ bool networkProtocolUDP::write(uint8_t *tx_buf, unsigned short len)
         return false;
 }
 
+/* Bytes 0 and 1 are what's left of the oldest datagram, so a read of that
+   length gets exactly one message. The number waiting comes from the 'Q' command.
+*/
 bool networkProtocolUDP::status(uint8_t *status_buf)
 {
-    unsigned short len = udp.parsePacket();
+    receive_pending();
 
-    if (len > 0)
-    {
-        // Set destination automatically to remote address.
-        //strcpy(dest, udp.remoteIP().toString().c_str());
-        in_addr_t addr = udp.remoteIP();
-        strcpy(dest, inet_ntoa(addr));
-        //port = udp.remotePort();
-
-        saved_rx_buffer_len = len;
-        udp.read(saved_rx_buffer, len);
-    }
+    unsigned short len = queue_count > 0 ? queue[queue_head].len - queue[queue_head].pos : 0;
 
-    status_buf[0] = saved_rx_buffer_len & 0xFF;
-    status_buf[1] = saved_rx_buffer_len >> 8;
+    status_buf[0] = len & 0xFF;
+    status_buf[1] = len >> 8;
     status_buf[2] = 1;
-    status_buf[3] = 0x00;
+    status_buf[3] = 1;
 
     return false;
 }
 
+bool networkProtocolUDP::special_supported_40_command(unsigned char comnd)
+{
+    if (comnd == 'Q') // Queue status
+        return true;
+    else
+        return false;
+}
+
 bool networkProtocolUDP::special_supported_80_command(unsigned char comnd)
 {
     if (comnd == 'D') // Set DEST address
@@ -143,11 +212,33 @@ bool networkProtocolUDP::special(uint8_t *sp_buf, unsigned short len, cmdFrame_t
     case 'D':
         err = special_set_destination(sp_buf, len);
         break;
+    case 'Q':
+        err = special_queue_status(sp_buf, len);
+        break;
     }
     return err;
 }
 
+/* Bytes 0 and 1 are the number of datagrams waiting, bytes 2 and 3 how many have been
+   dropped because the queue was full (stopping at 65535)
+*/
+bool networkProtocolUDP::special_queue_status(uint8_t *sp_buf, unsigned short len)
+{
+    if (len < 4)
+        return true;
+
+    receive_pending();
+
+    uint16_t lost = dropped > 0xFFFF ? 0xFFFF : dropped;
+    sp_buf[0] = queue_count & 0xFF;
+    sp_buf[1] = queue_count >> 8;
+    sp_buf[2] = lost & 0xFF;
+    sp_buf[3] = lost >> 8;
+    return false;
+}
+
 int networkProtocolUDP::available()
 {
-    return saved_rx_buffer_len;
+    receive_pending();
+    return queue_count > 0 ? queue[queue_head].len - queue[queue_head].pos : 0;
 }
\ No newline at end of file
@@ -6,6 +6,21 @@
 #include "networkProtocol.h"
 #include "EdUrlParser.h"
 
+// Datagrams held until the Atari reads them. When full the oldest is dropped
+#define UDP_QUEUE_DEPTH 16
+// Larger datagrams are truncated
+#define UDP_DATAGRAM_MAX 512
+
+struct udp_datagram
+{
+    in_addr_t addr;
+    uint16_t port;
+    uint16_t len;
+    // Bytes of this datagram the Atari has already read
+    uint16_t pos;
+    uint8_t data[UDP_DATAGRAM_MAX];
+};
+
 class networkProtocolUDP : public networkProtocol 
 {
 public:
@@ -20,6 +35,7 @@ public:
     virtual bool special(uint8_t* sp_buf, unsigned short len, cmdFrame_t* cmdFrame);
     virtual int available();
 
+    virtual bool special_supported_40_command(unsigned char comnd);
     virtual bool special_supported_80_command(unsigned char comnd);
 
 private:
@@ -27,10 +43,17 @@ private:
     fnUDP udp;
     char dest[64];
     unsigned short port;
-    char saved_rx_buffer[512];
-    unsigned short saved_rx_buffer_len=0;
+
+    // Ring of received datagrams, allocated on open
+    udp_datagram *queue = nullptr;
+    int queue_head = 0;
+    int queue_count = 0;
+    // Datagrams thrown out because the queue was full
+    uint32_t dropped = 0;
 
     bool special_set_destination(uint8_t* sp_buf, unsigned short len);
+    bool special_queue_status(uint8_t* sp_buf, unsigned short len);
+    void receive_pending();
 };
 
 #endif // NETWORKPROTOCOLUDP
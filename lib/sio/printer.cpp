@@ -1,5 +1,6 @@
 #include "../../include/atascii.h"
 #include "printer.h"
+#include "fnConfig.h"
 
 #include "file_printer.h"
 #include "html_printer.h"
@@ -21,11 +22,147 @@
 #define SIO_PRINTERCMD_WRITE 0x57
 #define SIO_PRINTERCMD_STATUS 0x53
 
+// Kept next to the paper file and hidden from SD listings the same way
+#define PRINTER_JOBFILE_FORMAT "/printjob%u"
+
+// Rendering runs on CPU0 so it doesn't compete with the SIO service loop on CPU1
+#define PRINTER_SPOOL_STACKSIZE 8192
+#define PRINTER_SPOOL_PRIORITY 5
+#define PRINTER_SPOOL_CPUAFFINITY 0
+
 sioPrinter::~sioPrinter()
 {
+    if (_spool_task_handle != nullptr)
+        vTaskDelete(_spool_task_handle);
+    if (_spool_queue != nullptr)
+        vQueueDelete(_spool_queue);
+    if (_pptr_mutex != nullptr)
+        vSemaphoreDelete(_pptr_mutex);
+
     delete _pptr;
 }
 
+/* Renders spooled lines through the printer emulator. When no lines have arrived
+   for the configured idle time, whatever has been printed is closed off as a finished job.
+*/
+void sioPrinter::_spool_task(void *param)
+{
+    sioPrinter *p = (sioPrinter *)param;
+    printer_spool_line line;
+
+    while (true)
+    {
+        // Read each time round so a change to the setting takes effect without a restart
+        int idle_secs = Config.get_general_printer_job_idle();
+        TickType_t wait = idle_secs > 0 ? pdMS_TO_TICKS((TickType_t)idle_secs * 1000) : portMAX_DELAY;
+
+        if (xQueueReceive(p->_spool_queue, &line, wait) == pdTRUE)
+        {
+            xSemaphoreTake(p->_pptr_mutex, portMAX_DELAY);
+            memcpy(p->_pptr->provideBuffer(), line.data, line.linelen);
+            if (p->_pptr->process(line.linelen, line.aux1, line.aux2) == false)
+            {
+                Debug_println("Printer emulator failed to process spooled line");
+                p->_spool_error = true;
+            }
+            xSemaphoreGive(p->_pptr_mutex);
+        }
+        else
+        {
+            xSemaphoreTake(p->_pptr_mutex, portMAX_DELAY);
+            p->_finish_job();
+            xSemaphoreGive(p->_pptr_mutex);
+        }
+    }
+}
+
+void sioPrinter::_wait_spool_empty(int timeout_ms)
+{
+    unsigned long start = fnSystem.millis();
+    while (spool_busy() && fnSystem.millis() - start < (unsigned long)timeout_ms)
+        vTaskDelay(pdMS_TO_TICKS(10));
+}
+
+/* Moves the current output into the next job slot, replacing the oldest job if we're full.
+   Caller must hold _pptr_mutex.
+*/
+bool sioPrinter::_finish_job()
+{
+    if (_pptr->hasOutput() == false)
+        return false;
+
+    uint32_t id = _next_job_id++;
+    char jobfile[20];
+    snprintf(jobfile, sizeof(jobfile), PRINTER_JOBFILE_FORMAT, id % PRINTER_MAX_JOBS);
+
+    paper_t ptype = _pptr->getPaperType();
+    if (_pptr->moveOutput(jobfile) == false)
+    {
+        Debug_printf("Failed to store print job %u\n", id);
+        return false;
+    }
+
+    if (_job_count == PRINTER_MAX_JOBS)
+    {
+        memmove(&_jobs[0], &_jobs[1], sizeof(printer_job) * (PRINTER_MAX_JOBS - 1));
+        _job_count--;
+    }
+    _jobs[_job_count].id = id;
+    _jobs[_job_count].paper_type = ptype;
+    _jobs[_job_count].size = 0;
+    FILE *f = _storage->file_open(jobfile);
+    if (f != nullptr)
+    {
+        _jobs[_job_count].size = FileSystem::filesize(f);
+        fclose(f);
+    }
+    _job_count++;
+
+    Debug_printf("Finished print job %u (%ld bytes)\n", id, _jobs[_job_count - 1].size);
+
+    // Start the next job with a fresh emulator
+    _create_printer_emu(_ptype);
+
+    return true;
+}
+
+bool sioPrinter::finish_job()
+{
+    _wait_spool_empty(PRINTER_SPOOL_WAIT_MS);
+
+    xSemaphoreTake(_pptr_mutex, portMAX_DELAY);
+    bool result = _finish_job();
+    xSemaphoreGive(_pptr_mutex);
+
+    return result;
+}
+
+const printer_job *sioPrinter::get_job(int index)
+{
+    if (index < 0 || index >= _job_count)
+        return nullptr;
+
+    return &_jobs[_job_count - index - 1];
+}
+
+FILE *sioPrinter::open_job(uint32_t id, paper_t *paper_type)
+{
+    for (int i = 0; i < _job_count; i++)
+    {
+        if (_jobs[i].id != id)
+            continue;
+
+        if (paper_type != nullptr)
+            *paper_type = _jobs[i].paper_type;
+
+        char jobfile[20];
+        snprintf(jobfile, sizeof(jobfile), PRINTER_JOBFILE_FORMAT, id % PRINTER_MAX_JOBS);
+        return _storage->file_open(jobfile);
+    }
+
+    return nullptr;
+}
+
 // write for W commands
 void sioPrinter::sio_write(uint8_t aux1, uint8_t aux2)
 {
@@ -78,13 +215,26 @@ void sioPrinter::sio_write(uint8_t aux1, uint8_t aux2)
             }
             _buffer[linelen] = ATASCII_EOL;
         }
-        // Copy the data to the printer emulator's buffer
-        memcpy(_pptr->provideBuffer(), _buffer, linelen);
+        // Report any failure rendering earlier lines
+        if (_spool_error)
+        {
+            _spool_error = false;
+            sio_error();
+            return;
+        }
+
+        printer_spool_line line;
+        line.linelen = linelen;
+        line.aux1 = aux1;
+        line.aux2 = aux2;
+        memcpy(line.data, _buffer, linelen);
 
-        if (_pptr->process(linelen, aux1, aux2))
+        // Only make the Atari wait if the spool is full
+        if (xQueueSend(_spool_queue, &line, pdMS_TO_TICKS(PRINTER_SPOOL_WAIT_MS)) == pdTRUE)
             sio_complete();
         else
         {
+            Debug_println("Printer spool full");
             sio_error();
         }
     }
@@ -127,13 +277,27 @@ void sioPrinter::sio_status()
 
     status[0] = 0;
     status[1] = _lastaux1;
-    status[2] = 5;
+    // Ask for a longer write timeout once the spool starts backing up
+    status[2] = uxQueueSpacesAvailable(_spool_queue) < PRINTER_SPOOL_DEPTH / 2 ? 15 : 5;
     status[3] = 0;
 
     sio_to_computer(status, sizeof(status), false);
 }
 
 void sioPrinter::set_printer_type(sioPrinter::printer_type printer_type)
+{
+    // Let anything already spooled print on the old emulator
+    _wait_spool_empty(PRINTER_SPOOL_WAIT_MS);
+
+    xSemaphoreTake(_pptr_mutex, portMAX_DELAY);
+    // Whatever was printed on the old emulator becomes a job of its own
+    _finish_job();
+    _create_printer_emu(printer_type);
+    xSemaphoreGive(_pptr_mutex);
+}
+
+// Caller must hold _pptr_mutex
+void sioPrinter::_create_printer_emu(sioPrinter::printer_type printer_type)
 {
     // Destroy any current printer emu object
     delete _pptr;
@@ -208,13 +372,22 @@ void sioPrinter::set_printer_type(sioPrinter::printer_type printer_type)
 sioPrinter::sioPrinter(FileSystem *filesystem, printer_type print_type)
 {
     _storage = filesystem;
-    set_printer_type(print_type);
+    _create_printer_emu(print_type);
+
+    _pptr_mutex = xSemaphoreCreateMutex();
+    _spool_queue = xQueueCreate(PRINTER_SPOOL_DEPTH, sizeof(printer_spool_line));
+    xTaskCreatePinnedToCore(_spool_task, "fnPrinter", PRINTER_SPOOL_STACKSIZE, this,
+        PRINTER_SPOOL_PRIORITY, &_spool_task_handle, PRINTER_SPOOL_CPUAFFINITY);
 }
 
 void sioPrinter::shutdown()
 {
+    _wait_spool_empty(PRINTER_SPOOL_WAIT_MS);
+
+    xSemaphoreTake(_pptr_mutex, portMAX_DELAY);
     if (_pptr != nullptr)
         _pptr->closeOutput();
+    xSemaphoreGive(_pptr_mutex);
 }
 /* Returns a printer type given a string model name
 */
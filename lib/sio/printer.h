@@ -3,10 +3,42 @@
 
 #include <string.h>
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+
 #include "sio.h"
 #include "../printer-emulator/printer_emulator.h"
 #include "fnFS.h"
 
+// Number of lines from the Atari we hold before making it wait for the printer emulator
+#define PRINTER_SPOOL_DEPTH 64
+// How long a write waits for room in a full spool before failing (must be under the SIO timeout)
+#define PRINTER_SPOOL_WAIT_MS 4000
+/* Output is closed off as a finished job after this many seconds without new lines, unless
+   "printerjobidle" in fnconfig.ini says otherwise. Zero there means jobs only end when the
+   output is fetched from the web UI or the printer type is changed
+*/
+#define PRINTER_JOB_IDLE_DEFAULT_SECS 120
+// Number of finished print jobs kept on storage
+#define PRINTER_MAX_JOBS 8
+
+struct printer_spool_line
+{
+    uint8_t linelen;
+    uint8_t aux1;
+    uint8_t aux2;
+    uint8_t data[40];
+};
+
+struct printer_job
+{
+    uint32_t id = 0;
+    paper_t paper_type = RAW;
+    long size = 0;
+};
+
 class sioPrinter : public sioDevice
 {
 protected:
@@ -20,6 +52,23 @@ protected:
     printer_emu *_pptr = nullptr;
     FileSystem *_storage = nullptr;
 
+    // Lines are acknowledged as soon as they're queued and rendered by _spool_task on the other core
+    QueueHandle_t _spool_queue = nullptr;
+    TaskHandle_t _spool_task_handle = nullptr;
+    // Held whenever _pptr is being used or replaced
+    SemaphoreHandle_t _pptr_mutex = nullptr;
+    // Set by the spool task when the emulator fails, reported on the next write
+    bool _spool_error = false;
+
+    // Finished jobs, oldest first
+    printer_job _jobs[PRINTER_MAX_JOBS];
+    int _job_count = 0;
+    uint32_t _next_job_id = 1;
+
+    static void _spool_task(void *param);
+    void _wait_spool_empty(int timeout_ms);
+    bool _finish_job();
+
     time_t _last_ms;
     uint8_t _lastaux1;
     uint8_t _lastaux2;
@@ -59,9 +108,22 @@ public:
 
     printer_emu *getPrinterPtr() { return _pptr; };
 
+    // True if there are lines waiting to be rendered
+    bool spool_busy() { return uxQueueMessagesWaiting(_spool_queue) > 0; };
+
+    // Renders anything still spooled and turns the current output into a finished job
+    bool finish_job();
+    int job_count() { return _job_count; };
+    // Index 0 is the most recent job
+    const printer_job *get_job(int index);
+    // Opens a finished job's output for reading. Returns nullptr if the job isn't available
+    FILE *open_job(uint32_t id, paper_t *paper_type);
+
 
 private:
     printer_type _ptype;
+
+    void _create_printer_emu(printer_type printer_type);
 };
 
 #endif // guard
@@ -9,6 +9,8 @@
 #include "utils.h"
 #include "midimaze.h"
 #include "cassette.h"
+#include "fujiImageCache.h"
+#include "sioTrace.h"
 #include "../../include/debug.h"
 
 // Helper functions outside the class defintions
@@ -54,6 +56,7 @@ void sioDevice::sio_to_computer(uint8_t *buf, uint16_t len, bool err)
         sio_complete();
 
     // Write data frame
+    fnSioTrace.data_to_computer(len);
     fnUartSIO.write(buf, len);
     // Write checksum
     fnUartSIO.write(sio_checksum(buf, len));
@@ -80,6 +83,7 @@ uint8_t sioDevice::sio_to_peripheral(uint8_t *buf, unsigned short len)
     while (0 == fnUartSIO.available())
         fnSystem.yield();
     uint8_t ck_rcv = fnUartSIO.read();
+    fnSioTrace.data_from_computer(len);
 
     uint8_t ck_tst = sio_checksum(buf, len);
 
@@ -94,6 +98,7 @@ uint8_t sioDevice::sio_to_peripheral(uint8_t *buf, unsigned short len)
 
     if (ck_rcv != ck_tst)
     {
+        SIO.highSpeedFrameResult(false);
         sio_nak();
         return false;
     }
@@ -106,6 +111,7 @@ uint8_t sioDevice::sio_to_peripheral(uint8_t *buf, unsigned short len)
 // SIO NAK
 void sioDevice::sio_nak()
 {
+    fnSioTrace.response('N');
     fnUartSIO.write('N');
     fnUartSIO.flush();
     Debug_println("NAK!");
@@ -114,6 +120,7 @@ void sioDevice::sio_nak()
 // SIO ACK
 void sioDevice::sio_ack()
 {
+    fnSioTrace.response('A');
     fnUartSIO.write('A');
     fnSystem.delay_microseconds(DELAY_T5); //?
     fnUartSIO.flush();
@@ -123,6 +130,7 @@ void sioDevice::sio_ack()
 // SIO COMPLETE
 void sioDevice::sio_complete()
 {
+    fnSioTrace.response('C');
     fnSystem.delay_microseconds(DELAY_T5);
     fnUartSIO.write('C');
     Debug_println("COMPLETE!");
@@ -131,6 +139,7 @@ void sioDevice::sio_complete()
 // SIO ERROR
 void sioDevice::sio_error()
 {
+    fnSioTrace.response('E');
     fnSystem.delay_microseconds(DELAY_T5);
     fnUartSIO.write('E');
     Debug_println("ERROR!");
@@ -174,8 +183,18 @@ void sioBus::_sio_process_cmd()
         fnSystem.yield();
 
     uint8_t ck = sio_checksum((uint8_t *)&tempFrame.commanddata, sizeof(tempFrame.commanddata)); // Calculate Checksum
+    fnSioTrace.begin_frame((uint8_t *)&tempFrame, ck == tempFrame.checksum);
     if (ck == tempFrame.checksum)
     {
+        /* The same sector read twice in a row from a disk means the computer didn't get it
+           the first time. Other devices (e.g. the network) use 'R' for reads that are
+           legitimately repeated, so only disk frames are checked
+        */
+        bool diskFrame = tempFrame.device >= SIO_DEVICEID_DISK && tempFrame.device <= SIO_DEVICEID_DISK_LAST;
+        highSpeedFrameResult(!diskFrame || tempFrame.comnd != 'R' || tempFrame.commanddata != _hsioLastCommand);
+        if (diskFrame)
+            _hsioLastCommand = tempFrame.commanddata;
+
         if (tempFrame.device == SIO_DEVICEID_DISK && _fujiDev != nullptr && _fujiDev->boot_config)
         {
             _activeDev = _fujiDev->bootdisk();
@@ -228,6 +247,7 @@ void sioBus::_sio_process_cmd()
     else
     {
         Debug_print("CHECKSUM_ERROR\n");
+        highSpeedFrameResult(false);
         // Switch to/from hispeed SIO if we get enough failed frame checksums
         _command_frame_counter++;
         if (COMMAND_FRAME_SPEED_CHANGE_THRESHOLD == _command_frame_counter)
@@ -236,6 +256,8 @@ void sioBus::_sio_process_cmd()
             toggleBaudrate();
         }
     }
+    fnSioTrace.end_frame();
+    _last_cmd_ms = fnSystem.millis();
     fnLedManager.set(eLed::LED_SIO, false);
 }
 
@@ -324,6 +346,17 @@ void sioBus::service()
     // Neither CMD nor active modem, so throw out any stray input data
     {
         fnUartSIO.flush_input();
+        // Overlay changes from the web UI that need the image's host
+        _fujiDev->run_pending_overlays();
+        // Good time to write back disk images kept in RAM
+        _fujiDev->flush_idle_disks();
+        // Read a little more from hosts once the computer seems to be busy with other things
+        if (fnSystem.millis() - _last_cmd_ms > SIO_BACKGROUND_IDLE_MS)
+        {
+            fnImageCache.fill_idle();
+            _fujiDev->prefetch_idle_disks();
+            _fujiDev->fill_idle_directories();
+        }
     }
 
     // Handle interrupts from network protocols
@@ -497,6 +530,72 @@ int sioBus::getHighSpeedBaud()
     return _sioBaudHigh;
 }
 
+/* HSIO calibration
+   We can't send anything until the computer asks, so calibration just watches normal traffic. Each
+   index, fastest first, is tried until HSIO_CALIBRATION_FRAMES good frames arrive at high speed. Too
+   many bad frames (or retried reads) rejects the index and we try the next slower one. The index the
+   computer is told about changes right away, but the computer only picks it up the next time it asks
+   (usually after falling back to standard speed because of the errors).
+*/
+void sioBus::startHighSpeedCalibration()
+{
+    Debug_println("Starting HSIO calibration");
+    if (_hsioCalibrating == false)
+        _hsioCalPreviousIndex = _sioHighSpeedIndex;
+    _hsioCalibrating = true;
+    _hsio_calibration_step(HSIO_CALIBRATION_FASTEST_INDEX);
+}
+
+void sioBus::_hsio_calibration_step(int index)
+{
+    _hsioCalFrames = 0;
+    _hsioCalErrors = 0;
+    setHighSpeedIndex(index);
+}
+
+int sioBus::highSpeedCalibrationVerdict(int frames, int errors)
+{
+    if (errors > HSIO_CALIBRATION_MAX_ERRORS)
+        return -1;
+    if (frames >= HSIO_CALIBRATION_FRAMES)
+        return 1;
+    return 0;
+}
+
+void sioBus::highSpeedFrameResult(bool good)
+{
+    // Frames at standard speed say nothing about the index
+    if (_hsioCalibrating == false || useUltraHigh || _sioBaud != _sioBaudHigh)
+        return;
+
+    if (good)
+        _hsioCalFrames++;
+    else
+        _hsioCalErrors++;
+
+    switch (highSpeedCalibrationVerdict(_hsioCalFrames, _hsioCalErrors))
+    {
+    case 1:
+        Debug_printf("HSIO calibration: index %d is stable\n", _sioHighSpeedIndex);
+        _hsioCalibrating = false;
+        Config.store_general_hsioindex(_sioHighSpeedIndex);
+        Config.store_general_hsio_calibrated(true);
+        Config.save();
+        break;
+    case -1:
+        Debug_printf("HSIO calibration: index %d rejected after %d good frames\n", _sioHighSpeedIndex, _hsioCalFrames);
+        if (_sioHighSpeedIndex < HSIO_CALIBRATION_SLOWEST_INDEX)
+            _hsio_calibration_step(_sioHighSpeedIndex + 1);
+        else
+        {
+            Debug_println("HSIO calibration: no stable index - keeping previous setting");
+            _hsioCalibrating = false;
+            setHighSpeedIndex(_hsioCalPreviousIndex);
+        }
+        break;
+    }
+}
+
 void sioBus::setMIDIHost(const char *hostname)
 {
 
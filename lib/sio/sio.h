@@ -56,9 +56,20 @@ FN_HISPEED_INDEX=40 //  18,806 (18,806) baud
 
 #define SIO_HISPEED_LOWEST_INDEX 0x0A // Lowest HSIO index we'll accept
 
+// HSIO calibration starts at the fastest index and steps down to the slowest one fnConfig will load
+#define HSIO_CALIBRATION_FASTEST_INDEX 0x00
+#define HSIO_CALIBRATION_SLOWEST_INDEX 0x09
+// Good high speed frames needed before an index is called stable
+#define HSIO_CALIBRATION_FRAMES 256
+// An index is rejected once it's had more bad frames (or retried reads) than this
+#define HSIO_CALIBRATION_MAX_ERRORS 2
+
 #define COMMAND_FRAME_SPEED_CHANGE_THRESHOLD 2
 #define SERIAL_TIMEOUT 300
 
+// Background work that reads from hosts (image cache copies, prefetch) waits until there's been no command for this long
+#define SIO_BACKGROUND_IDLE_MS 1000
+
 #define SIO_DEVICEID_DISK 0x31
 #define SIO_DEVICEID_DISK_LAST 0x3F
 
@@ -244,6 +255,8 @@ private:
     std::forward_list<sioDevice *> _daisyChain;
 
     int _command_frame_counter = 0;
+    // When we last finished handling a command frame
+    unsigned long _last_cmd_ms = 0;
 
     sioDevice *_activeDev = nullptr;
     sioModem *_modemDev = nullptr;
@@ -258,6 +271,16 @@ private:
 
     bool useUltraHigh=false; // Use fujinet derived clock.
 
+    // HSIO calibration state
+    bool _hsioCalibrating = false;
+    int _hsioCalFrames = 0;
+    int _hsioCalErrors = 0;
+    int _hsioCalPreviousIndex = SIO_HISPEED_INDEX;
+    // Used to spot the computer retrying a read
+    uint32_t _hsioLastCommand = 0;
+
+    void _hsio_calibration_step(int index);
+
     void _sio_process_cmd();
     void _sio_process_queue();
 
@@ -281,6 +304,14 @@ public:
     int getHighSpeedIndex(); // Gets current HSIO index
     int getHighSpeedBaud(); // Gets current HSIO baud
 
+    void startHighSpeedCalibration(); // Try HSIO indexes from the fastest down until one runs without errors
+    bool isHighSpeedCalibrating() { return _hsioCalibrating; }
+    int getHighSpeedCalibrationFrames() { return _hsioCalFrames; }
+    int getHighSpeedCalibrationErrors() { return _hsioCalErrors; }
+    void highSpeedFrameResult(bool good); // Counts a frame towards calibration if we're at high speed
+    // 1 if an index with these counts is stable, -1 if it should be rejected, 0 if we need more frames
+    static int highSpeedCalibrationVerdict(int frames, int errors);
+
     void setMIDIHost(const char *newhost); // Set new host/ip for MIDIMaze
     void setUltraHigh(bool _enable, int _ultraHighBaud = 0); // enable ultrahigh/set baud rate
     bool getUltraHighEnabled() { return useUltraHigh; }
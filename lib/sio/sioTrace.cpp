@@ -0,0 +1,107 @@
+#include <string.h>
+
+#include "esp_heap_caps.h"
+
+#include "../../include/debug.h"
+#include "fnSystem.h"
+
+#include "sioTrace.h"
+
+// Entries copied per critical section by snapshot(), so interrupts aren't held off for the whole buffer
+#define SIO_TRACE_SNAPSHOT_BATCH 16
+
+sioTrace fnSioTrace;
+
+void sioTrace::begin_frame(const uint8_t frame[5], bool checksum_ok)
+{
+    _current = nullptr;
+
+    if (enabled == false)
+        return;
+
+    // Only allocated once there's something to record
+    if (_entries == nullptr)
+    {
+        _entries = (sio_trace_entry *)heap_caps_calloc(SIO_TRACE_ENTRIES, sizeof(sio_trace_entry), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (_entries == nullptr)
+        {
+            Debug_println("sioTrace failed to allocate buffer - disabling");
+            enabled = false;
+            return;
+        }
+    }
+
+    portENTER_CRITICAL(&_lock);
+    _current = &_entries[_recorded % SIO_TRACE_ENTRIES];
+    memset(_current, 0, sizeof(sio_trace_entry));
+    _current->start_us = fnSystem.micros();
+    memcpy(_current->frame, frame, sizeof(_current->frame));
+    if (checksum_ok == false)
+        _current->flags |= SIO_TRACE_BAD_CHECKSUM;
+    _recorded++;
+    portEXIT_CRITICAL(&_lock);
+}
+
+void sioTrace::response(char r)
+{
+    if (_current == nullptr)
+        return;
+
+    for (int i = 0; i < SIO_TRACE_MAX_RESPONSES; i++)
+        if (_current->responses[i] == '\0')
+        {
+            _current->responses[i] = r;
+            return;
+        }
+    _current->flags |= SIO_TRACE_RESPONSES_LOST;
+}
+
+void sioTrace::data_to_computer(uint16_t len)
+{
+    if (_current != nullptr)
+        _current->bytes_to_computer += len;
+}
+
+void sioTrace::data_from_computer(uint16_t len)
+{
+    if (_current != nullptr)
+        _current->bytes_from_computer += len;
+}
+
+void sioTrace::end_frame()
+{
+    if (_current == nullptr)
+        return;
+
+    _current->duration_us = fnSystem.micros() - _current->start_us;
+    _current = nullptr;
+}
+
+int sioTrace::snapshot(sio_trace_entry *buffer, int max)
+{
+    if (_entries == nullptr)
+        return 0;
+
+    portENTER_CRITICAL(&_lock);
+    uint32_t end = _recorded;
+    portEXIT_CRITICAL(&_lock);
+
+    uint32_t count = end < SIO_TRACE_ENTRIES ? end : SIO_TRACE_ENTRIES;
+    if (count > max)
+        count = max;
+
+    uint32_t next = end - count;
+    int copied = 0;
+    while (next < end)
+    {
+        portENTER_CRITICAL(&_lock);
+        // Frames recorded since we started may have reused entries we hadn't copied yet, so skip past them
+        if (_recorded - next > SIO_TRACE_ENTRIES)
+            next = _recorded - SIO_TRACE_ENTRIES;
+        for (int i = 0; i < SIO_TRACE_SNAPSHOT_BATCH && next < end; i++)
+            buffer[copied++] = _entries[next++ % SIO_TRACE_ENTRIES];
+        portEXIT_CRITICAL(&_lock);
+    }
+
+    return copied;
+}
@@ -0,0 +1,64 @@
+/* Recent SIO traffic kept in RAM for diagnosing boot failures without a serial console
+
+ Each command frame gets an entry with the frame as received, whether its
+ checksum was good, the ACK/NAK/COMPLETE/ERROR bytes we sent back, the size
+ of any data frames in each direction and timing in microseconds. Data frame
+ contents aren't kept. The last SIO_TRACE_ENTRIES frames are kept and can be
+ downloaded from the web UI as JSON.
+*/
+#ifndef _SIO_TRACE_
+#define _SIO_TRACE_
+
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+
+#define SIO_TRACE_ENTRIES 1024
+#define SIO_TRACE_MAX_RESPONSES 4
+
+// Entry flags
+#define SIO_TRACE_BAD_CHECKSUM 0x01
+// More responses were sent than would fit
+#define SIO_TRACE_RESPONSES_LOST 0x02
+
+struct sio_trace_entry
+{
+    // fnSystem.micros() when the command frame arrived
+    uint32_t start_us;
+    uint32_t duration_us;
+    // Device, command, aux1, aux2 and checksum as received
+    uint8_t frame[5];
+    uint8_t flags;
+    // 'A', 'N', 'C' and 'E' in the order they were sent
+    char responses[SIO_TRACE_MAX_RESPONSES];
+    uint16_t bytes_to_computer;
+    uint16_t bytes_from_computer;
+} __attribute__((packed));
+
+class sioTrace
+{
+private:
+    sio_trace_entry *_entries = nullptr;
+    // Total frames recorded - the next entry is _recorded % SIO_TRACE_ENTRIES
+    uint32_t _recorded = 0;
+    // Entry for the frame being handled, if any
+    sio_trace_entry *_current = nullptr;
+    portMUX_TYPE _lock = portMUX_INITIALIZER_UNLOCKED;
+
+public:
+    bool enabled = true;
+
+    void begin_frame(const uint8_t frame[5], bool checksum_ok);
+    void response(char r);
+    void data_to_computer(uint16_t len);
+    void data_from_computer(uint16_t len);
+    void end_frame();
+
+    uint32_t recorded() { return _recorded; };
+    // Copies up to max entries into buffer, oldest first. Returns the number copied
+    int snapshot(sio_trace_entry *buffer, int max);
+};
+
+extern sioTrace fnSioTrace;
+
+#endif // _SIO_TRACE_
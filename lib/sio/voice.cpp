@@ -6,6 +6,36 @@ using namespace std;
 
 #define EOL 0x9B
 
+// Number of utterances waiting to be spoken before the Atari has to wait
+#define VOICE_QUEUE_DEPTH 4
+// How long a write waits for room in the queue before the utterance is dropped. Kept short so SIO isn't held up
+#define VOICE_QUEUE_WAIT_MS 5
+
+// Speech runs on CPU0 so it doesn't compete with the SIO service loop on CPU1
+#define VOICE_STACKSIZE 8192
+#define VOICE_PRIORITY 5
+#define VOICE_CPUAFFINITY 0
+
+void sioVoice::_voice_task(void *param)
+{
+    sioVoice *v = (sioVoice *)param;
+    vector<string> *args;
+
+    while (true)
+    {
+        if (xQueueReceive(v->_voice_queue, &args, portMAX_DELAY) != pdTRUE)
+            continue;
+
+        char *a[16];
+        int n = 0;
+        for (vector<string>::iterator it = args->begin(); it != args->end() && n < 16; ++it)
+            a[n++] = (char *)it->c_str();
+
+        sam(n, a);
+        delete args;
+    }
+}
+
 void sioVoice::sio_sam_parameters()
 {
     string s = string((char *)lineBuffer); // change to lineBuffer
@@ -52,7 +82,10 @@ void sioVoice::sio_sam_parameters()
     }
 }
 
-void sioVoice::sio_sam()
+/* Builds the SAM command line and queues it for the voice task.
+   Returns false if the queue was full and the utterance was dropped.
+*/
+bool sioVoice::sio_sam()
 {
     int n = 0;
     char *a[16];
@@ -104,7 +137,24 @@ void sioVoice::sio_sam()
     }
 
     a[n++] = (char *)samBuffer;
-    sam(n, a);
+
+    // The task and queue are created on first use since we're a global object
+    if (_voice_queue == nullptr)
+    {
+        _voice_queue = xQueueCreate(VOICE_QUEUE_DEPTH, sizeof(vector<string> *));
+        xTaskCreatePinnedToCore(_voice_task, "fnVoice", VOICE_STACKSIZE, this,
+            VOICE_PRIORITY, &_voice_task_handle, VOICE_CPUAFFINITY);
+    }
+
+    vector<string> *args = new vector<string>(a, a + n);
+    if (xQueueSend(_voice_queue, &args, pdMS_TO_TICKS(VOICE_QUEUE_WAIT_MS)) != pdTRUE)
+    {
+        Debug_println("Voice queue full - dropping utterance");
+        delete args;
+        return false;
+    }
+
+    return true;
 };
 
 void sioVoice::sio_write()
@@ -121,6 +171,7 @@ void sioVoice::sio_write()
     {
         // append sioBuffer onto lineBuffer until EOL is reached
         // move this logic to append \0 into sio_write
+        bool queued = true;
         uint8_t i = 0;
         while (i < 40)
         {
@@ -133,14 +184,17 @@ void sioVoice::sio_write()
             {
                 lineBuffer[buffer_idx] = '\0';
                 buffer_idx = 0;
-                sio_sam();
+                queued = sio_sam();
                 // clear lineBuffer
                 memset(lineBuffer, 0, sizeof(lineBuffer));
                 break;
             }
             i++;
         }
-        sio_complete();
+        if (queued)
+            sio_complete();
+        else
+            sio_error();
     }
     else
     {
@@ -2,6 +2,12 @@
 #define VOICE_H
 
 #include <string>
+#include <vector>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+
 #include "sio.h"
 #include "samlib.h"
 
@@ -27,7 +33,12 @@ private:
     std::string speed;
     std::string throat;
 
-    void sio_sam();
+    // Utterances are rendered and played by _voice_task so SIO isn't held up while speaking
+    QueueHandle_t _voice_queue = nullptr;
+    TaskHandle_t _voice_task_handle = nullptr;
+    static void _voice_task(void *param);
+
+    bool sio_sam();
     void sio_sam_parameters();
 
 public:
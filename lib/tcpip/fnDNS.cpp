@@ -1,20 +1,53 @@
+#include <stdlib.h>
+#include <string.h>
 #include <lwip/netdb.h>
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
 #include "fnDNS.h"
 #include "../../include/debug.h"
+#include "../hardware/fnSystem.h"
 
+#define DNS_LOOKUP_STACKSIZE 3072
+#define DNS_LOOKUP_PRIORITY 5
 
-// Return a single IP4 address given a hostname
-in_addr_t get_ip4_addr_by_name(const char *hostname)
+enum dns_cache_state
+{
+    DNS_CACHE_EMPTY = 0,
+    // A background lookup is under way
+    DNS_CACHE_PENDING,
+    DNS_CACHE_RESOLVED,
+    DNS_CACHE_FAILED
+};
+
+struct dns_cache_entry
+{
+    dns_cache_state state = DNS_CACHE_EMPTY;
+    char hostname[DNS_CACHE_HOSTNAME_MAX];
+    in_addr_t addr;
+    // When the entry was stored
+    unsigned long since;
+};
+
+static dns_cache_entry _dns_cache[DNS_CACHE_ENTRIES];
+static portMUX_TYPE _dns_cache_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Asks the DNS server. gethostbyname_r() is used so lookups in different tasks can run at once
+static in_addr_t _dns_resolve(const char *hostname)
 {
     in_addr_t result = IPADDR_NONE;
 
     #ifdef DEBUG
     Debug_printf("Resolving hostname \"%s\"\n", hostname);
     #endif
-    struct hostent *info = gethostbyname(hostname);
+    struct hostent info;
+    struct hostent *found = nullptr;
+    char buf[DNS_CACHE_HOSTNAME_MAX + 64];
+    int err = 0;
+    gethostbyname_r(hostname, &info, buf, sizeof(buf), &found, &err);
 
-    if(info == nullptr)
+    if(found == nullptr)
     {
         #ifdef DEBUG
         Debug_println("Name failed to resolve");
@@ -22,13 +55,170 @@ in_addr_t get_ip4_addr_by_name(const char *hostname)
     }
     else
     {
-        if(info->h_addr_list[0] != nullptr)
+        if(found->h_addr_list[0] != nullptr)
         {
-            result = *((in_addr_t*)(info->h_addr_list[0]));
+            result = *((in_addr_t*)(found->h_addr_list[0]));
             #ifdef DEBUG
             Debug_printf("Resolved to address %s\n", inet_ntoa(result));
             #endif
         }
     }
-    return result;    
-}
\ No newline at end of file
+    return result;
+}
+
+// Returns the index of hostname's entry, or -1. Call with the lock held
+static int _dns_cache_find(const char *hostname, unsigned long now)
+{
+    for (int i = 0; i < DNS_CACHE_ENTRIES; i++)
+    {
+        dns_cache_entry &e = _dns_cache[i];
+        if (e.state == DNS_CACHE_EMPTY || strcasecmp(e.hostname, hostname) != 0)
+            continue;
+
+        unsigned long ttl = e.state == DNS_CACHE_RESOLVED ? DNS_CACHE_TTL_MS : DNS_CACHE_NEGATIVE_TTL_MS;
+        if (now - e.since > ttl)
+        {
+            e.state = DNS_CACHE_EMPTY;
+            return -1;
+        }
+        return i;
+    }
+    return -1;
+}
+
+/* Records the state of hostname, replacing any entry it already has, or else an empty one,
+   or else the oldest one. Call with the lock held
+*/
+static void _dns_cache_store(const char *hostname, dns_cache_state state, in_addr_t addr, unsigned long now)
+{
+    int slot = -1;
+    for (int i = 0; i < DNS_CACHE_ENTRIES; i++)
+    {
+        dns_cache_entry &e = _dns_cache[i];
+        if (e.state != DNS_CACHE_EMPTY && strcasecmp(e.hostname, hostname) == 0)
+        {
+            slot = i;
+            break;
+        }
+        if (slot < 0 || (_dns_cache[slot].state != DNS_CACHE_EMPTY &&
+                         (e.state == DNS_CACHE_EMPTY || e.since < _dns_cache[slot].since)))
+            slot = i;
+    }
+
+    dns_cache_entry &e = _dns_cache[slot];
+    strcpy(e.hostname, hostname);
+    e.state = state;
+    e.addr = addr;
+    e.since = now;
+}
+
+// Asks the DNS server and remembers the answer, whether or not there was one
+static in_addr_t _dns_lookup(const char *hostname)
+{
+    in_addr_t result = _dns_resolve(hostname);
+
+    unsigned long now = fnSystem.millis();
+    portENTER_CRITICAL(&_dns_cache_lock);
+    _dns_cache_store(hostname, result == IPADDR_NONE ? DNS_CACHE_FAILED : DNS_CACHE_RESOLVED, result, now);
+    portEXIT_CRITICAL(&_dns_cache_lock);
+
+    return result;
+}
+
+// Names too long to keep and dotted addresses aren't cached
+static bool _dns_cacheable(const char *hostname)
+{
+    return hostname != nullptr && hostname[0] != '\0' && strlen(hostname) < DNS_CACHE_HOSTNAME_MAX &&
+           inet_addr(hostname) == IPADDR_NONE;
+}
+
+/* Returns true with result set if we already have an answer for hostname. If start_lookup
+   is set and we don't, hostname is marked as being looked up
+*/
+static bool _dns_cache_check(const char *hostname, in_addr_t *result, bool start_lookup, bool *pending)
+{
+    unsigned long now = fnSystem.millis();
+    bool found = false;
+    *pending = false;
+
+    portENTER_CRITICAL(&_dns_cache_lock);
+    int i = _dns_cache_find(hostname, now);
+    if (i >= 0 && _dns_cache[i].state != DNS_CACHE_PENDING)
+    {
+        *result = _dns_cache[i].addr;
+        found = true;
+    }
+    else if (i >= 0)
+        *pending = true;
+    else if (start_lookup)
+        _dns_cache_store(hostname, DNS_CACHE_PENDING, IPADDR_NONE, now);
+    portEXIT_CRITICAL(&_dns_cache_lock);
+
+    return found;
+}
+
+static void _dns_lookup_task(void *param)
+{
+    char *hostname = (char *)param;
+    _dns_lookup(hostname);
+    free(hostname);
+    vTaskDelete(nullptr);
+}
+
+// Return a single IP4 address given a hostname
+in_addr_t get_ip4_addr_by_name(const char *hostname)
+{
+    if (_dns_cacheable(hostname) == false)
+        return _dns_resolve(hostname);
+
+    // A name being looked up in the background is just looked up again here rather than waited for
+    in_addr_t result;
+    bool pending;
+    if (_dns_cache_check(hostname, &result, false, &pending))
+    {
+        #ifdef DEBUG
+        Debug_printf("Cached address for \"%s\"\n", hostname);
+        #endif
+        return result;
+    }
+
+    return _dns_lookup(hostname);
+}
+
+bool get_ip4_addr_by_name_async(const char *hostname, in_addr_t *result)
+{
+    if (_dns_cacheable(hostname) == false)
+    {
+        *result = _dns_resolve(hostname);
+        return true;
+    }
+
+    bool pending;
+    if (_dns_cache_check(hostname, result, true, &pending))
+        return true;
+
+    // Someone else already started the lookup
+    if (pending)
+        return false;
+
+    char *name = strdup(hostname);
+    if (name == nullptr || xTaskCreate(_dns_lookup_task, "dnslookup", DNS_LOOKUP_STACKSIZE, name,
+                                       DNS_LOOKUP_PRIORITY, nullptr) != pdPASS)
+    {
+        free(name);
+        #ifdef DEBUG
+        Debug_println("Failed to start background lookup");
+        #endif
+        *result = _dns_lookup(hostname);
+        return true;
+    }
+    return false;
+}
+
+void dns_cache_clear()
+{
+    portENTER_CRITICAL(&_dns_cache_lock);
+    for (int i = 0; i < DNS_CACHE_ENTRIES; i++)
+        _dns_cache[i].state = DNS_CACHE_EMPTY;
+    portEXIT_CRITICAL(&_dns_cache_lock);
+}
@@ -2,6 +2,28 @@
 #define _FN_DNS_
 #include <lwip/netdb.h>
 
+/* Hostname lookups are cached, including failed ones, so repeated connections
+ to the same host don't wait on the DNS server each time. lwIP doesn't tell us
+ a record's TTL, so every entry is kept for the same fixed time.
+*/
+// Hostnames remembered
+#define DNS_CACHE_ENTRIES 16
+#define DNS_CACHE_HOSTNAME_MAX 128
+// How long a resolved address is used before looking it up again
+#define DNS_CACHE_TTL_MS (5 * 60 * 1000)
+// How long a failed lookup is remembered
+#define DNS_CACHE_NEGATIVE_TTL_MS (30 * 1000)
+
+// Returns IPADDR_NONE if the name doesn't resolve
 in_addr_t get_ip4_addr_by_name(const char *hostname);
 
-#endif // _FN_DNS_
\ No newline at end of file
+/* Returns true with result set (IPADDR_NONE if the name doesn't resolve) if the answer is
+   already known. Otherwise starts looking it up in the background and returns false, so the
+   caller can get on with other work and ask again later.
+*/
+bool get_ip4_addr_by_name_async(const char *hostname, in_addr_t *result);
+
+// Forgets everything, such as when we've joined a different network
+void dns_cache_clear();
+
+#endif // _FN_DNS_
@@ -458,6 +458,16 @@ bool util_string_value_is_true(std::string value)
     return  util_string_value_is_true(value.c_str());
 }
 
+// Turns a size in MB from the config into bytes, limited to what fits in 32 bits
+uint32_t util_megabytes_to_bytes(int mb)
+{
+    if (mb <= 0)
+        return 0;
+    if (mb > UTIL_MAX_MEGABYTES)
+        mb = UTIL_MAX_MEGABYTES;
+    return (uint32_t)mb * 1024 * 1024;
+}
+
 
 /**
  * Ask SAM to say something. see https://github.com/FujiNetWIFI/fujinet-platformio/wiki/Using-SAM-%28Voice-Synthesizer%29 
@@ -59,6 +59,10 @@ std::vector<std::string> util_tokenize(std::string s, char c = ' ');
 bool util_string_value_is_true(std::string value);
 bool util_string_value_is_true(const char *value);
 
+// Largest size in MB that still fits in 32 bits as bytes
+#define UTIL_MAX_MEGABYTES 4095
+uint32_t util_megabytes_to_bytes(int mb);
+
 
 void util_sam_say(const char *p,
                   bool phonetic=false,